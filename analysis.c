@@ -0,0 +1,374 @@
+/*
+ * analysis.c, relations between the frames rules match
+ *
+ * ebt_rule_covers() tells whether every frame a rule matches is also
+ * matched by another rule, ebt_rules_disjoint() whether no frame can be
+ * matched by both. Both only answer 1 when this can be proven from the
+ * base fields (protocol, interfaces with wildcards, MAC addresses with
+ * masks) and from the matches that are understood here: ip and ip6
+ * (addresses with masks, tos/tclass, protocol, port and icmp ranges),
+ * vlan, pkttype and mark_m. A rule with another match (except comment)
+ * covers nothing, its other matches are ignored for disjointness.
+ *
+ * Every field is a set of values, possibly inverted. The relations
+ * between the non-inverted sets of two rules are enough to decide the
+ * relations with inversion, see rel_covers() and rel_disjoint().
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "include/ebtables_u.h"
+#include <linux/netfilter_bridge/ebt_ip.h>
+#include <linux/netfilter_bridge/ebt_ip6.h>
+#include <linux/netfilter_bridge/ebt_vlan.h>
+#include <linux/netfilter_bridge/ebt_pkttype.h>
+#include <linux/netfilter_bridge/ebt_mark_m.h>
+
+/* For the non-inverted sets A and B of a field */
+struct rel
+{
+	/* A is a subset of B */
+	int sub;
+	/* A is a superset of B */
+	int sup;
+	/* A and B have no value in common */
+	int disj;
+};
+
+struct relation
+{
+	/* A covers B */
+	int covers;
+	int disjoint;
+};
+
+/* B is a subset of A, taking the inversions into account */
+static int rel_covers(const struct rel *r, int inv_a, int inv_b)
+{
+	if (!inv_a)
+		return !inv_b && r->sup;
+	return inv_b ? r->sub : r->disj;
+}
+
+static int rel_disjoint(const struct rel *r, int inv_a, int inv_b)
+{
+	if (!inv_a)
+		return inv_b ? r->sub : r->disj;
+	return !inv_b && r->sup;
+}
+
+/* A field of the rules, in_a and in_b tell whether the rules use it */
+static void field(struct relation *res, int in_a, int in_b,
+		  const struct rel *r, int inv_a, int inv_b)
+{
+	if (in_a && (!in_b || !rel_covers(r, inv_a, inv_b)))
+		res->covers = 0;
+	if (in_a && in_b && rel_disjoint(r, inv_a, inv_b))
+		res->disjoint = 1;
+}
+
+static struct rel rel_eq(unsigned long a, unsigned long b)
+{
+	struct rel r = { a == b, a == b, a != b };
+
+	return r;
+}
+
+static struct rel rel_range(unsigned int alo, unsigned int ahi,
+			    unsigned int blo, unsigned int bhi)
+{
+	struct rel r;
+
+	r.sub = blo <= alo && ahi <= bhi;
+	r.sup = alo <= blo && bhi <= ahi;
+	r.disj = ahi < blo || bhi < alo;
+	return r;
+}
+
+/* Both values must be in their range */
+static struct rel rel_and(struct rel r1, struct rel r2)
+{
+	struct rel r;
+
+	r.sub = r1.sub && r2.sub;
+	r.sup = r1.sup && r2.sup;
+	r.disj = r1.disj || r2.disj;
+	return r;
+}
+
+/* The values x with x & mask == value & mask */
+static struct rel rel_mask(const unsigned char *a, const unsigned char *am,
+			   const unsigned char *b, const unsigned char *bm,
+			   int len)
+{
+	struct rel r = { 1, 1, 0 };
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (bm[i] & ~am[i] || (a[i] ^ b[i]) & bm[i])
+			r.sub = 0;
+		if (am[i] & ~bm[i] || (a[i] ^ b[i]) & am[i])
+			r.sup = 0;
+		if ((a[i] ^ b[i]) & am[i] & bm[i])
+			r.disj = 1;
+	}
+	return r;
+}
+
+/* An interface name, a trailing wildcard is stored as 1 */
+static int iface_in(const char *a, const char *b)
+{
+	const char *wb = strchr(b, 1);
+	const char *wa = strchr(a, 1);
+
+	if (!wb)
+		return !wa && !strcmp(a, b);
+	/* Everything a matches starts with the stem of b */
+	return !strncmp(a, b, wb - b);
+}
+
+static struct rel rel_iface(const char *a, const char *b)
+{
+	struct rel r;
+	const char *wa = strchr(a, 1), *wb = strchr(b, 1);
+	size_t la = wa ? wa - a : strlen(a), lb = wb ? wb - b : strlen(b);
+
+	r.sub = iface_in(a, b);
+	r.sup = iface_in(b, a);
+	if (!wa && !wb)
+		r.disj = strcmp(a, b) != 0;
+	else
+		/* A name or stem can't start with the stem of the other */
+		r.disj = strncmp(a, b, la < lb ? la : lb) != 0 ||
+			 (!wa && la < lb) || (!wb && lb < la);
+	return r;
+}
+
+static void iface_field(struct relation *res, const struct ebt_u_entry *a,
+			const struct ebt_u_entry *b, const char *ia,
+			const char *ib, unsigned int flag)
+{
+	struct rel r = { 0 };
+
+	if (*ia && *ib)
+		r = rel_iface(ia, ib);
+	field(res, *ia != '\0', *ib != '\0', &r, a->invflags & flag,
+	      b->invflags & flag);
+}
+
+static void mac_field(struct relation *res, const struct ebt_u_entry *a,
+		      const struct ebt_u_entry *b, unsigned int bit,
+		      unsigned int flag, int src)
+{
+	struct rel r = { 0 };
+	int in_a = a->bitmask & bit, in_b = b->bitmask & bit;
+
+	if (in_a && in_b)
+		r = src ? rel_mask(a->sourcemac, a->sourcemsk, b->sourcemac,
+				   b->sourcemsk, ETH_ALEN) :
+			  rel_mask(a->destmac, a->destmsk, b->destmac,
+				   b->destmsk, ETH_ALEN);
+	field(res, in_a, in_b, &r, a->invflags & flag, b->invflags & flag);
+}
+
+/* The protocol is either the 802.3 length range or one Ethernet type */
+static void proto_field(struct relation *res, const struct ebt_u_entry *a,
+			const struct ebt_u_entry *b)
+{
+	int in_a = !(a->bitmask & EBT_NOPROTO), in_b = !(b->bitmask & EBT_NOPROTO);
+	int len_a = a->bitmask & EBT_802_3, len_b = b->bitmask & EBT_802_3;
+	struct rel r = { 0 };
+
+	if (in_a && in_b) {
+		if (len_a && len_b)
+			r = rel_eq(0, 0);
+		else if (len_a || len_b) {
+			/* An Ethernet type below 0x600 is a length */
+			r.sub = len_b && ntohs(a->ethproto) < 0x600;
+			r.sup = len_a && ntohs(b->ethproto) < 0x600;
+			r.disj = ntohs(len_a ? b->ethproto : a->ethproto) >= 0x600;
+		} else
+			r = rel_eq(a->ethproto, b->ethproto);
+	}
+	field(res, in_a, in_b, &r, a->invflags & EBT_IPROTO,
+	      b->invflags & EBT_IPROTO);
+}
+
+/* A field of the info of a match, expr is only evaluated when both
+ * matches use it */
+#define INFO_FIELD(flag, expr) do {						\
+	struct rel _r = { 0 };						\
+	int _in_a = a->bitmask & (flag), _in_b = b->bitmask & (flag);	\
+									\
+	if (_in_a && _in_b)						\
+		_r = expr;						\
+	field(res, _in_a, _in_b, &_r, a->invflags & (flag),		\
+	      b->invflags & (flag));					\
+} while (0)
+
+static void ip_match(struct relation *res, const struct ebt_ip_info *a,
+		     const struct ebt_ip_info *b)
+{
+	INFO_FIELD(EBT_IP_SOURCE, rel_mask((unsigned char *)&a->saddr,
+		 (unsigned char *)&a->smsk, (unsigned char *)&b->saddr,
+		 (unsigned char *)&b->smsk, 4));
+	INFO_FIELD(EBT_IP_DEST, rel_mask((unsigned char *)&a->daddr,
+		 (unsigned char *)&a->dmsk, (unsigned char *)&b->daddr,
+		 (unsigned char *)&b->dmsk, 4));
+	INFO_FIELD(EBT_IP_TOS, rel_eq(a->tos, b->tos));
+	INFO_FIELD(EBT_IP_PROTO, rel_eq(a->protocol, b->protocol));
+	INFO_FIELD(EBT_IP_SPORT, rel_range(a->sport[0], a->sport[1],
+		 b->sport[0], b->sport[1]));
+	INFO_FIELD(EBT_IP_DPORT, rel_range(a->dport[0], a->dport[1],
+		 b->dport[0], b->dport[1]));
+	INFO_FIELD(EBT_IP_ICMP, rel_and(rel_range(a->icmp_type[0],
+		 a->icmp_type[1], b->icmp_type[0], b->icmp_type[1]),
+		 rel_range(a->icmp_code[0], a->icmp_code[1], b->icmp_code[0],
+		 b->icmp_code[1])));
+	INFO_FIELD(EBT_IP_IGMP, rel_range(a->igmp_type[0], a->igmp_type[1],
+		 b->igmp_type[0], b->igmp_type[1]));
+}
+
+static void ip6_match(struct relation *res, const struct ebt_ip6_info *a,
+		      const struct ebt_ip6_info *b)
+{
+	INFO_FIELD(EBT_IP6_SOURCE, rel_mask(a->saddr.s6_addr, a->smsk.s6_addr,
+		 b->saddr.s6_addr, b->smsk.s6_addr, 16));
+	INFO_FIELD(EBT_IP6_DEST, rel_mask(a->daddr.s6_addr, a->dmsk.s6_addr,
+		 b->daddr.s6_addr, b->dmsk.s6_addr, 16));
+	INFO_FIELD(EBT_IP6_TCLASS, rel_eq(a->tclass, b->tclass));
+	INFO_FIELD(EBT_IP6_PROTO, rel_eq(a->protocol, b->protocol));
+	INFO_FIELD(EBT_IP6_SPORT, rel_range(a->sport[0], a->sport[1],
+		 b->sport[0], b->sport[1]));
+	INFO_FIELD(EBT_IP6_DPORT, rel_range(a->dport[0], a->dport[1],
+		 b->dport[0], b->dport[1]));
+	INFO_FIELD(EBT_IP6_ICMP6, rel_and(rel_range(a->icmpv6_type[0],
+		 a->icmpv6_type[1], b->icmpv6_type[0], b->icmpv6_type[1]),
+		 rel_range(a->icmpv6_code[0], a->icmpv6_code[1],
+		 b->icmpv6_code[0], b->icmpv6_code[1])));
+}
+
+static void vlan_match(struct relation *res, const struct ebt_vlan_info *a,
+		       const struct ebt_vlan_info *b)
+{
+	INFO_FIELD(EBT_VLAN_ID, rel_eq(a->id, b->id));
+	INFO_FIELD(EBT_VLAN_PRIO, rel_eq(a->prio, b->prio));
+	INFO_FIELD(EBT_VLAN_ENCAP, rel_eq(a->encap, b->encap));
+}
+
+static void pkttype_match(struct relation *res,
+			  const struct ebt_pkttype_info *a,
+			  const struct ebt_pkttype_info *b)
+{
+	struct rel r = rel_eq(a->pkt_type, b->pkt_type);
+
+	field(res, 1, 1, &r, a->invert, b->invert);
+}
+
+/* Returns 0 if a --mark-or match is involved. The kernel compares the
+ * masked frame mark with the unmasked mark of the rule, so a mark with bits
+ * outside the mask matches no frame (every frame when inverted). */
+static int mark_match(struct relation *res, const struct ebt_mark_m_info *a,
+		      const struct ebt_mark_m_info *b)
+{
+	int empty_a = (a->mark & ~a->mask) != 0;
+	int empty_b = (b->mark & ~b->mask) != 0;
+	struct rel r;
+
+	if (a->bitmask & EBT_MARK_OR || b->bitmask & EBT_MARK_OR)
+		return 0;
+	if (empty_a || empty_b) {
+		/* Only claim what holds for an empty set, never that it is
+		 * a superset of another set */
+		r.sub = empty_a;
+		r.sup = !empty_a;
+		r.disj = 1;
+	} else
+		r = rel_mask((unsigned char *)&a->mark,
+			     (unsigned char *)&a->mask,
+			     (unsigned char *)&b->mark,
+			     (unsigned char *)&b->mask,
+			     sizeof(unsigned long));
+	field(res, 1, 1, &r, a->invert, b->invert);
+	return 1;
+}
+
+static struct ebt_entry_match *rule_match(const struct ebt_u_entry *e,
+					  const char *name)
+{
+	struct ebt_u_match_list *m_l;
+
+	for (m_l = e->m_list; m_l; m_l = m_l->next)
+		if (!strcmp(m_l->m->u.name, name))
+			return m_l->m;
+	return NULL;
+}
+
+/* Compares a match of rule a with the same match of rule b, returns 0 if
+ * the match isn't understood */
+static int match_relation(struct relation *res, const struct ebt_entry_match *ma,
+			  const struct ebt_u_entry *b)
+{
+	const struct ebt_entry_match *mb = rule_match(b, ma->u.name);
+	const char *name = ma->u.name;
+
+	if (!strcmp(name, "comment"))
+		return 1;
+	if (strcmp(name, EBT_IP_MATCH) && strcmp(name, EBT_IP6_MATCH) &&
+	    strcmp(name, EBT_VLAN_MATCH) && strcmp(name, EBT_PKTTYPE_MATCH) &&
+	    strcmp(name, EBT_MARK_MATCH))
+		return 0;
+	if (!mb) {
+		/* The match restricts a, but not b */
+		res->covers = 0;
+		return 1;
+	}
+	if (!strcmp(name, EBT_IP_MATCH))
+		ip_match(res, (struct ebt_ip_info *)ma->data,
+			 (struct ebt_ip_info *)mb->data);
+	else if (!strcmp(name, EBT_IP6_MATCH))
+		ip6_match(res, (struct ebt_ip6_info *)ma->data,
+			  (struct ebt_ip6_info *)mb->data);
+	else if (!strcmp(name, EBT_VLAN_MATCH))
+		vlan_match(res, (struct ebt_vlan_info *)ma->data,
+			   (struct ebt_vlan_info *)mb->data);
+	else if (!strcmp(name, EBT_PKTTYPE_MATCH))
+		pkttype_match(res, (struct ebt_pkttype_info *)ma->data,
+			      (struct ebt_pkttype_info *)mb->data);
+	else
+		return mark_match(res, (struct ebt_mark_m_info *)ma->data,
+				  (struct ebt_mark_m_info *)mb->data);
+	return 1;
+}
+
+static struct relation relation(const struct ebt_u_entry *a,
+				const struct ebt_u_entry *b)
+{
+	struct relation res = { 1, 0 };
+	struct ebt_u_match_list *m_l;
+
+	proto_field(&res, a, b);
+	iface_field(&res, a, b, a->in, b->in, EBT_IIN);
+	iface_field(&res, a, b, a->out, b->out, EBT_IOUT);
+	iface_field(&res, a, b, a->logical_in, b->logical_in, EBT_ILOGICALIN);
+	iface_field(&res, a, b, a->logical_out, b->logical_out,
+		    EBT_ILOGICALOUT);
+	mac_field(&res, a, b, EBT_SOURCEMAC, EBT_ISOURCE, 1);
+	mac_field(&res, a, b, EBT_DESTMAC, EBT_IDEST, 0);
+	for (m_l = a->m_list; m_l; m_l = m_l->next)
+		if (!match_relation(&res, m_l->m, b))
+			res.covers = 0;
+	return res;
+}
+
+/* 1 if every frame rule b matches is also matched by rule a */
+int ebt_rule_covers(const struct ebt_u_entry *a, const struct ebt_u_entry *b)
+{
+	return relation(a, b).covers;
+}
+
+/* 1 if no frame can be matched by both rules */
+int ebt_rules_disjoint(const struct ebt_u_entry *a, const struct ebt_u_entry *b)
+{
+	return relation(a, b).disjoint;
+}
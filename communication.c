@@ -19,8 +19,17 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <stddef.h>
 #include <sys/socket.h>
+#include <pthread.h>
 #include "include/ebtables_u.h"
+#include <linux/netfilter_bridge/ebt_limit.h>
+#include <linux/netfilter_bridge/ebt_log.h>
+#include <linux/netfilter_bridge/ebt_nflog.h>
+#include <linux/netfilter_bridge/ebt_ulog.h>
+#include <linux/netfilter/ipset/ip_set.h>
+#include <linux/netfilter/xt_comment.h>
+#include <linux/netfilter/xt_string.h>
 
 extern char* hooknames[NF_BR_NUMHOOKS];
 
@@ -30,23 +39,138 @@ extern char* hooknames[NF_BR_NUMHOOKS];
 #define sparc_cast
 #endif
 
-int sockfd = -1;
+/* Every handle has its own socket */
+#define sockfd (ebt_cur_handle->sockfd)
+
+static int kernel_socket()
+{
+	return socket(AF_INET, SOCK_RAW, PF_INET);
+}
+
+static int kernel_getsockopt(int fd, int optname, void *optval,
+			     socklen_t *optlen)
+{
+	return getsockopt(fd, IPPROTO_IP, optname, optval, optlen);
+}
+
+static int kernel_setsockopt(int fd, int optname, const void *optval,
+			     socklen_t optlen)
+{
+	return setsockopt(fd, IPPROTO_IP, optname, optval, optlen);
+}
+
+static int kernel_ipset(int fd, void *req, socklen_t *size)
+{
+	return getsockopt(fd, SOL_IP, SO_IP_SET, req, size);
+}
+
+struct ebt_backend ebt_kernel_backend =
+{
+	.name		= "kernel",
+	.socket		= kernel_socket,
+	.getsockopt	= kernel_getsockopt,
+	.setsockopt	= kernel_setsockopt,
+	.ipset		= kernel_ipset,
+	.modules	= 1,
+};
+
+static struct ebt_backend *backends[] = {
+	&ebt_kernel_backend,
+	&ebt_memory_backend,
+	NULL
+};
+
+static struct ebt_backend *backend;
+/* The unknown backend name found in EBTABLES_BACKEND */
+static const char *bad_backend;
+/* 1 once a socket was made with the backend, it can't change anymore */
+static int backend_used;
+static pthread_once_t backend_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t backend_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct ebt_backend *find_backend(const char *name)
+{
+	int i;
+
+	for (i = 0; backends[i]; i++)
+		if (!strcmp(backends[i]->name, name))
+			return backends[i];
+	return NULL;
+}
+
+static void init_backend()
+{
+	const char *name = getenv("EBTABLES_BACKEND");
+
+	if (name && *name && !(backend = find_backend(name)))
+		bad_backend = name;
+	if (!backend)
+		backend = &ebt_kernel_backend;
+}
+
+/* Select the backend of the process by name, overriding EBTABLES_BACKEND.
+ * Returns -1 if there is no such backend or if a socket was already made
+ * with another backend */
+int ebt_set_backend(const char *name)
+{
+	struct ebt_backend *b = find_backend(name);
+	int ret = 0;
+
+	if (!b)
+		return -1;
+	pthread_once(&backend_once, init_backend);
+	pthread_mutex_lock(&backend_lock);
+	if (backend_used && b != backend)
+		ret = -1;
+	else {
+		backend = b;
+		bad_backend = NULL;
+	}
+	pthread_mutex_unlock(&backend_lock);
+	return ret;
+}
+
+struct ebt_backend *ebt_get_backend()
+{
+	pthread_once(&backend_once, init_backend);
+	return backend;
+}
 
 static int get_sockfd()
 {
 	int ret = 0;
+
 	if (sockfd == -1) {
-		sockfd = socket(AF_INET, SOCK_RAW, PF_INET);
+		ebt_get_backend();
+		pthread_mutex_lock(&backend_lock);
+		if (bad_backend) {
+			pthread_mutex_unlock(&backend_lock);
+			ebt_print_error("Unknown backend '%s' in EBTABLES_BACKEND", bad_backend);
+			return -1;
+		}
+		backend_used = 1;
+		pthread_mutex_unlock(&backend_lock);
+		sockfd = backend->socket();
 		if (sockfd < 0) {
 			ebt_print_error("Problem getting a socket, "
 					"you probably don't have the right "
 					"permissions");
 			ret = -1;
-		}
+		} else
+			fcntl(sockfd, F_SETFD, FD_CLOEXEC);
 	}
 	return ret;
 }
 
+/* The extensions that talk to other kernel modules (ipset) use the
+ * socket of the handle too. Returns -1 on error. */
+int ebt_get_sockfd()
+{
+	if (get_sockfd())
+		return -1;
+	return sockfd;
+}
+
 static struct ebt_replace *translate_user2kernel(struct ebt_u_replace *u_repl)
 {
 	struct ebt_replace *new;
@@ -55,9 +179,10 @@ static struct ebt_replace *translate_user2kernel(struct ebt_u_replace *u_repl)
 	struct ebt_u_watcher_list *w_l;
 	struct ebt_u_entries *entries;
 	char *p, *base;
-	int i, j;
+	int i, j, nchains = 0;
 	unsigned int entries_size = 0, *chain_offsets;
 
+	ebt_stats_begin(EBT_STATS_TRANSLATE);
 	new = (struct ebt_replace *)malloc(sizeof(struct ebt_replace));
 	if (!new)
 		ebt_print_memory();
@@ -73,6 +198,7 @@ static struct ebt_replace *translate_user2kernel(struct ebt_u_replace *u_repl)
 	for (i = 0; i < u_repl->num_chains; i++) {
 		if (!(entries = u_repl->chains[i]))
 			continue;
+		nchains++;
 		chain_offsets[i] = entries_size;
 		entries_size += sizeof(struct ebt_entries);
 		j = 0;
@@ -182,6 +308,9 @@ static struct ebt_replace *translate_user2kernel(struct ebt_u_replace *u_repl)
 	if (p - (char *)new->entries != new->entries_size)
 		ebt_print_bug("Entries_size bug");
 	free(chain_offsets);
+	ebt_stats_add(rules_out, new->nentries);
+	ebt_stats_add(chains_out, nchains);
+	ebt_stats_end();
 	return new;
 }
 
@@ -215,13 +344,355 @@ static void store_table_in_file(char *filename, struct ebt_replace *repl)
 	free(data);
 }
 
-void ebt_deliver_table(struct ebt_u_replace *u_repl)
+/*
+ * Table fingerprints (--optimistic)
+ *
+ * The fingerprint is a FNV-1a hash over the kernel representation of the
+ * table. Some matches keep state inside their data that the kernel updates
+ * while the table is live, only the part of their data that is specified by
+ * the user is hashed.
+ */
+#define FP_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FP_PRIME 0x100000001b3ULL
+
+static struct {
+	const char *name;
+	unsigned int size;
+} fp_volatile_matches[] = {
+	{ "limit", offsetof(struct ebt_limit_info, prev) },
+	{ NULL, 0 }
+};
+
+static void fp_add(uint64_t *hash, const void *data, unsigned int len)
+{
+	const unsigned char *p = data;
+
+	while (len--) {
+		*hash ^= *p++;
+		*hash *= FP_PRIME;
+	}
+}
+
+/* The size of the part of the match data that is hashed */
+static unsigned int fp_match_size(const char *name, unsigned int size)
+{
+	int i;
+
+	for (i = 0; fp_volatile_matches[i].name; i++)
+		if (!strcmp(name, fp_volatile_matches[i].name)) {
+			if (size > fp_volatile_matches[i].size)
+				size = fp_volatile_matches[i].size;
+			break;
+		}
+	return size;
+}
+
+static int fp_add_match(struct ebt_entry_match *m, uint64_t *hash)
+{
+	fp_add(hash, m, sizeof(struct ebt_entry_match) +
+	       fp_match_size(m->u.name, m->match_size));
+	return 0;
+}
+
+static int fp_add_entry(struct ebt_entry *e, uint64_t *hash)
+{
+	/* A chain header (struct ebt_entries) */
+	if (!e->bitmask) {
+		fp_add(hash, e, sizeof(struct ebt_entries));
+		return 0;
+	}
+	fp_add(hash, e, sizeof(struct ebt_entry));
+	EBT_MATCH_ITERATE(e, fp_add_match, hash);
+	/* Watchers and target */
+	fp_add(hash, (char *)e + e->watchers_offset,
+	       e->next_offset - e->watchers_offset);
+	return 0;
+}
+
+static void fingerprint_table(struct ebt_replace *repl,
+			      struct ebt_u_fingerprint *fp)
+{
+	fp->valid = 1;
+	fp->delivered = 0;
+	fp->valid_hooks = repl->valid_hooks;
+	fp->nentries = repl->nentries;
+	fp->entries_size = repl->entries_size;
+	fp->hash = FP_OFFSET_BASIS;
+	EBT_ENTRY_ITERATE((char *)repl->entries, repl->entries_size,
+			  fp_add_entry, &fp->hash);
+}
+
+/* The table information returned by EBT_SO_GET_INFO doesn't match the
+ * fingerprint */
+static int info_differs(const struct ebt_replace *repl,
+			const struct ebt_u_fingerprint *expect)
+{
+	return repl->valid_hooks != expect->valid_hooks ||
+	       repl->nentries != expect->nentries ||
+	       repl->entries_size != expect->entries_size;
+}
+
+/* Fingerprint the table as it currently is in the kernel, without
+ * retrieving the counters. Returns -1 if the table can't be read. If
+ * expect != NULL, 1 is returned without retrieving the entries when
+ * EBT_SO_GET_INFO already shows the table differs from expect. */
+static int fingerprint_kernel_table(const char *name,
+				    struct ebt_u_fingerprint *fp,
+				    const struct ebt_u_fingerprint *expect)
+{
+	struct ebt_replace repl;
+	socklen_t optlen = sizeof(struct ebt_replace);
+	char *entries;
+	int ret = 0;
+
+	strcpy(repl.name, name);
+	ebt_stats_begin(EBT_STATS_FETCH);
+	if (backend->getsockopt(sockfd, EBT_SO_GET_INFO, &repl, &optlen)) {
+		ebt_stats_end();
+		return -1;
+	}
+	if (expect && info_differs(&repl, expect)) {
+		ebt_stats_end();
+		return 1;
+	}
+	if (!(entries = (char *)malloc(repl.entries_size)))
+		ebt_print_memory();
+	repl.entries = sparc_cast entries;
+	repl.num_counters = 0;
+	repl.counters = sparc_cast NULL;
+	optlen += repl.entries_size;
+	/* Fails when the table changed since EBT_SO_GET_INFO */
+	if (backend->getsockopt(sockfd, EBT_SO_GET_ENTRIES, &repl, &optlen))
+		ret = -1;
+	else {
+		ebt_stats_add(bytes_in, optlen);
+		fingerprint_table(&repl, fp);
+	}
+	free(entries);
+	ebt_stats_end();
+	return ret;
+}
+
+/* Returns 1 if the kernel table no longer matches the fingerprint taken
+ * when it was retrieved. The entries are only retrieved when the size of
+ * the table didn't change. */
+static int kernel_table_changed(struct ebt_u_replace *u_repl)
+{
+	struct ebt_u_fingerprint fp;
+
+	if (fingerprint_kernel_table(u_repl->name, &fp, &u_repl->fp))
+		return 1;
+	return fp.nentries != u_repl->fp.nentries ||
+	       fp.entries_size != u_repl->fp.entries_size ||
+	       fp.hash != u_repl->fp.hash;
+}
+
+static struct ebt_u_delivered *find_delivered(const char *name)
+{
+	struct ebt_u_delivered *d;
+
+	for (d = ebt_delivered; d; d = d->next)
+		if (!strcmp(d->name, name))
+			return d;
+	return NULL;
+}
+
+/* Keep the entries of repl, which the kernel just accepted, so the table
+ * doesn't have to be retrieved again. repl->entries is taken over. */
+static void keep_delivered(struct ebt_replace *repl,
+			   const struct ebt_u_fingerprint *fp)
+{
+	struct ebt_u_delivered *d = find_delivered(repl->name);
+
+	if (!d) {
+		if (!(d = (struct ebt_u_delivered *)
+		   calloc(1, sizeof(struct ebt_u_delivered))))
+			ebt_print_memory();
+		strcpy(d->name, repl->name);
+		d->next = ebt_delivered;
+		ebt_delivered = d;
+	}
+	free(d->entries);
+	free(d->counters);
+	d->entries = repl->entries;
+	d->counters = NULL;
+	d->fp = *fp;
+	repl->entries = NULL;
+}
+
+void ebt_free_delivered()
+{
+	struct ebt_u_delivered *d;
+
+	while ((d = ebt_delivered)) {
+		ebt_delivered = d->next;
+		free(d->entries);
+		free(d->counters);
+		free(d);
+	}
+}
+
+/*
+ * Rule IDs (-L --format, --diff)
+ *
+ * The same kind of hash as the table fingerprint, over one rule in its
+ * userspace representation. The ID only depends on the content of the rule:
+ * a jump to a user defined chain is hashed by the name of the chain, not by
+ * its number, and the alignment padding of the extension data is left out.
+ * The base fields that aren't used (the protocol, the MAC addresses) are
+ * left out and the MAC addresses are hashed with their mask applied. The
+ * parts of the extension data listed in rule_id_fields are strings, only
+ * hashed up to their end, or bytes without meaning. Extensions with data
+ * of variable size (among, isnat) are hashed entirely, they have to zero
+ * their padding.
+ */
+static struct {
+	const char *name;
+	unsigned int offset;
+	unsigned int size;
+	/* 1: a string, 0: skipped */
+	int string;
+} rule_id_fields[] = {
+	/* Sorted by offset for each extension */
+	{ "log", offsetof(struct ebt_log_info, prefix),
+	  offsetof(struct ebt_log_info, bitmask) -
+	  offsetof(struct ebt_log_info, prefix), 1 },
+	{ "nflog", offsetof(struct ebt_nflog_info, pad),
+	  sizeof(((struct ebt_nflog_info *)0)->pad), 0 },
+	{ "nflog", offsetof(struct ebt_nflog_info, prefix),
+	  EBT_NFLOG_PREFIX_SIZE, 1 },
+	{ "ulog", offsetof(struct ebt_ulog_info, prefix),
+	  EBT_ULOG_PREFIX_LEN, 1 },
+	{ "comment", offsetof(struct xt_comment_info, comment),
+	  XT_MAX_COMMENT_LEN, 1 },
+	{ "string", offsetof(struct xt_string_info, algo),
+	  XT_STRING_MAX_ALGO_NAME_SIZE, 1 },
+	{ NULL, 0, 0, 0 }
+};
+
+static void rule_id_add_iface(uint64_t *hash, const char *iface)
+{
+	fp_add(hash, iface, strnlen(iface, IFNAMSIZ));
+	fp_add(hash, "", 1);
+}
+
+static void rule_id_add_mac(uint64_t *hash, const unsigned char *mac,
+			    const unsigned char *mask)
+{
+	unsigned char masked[ETH_ALEN];
+	int i;
+
+	for (i = 0; i < ETH_ALEN; i++)
+		masked[i] = mac[i] & mask[i];
+	fp_add(hash, masked, ETH_ALEN);
+	fp_add(hash, mask, ETH_ALEN);
+}
+
+/* The size of the extension data that is hashed: the registered size if
+ * the data has a fixed size, all of it otherwise */
+static unsigned int rule_id_data_size(unsigned int registered,
+				      unsigned int size)
+{
+	return EBT_ALIGN(registered) == size ? registered : size;
+}
+
+static void rule_id_add_ext(uint64_t *hash, const char *name,
+			    const void *data, unsigned int size)
+{
+	const char *p = data;
+	unsigned int pos = 0, end;
+	int i;
+
+	fp_add(hash, name, strlen(name) + 1);
+	fp_add(hash, &size, sizeof(size));
+	for (i = 0; rule_id_fields[i].name; i++) {
+		if (strcmp(name, rule_id_fields[i].name) ||
+		    rule_id_fields[i].offset < pos)
+			continue;
+		if (rule_id_fields[i].offset >= size)
+			break;
+		fp_add(hash, p + pos, rule_id_fields[i].offset - pos);
+		pos = rule_id_fields[i].offset;
+		end = pos + rule_id_fields[i].size;
+		if (end > size)
+			end = size;
+		if (rule_id_fields[i].string) {
+			fp_add(hash, p + pos, strnlen(p + pos, end - pos));
+			fp_add(hash, "", 1);
+		}
+		pos = end;
+	}
+	fp_add(hash, p + pos, size - pos);
+}
+
+uint64_t ebt_rule_id(const struct ebt_u_replace *replace,
+		     const struct ebt_u_entry *e)
+{
+	uint64_t hash = FP_OFFSET_BASIS;
+	unsigned int bitmask = e->bitmask & ~EBT_ENTRY_OR_ENTRIES, size;
+	struct ebt_u_match_list *m_l;
+	struct ebt_u_watcher_list *w_l;
+	struct ebt_u_match *m;
+	struct ebt_u_watcher *w;
+	struct ebt_u_target *t;
+	int verdict;
+
+	fp_add(&hash, &bitmask, sizeof(bitmask));
+	fp_add(&hash, &e->invflags, sizeof(e->invflags));
+	if (!(e->bitmask & EBT_NOPROTO))
+		fp_add(&hash, &e->ethproto, sizeof(e->ethproto));
+	rule_id_add_iface(&hash, e->in);
+	rule_id_add_iface(&hash, e->logical_in);
+	rule_id_add_iface(&hash, e->out);
+	rule_id_add_iface(&hash, e->logical_out);
+	if (e->bitmask & EBT_SOURCEMAC)
+		rule_id_add_mac(&hash, e->sourcemac, e->sourcemsk);
+	if (e->bitmask & EBT_DESTMAC)
+		rule_id_add_mac(&hash, e->destmac, e->destmsk);
+
+	for (m_l = e->m_list; m_l; m_l = m_l->next) {
+		size = m_l->m->match_size;
+		if ((m = ebt_find_match(m_l->m->u.name)))
+			size = rule_id_data_size(m->size, size);
+		size = fp_match_size(m_l->m->u.name, size);
+		rule_id_add_ext(&hash, m_l->m->u.name, m_l->m->data, size);
+	}
+	for (w_l = e->w_list; w_l; w_l = w_l->next) {
+		size = w_l->w->watcher_size;
+		if ((w = ebt_find_watcher(w_l->w->u.name)))
+			size = rule_id_data_size(w->size, size);
+		rule_id_add_ext(&hash, w_l->w->u.name, w_l->w->data, size);
+	}
+
+	if (!strcmp(e->t->u.name, EBT_STANDARD_TARGET) &&
+	    (verdict = ((struct ebt_standard_target *)e->t)->verdict) >= 0) {
+		const char *chain;
+
+		chain = replace->chains[verdict + NF_BR_NUMHOOKS]->name;
+		fp_add(&hash, EBT_STANDARD_TARGET, sizeof(EBT_STANDARD_TARGET));
+		fp_add(&hash, chain, strlen(chain) + 1);
+		return hash;
+	}
+	size = e->t->target_size;
+	if ((t = ebt_find_target(e->t->u.name)))
+		size = rule_id_data_size(t->size, size);
+	rule_id_add_ext(&hash, e->t->u.name, e->t->data, size);
+	return hash;
+}
+
+/* Returns 0 on success, 1 when --optimistic is used and the kernel table
+ * was changed by someone else since it was retrieved (nothing is delivered
+ * in that case) and -1 on error */
+int ebt_deliver_table(struct ebt_u_replace *u_repl)
 {
 	socklen_t optlen;
 	struct ebt_replace *repl;
+	int optimistic = 0, ret = 0;
 
 	/* Translate the struct ebt_u_replace to a struct ebt_replace */
 	repl = translate_user2kernel(u_repl);
+	ebt_generation++;
+	ebt_stats_begin(EBT_STATS_DELIVER);
 	if (u_repl->filename != NULL) {
 		store_table_in_file(u_repl->filename, repl);
 		goto free_repl;
@@ -230,14 +701,26 @@ void ebt_deliver_table(struct ebt_u_replace *u_repl)
 	optlen = sizeof(struct ebt_replace) + repl->entries_size;
 	if (get_sockfd())
 		goto free_repl;
-	if (!setsockopt(sockfd, IPPROTO_IP, EBT_SO_SET_ENTRIES, repl, optlen))
+	optimistic = ebt_optimistic && u_repl->fp.valid;
+	if (optimistic && kernel_table_changed(u_repl)) {
+		ret = 1;
 		goto free_repl;
+	}
+	if (!backend->setsockopt(sockfd, EBT_SO_SET_ENTRIES, repl, optlen))
+		goto delivered;
 	if (u_repl->command == 8) { /* The ebtables module may not
 	                             * yet be loaded with --atomic-commit */
 		ebtables_insmod("ebtables");
-		if (!setsockopt(sockfd, IPPROTO_IP, EBT_SO_SET_ENTRIES,
+		if (!backend->setsockopt(sockfd, EBT_SO_SET_ENTRIES,
 		    repl, optlen))
-			goto free_repl;
+			goto delivered;
+	}
+	/* The kernel refuses the table when the number of counters we expect
+	 * back doesn't match, which happens when someone else updated the
+	 * table right after our check */
+	if (optimistic && kernel_table_changed(u_repl)) {
+		ret = 1;
+		goto free_repl;
 	}
 
 	ebt_print_error("Unable to update the kernel. Two possible causes:\n"
@@ -247,11 +730,22 @@ void ebt_deliver_table(struct ebt_u_replace *u_repl)
 			"   used to support concurrent scripts that update the ebtables kernel tables.\n"
 			"2. The kernel doesn't support a certain ebtables extension, consider\n"
 			"   recompiling your kernel or insmod the extension.\n");
+	ret = -1;
+	goto free_repl;
+delivered:
+	ebt_stats_add(bytes_out, optlen);
+	/* The kernel table is now our own, hashing what we delivered avoids
+	 * retrieving it for the fingerprint */
+	fingerprint_table(repl, &u_repl->fp);
+	u_repl->fp.delivered = 1;
+	keep_delivered(repl, &u_repl->fp);
 free_repl:
+	ebt_stats_end();
 	if (repl) {
 		free(repl->entries);
 		free(repl);
 	}
+	return ret;
 }
 
 static int store_counters_in_file(char *filename, struct ebt_u_replace *repl)
@@ -289,12 +783,13 @@ close_file:
  * and resets the counterchanges to CNT_NORM */
 void ebt_deliver_counters(struct ebt_u_replace *u_repl)
 {
-	struct ebt_counter *old, *new, *newcounters;
+	struct ebt_counter *old, *new, *newcounters, *src;
 	socklen_t optlen;
 	struct ebt_replace repl;
 	struct ebt_cntchanges *cc = u_repl->cc->next, *cc2;
 	struct ebt_u_entries *entries = NULL;
 	struct ebt_u_entry *next = NULL;
+	struct ebt_u_delivered *d;
 	int i, chainnr = -1;
 
 	if (u_repl->nentries == 0)
@@ -305,6 +800,11 @@ void ebt_deliver_counters(struct ebt_u_replace *u_repl)
 	if (!newcounters)
 		ebt_print_memory();
 	memset(newcounters, 0, u_repl->nentries * sizeof(struct ebt_counter));
+	/* Moved rules take their counter from their old position */
+	i = 0;
+	for (cc2 = cc; cc2 != u_repl->cc; cc2 = cc2->next)
+		if (cc2->type != CNT_ADD && cc2->type != CNT_MOVE)
+			cc2->old_nr = i++;
 	old = u_repl->counters;
 	new = newcounters;
 	while (cc != u_repl->cc) {
@@ -330,24 +830,26 @@ void ebt_deliver_counters(struct ebt_u_replace *u_repl)
 		} else if (cc->type == CNT_DEL) {
 			old++; /* Don't use this old counter */
 		} else {
-			if (cc->type == CNT_CHANGE) {
+			if (cc->type == CNT_CHANGE || cc->type == CNT_MOVE) {
+				src = cc->type == CNT_MOVE ?
+				   u_repl->counters + cc->from->old_nr : old;
 				if (cc->change % 3 == 1)
-					new->pcnt = old->pcnt + next->cnt_surplus.pcnt;
+					new->pcnt = src->pcnt + next->cnt_surplus.pcnt;
 				else if (cc->change % 3 == 2)
-					new->pcnt = old->pcnt - next->cnt_surplus.pcnt;
+					new->pcnt = src->pcnt - next->cnt_surplus.pcnt;
 				else
 					new->pcnt = next->cnt.pcnt;
 				if (cc->change / 3 == 1)
-					new->bcnt = old->bcnt + next->cnt_surplus.bcnt;
+					new->bcnt = src->bcnt + next->cnt_surplus.bcnt;
 				else if (cc->change / 3 == 2)
-					new->bcnt = old->bcnt - next->cnt_surplus.bcnt;
+					new->bcnt = src->bcnt - next->cnt_surplus.bcnt;
 				else
 					new->bcnt = next->cnt.bcnt;
 			} else
 				*new = next->cnt;
 			next->cnt = *new;
 			next->cnt_surplus.pcnt = next->cnt_surplus.bcnt = 0;
-			if (cc->type == CNT_ADD)
+			if (cc->type == CNT_ADD || cc->type == CNT_MOVE)
 				new++;
 			else {
 				old++;
@@ -393,8 +895,20 @@ void ebt_deliver_counters(struct ebt_u_replace *u_repl)
 
 	if (get_sockfd())
 		return;
-	if (setsockopt(sockfd, IPPROTO_IP, EBT_SO_SET_COUNTERS, &repl, optlen))
+	ebt_stats_begin(EBT_STATS_COUNTERS);
+	if (backend->setsockopt(sockfd, EBT_SO_SET_COUNTERS, &repl, optlen))
 		ebt_print_bug("Couldn't update kernel counters");
+	ebt_stats_add(bytes_out, optlen);
+	ebt_stats_end();
+	if ((d = find_delivered(u_repl->name)) &&
+	    d->fp.nentries == u_repl->nentries) {
+		free(d->counters);
+		if (!(d->counters = (struct ebt_counter *)malloc(optlen -
+		   sizeof(struct ebt_replace))))
+			ebt_print_memory();
+		memcpy(d->counters, u_repl->counters,
+		       optlen - sizeof(struct ebt_replace));
+	}
 }
 
 static int
@@ -659,9 +1173,14 @@ close_file:
 	return ret;
 }
 
-static int retrieve_from_kernel(struct ebt_replace *repl, char command,
-				int init)
+/* If cached != NULL, the table we delivered ourselves is taken instead of
+ * the kernel's entries when the kernel table still has its size, *cached
+ * then points to it (else it is set to NULL) */
+static int get_from_kernel(struct ebt_replace *repl, char command,
+			   int init, const struct ebt_u_fingerprint *expect,
+			   struct ebt_u_delivered **cached)
 {
+	struct ebt_u_delivered *d;
 	socklen_t optlen;
 	int optname;
 	char *entries;
@@ -674,8 +1193,10 @@ static int retrieve_from_kernel(struct ebt_replace *repl, char command,
 		optname = EBT_SO_GET_INIT_INFO;
 	else
 		optname = EBT_SO_GET_INFO;
-	if (getsockopt(sockfd, IPPROTO_IP, optname, repl, &optlen))
+	if (backend->getsockopt(sockfd, optname, repl, &optlen))
 		return -1;
+	if (expect && info_differs(repl, expect))
+		return 1;
 
 	if ( !(entries = (char *)malloc(repl->entries_size)) )
 		ebt_print_memory();
@@ -693,24 +1214,52 @@ static int retrieve_from_kernel(struct ebt_replace *repl, char command,
 
 	/* We want to receive the counters */
 	repl->num_counters = repl->nentries;
+	if (cached)
+		*cached = NULL;
+	if (cached && !init && (d = find_delivered(repl->name)) &&
+	    !info_differs(repl, &d->fp) && (d->counters || !repl->nentries)) {
+		memcpy(entries, d->entries, repl->entries_size);
+		if (repl->nentries)
+			memcpy(repl->counters, d->counters,
+			       repl->nentries * sizeof(struct ebt_counter));
+		*cached = d;
+		return 0;
+	}
 	optlen += repl->entries_size + repl->num_counters *
 	   sizeof(struct ebt_counter);
 	if (init)
 		optname = EBT_SO_GET_INIT_ENTRIES;
 	else
 		optname = EBT_SO_GET_ENTRIES;
-	if (getsockopt(sockfd, IPPROTO_IP, optname, repl, &optlen))
+	if (backend->getsockopt(sockfd, optname, repl, &optlen))
 		ebt_print_bug("Hmm, what is wrong??? bug#1");
+	ebt_stats_add(bytes_in, optlen);
 
 	return 0;
 }
 
-int ebt_get_table(struct ebt_u_replace *u_repl, int init)
+/* If expect != NULL, 1 is returned without retrieving the entries when the
+ * size or the base chains of the kernel table don't match the fingerprint.
+ * For cached, see get_from_kernel(). */
+static int retrieve_from_kernel(struct ebt_replace *repl, char command,
+				int init, const struct ebt_u_fingerprint *expect,
+				struct ebt_u_delivered **cached)
+{
+	int ret;
+
+	ebt_stats_begin(EBT_STATS_FETCH);
+	ret = get_from_kernel(repl, command, init, expect, cached);
+	ebt_stats_end();
+	return ret;
+}
+
+static int get_table(struct ebt_u_replace *u_repl, int init)
 {
 	int i, j, k, hook;
 	struct ebt_replace repl;
 	struct ebt_u_entry *u_e = NULL;
 	struct ebt_cntchanges *new_cc = NULL, *cc;
+	struct ebt_u_delivered *cached = NULL;
 
 	strcpy(repl.name, u_repl->name);
 	if (u_repl->filename != NULL) {
@@ -720,9 +1269,17 @@ int ebt_get_table(struct ebt_u_replace *u_repl, int init)
 			return -1;
 		/* -L with a wrong table name should be dealt with silently */
 		strcpy(u_repl->name, repl.name);
-	} else if (retrieve_from_kernel(&repl, u_repl->command, init))
+	} else if (retrieve_from_kernel(&repl, u_repl->command, init, NULL,
+					&cached))
 		return -1;
 
+	if (cached)
+		u_repl->fp = cached->fp;
+	else if (u_repl->filename == NULL && !init)
+		fingerprint_table(&repl, &u_repl->fp);
+	else
+		u_repl->fp.valid = 0;
+
 	/* Translate the struct ebt_replace to a struct ebt_u_replace */
 	u_repl->valid_hooks = repl.valid_hooks;
 	u_repl->nentries = repl.nentries;
@@ -768,5 +1325,91 @@ int ebt_get_table(struct ebt_u_replace *u_repl, int init)
 	if (k != u_repl->nentries)
 		ebt_print_bug("Wrong total nentries");
 	free(repl.entries);
+	if (ebt_cur_stats) {
+		ebt_cur_stats->rules_in += u_repl->nentries;
+		for (i = 0; i < u_repl->num_chains; i++)
+			if (u_repl->chains[i])
+				ebt_cur_stats->chains_in++;
+	}
+	return 0;
+}
+
+/* Retrieve the table from the kernel or the file and translate it */
+int ebt_get_table(struct ebt_u_replace *u_repl, int init)
+{
+	int ret;
+
+	ebt_stats_begin(EBT_STATS_DECODE);
+	ret = get_table(u_repl, init);
+	ebt_stats_end();
+	return ret;
+}
+
+/*
+ * Gets executed instead of ebt_get_table() for a table that is known to
+ * equal the kernel table described by u_repl->fp, i.e. the table we last
+ * retrieved or delivered ourselves. A table whose size or base chains
+ * changed is detected with EBT_SO_GET_INFO alone.
+ * For a table we delivered, that is all: the table and its counters, as
+ * computed by ebt_deliver_counters(), are kept as they are. The counters
+ * the kernel added since the commit are then not shown and a table of the
+ * same size written by someone else isn't noticed, like for the copy
+ * ebt_get_table() takes (see get_from_kernel()).
+ * For a table we retrieved, the entries are still retrieved to verify the
+ * fingerprint and to get the counters, this only saves the translation.
+ * Returns -1 if the table differs, it must then be retrieved again.
+ */
+int ebt_refresh_kernel_table(struct ebt_u_replace *u_repl)
+{
+	struct ebt_replace repl;
+	struct ebt_u_fingerprint fp;
+	struct ebt_cntchanges *cc;
+	struct ebt_u_entries *entries;
+	socklen_t optlen;
+	struct ebt_u_entry *e;
+	struct ebt_counter *cnt;
+	int i;
+
+	if (!u_repl->fp.valid || u_repl->filename != NULL)
+		return -1;
+	/* Uncommitted counter changes can't be kept */
+	i = 0;
+	for (cc = u_repl->cc->next; cc != u_repl->cc; cc = cc->next, i++)
+		if (cc->type != CNT_NORM)
+			return -1;
+	if (i != u_repl->nentries)
+		return -1;
+
+	strcpy(repl.name, u_repl->name);
+	if (u_repl->fp.delivered) {
+		optlen = sizeof(struct ebt_replace);
+		if (get_sockfd())
+			return -1;
+		ebt_stats_begin(EBT_STATS_FETCH);
+		i = backend->getsockopt(sockfd, EBT_SO_GET_INFO, &repl, &optlen);
+		ebt_stats_end();
+		return i || info_differs(&repl, &u_repl->fp) ? -1 : 0;
+	}
+	if (retrieve_from_kernel(&repl, u_repl->command, 0, &u_repl->fp, NULL))
+		return -1;
+	fingerprint_table(&repl, &fp);
+	free(repl.entries);
+	if (fp.hash != u_repl->fp.hash) {
+		free(repl.counters);
+		return -1;
+	}
+
+	free(u_repl->counters);
+	u_repl->counters = repl.counters;
+	u_repl->num_counters = repl.num_counters;
+	cnt = u_repl->counters;
+	for (i = 0; i < u_repl->num_chains; i++) {
+		if (!(entries = u_repl->chains[i]))
+			continue;
+		for (e = entries->entries->next; e != entries->entries; e = e->next) {
+			e->cnt = *cnt++;
+			e->cnt_surplus.pcnt = e->cnt_surplus.bcnt = 0;
+		}
+	}
 	return 0;
 }
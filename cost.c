@@ -0,0 +1,350 @@
+/*
+ * cost.c, static per-frame cost of a table for --cost-report
+ *
+ * Every rule gets a cost, in units of roughly one field comparison: the
+ * base fields it checks, the cost of each of its matches (see
+ * match_cost()) and, for a frame it matches, the cost of its watchers and
+ * target. A jump adds the cost of the chain it jumps to.
+ *
+ * The worst case of a chain is a frame that is compared with every rule,
+ * takes every jump and is logged by every watcher. The average assumes a
+ * frame leaves the chain at each of its exits with the same probability:
+ * after a rule with target ACCEPT, DROP or RETURN, or at the end of the
+ * chain. The jumps before the exit are taken, their cost is the average
+ * of the chain they jump to. The other rules before the exit don't match
+ * the frame, their watchers and targets don't count.
+ *
+ * The chains reachable from each base chain are found with
+ * ebt_check_for_loops(), which also refuses tables with loops.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "include/ebtables_u.h"
+#include <linux/netfilter/xt_string.h>
+#include <linux/netfilter_bridge/ebt_among.h>
+#include <linux/netfilter_bridge/ebt_log.h>
+#include <linux/netfilter_bridge/ebt_nflog.h>
+#include <linux/netfilter_bridge/ebt_ulog.h>
+
+/* The frame length assumed for the string match */
+#define COST_FRAME_LEN 1500
+/* The string match examines this many bytes per unit */
+#define COST_STRING_BYTES 8
+/* Number of rules listed as the most expensive ones */
+#define COST_TOP 10
+
+struct match_cost
+{
+	const char *name;
+	double cost;
+};
+
+/* Matches with a fixed cost, other matches cost COST_UNKNOWN */
+static const struct match_cost match_costs[] = {
+	{ "802_3",   1 },
+	{ "pkttype", 1 },
+	{ "mark_m",  1 },
+	{ "comment", 1 },
+	{ "vlan",    2 },
+	{ "arp",     3 },
+	{ "ip",      3 },
+	{ "ip6",     4 },
+	{ "stp",     4 },
+	/* A spinlock and the token bucket arithmetic */
+	{ "limit",   6 },
+	/* An ipset lookup under the set's lock */
+	{ "set-src", 12 },
+	{ "set-dst", 12 },
+	{ "dset",    12 },
+};
+#define COST_UNKNOWN 4
+
+/* For a frame the rule matches */
+static const struct match_cost watcher_costs[] = {
+	/* Formatted by printk() */
+	{ EBT_LOG_WATCHER,   40 },
+	{ EBT_NFLOG_WATCHER, 20 },
+	{ EBT_ULOG_WATCHER,  20 },
+};
+#define COST_TARGET 2
+
+struct rule_cost
+{
+	int chain_nr;
+	int rule_nr;
+	double worst;
+	double average;
+};
+
+struct chain_cost
+{
+	/* 0 not computed yet, 1 computed */
+	int done;
+	double worst;
+	double average;
+	int depth;
+};
+
+/* Entries in the buckets of a MAC address list: the mean for a random
+ * address or the largest bucket */
+static double wormhash_cost(const struct ebt_mac_wormhash *wh, int worst)
+{
+	int i, n, most = 0;
+
+	if (!wh)
+		return 0;
+	if (!worst)
+		return 2 + wh->poolsize / 256.0;
+	for (i = 0; i < 256; i++) {
+		n = wh->table[i + 1] - wh->table[i];
+		if (n > most)
+			most = n;
+	}
+	return 2 + most;
+}
+
+/* Boyer-Moore skips up to the pattern length on average, but can examine
+ * every byte just like Knuth-Morris-Pratt */
+static double string_cost(const struct xt_string_info *info, int worst)
+{
+	int len = info->to_offset < COST_FRAME_LEN ? info->to_offset :
+		  COST_FRAME_LEN;
+
+	len = len > info->from_offset ? len - info->from_offset : 0;
+	if (!worst && !strcmp(info->algo, "bm") && info->patlen)
+		len /= info->patlen;
+	return 2 + (double)len / COST_STRING_BYTES;
+}
+
+static double match_cost(const struct ebt_entry_match *m, int worst)
+{
+	const struct ebt_among_info *among;
+	int i;
+
+	if (!strcmp(m->u.name, "string"))
+		return string_cost((struct xt_string_info *)m->data, worst);
+	if (!strcmp(m->u.name, EBT_AMONG_MATCH)) {
+		among = (struct ebt_among_info *)m->data;
+		return wormhash_cost(ebt_among_wh_dst(among), worst) +
+		       wormhash_cost(ebt_among_wh_src(among), worst);
+	}
+	for (i = 0; i < sizeof(match_costs) / sizeof(match_costs[0]); i++)
+		if (!strcmp(m->u.name, match_costs[i].name))
+			return match_costs[i].cost;
+	return COST_UNKNOWN;
+}
+
+static double watcher_cost(const struct ebt_entry_watcher *w)
+{
+	int i;
+
+	for (i = 0; i < sizeof(watcher_costs) / sizeof(watcher_costs[0]); i++)
+		if (!strcmp(w->u.name, watcher_costs[i].name))
+			return watcher_costs[i].cost;
+	return COST_UNKNOWN;
+}
+
+/* The comparisons of the rule, without the chain it jumps to */
+static double rule_cost(const struct ebt_u_entry *e, int worst)
+{
+	struct ebt_u_match_list *m_l;
+	double cost = 1;
+
+	if (e->in[0])
+		cost++;
+	if (e->out[0])
+		cost++;
+	if (e->logical_in[0])
+		cost++;
+	if (e->logical_out[0])
+		cost++;
+	if (e->bitmask & EBT_SOURCEMAC)
+		cost++;
+	if (e->bitmask & EBT_DESTMAC)
+		cost++;
+	for (m_l = e->m_list; m_l; m_l = m_l->next)
+		cost += match_cost(m_l->m, worst);
+	return cost;
+}
+
+/* The cost of a frame the rule matches: its watchers and target */
+static double action_cost(const struct ebt_u_entry *e)
+{
+	struct ebt_u_watcher_list *w_l;
+	double cost = 0;
+
+	for (w_l = e->w_list; w_l; w_l = w_l->next)
+		cost += watcher_cost(w_l->w);
+	if (strcmp(e->t->u.name, EBT_STANDARD_TARGET))
+		cost += COST_TARGET;
+	return cost;
+}
+
+static int rule_verdict(const struct ebt_u_entry *e)
+{
+	if (strcmp(e->t->u.name, EBT_STANDARD_TARGET))
+		return EBT_CONTINUE;
+	return ((struct ebt_standard_target *)e->t)->verdict;
+}
+
+static void chain_cost(struct ebt_u_replace *replace, struct chain_cost *costs,
+		       int chain_nr)
+{
+	struct ebt_u_entries *entries = replace->chains[chain_nr];
+	struct chain_cost *c = &costs[chain_nr], *to;
+	struct ebt_u_entry *e;
+	double prefix = 0, sum = 0;
+	int exits = 0, verdict;
+
+	for (e = entries->entries->next; e != entries->entries; e = e->next) {
+		c->worst += rule_cost(e, 1) + action_cost(e);
+		prefix += rule_cost(e, 0);
+		verdict = rule_verdict(e);
+		if (verdict >= 0) {
+			prefix += action_cost(e);
+			to = &costs[verdict + NF_BR_NUMHOOKS];
+			if (!to->done)
+				chain_cost(replace, costs,
+					   verdict + NF_BR_NUMHOOKS);
+			c->worst += to->worst;
+			prefix += to->average;
+			if (to->depth + 1 > c->depth)
+				c->depth = to->depth + 1;
+		} else if (verdict != EBT_CONTINUE) {
+			sum += prefix + action_cost(e);
+			exits++;
+		}
+	}
+	/* The frames that reach the policy */
+	c->average = (sum + prefix) / (exits + 1);
+	c->done = 1;
+}
+
+/* Chains and rules reachable from the base chain */
+static void reachable(struct ebt_u_replace *replace, int hook, int *nchains,
+		      int *nrules)
+{
+	int i;
+
+	*nchains = *nrules = 0;
+	for (i = 0; i < replace->num_chains; i++)
+		if (replace->chains[i] &&
+		    replace->chains[i]->hook_mask & (1 << hook)) {
+			(*nchains)++;
+			*nrules += replace->chains[i]->nentries;
+		}
+}
+
+static int cmp_rule_cost(const void *a, const void *b)
+{
+	const struct rule_cost *r1 = a, *r2 = b;
+
+	if (r1->worst != r2->worst)
+		return r1->worst < r2->worst ? 1 : -1;
+	if (r1->chain_nr != r2->chain_nr)
+		return r1->chain_nr - r2->chain_nr;
+	return r1->rule_nr - r2->rule_nr;
+}
+
+static void print_json_name(const char *s)
+{
+	putchar('"');
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			putchar('\\');
+		if ((unsigned char)*s < 0x20)
+			printf("\\u%04x", *s);
+		else
+			putchar(*s);
+	}
+	putchar('"');
+}
+
+/* Prints the worst case and average cost of every base chain and the most
+ * expensive rules reachable from them, followed by the same figures as
+ * one JSON line */
+void ebt_cost_report(struct ebt_u_replace *replace)
+{
+	struct chain_cost *costs;
+	struct rule_cost *rules;
+	struct ebt_u_entries *entries;
+	struct ebt_u_entry *e;
+	int i, j, n = 0, nchains, nrules, first;
+
+	ebt_check_for_loops(replace);
+	if (ebt_errormsg[0] != '\0')
+		return;
+	costs = (struct chain_cost *)calloc(replace->num_chains,
+					     sizeof(struct chain_cost));
+	rules = (struct rule_cost *)malloc((replace->nentries + 1) *
+					   sizeof(struct rule_cost));
+	if (!costs || !rules)
+		ebt_print_memory();
+	for (i = 0; i < replace->num_chains; i++) {
+		if (!(entries = replace->chains[i]) || !entries->hook_mask)
+			continue;
+		if (i < NF_BR_NUMHOOKS)
+			chain_cost(replace, costs, i);
+		j = 1;
+		for (e = entries->entries->next; e != entries->entries;
+		     e = e->next, j++) {
+			rules[n].chain_nr = i;
+			rules[n].rule_nr = j;
+			rules[n].worst = rule_cost(e, 1) + action_cost(e);
+			rules[n].average = rule_cost(e, 0) + action_cost(e);
+			n++;
+		}
+	}
+	qsort(rules, n, sizeof(struct rule_cost), cmp_rule_cost);
+	if (n > COST_TOP)
+		n = COST_TOP;
+
+	printf("Bridge table: %s\n\n", replace->name);
+	printf("%-16s %10s %10s %6s %6s %6s\n", "Chain", "worst", "average",
+	       "depth", "chains", "rules");
+	for (i = 0; i < NF_BR_NUMHOOKS; i++) {
+		if (!(entries = replace->chains[i]))
+			continue;
+		reachable(replace, i, &nchains, &nrules);
+		printf("%-16s %10.1f %10.1f %6d %6d %6d\n", entries->name,
+		       costs[i].worst, costs[i].average, costs[i].depth,
+		       nchains, nrules);
+	}
+	if (n) {
+		printf("\nMost expensive rules:\n");
+		printf("%10s %10s  %s\n", "worst", "average", "rule");
+	}
+	for (i = 0; i < n; i++)
+		printf("%10.1f %10.1f  %s %d\n", rules[i].worst,
+		       rules[i].average, replace->chains[rules[i].chain_nr]->name,
+		       rules[i].rule_nr);
+
+	printf("{\"table\":");
+	print_json_name(replace->name);
+	printf(",\"hooks\":{");
+	first = 1;
+	for (i = 0; i < NF_BR_NUMHOOKS; i++) {
+		if (!(entries = replace->chains[i]))
+			continue;
+		if (!first)
+			putchar(',');
+		first = 0;
+		reachable(replace, i, &nchains, &nrules);
+		print_json_name(entries->name);
+		printf(":{\"worst\":%.1f,\"average\":%.1f,\"depth\":%d,"
+		       "\"chains\":%d,\"rules\":%d}", costs[i].worst,
+		       costs[i].average, costs[i].depth, nchains, nrules);
+	}
+	printf("},\"top\":[");
+	for (i = 0; i < n; i++) {
+		printf("%s{\"chain\":", i ? "," : "");
+		print_json_name(replace->chains[rules[i].chain_nr]->name);
+		printf(",\"rule\":%d,\"worst\":%.1f,\"average\":%.1f}",
+		       rules[i].rule_nr, rules[i].worst, rules[i].average);
+	}
+	printf("]}\n");
+	free(costs);
+	free(rules);
+}
@@ -0,0 +1,302 @@
+/*
+ * diff.c, differences between two versions of a table for --diff
+ *
+ * A version of the table is read from a source: the kernel ("kernel"), an
+ * atomic file or a file with the output of ebtables-save. Atomic files
+ * start with the table name padded with NUL bytes, which the text never
+ * contains. Every source is read through a handle of its own.
+ *
+ * The rules are compared by their ebt_rule_id(). In every chain, each rule
+ * of the second version is paired with the first unpaired rule of the
+ * first version with the same ID, found through a hash table, the rules
+ * that are left over were removed or added. The paired rules that are not
+ * part of a longest run of pairs in the same order in both versions (a
+ * longest increasing subsequence of their old positions) were moved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "include/ebtables_u.h"
+
+struct diff_counts
+{
+	unsigned int added;
+	unsigned int removed;
+	unsigned int moved;
+	unsigned int chains_added;
+	unsigned int chains_removed;
+	unsigned int policies;
+};
+
+/* The rules of a chain, NULL for a chain the version doesn't have */
+struct diff_chain
+{
+	struct ebt_u_replace *replace;
+	struct ebt_u_entries *entries;
+	int n;
+	struct ebt_u_entry **rules;
+	uint64_t *ids;
+};
+
+static struct ebt_handle *read_source(const char *table, const char *source)
+{
+	char head[sizeof(struct ebt_replace)];
+	struct ebt_handle *h;
+	FILE *file;
+	int ret;
+
+	if (!(h = ebt_handle_new(table))) {
+		ebt_print_error("Bad table name '%s'", table);
+		return NULL;
+	}
+	if (!strcmp(source, "kernel")) {
+		if (!(ret = ebt_handle_open(h, 0)))
+			return h;
+		ebt_print_error("kernel: %s", ebt_handle_error(h));
+		goto free_handle;
+	}
+	if (!(file = fopen(source, "r"))) {
+		ebt_print_error("Could not open file %s", source);
+		goto free_handle;
+	}
+	if (fread(head, 1, sizeof(head), file) == sizeof(head) &&
+	    memchr(head, '\0', EBT_TABLE_MAXNAMELEN)) {
+		fclose(file);
+		h->replace.filename = (char *)source;
+		ret = ebt_handle_open(h, 0);
+		h->replace.filename = NULL;
+		if (!ret)
+			return h;
+		ebt_print_error("%s", ebt_handle_error(h));
+		goto free_handle;
+	}
+	rewind(file);
+	if ((ret = ebt_handle_restore(h, file, source)))
+		ebt_print_error("%s", ebt_handle_error(h));
+	fclose(file);
+	if (!ret)
+		return h;
+free_handle:
+	ebt_handle_free(h);
+	return NULL;
+}
+
+static void get_chain(struct diff_chain *c, struct ebt_u_replace *replace,
+		      struct ebt_u_entries *entries)
+{
+	struct ebt_u_entry *e;
+	int i = 0;
+
+	c->replace = replace;
+	c->entries = entries;
+	c->n = entries ? entries->nentries : 0;
+	c->rules = (struct ebt_u_entry **)malloc((c->n + 1) *
+						 sizeof(struct ebt_u_entry *));
+	c->ids = (uint64_t *)malloc((c->n + 1) * sizeof(uint64_t));
+	if (!c->rules || !c->ids)
+		ebt_print_memory();
+	if (!entries)
+		return;
+	for (e = entries->entries->next; e != entries->entries; e = e->next) {
+		c->rules[i] = e;
+		c->ids[i++] = ebt_rule_id(replace, e);
+	}
+}
+
+static void print_diff_rule(char sign, const struct diff_chain *c, int nr,
+			    int new_nr)
+{
+	printf("%c%s %d", sign, c->entries->name, nr + 1);
+	if (new_nr >= 0)
+		printf(" -> %d", new_nr + 1);
+	fputs(": ", stdout);
+	ebt_print_rule(c->replace, c->rules[nr]);
+	putchar('\n');
+}
+
+/* pair[j] is the rule of a paired with rule j of b, or -1. Sets moved[j]
+ * for the pairs outside a longest increasing subsequence of pair[] that
+ * changed their position, the subsequence isn't always the one that keeps
+ * the most rules in place */
+static void find_moved(const int *pair, int n, char *moved)
+{
+	int *tail, *prev, len = 0, lo, hi, mid, j;
+
+	tail = (int *)malloc((n + 1) * sizeof(int));
+	prev = (int *)malloc((n + 1) * sizeof(int));
+	if (!tail || !prev)
+		ebt_print_memory();
+	for (j = 0; j < n; j++) {
+		moved[j] = pair[j] != -1;
+		if (pair[j] == -1)
+			continue;
+		/* The shortest run that can be extended by pair[j] */
+		lo = 0;
+		hi = len;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (pair[tail[mid]] < pair[j])
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		prev[j] = lo ? tail[lo - 1] : -1;
+		tail[lo] = j;
+		if (lo == len)
+			len++;
+	}
+	for (j = len ? tail[len - 1] : -1; j != -1; j = prev[j])
+		moved[j] = 0;
+	for (j = 0; j < n; j++)
+		if (pair[j] == j)
+			moved[j] = 0;
+	free(tail);
+	free(prev);
+}
+
+static void diff_chain(struct diff_chain *a, struct diff_chain *b,
+		       struct diff_counts *counts)
+{
+	unsigned int size = 1, mask, k;
+	uint64_t *slot_id;
+	int *slot, *next, *pair, i, j;
+	char *paired, *moved;
+
+	while (size < 2 * (unsigned int)a->n)
+		size <<= 1;
+	mask = size - 1;
+	slot_id = (uint64_t *)calloc(size, sizeof(uint64_t));
+	slot = (int *)malloc(size * sizeof(int));
+	next = (int *)malloc((a->n + 1) * sizeof(int));
+	pair = (int *)malloc((b->n + 1) * sizeof(int));
+	paired = (char *)calloc(a->n + 1, 1);
+	moved = (char *)malloc(b->n + 1);
+	if (!slot_id || !slot || !next || !pair || !paired || !moved)
+		ebt_print_memory();
+	for (k = 0; k < size; k++)
+		slot[k] = -2;
+
+	/* Every slot holds the unpaired rules of a with the same ID, in
+	 * their order, -1 when they're all paired */
+	for (i = a->n - 1; i >= 0; i--) {
+		for (k = a->ids[i] & mask; slot[k] != -2 &&
+		     slot_id[k] != a->ids[i]; k = (k + 1) & mask);
+		next[i] = slot[k] == -2 ? -1 : slot[k];
+		slot[k] = i;
+		slot_id[k] = a->ids[i];
+	}
+	for (j = 0; j < b->n; j++) {
+		pair[j] = -1;
+		for (k = b->ids[j] & mask; slot[k] != -2 &&
+		     slot_id[k] != b->ids[j]; k = (k + 1) & mask);
+		if (slot[k] < 0)
+			continue;
+		pair[j] = slot[k];
+		paired[slot[k]] = 1;
+		slot[k] = next[slot[k]];
+	}
+	find_moved(pair, b->n, moved);
+
+	for (i = 0; i < a->n; i++)
+		if (!paired[i]) {
+			print_diff_rule('-', a, i, -1);
+			counts->removed++;
+		}
+	for (j = 0; j < b->n; j++)
+		if (pair[j] == -1) {
+			print_diff_rule('+', b, j, -1);
+			counts->added++;
+		} else if (moved[j]) {
+			print_diff_rule('~', a, pair[j], j);
+			counts->moved++;
+		}
+	free(slot_id);
+	free(slot);
+	free(next);
+	free(pair);
+	free(paired);
+	free(moved);
+}
+
+static void compare_chains(struct ebt_u_replace *a, struct ebt_u_entries *ca,
+			   struct ebt_u_replace *b, struct ebt_u_entries *cb,
+			   struct diff_counts *counts)
+{
+	struct diff_chain chain_a, chain_b;
+
+	if (!cb) {
+		printf("-chain %s, policy %s\n", ca->name,
+		       ebt_standard_targets[-ca->policy - 1]);
+		counts->chains_removed++;
+	} else if (!ca) {
+		printf("+chain %s, policy %s\n", cb->name,
+		       ebt_standard_targets[-cb->policy - 1]);
+		counts->chains_added++;
+	} else if (ca->policy != cb->policy) {
+		printf("!chain %s, policy %s -> %s\n", ca->name,
+		       ebt_standard_targets[-ca->policy - 1],
+		       ebt_standard_targets[-cb->policy - 1]);
+		counts->policies++;
+	}
+	get_chain(&chain_a, a, ca);
+	get_chain(&chain_b, b, cb);
+	/* The rules of a missing chain are printed with the other name */
+	if (!ca)
+		chain_a.entries = cb;
+	if (!cb)
+		chain_b.entries = ca;
+	diff_chain(&chain_a, &chain_b, counts);
+	free(chain_a.rules);
+	free(chain_a.ids);
+	free(chain_b.rules);
+	free(chain_b.ids);
+}
+
+/* Prints the differences of the table between source_a and source_b.
+ * Returns 0 if there are none, 1 if there are and -1 on error */
+int ebt_diff_tables(const char *table, const char *source_a,
+		    const char *source_b)
+{
+	struct ebt_handle *ha, *hb = NULL;
+	struct ebt_u_replace *a, *b;
+	struct diff_counts counts;
+	int i, j;
+
+	/* Nothing is read from or given to the kernel. This fails when the
+	 * process already used the kernel, which then parses the files. */
+	if (strcmp(source_a, "kernel") && strcmp(source_b, "kernel"))
+		ebt_set_backend("memory");
+	if (!(ha = read_source(table, source_a)) ||
+	    !(hb = read_source(table, source_b))) {
+		ebt_handle_free(ha);
+		return -1;
+	}
+	a = &ha->replace;
+	b = &hb->replace;
+	memset(&counts, 0, sizeof(counts));
+
+	printf("--- %s\n+++ %s\n", source_a, source_b);
+	for (i = 0; i < a->num_chains; i++) {
+		if (!a->chains[i])
+			continue;
+		j = ebt_get_chainnr(b, a->chains[i]->name);
+		compare_chains(a, a->chains[i], b, j == -1 ? NULL :
+			       b->chains[j], &counts);
+	}
+	for (j = 0; j < b->num_chains; j++)
+		if (b->chains[j] &&
+		    ebt_get_chainnr(a, b->chains[j]->name) == -1)
+			compare_chains(a, NULL, b, b->chains[j], &counts);
+	printf("%u rule%s added, %u removed, %u moved; %u chain%s added, "
+	       "%u removed, %u polic%s changed\n", counts.added,
+	       counts.added == 1 ? "" : "s", counts.removed, counts.moved,
+	       counts.chains_added, counts.chains_added == 1 ? "" : "s",
+	       counts.chains_removed, counts.policies,
+	       counts.policies == 1 ? "y" : "ies");
+
+	ebt_handle_free(ha);
+	ebt_handle_free(hb);
+	return counts.added || counts.removed || counts.moved ||
+	       counts.chains_added || counts.chains_removed || counts.policies;
+}
@@ -0,0 +1,1203 @@
+/*
+ * ebtables-optimize.c, folding MAC address runs into among matches,
+ * removing, reordering and dispatching rules
+ *
+ * Looks for runs of consecutive rules in a chain that only differ in the
+ * source (or only in the destination) MAC address, e.g.
+ *
+ *   -A FORWARD -i eth0 -s 0:1:2:3:4:5 -j ACCEPT
+ *   -A FORWARD -i eth0 -s 0:1:2:3:4:6 -j ACCEPT
+ *   ...
+ *
+ * Such a run is evaluated rule by rule by the kernel. It can be replaced
+ * by one rule with an among match: the kernel finds a MAC address of an
+ * among list in the hash bucket of its last byte. Without --apply, the
+ * runs and the estimated savings are only reported. With --apply, the
+ * rules of all runs are replaced in one commit, the counters of a new
+ * rule are the sum of the counters of the rules it replaces.
+ *
+ * A run is only folded when the outcome for every frame is provably the
+ * same:
+ *  - the MAC addresses aren't inverted or masked and the rules have no
+ *    among match yet;
+ *  - the target is ACCEPT, DROP or RETURN, so a frame leaves the run after
+ *    the first rule that matches, or CONTINUE without watchers (the rule
+ *    only counts) or with watchers and no address present twice (the
+ *    frame can only match one rule of the run);
+ *  - the among match fails for truncated IPv4 headers and for ARP
+ *    headers without Ethernet and IPv4 addresses (it looks up the IP
+ *    address of a frame even for a list without IP addresses). So the
+ *    rules must only match other protocols, IPv4 frames with an ip match
+ *    or ARP frames with an arp match that needs the IPv4 and the MAC
+ *    addresses, unless --loose is given.
+ *
+ * With --shadowed, rules that can never change the outcome are looked
+ * for instead, using the coverage analysis of analysis.c:
+ *  - a rule is shadowed when an earlier rule with target ACCEPT, DROP or
+ *    RETURN matches every frame it matches, without a rule in between
+ *    that could change the frame (a jump or the target of an extension);
+ *  - a rule with target ACCEPT, DROP or RETURN and without watchers is
+ *    redundant when every frame it matches would get the same verdict
+ *    from a later rule or from the policy of the chain: the rules in
+ *    between that could match the frame must have the same verdict or
+ *    CONTINUE, no watchers and no jump;
+ *  - a user defined chain is unreachable when no rule of a reachable
+ *    chain that isn't shadowed jumps to it.
+ * Removing them doesn't change the verdict for any frame, only the
+ * counters of the rules that now see the frames. With --apply, they are
+ * removed in one commit.
+ *
+ * With --reorder-by-counters, rules that decide many frames (their counter
+ * is high and their target is ACCEPT, DROP or RETURN) are moved to the
+ * front of their chain, so these frames are evaluated by fewer rules. A
+ * rule only moves past a rule that can't match the same frame, or that
+ * has the same target, neither having watchers. Rules with a jump or the
+ * target of an extension stay where they are and nothing moves past them.
+ * The rules keep their counters.
+ *
+ * With --dispatch key, runs of rules that all match one value of the key
+ * (the input interface, the input bridge, the protocol or the VLAN id),
+ * e.g. rules that all start with -i portN, are split per value: the rules
+ * of every value are moved to a new user defined chain and the run is
+ * replaced by one rule per value jumping to that chain. As no frame can
+ * match rules of two values, the first rule that matches a frame stays
+ * the same. A frame is then evaluated by the jump rules and the rules of
+ * its own value, instead of by the whole run. Rules that could return
+ * from their chain can't be moved to another chain and end a run.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "include/ebtables_u.h"
+#include <linux/netfilter_bridge/ebt_among.h>
+#include <linux/netfilter_bridge/ebt_arp.h>
+#include <linux/netfilter_bridge/ebt_vlan.h>
+#include <linux/netfilter_bridge/ebt_mark_t.h>
+#include <linux/netfilter_bridge/ebt_nat.h>
+#include <linux/netfilter_bridge/ebt_redirect.h>
+#include <linux/netfilter_bridge/ebt_arpreply.h>
+
+#define opt_error(format, args...) do {fprintf(stderr, "ebtables-optimize: " \
+                                   format".\n", ##args); exit(1);} while (0)
+
+static const struct option options[] = {
+	{.name = "table",       .has_arg = 1, .val = 't'},
+	{.name = "chain",       .has_arg = 1, .val = 'c'},
+	{.name = "atomic-file", .has_arg = 1, .val = 'f'},
+	{.name = "min-run",     .has_arg = 1, .val = 'm'},
+	{.name = "loose",       .has_arg = 0, .val = 'l'},
+	{.name = "shadowed",    .has_arg = 0, .val = 's'},
+	{.name = "reorder-by-counters", .has_arg = 0, .val = 'r'},
+	{.name = "dispatch",    .has_arg = 1, .val = 'd'},
+	{.name = "apply",       .has_arg = 0, .val = 'a'},
+	{ 0 }
+};
+
+/* Why a run wasn't folded */
+enum { RUN_FOLD, RUN_PROTO, RUN_DUPLICATES };
+
+struct run
+{
+	int chain_nr;
+	/* The first rule has number 1 */
+	int start;
+	int n;
+	/* EBT_SOURCEMAC or EBT_DESTMAC */
+	unsigned int which;
+	int status;
+	/* Number of different addresses, the largest hash bucket */
+	int nmacs, max_bucket;
+	/* Sum over the addresses of the size of their bucket */
+	uint64_t bucket_sum;
+	/* Frames that matched a rule of the run and the rules of the run
+	 * these frames were evaluated by */
+	uint64_t pcnt, evaluated;
+	struct ebt_u_entry *first;
+	struct run *next;
+};
+
+/* What --shadowed found for a rule */
+enum { RULE_KEEP, RULE_SHADOWED, RULE_REDUNDANT };
+
+struct chain_rules
+{
+	int n;
+	struct ebt_u_entry **rules;
+	int *status;
+	/* The number of the rule that makes the rule useless, 0 for the
+	 * policy */
+	int *by;
+	int reachable;
+};
+
+static int min_run = 4, loose;
+
+static const unsigned char full_mask[ETH_ALEN] =
+	{0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+
+static const char *mac_option(unsigned int which)
+{
+	return which == EBT_SOURCEMAC ? "-s" : "-d";
+}
+
+static const unsigned char *rule_mac(const struct ebt_u_entry *e,
+				     unsigned int which)
+{
+	return which == EBT_SOURCEMAC ? e->sourcemac : e->destmac;
+}
+
+static struct ebt_entry_match *find_match(const struct ebt_u_entry *e,
+					  const char *name)
+{
+	struct ebt_u_match_list *m_l;
+
+	for (m_l = e->m_list; m_l; m_l = m_l->next)
+		if (!strcmp(m_l->m->u.name, name))
+			return m_l->m;
+	return NULL;
+}
+
+static int verdict(const struct ebt_u_entry *e)
+{
+	if (strcmp(e->t->u.name, EBT_STANDARD_TARGET))
+		return 0;
+	return ((struct ebt_standard_target *)e->t)->verdict;
+}
+
+/* EBT_SOURCEMAC or EBT_DESTMAC if the rule could be part of a run on that
+ * address, 0 otherwise */
+static unsigned int fold_side(const struct ebt_u_entry *e)
+{
+	unsigned int which = e->bitmask & (EBT_SOURCEMAC | EBT_DESTMAC);
+	int v = verdict(e);
+
+	if (which != EBT_SOURCEMAC && which != EBT_DESTMAC)
+		return 0;
+	if (e->invflags & (which == EBT_SOURCEMAC ? EBT_ISOURCE : EBT_IDEST))
+		return 0;
+	if (memcmp(which == EBT_SOURCEMAC ? e->sourcemsk : e->destmsk,
+	    full_mask, ETH_ALEN))
+		return 0;
+	if (find_match(e, EBT_AMONG_MATCH))
+		return 0;
+	/* Jumps and the targets of extensions can change the frame */
+	if (v != EBT_ACCEPT && v != EBT_DROP && v != EBT_RETURN &&
+	    v != EBT_CONTINUE)
+		return 0;
+	return which;
+}
+
+/* 1 if the rules are the same, apart from the address which */
+static int same_but_mac(const struct ebt_u_entry *a,
+			const struct ebt_u_entry *b)
+{
+	struct ebt_u_match_list *m_l, *m_l2;
+	struct ebt_u_watcher_list *w_l, *w_l2;
+	struct ebt_u_match *m;
+	struct ebt_u_watcher *w;
+
+	if (a->bitmask != b->bitmask || a->invflags != b->invflags ||
+	    a->ethproto != b->ethproto || strcmp(a->in, b->in) ||
+	    strcmp(a->out, b->out) || strcmp(a->logical_in, b->logical_in) ||
+	    strcmp(a->logical_out, b->logical_out))
+		return 0;
+	if (verdict(a) != verdict(b))
+		return 0;
+	for (m_l = a->m_list, m_l2 = b->m_list; m_l && m_l2;
+	     m_l = m_l->next, m_l2 = m_l2->next) {
+		if (strcmp(m_l->m->u.name, m_l2->m->u.name) ||
+		    m_l->m->u.revision != m_l2->m->u.revision ||
+		    !(m = ebt_find_match(m_l->m->u.name)) ||
+		    !m->compare(m_l->m, m_l2->m))
+			return 0;
+	}
+	if (m_l || m_l2)
+		return 0;
+	for (w_l = a->w_list, w_l2 = b->w_list; w_l && w_l2;
+	     w_l = w_l->next, w_l2 = w_l2->next) {
+		if (strcmp(w_l->w->u.name, w_l2->w->u.name) ||
+		    !(w = ebt_find_watcher(w_l->w->u.name)) ||
+		    !w->compare(w_l->w, w_l2->w))
+			return 0;
+	}
+	return !w_l && !w_l2;
+}
+
+/* 1 if the among match can't fail on a frame the rule matches because
+ * of a truncated IPv4 header or an unusual ARP header */
+static int proto_is_safe(const struct ebt_u_entry *e)
+{
+	struct ebt_entry_match *m;
+	struct ebt_arp_info *arp;
+
+	if (e->bitmask & EBT_802_3)
+		return !(e->invflags & EBT_IPROTO);
+	if (e->bitmask & EBT_NOPROTO || e->invflags & EBT_IPROTO)
+		return 0;
+	if (e->ethproto == htons(ETH_P_IP))
+		return find_match(e, "ip") != NULL;
+	if (e->ethproto == htons(ETH_P_ARP)) {
+		if (!(m = find_match(e, "arp")))
+			return 0;
+		arp = (struct ebt_arp_info *)m->data;
+		return arp->bitmask & (EBT_ARP_SRC_IP | EBT_ARP_DST_IP |
+		   EBT_ARP_GRAT) && arp->bitmask & (EBT_ARP_SRC_MAC |
+		   EBT_ARP_DST_MAC);
+	}
+	return 1;
+}
+
+/* Hash bucket order, as in the among extension: by last byte, then by
+ * address */
+static int mac_cmp(const void *va, const void *vb)
+{
+	const unsigned char *a = va, *b = vb;
+
+	if (a[ETH_ALEN - 1] != b[ETH_ALEN - 1])
+		return a[ETH_ALEN - 1] - b[ETH_ALEN - 1];
+	return memcmp(a, b, ETH_ALEN);
+}
+
+/* The sorted addresses of the run without copies, returns their number */
+static int run_macs(const struct run *r, unsigned char (**macs)[ETH_ALEN])
+{
+	struct ebt_u_entry *e = r->first;
+	int i, n = 0;
+
+	*macs = malloc(r->n * ETH_ALEN);
+	if (!*macs)
+		ebt_print_memory();
+	for (i = 0; i < r->n; i++, e = e->next)
+		memcpy((*macs)[i], rule_mac(e, r->which), ETH_ALEN);
+	qsort(*macs, r->n, ETH_ALEN, mac_cmp);
+	for (i = 0; i < r->n; i++)
+		if (!n || memcmp((*macs)[n - 1], (*macs)[i], ETH_ALEN))
+			memcpy((*macs)[n++], (*macs)[i], ETH_ALEN);
+	return n;
+}
+
+/* Decides whether the run can be folded and estimates the savings */
+static void analyze_run(struct run *r)
+{
+	unsigned char (*macs)[ETH_ALEN];
+	struct ebt_u_entry *e = r->first;
+	int bucket[256] = { 0 }, i;
+
+	r->nmacs = run_macs(r, &macs);
+	for (i = 0; i < r->nmacs; i++)
+		bucket[macs[i][ETH_ALEN - 1]]++;
+	for (i = 0; i < 256; i++) {
+		r->bucket_sum += (uint64_t)bucket[i] * bucket[i];
+		if (bucket[i] > r->max_bucket)
+			r->max_bucket = bucket[i];
+	}
+	free(macs);
+	for (i = 0; i < r->n; i++, e = e->next) {
+		r->pcnt += e->cnt.pcnt;
+		r->evaluated += e->cnt.pcnt * (i + 1);
+	}
+	if (!loose && !proto_is_safe(r->first))
+		r->status = RUN_PROTO;
+	else if (verdict(r->first) == EBT_CONTINUE && r->first->w_list &&
+		 r->nmacs != r->n)
+		r->status = RUN_DUPLICATES;
+	else
+		r->status = RUN_FOLD;
+}
+
+/* The data of the among match holding the addresses of the run */
+static void *among_data(const struct run *r, unsigned int *size)
+{
+	unsigned char (*macs)[ETH_ALEN];
+	struct ebt_among_info *info;
+	struct ebt_mac_wormhash *wh;
+	int i, n = run_macs(r, &macs);
+
+	*size = sizeof(struct ebt_among_info) + sizeof(struct ebt_mac_wormhash) +
+		n * sizeof(struct ebt_mac_wormhash_tuple);
+	if (!(info = calloc(1, *size)))
+		ebt_print_memory();
+	wh = (struct ebt_mac_wormhash *)(info + 1);
+	if (r->which == EBT_SOURCEMAC)
+		info->wh_src_ofs = sizeof(struct ebt_among_info);
+	else
+		info->wh_dst_ofs = sizeof(struct ebt_among_info);
+	wh->poolsize = n;
+	/* The kernel looks up a MAC in the entries from table[c] up to
+	 * table[c + 1], with c the last byte of the MAC */
+	for (i = 0; i < n; i++) {
+		memcpy((char *)wh->pool[i].cmp + 2, macs[i], ETH_ALEN);
+		wh->table[macs[i][ETH_ALEN - 1] + 1]++;
+	}
+	for (i = 0; i < 256; i++)
+		wh->table[i + 1] += wh->table[i];
+	free(macs);
+	return info;
+}
+
+/* The rule replacing the run */
+static struct ebt_u_entry *fold_run(const struct run *r)
+{
+	const struct ebt_u_entry *first = r->first, *e = first;
+	struct ebt_u_match_list *m_l;
+	struct ebt_u_watcher_list *w_l;
+	struct ebt_u_entry *new = ebt_rule_new();
+	uint64_t pcnt = 0, bcnt = 0;
+	unsigned int size;
+	void *data;
+	int i;
+
+	new->bitmask = first->bitmask & ~r->which;
+	new->invflags = first->invflags;
+	new->ethproto = first->ethproto;
+	memcpy(new->in, first->in, IFNAMSIZ);
+	memcpy(new->out, first->out, IFNAMSIZ);
+	memcpy(new->logical_in, first->logical_in, IFNAMSIZ);
+	memcpy(new->logical_out, first->logical_out, IFNAMSIZ);
+	for (m_l = first->m_list; m_l; m_l = m_l->next)
+		if (ebt_rule_add_match(new, m_l->m->u.name, m_l->m->data,
+		    m_l->m->match_size))
+			opt_error("Can't copy the %s match", m_l->m->u.name);
+	data = among_data(r, &size);
+	if (ebt_rule_add_match(new, EBT_AMONG_MATCH, data, size))
+		opt_error("The among match is not available");
+	free(data);
+	for (w_l = first->w_list; w_l; w_l = w_l->next)
+		if (ebt_rule_add_watcher(new, w_l->w->u.name, w_l->w->data,
+		    w_l->w->watcher_size))
+			opt_error("Can't copy the %s watcher", w_l->w->u.name);
+	ebt_rule_set_verdict(new, verdict(first));
+	for (i = 0; i < r->n; i++, e = e->next) {
+		pcnt += e->cnt.pcnt;
+		bcnt += e->cnt.bcnt;
+	}
+	ebt_rule_set_counters(new, pcnt, bcnt);
+	return new;
+}
+
+/* Finds the runs of at least min_run rules in the chain, appends them to
+ * the list *tail points to */
+static struct run **find_runs(struct ebt_u_replace *replace, int chain_nr,
+			      struct run **tail)
+{
+	struct ebt_u_entries *entries = replace->chains[chain_nr];
+	struct ebt_u_entry *e, *first = NULL;
+	struct run *r;
+	unsigned int which, run_which = 0;
+	int i, start = 0;
+
+	for (i = 1, e = entries->entries->next; ; i++, e = e->next) {
+		which = e != entries->entries ? fold_side(e) : 0;
+		if (first && which == run_which && same_but_mac(first, e))
+			continue;
+		if (first && i - start >= min_run) {
+			if (!(r = calloc(1, sizeof(struct run))))
+				ebt_print_memory();
+			r->chain_nr = chain_nr;
+			r->start = start;
+			r->n = i - start;
+			r->which = run_which;
+			r->first = first;
+			analyze_run(r);
+			*tail = r;
+			tail = &r->next;
+		}
+		if (e == entries->entries)
+			break;
+		first = which ? e : NULL;
+		run_which = which;
+		start = i;
+	}
+	return tail;
+}
+
+static void report(struct ebt_u_replace *replace, struct run *runs)
+{
+	static const char *reasons[] = {
+		[RUN_PROTO] = "among could fail on malformed IPv4 or ARP "
+			      "frames, use --loose",
+		[RUN_DUPLICATES] = "CONTINUE with watchers and an address "
+				   "that is present twice",
+	};
+	struct run *r;
+	uint64_t pcnt = 0, before = 0, after = 0;
+	unsigned int nruns = 0, saved = 0, passed = 0;
+	double lookups = 0;
+
+	for (r = runs; r; r = r->next) {
+		printf("%s: rules %d-%d, %d rules differing in %s (%d "
+		       "addresses, -j %s): ", replace->chains[r->chain_nr]->name,
+		       r->start, r->start + r->n - 1, r->n, mac_option(r->which),
+		       r->nmacs, TARGET_NAME(verdict(r->first)));
+		if (r->status != RUN_FOLD) {
+			printf("not folded, %s\n", reasons[r->status]);
+			continue;
+		}
+		printf("1 rule, hash buckets of %.1f addresses on average, "
+		       "%d at most\n", (double)r->bucket_sum / r->nmacs,
+		       r->max_bucket);
+		nruns++;
+		saved += r->n - 1;
+		passed += r->n;
+		/* The bucket of an address that is not in the list */
+		lookups += r->nmacs / 256.0;
+		pcnt += r->pcnt;
+		before += r->evaluated;
+		after += r->pcnt;
+	}
+	printf("\n%u run%s folded, %u rules less (%u instead of %u)\n", nruns,
+	       nruns == 1 ? "" : "s", saved, replace->nentries - saved,
+	       replace->nentries);
+	if (!nruns)
+		return;
+	printf("A frame that passes all folded runs without a match is "
+	       "evaluated by %u rules instead of %u, which compare about "
+	       "%.1f addresses in total\n", nruns, passed, lookups);
+	if (pcnt)
+		printf("The %llu frames counted by the rules of the runs were "
+		       "evaluated by %llu of their rules, folded this would be "
+		       "%llu rules\n", (unsigned long long)pcnt,
+		       (unsigned long long)before, (unsigned long long)after);
+}
+
+/* Replaces the runs, the last one first so that the rule numbers of the
+ * other runs stay valid */
+static void apply(struct ebt_txn *txn, struct ebt_u_replace *replace,
+		  struct run *r)
+{
+	struct ebt_u_entry *new;
+	const char *chain;
+	int i;
+
+	if (!r)
+		return;
+	apply(txn, replace, r->next);
+	if (r->status != RUN_FOLD)
+		return;
+	chain = replace->chains[r->chain_nr]->name;
+	new = fold_run(r);
+	for (i = 0; i < r->n; i++)
+		ebt_txn_delete(txn, chain, r->start);
+	if (ebt_txn_add(txn, chain, r->start, new))
+		ebt_rule_free(new);
+}
+
+static int terminal(int v)
+{
+	return v == EBT_ACCEPT || v == EBT_DROP || v == EBT_RETURN;
+}
+
+/* A jump or the target of an extension can change the frame */
+static int barrier(const struct ebt_u_entry *e)
+{
+	return strcmp(e->t->u.name, EBT_STANDARD_TARGET) || verdict(e) >= 0;
+}
+
+static void find_shadowed(struct chain_rules *c)
+{
+	int i, j;
+
+	for (j = 1; j < c->n; j++)
+		for (i = j - 1; i >= 0 && !barrier(c->rules[i]); i--)
+			if (terminal(verdict(c->rules[i])) &&
+			    ebt_rule_covers(c->rules[i], c->rules[j])) {
+				c->status[j] = RULE_SHADOWED;
+				c->by[j] = i + 1;
+				break;
+			}
+}
+
+/* Shadowed rules never match and the redundant rules are removed from the
+ * last one on, so every decision is taken on the chain without them */
+static void find_redundant(struct chain_rules *c, int policy)
+{
+	struct ebt_u_entry *b, *e;
+	int i, j, v, by;
+
+	for (j = c->n - 1; j >= 0; j--) {
+		b = c->rules[j];
+		v = verdict(b);
+		if (c->status[j] != RULE_KEEP || barrier(b) || !terminal(v) ||
+		    b->w_list)
+			continue;
+		by = policy == v ? 0 : -1;
+		for (i = j + 1; i < c->n; i++) {
+			e = c->rules[i];
+			if (c->status[i] != RULE_KEEP || ebt_rules_disjoint(e, b))
+				continue;
+			if (barrier(e) || e->w_list ||
+			    (verdict(e) != v && verdict(e) != EBT_CONTINUE)) {
+				by = -1;
+				break;
+			}
+			if (verdict(e) == v && ebt_rule_covers(e, b)) {
+				by = i + 1;
+				break;
+			}
+		}
+		if (by != -1) {
+			c->status[j] = RULE_REDUNDANT;
+			c->by[j] = by;
+		}
+	}
+}
+
+/* Marks the chains the chain jumps to, through rules that can match */
+static void mark_reachable(struct chain_rules *chains, int chain_nr)
+{
+	struct chain_rules *c = &chains[chain_nr];
+	int i, v;
+
+	if (c->reachable)
+		return;
+	c->reachable = 1;
+	for (i = 0; i < c->n; i++)
+		if (c->status[i] != RULE_SHADOWED &&
+		    (v = verdict(c->rules[i])) >= 0)
+			mark_reachable(chains, v + NF_BR_NUMHOOKS);
+}
+
+static struct chain_rules *find_useless(struct ebt_u_replace *replace,
+					const char *chain)
+{
+	struct chain_rules *chains, *c;
+	struct ebt_u_entries *entries;
+	struct ebt_u_entry *e;
+	int i, j;
+
+	if (!(chains = calloc(replace->num_chains, sizeof(struct chain_rules))))
+		ebt_print_memory();
+	for (i = 0; i < replace->num_chains; i++) {
+		if (!(entries = replace->chains[i]))
+			continue;
+		c = &chains[i];
+		c->n = entries->nentries;
+		c->rules = malloc((c->n + 1) * sizeof(struct ebt_u_entry *));
+		c->status = calloc(c->n + 1, sizeof(int));
+		c->by = calloc(c->n + 1, sizeof(int));
+		if (!c->rules || !c->status || !c->by)
+			ebt_print_memory();
+		for (j = 0, e = entries->entries->next; j < c->n; j++, e = e->next)
+			c->rules[j] = e;
+		if (chain && strcmp(entries->name, chain))
+			continue;
+		find_shadowed(c);
+		find_redundant(c, entries->policy);
+	}
+	for (i = 0; i < NF_BR_NUMHOOKS; i++)
+		if (replace->chains[i])
+			mark_reachable(chains, i);
+	return chains;
+}
+
+static void report_useless(struct ebt_u_replace *replace,
+			   struct chain_rules *chains, const char *chain)
+{
+	struct chain_rules *c;
+	const char *name;
+	unsigned int shadowed = 0, redundant = 0, unreachable = 0;
+	int i, j;
+
+	for (i = 0; i < replace->num_chains; i++) {
+		if (!replace->chains[i])
+			continue;
+		c = &chains[i];
+		name = replace->chains[i]->name;
+		if (!chain && !c->reachable) {
+			printf("%s: unreachable chain, %d rule%s\n", name, c->n,
+			       c->n == 1 ? "" : "s");
+			unreachable++;
+			continue;
+		}
+		for (j = 0; j < c->n; j++) {
+			if (c->status[j] == RULE_SHADOWED) {
+				printf("%s: rule %d is shadowed by rule %d\n",
+				       name, j + 1, c->by[j]);
+				shadowed++;
+			} else if (c->status[j] == RULE_REDUNDANT) {
+				if (c->by[j])
+					printf("%s: rule %d is redundant, rule "
+					       "%d gives the same verdict %s\n",
+					       name, j + 1, c->by[j],
+					       TARGET_NAME(verdict(c->rules[j])));
+				else
+					printf("%s: rule %d is redundant, the "
+					       "policy gives the same verdict "
+					       "%s\n", name, j + 1,
+					       TARGET_NAME(verdict(c->rules[j])));
+				redundant++;
+			}
+		}
+	}
+	printf("\n%u shadowed rule%s, %u redundant rule%s", shadowed,
+	       shadowed == 1 ? "" : "s", redundant, redundant == 1 ? "" : "s");
+	if (!chain)
+		printf(", %u unreachable chain%s", unreachable,
+		       unreachable == 1 ? "" : "s");
+	printf("\n");
+}
+
+/* The rules are deleted from the last one on, so the rule numbers stay
+ * valid. The unreachable chains can refer to each other, they are all
+ * flushed before they are deleted */
+static void apply_useless(struct ebt_txn *txn, struct ebt_u_replace *replace,
+			  struct chain_rules *chains, const char *chain)
+{
+	char (*names)[EBT_CHAIN_MAXNAMELEN];
+	int i, j, n = 0;
+
+	if (!(names = malloc(replace->num_chains * EBT_CHAIN_MAXNAMELEN)))
+		ebt_print_memory();
+	for (i = 0; i < replace->num_chains; i++) {
+		if (!replace->chains[i])
+			continue;
+		if (!chain && !chains[i].reachable) {
+			strcpy(names[n++], replace->chains[i]->name);
+			continue;
+		}
+		for (j = chains[i].n - 1; j >= 0; j--)
+			if (chains[i].status[j] != RULE_KEEP)
+				ebt_txn_delete(txn, replace->chains[i]->name,
+					       j + 1);
+	}
+	for (i = 0; i < n; i++)
+		ebt_txn_flush(txn, names[i]);
+	for (i = 0; i < n; i++)
+		ebt_txn_delete_chain(txn, names[i]);
+	free(names);
+}
+
+static void free_useless(struct ebt_u_replace *replace,
+			 struct chain_rules *chains)
+{
+	int i;
+
+	for (i = 0; i < replace->num_chains; i++) {
+		free(chains[i].rules);
+		free(chains[i].status);
+		free(chains[i].by);
+	}
+	free(chains);
+}
+
+/* Frames that matched the rule and weren't evaluated by the rules after it */
+static uint64_t decided(const struct ebt_u_entry *e)
+{
+	return terminal(verdict(e)) ? e->cnt.pcnt : 0;
+}
+
+/* 1 if no frame gets another outcome when the adjacent rules a and b
+ * change places */
+static int commute(const struct ebt_u_entry *a, const struct ebt_u_entry *b)
+{
+	if (barrier(a) || barrier(b))
+		return 0;
+	if (ebt_rules_disjoint(a, b))
+		return 1;
+	return verdict(a) == verdict(b) && !a->w_list && !b->w_list;
+}
+
+/* Moves the rules of the chain deciding most frames to the front, as far
+ * as they commute with the rules before them. Returns the number of rules
+ * moved forward */
+static int reorder_chain(struct ebt_txn *txn, struct ebt_u_entries *entries)
+{
+	struct ebt_u_entry **order, **cur, *e;
+	uint64_t frames = 0, before = 0, after = 0;
+	int n = entries->nentries, *old, i, j, tmp, moved = 0;
+
+	order = malloc((n + 1) * sizeof(struct ebt_u_entry *));
+	cur = malloc((n + 1) * sizeof(struct ebt_u_entry *));
+	old = malloc((n + 1) * sizeof(int));
+	if (!order || !cur || !old)
+		ebt_print_memory();
+	for (i = 0, e = entries->entries->next; i < n; i++, e = e->next) {
+		order[i] = cur[i] = e;
+		old[i] = i;
+	}
+	/* Insertion sort on the adjacent rules that commute, every step
+	 * keeps the outcome for all frames */
+	for (i = 1; i < n; i++)
+		for (j = i; j > 0 && decided(order[j]) > decided(order[j - 1]) &&
+		     commute(order[j - 1], order[j]); j--) {
+			e = order[j];
+			order[j] = order[j - 1];
+			order[j - 1] = e;
+			tmp = old[j];
+			old[j] = old[j - 1];
+			old[j - 1] = tmp;
+		}
+	for (i = 0; i < n; i++) {
+		frames += decided(order[i]);
+		before += decided(order[i]) * (old[i] + 1);
+		after += decided(order[i]) * (i + 1);
+		if (old[i] > i) {
+			printf("%s: rule %d (%llu frames) moves to %d\n",
+			       entries->name, old[i] + 1,
+			       (unsigned long long)order[i]->cnt.pcnt, i + 1);
+			moved++;
+		}
+	}
+	if (moved)
+		printf("%s: the %llu frames decided by its rules were evaluated "
+		       "by %.2f of its rules on average, reordered %.2f\n",
+		       entries->name, (unsigned long long)frames,
+		       (double)before / frames, (double)after / frames);
+	/* Put the rules in place one by one, the first i rules are in their
+	 * final place */
+	for (i = 0; txn && i < n; i++) {
+		for (j = i; cur[j] != order[i]; j++)
+			;
+		if (j == i)
+			continue;
+		ebt_txn_move(txn, entries->name, j + 1, i + 1);
+		memmove(cur + i + 1, cur + i, (j - i) * sizeof(struct ebt_u_entry *));
+		cur[i] = order[i];
+	}
+	free(order);
+	free(cur);
+	free(old);
+	return moved;
+}
+
+/* The keys of --dispatch */
+enum { KEY_IN, KEY_LOGICAL_IN, KEY_PROTO, KEY_VLAN };
+
+static const char *key_names[] = {
+	[KEY_IN] = "in", [KEY_LOGICAL_IN] = "logical-in",
+	[KEY_PROTO] = "proto", [KEY_VLAN] = "vlan",
+};
+
+static const char *key_plurals[] = {
+	[KEY_IN] = "interfaces", [KEY_LOGICAL_IN] = "bridges",
+	[KEY_PROTO] = "protocols", [KEY_VLAN] = "VLANs",
+};
+
+/* A run of rules that is split per key value */
+struct dispatch
+{
+	int chain_nr;
+	/* The first rule has number 1 */
+	int start;
+	int n;
+	int nkeys;
+	/* The values in the order of the jump rules, the number of rules and
+	 * the frames decided for every value */
+	char (*keys)[IFNAMSIZ];
+	int *count;
+	uint64_t *frames;
+	/* The value of every rule of the run */
+	int *key;
+	struct dispatch *next;
+};
+
+static int dispatch_key;
+
+/* The verdict of the target, 1 for unknown targets */
+static int target_verdict(const struct ebt_u_entry *e)
+{
+	const char *name = e->t->u.name;
+
+	if (!strcmp(name, EBT_STANDARD_TARGET))
+		return verdict(e);
+	if (!strcmp(name, EBT_MARK_TARGET))
+		return ((struct ebt_mark_t_info *)e->t->data)->target |
+		       ~EBT_VERDICT_BITS;
+	if (!strcmp(name, EBT_SNAT_TARGET))
+		return ((struct ebt_nat_info *)e->t->data)->target |
+		       ~EBT_VERDICT_BITS;
+	if (!strcmp(name, EBT_DNAT_TARGET))
+		return ((struct ebt_nat_info *)e->t->data)->target;
+	if (!strcmp(name, EBT_REDIRECT_TARGET))
+		return ((struct ebt_redirect_info *)e->t->data)->target;
+	if (!strcmp(name, EBT_ARPREPLY_TARGET))
+		return ((struct ebt_arpreply_info *)e->t->data)->target;
+	return 1;
+}
+
+/* Puts the value of the dispatch key of the rule in key, returns 0 if the
+ * rule doesn't only match one value or can't be moved to another chain */
+static int rule_key(const struct ebt_u_entry *e, char *key)
+{
+	struct ebt_entry_match *m;
+	struct ebt_vlan_info *vlan;
+	int v = target_verdict(e);
+
+	if (v == EBT_RETURN || v == 1)
+		return 0;
+	switch (dispatch_key) {
+	case KEY_IN:
+	case KEY_LOGICAL_IN:
+		if (dispatch_key == KEY_IN ?
+		    !e->in[0] || strchr(e->in, 1) || e->invflags & EBT_IIN :
+		    !e->logical_in[0] || strchr(e->logical_in, 1) ||
+		    e->invflags & EBT_ILOGICALIN)
+			return 0;
+		strcpy(key, dispatch_key == KEY_IN ? e->in : e->logical_in);
+		return 1;
+	case KEY_PROTO:
+		if (e->bitmask & (EBT_NOPROTO | EBT_802_3) ||
+		    e->invflags & EBT_IPROTO)
+			return 0;
+		sprintf(key, "0x%04x", ntohs(e->ethproto));
+		return 1;
+	}
+	if (e->bitmask & (EBT_NOPROTO | EBT_802_3) ||
+	    e->invflags & EBT_IPROTO || e->ethproto != htons(ETH_P_8021Q) ||
+	    !(m = find_match(e, EBT_VLAN_MATCH)))
+		return 0;
+	vlan = (struct ebt_vlan_info *)m->data;
+	if (!(vlan->bitmask & EBT_VLAN_ID) || vlan->invflags & EBT_VLAN_ID)
+		return 0;
+	sprintf(key, "vlan%d", vlan->id);
+	return 1;
+}
+
+static void free_dispatch(struct dispatch *d)
+{
+	free(d->keys);
+	free(d->count);
+	free(d->frames);
+	free(d->key);
+	free(d);
+}
+
+/* Orders the values by the frames their rules decided, most first */
+static void sort_keys(struct dispatch *d)
+{
+	char tmp[IFNAMSIZ];
+	uint64_t f;
+	int i, j, k, c;
+
+	for (i = 1; i < d->nkeys; i++)
+		for (j = i; j > 0 && d->frames[j] > d->frames[j - 1]; j--) {
+			strcpy(tmp, d->keys[j]);
+			strcpy(d->keys[j], d->keys[j - 1]);
+			strcpy(d->keys[j - 1], tmp);
+			c = d->count[j];
+			d->count[j] = d->count[j - 1];
+			d->count[j - 1] = c;
+			f = d->frames[j];
+			d->frames[j] = d->frames[j - 1];
+			d->frames[j - 1] = f;
+			for (k = 0; k < d->n; k++)
+				if (d->key[k] == j)
+					d->key[k] = j - 1;
+				else if (d->key[k] == j - 1)
+					d->key[k] = j;
+		}
+}
+
+/* The run of n rules starting with rule first, returns NULL if no frame
+ * would be evaluated by fewer rules after splitting it */
+static struct dispatch *new_dispatch(int chain_nr, int start, int n,
+				     struct ebt_u_entry *first)
+{
+	struct dispatch *d;
+	struct ebt_u_entry *e;
+	char key[IFNAMSIZ];
+	int i, k, most = 0;
+
+	if (n < min_run)
+		return NULL;
+	d = calloc(1, sizeof(struct dispatch));
+	if (!d || !(d->keys = malloc(n * IFNAMSIZ)) ||
+	    !(d->count = calloc(n, sizeof(int))) ||
+	    !(d->frames = calloc(n, sizeof(uint64_t))) ||
+	    !(d->key = malloc(n * sizeof(int))))
+		ebt_print_memory();
+	d->chain_nr = chain_nr;
+	d->start = start;
+	d->n = n;
+	for (i = 0, e = first; i < n; i++, e = e->next) {
+		rule_key(e, key);
+		for (k = 0; k < d->nkeys && strcmp(d->keys[k], key); k++)
+			;
+		if (k == d->nkeys)
+			strcpy(d->keys[d->nkeys++], key);
+		d->key[i] = k;
+		d->count[k]++;
+		if (terminal(verdict(e)))
+			d->frames[k] += e->cnt.pcnt;
+	}
+	for (k = 0; k < d->nkeys; k++)
+		if (d->count[k] > most)
+			most = d->count[k];
+	if (d->nkeys + most >= n) {
+		free_dispatch(d);
+		return NULL;
+	}
+	sort_keys(d);
+	return d;
+}
+
+/* Finds the runs of the chain that can be split, appends them to the list
+ * *tail points to */
+static struct dispatch **find_dispatch(struct ebt_u_replace *replace,
+				       int chain_nr, struct dispatch **tail)
+{
+	struct ebt_u_entries *entries = replace->chains[chain_nr];
+	struct ebt_u_entry *e, *first = NULL;
+	struct dispatch *d;
+	char key[IFNAMSIZ];
+	int i, start = 0;
+
+	for (i = 1, e = entries->entries->next; ; i++, e = e->next) {
+		if (e != entries->entries && rule_key(e, key)) {
+			if (!first) {
+				first = e;
+				start = i;
+			}
+			continue;
+		}
+		if (first && (d = new_dispatch(chain_nr, start, i - start,
+		    first))) {
+			*tail = d;
+			tail = &d->next;
+		}
+		first = NULL;
+		if (e == entries->entries)
+			break;
+	}
+	return tail;
+}
+
+static void report_dispatch(struct ebt_u_replace *replace,
+			    struct dispatch *list)
+{
+	struct dispatch *d;
+	unsigned int nruns = 0, chains = 0;
+	int i, most;
+
+	for (d = list; d; d = d->next) {
+		for (i = 0, most = 0; i < d->nkeys; i++)
+			if (d->count[i] > most)
+				most = d->count[i];
+		printf("%s: rules %d-%d, %d rules for %d %s: a frame is "
+		       "evaluated by at most %d of these rules instead of %d\n",
+		       replace->chains[d->chain_nr]->name, d->start,
+		       d->start + d->n - 1, d->n, d->nkeys,
+		       key_plurals[dispatch_key], d->nkeys + most, d->n);
+		nruns++;
+		chains += d->nkeys;
+	}
+	printf("\n%u run%s split, %u new chain%s\n", nruns,
+	       nruns == 1 ? "" : "s", chains, chains == 1 ? "" : "s");
+}
+
+/* A new chain name for value k of the run */
+static void dispatch_chain_name(struct ebt_u_replace *replace,
+				const struct dispatch *d, int k, char *name)
+{
+	const char *chain = replace->chains[d->chain_nr]->name;
+	int i = 0;
+
+	if (snprintf(name, EBT_CHAIN_MAXNAMELEN, "%s-%s", chain, d->keys[k]) <
+	    EBT_CHAIN_MAXNAMELEN && ebt_get_chainnr(replace, name) == -1)
+		return;
+	do
+		snprintf(name, EBT_CHAIN_MAXNAMELEN, "%.20s-%d", chain, ++i);
+	while (ebt_get_chainnr(replace, name) != -1);
+}
+
+/* Splits the runs, the last one first so that the rule numbers of the
+ * other runs stay valid */
+static void apply_dispatch(struct ebt_txn *txn, struct ebt_u_replace *replace,
+			   struct dispatch *d)
+{
+	char (*names)[EBT_CHAIN_MAXNAMELEN], chain[EBT_CHAIN_MAXNAMELEN];
+	struct ebt_u_entry *e;
+	int *filled, i;
+
+	if (!d)
+		return;
+	apply_dispatch(txn, replace, d->next);
+	strcpy(chain, replace->chains[d->chain_nr]->name);
+	names = malloc(d->nkeys * EBT_CHAIN_MAXNAMELEN);
+	filled = calloc(d->nkeys, sizeof(int));
+	if (!names || !filled)
+		ebt_print_memory();
+	for (i = 0; i < d->nkeys; i++) {
+		dispatch_chain_name(replace, d, i, names[i]);
+		ebt_txn_new_chain(txn, names[i], EBT_RETURN);
+	}
+	/* The rules of the run are moved away one by one, the next one is
+	 * always at the start of the run */
+	for (i = 0; i < d->n; i++)
+		ebt_txn_move_to(txn, chain, d->start, names[d->key[i]],
+				++filled[d->key[i]]);
+	for (i = 0; i < d->nkeys; i++) {
+		e = ebt_rule_new();
+		if (dispatch_key == KEY_IN)
+			ebt_rule_set_iface(e, EBT_IIN, d->keys[i], 0);
+		else if (dispatch_key == KEY_LOGICAL_IN)
+			ebt_rule_set_iface(e, EBT_ILOGICALIN, d->keys[i], 0);
+		else if (dispatch_key == KEY_PROTO)
+			ebt_rule_set_proto(e, strtol(d->keys[i], NULL, 16), 0);
+		else {
+			struct ebt_vlan_info vlan = { 0 };
+
+			vlan.id = atoi(d->keys[i] + 4);
+			vlan.bitmask = EBT_VLAN_ID;
+			ebt_rule_set_proto(e, ETH_P_8021Q, 0);
+			if (ebt_rule_match(e, EBT_VLAN_MATCH, &vlan))
+				opt_error("The vlan match is not available");
+		}
+		ebt_txn_jump(txn, e, names[i]);
+		if (ebt_txn_add(txn, chain, d->start + i, e))
+			ebt_rule_free(e);
+	}
+	free(names);
+	free(filled);
+}
+
+static void print_usage()
+{
+	fprintf(stderr,
+"Usage: ebtables-optimize [options]\n"
+"  -t, --table table          table to optimize (default filter)\n"
+"  -c, --chain chain          only optimize this chain\n"
+"  -f, --atomic-file file     optimize the table in an atomic file\n"
+"  -m, --min-run n            fold or split runs of at least n rules\n"
+"                             (default 4)\n"
+"  -l, --loose                also fold runs that could match malformed\n"
+"                             IPv4 or ARP frames\n"
+"  -s, --shadowed             look for shadowed and redundant rules and\n"
+"                             unreachable chains instead of runs\n"
+"  -r, --reorder-by-counters  move the rules that decide most frames to\n"
+"                             the front of their chain instead\n"
+"  -d, --dispatch key         split runs of rules for different values of\n"
+"                             key (in, logical-in, proto or vlan) into one\n"
+"                             chain per value instead\n"
+"  -a, --apply                replace the runs (remove the rules and\n"
+"                             chains, move the rules), without this option\n"
+"                             they are only reported\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *table = "filter", *chain = NULL, *atomic = NULL;
+	struct ebt_u_replace *replace;
+	struct ebt_handle *h;
+	struct ebt_txn *txn;
+	struct run *runs = NULL, **tail = &runs, *r;
+	struct chain_rules *chains;
+	struct dispatch *dispatch = NULL, **d_tail = &dispatch, *d;
+	int c, i, do_apply = 0, shadowed = 0, reorder = 0, moved = 0, split = 0;
+	char *end;
+
+	while ((c = getopt_long(argc, argv, "t:c:f:m:lsrd:a", options,
+				NULL)) != -1) {
+		switch (c) {
+		case 't':
+			table = optarg;
+			break;
+		case 'c':
+			chain = optarg;
+			break;
+		case 'f':
+			atomic = optarg;
+			break;
+		case 'm':
+			min_run = strtol(optarg, &end, 10);
+			if (*end != '\0' || min_run < 2)
+				opt_error("Bad minimum run length '%s'", optarg);
+			break;
+		case 'l':
+			loose = 1;
+			break;
+		case 's':
+			shadowed = 1;
+			break;
+		case 'r':
+			reorder = 1;
+			break;
+		case 'd':
+			for (i = 0; i < 4 && strcmp(optarg, key_names[i]); i++)
+				;
+			if (i == 4)
+				opt_error("Bad dispatch key '%s'", optarg);
+			dispatch_key = i;
+			split = 1;
+			break;
+		case 'a':
+			do_apply = 1;
+			break;
+		default:
+			print_usage();
+		}
+	}
+	if (optind != argc)
+		print_usage();
+	if (shadowed + reorder + split > 1)
+		opt_error("Only one of --shadowed, --reorder-by-counters and "
+			  "--dispatch can be given");
+
+	ebt_silent = 0;
+	ebt_early_init_once();
+	if (!(h = ebt_handle_new(table)))
+		opt_error("Bad table name '%s'", table);
+	replace = &h->replace;
+	/* Read and written by ebt_get_table() and ebt_deliver_table() */
+	if (atomic && !(replace->filename = strdup(atomic)))
+		ebt_print_memory();
+	if (!(txn = ebt_txn_begin(h)))
+		opt_error("%s", ebt_handle_error(h));
+	if (chain && ebt_get_chainnr(replace, chain) == -1)
+		opt_error("Chain '%s' doesn't exist", chain);
+
+	if (shadowed) {
+		chains = find_useless(replace, chain);
+		report_useless(replace, chains, chain);
+		if (do_apply)
+			apply_useless(txn, replace, chains, chain);
+		free_useless(replace, chains);
+	} else if (split) {
+		for (i = 0; i < replace->num_chains; i++)
+			if (replace->chains[i] &&
+			    (!chain || !strcmp(replace->chains[i]->name, chain)))
+				d_tail = find_dispatch(replace, i, d_tail);
+		report_dispatch(replace, dispatch);
+		if (do_apply)
+			apply_dispatch(txn, replace, dispatch);
+		while ((d = dispatch)) {
+			dispatch = d->next;
+			free_dispatch(d);
+		}
+	} else if (reorder) {
+		for (i = 0; i < replace->num_chains; i++)
+			if (replace->chains[i] &&
+			    (!chain || !strcmp(replace->chains[i]->name, chain)))
+				moved += reorder_chain(do_apply ? txn : NULL,
+						       replace->chains[i]);
+		printf("%s%d rule%s moved forward\n", moved ? "\n" : "", moved,
+		       moved == 1 ? "" : "s");
+	} else {
+		for (i = 0; i < replace->num_chains; i++)
+			if (replace->chains[i] &&
+			    (!chain || !strcmp(replace->chains[i]->name, chain)))
+				tail = find_runs(replace, i, tail);
+		report(replace, runs);
+		if (do_apply)
+			apply(txn, replace, runs);
+	}
+
+	if (do_apply) {
+		if (ebt_txn_commit(txn))
+			opt_error("%s", ebt_handle_error(h));
+	} else
+		ebt_txn_abort(txn);
+	while ((r = runs)) {
+		runs = r->next;
+		free(r);
+	}
+	ebt_handle_free(h);
+	return 0;
+}
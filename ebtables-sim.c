@@ -0,0 +1,1249 @@
+/*
+ * ebtables-sim.c, offline packet classification
+ *
+ * Classifies the frames of a pcap file with a table, the way the kernel's
+ * ebt_do_table() does, without a bridge. The table is taken from the kernel
+ * (or the backend selected with EBTABLES_BACKEND), from an atomic file or
+ * from the output of ebtables-save, and is walked in the kernel format
+ * (struct ebt_replace): the base fields of the rules, the 802_3, among,
+ * arp, ip, ip6, mark_m, pkttype, stp and vlan matches, the standard
+ * target with jumps and RETURN, and the mark, snat, dnat, redirect and
+ * arpreply targets (only their effect on the MAC header and the mark).
+ * Other matches always match and other targets continue, a warning is
+ * printed for them.
+ *
+ * The report contains the packet and byte counters of every rule, the
+ * verdicts and a histogram of the number of rules evaluated per packet.
+ * With -n, the frames are classified again that many times as fast as
+ * possible, which measures the cost of the rule set.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <linux/if_packet.h>
+#include "include/ebtables_u.h"
+#include <linux/netfilter_bridge/ebt_802_3.h>
+#include <linux/netfilter_bridge/ebt_among.h>
+#include <linux/netfilter_bridge/ebt_arp.h>
+#include <linux/netfilter_bridge/ebt_arpreply.h>
+#include <linux/netfilter_bridge/ebt_ip.h>
+#include <linux/netfilter_bridge/ebt_ip6.h>
+#include <linux/netfilter_bridge/ebt_mark_m.h>
+#include <linux/netfilter_bridge/ebt_mark_t.h>
+#include <linux/netfilter_bridge/ebt_nat.h>
+#include <linux/netfilter_bridge/ebt_pkttype.h>
+#include <linux/netfilter_bridge/ebt_redirect.h>
+#include <linux/netfilter_bridge/ebt_stp.h>
+#include <linux/netfilter_bridge/ebt_vlan.h>
+
+#define sim_error(format, args...) do {fprintf(stderr, "ebtables-sim: " \
+                                   format".\n", ##args); exit(1);} while (0)
+
+#define ETH_HLEN 14
+#define HIST_BUCKETS 33
+
+static const struct option options[] = {
+	{.name = "table",       .has_arg = 1, .val = 't'},
+	{.name = "chain",       .has_arg = 1, .val = 'c'},
+	{.name = "atomic-file", .has_arg = 1, .val = 'f'},
+	{.name = "restore",     .has_arg = 1, .val = 'r'},
+	{.name = "in-if",       .has_arg = 1, .val = 'i'},
+	{.name = "out-if",      .has_arg = 1, .val = 'o'},
+	{.name = "logical-in",  .has_arg = 1, .val = 'I'},
+	{.name = "logical-out", .has_arg = 1, .val = 'O'},
+	{.name = "mark",        .has_arg = 1, .val = 'm'},
+	{.name = "host-mac",    .has_arg = 1, .val = 'H'},
+	{.name = "passes",      .has_arg = 1, .val = 'n'},
+	{ 0 }
+};
+
+/* A frame of the pcap file, being classified */
+struct frame
+{
+	/* The MAC addresses, the nat targets change them */
+	unsigned char dst[ETH_ALEN], src[ETH_ALEN];
+	/* Network byte order */
+	uint16_t proto;
+	/* Everything after the ethernet header */
+	const unsigned char *data;
+	unsigned int len;
+	unsigned long mark;
+	unsigned char pkt_type;
+};
+
+struct packet
+{
+	const unsigned char *data;
+	unsigned int len;
+};
+
+struct sim_match
+{
+	int (*match)(const struct frame *f, const void *data);
+	const void *data;
+};
+
+enum { T_STANDARD, T_MARK, T_SNAT, T_DNAT, T_REDIRECT, T_ARPREPLY, T_OTHER };
+
+struct sim_rule
+{
+	const struct ebt_entry *e;
+	struct sim_match *matches;
+	unsigned int nmatches;
+	int target;
+	const void *tdata;
+	/* Standard target: the verdict, or the chain jumped to */
+	int verdict, jump;
+	uint64_t pcnt, bcnt;
+};
+
+struct sim_chain
+{
+	const struct ebt_entries *entries;
+	unsigned int offset;
+	struct sim_rule *rules;
+	uint64_t policy_cnt;
+};
+
+static struct sim_chain *chains;
+static unsigned int nchains;
+static struct sim_rule *rules;
+static struct sim_match *matches;
+
+/* The interfaces and state all frames are classified with */
+static const char *in_if, *out_if, *logical_in, *logical_out;
+static unsigned long start_mark;
+static unsigned char host_mac[ETH_ALEN];
+static int host_mac_set;
+
+static struct packet *packets;
+static unsigned int npackets;
+
+/* Like skb_header_pointer(): off bytes into the network header */
+static inline const unsigned char *header(const struct frame *f,
+					  unsigned int off, unsigned int size)
+{
+	return off + size <= f->len ? f->data + off : NULL;
+}
+
+static inline uint16_t get16(const unsigned char *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+static inline uint32_t get32(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/* Network byte order, as stored in the kernel structs */
+static inline uint32_t raw32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint16_t raw16(const unsigned char *p)
+{
+	uint16_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/* ebt_dev_check(), 1 if the interface doesn't match */
+static int dev_check(const char *entry, const char *dev)
+{
+	int i = 0;
+
+	if (*entry == '\0')
+		return 0;
+	if (!dev)
+		return 1;
+	/* 1 is the wildcard token */
+	while (entry[i] != '\0' && entry[i] != 1 && entry[i] == dev[i])
+		i++;
+	return dev[i] != entry[i] && entry[i] != 1;
+}
+
+#define FWINV(bool, invflg) ((bool) ^ !!(e->invflags & (invflg)))
+
+/* ebt_basic_match(), 1 if the rule doesn't match */
+static int basic_match(const struct ebt_entry *e, const struct frame *f)
+{
+	unsigned int verdict = 0;
+	int i;
+
+	if (e->bitmask & EBT_802_3) {
+		if (FWINV(ntohs(f->proto) >= 0x0600, EBT_IPROTO))
+			return 1;
+	} else if (!(e->bitmask & EBT_NOPROTO) &&
+		   FWINV(e->ethproto != f->proto, EBT_IPROTO))
+		return 1;
+	if (FWINV(dev_check(e->in, in_if), EBT_IIN))
+		return 1;
+	if (FWINV(dev_check(e->out, out_if), EBT_IOUT))
+		return 1;
+	/* A bridge that isn't given matches no name, like an interface */
+	if (FWINV(dev_check(e->logical_in, logical_in), EBT_ILOGICALIN))
+		return 1;
+	if (FWINV(dev_check(e->logical_out, logical_out), EBT_ILOGICALOUT))
+		return 1;
+	if (e->bitmask & EBT_SOURCEMAC) {
+		for (i = 0; i < ETH_ALEN; i++)
+			verdict |= (f->src[i] ^ e->sourcemac[i]) & e->sourcemsk[i];
+		if (FWINV(verdict != 0, EBT_ISOURCE))
+			return 1;
+	}
+	if (e->bitmask & EBT_DESTMAC) {
+		verdict = 0;
+		for (i = 0; i < ETH_ALEN; i++)
+			verdict |= (f->dst[i] ^ e->destmac[i]) & e->destmsk[i];
+		if (FWINV(verdict != 0, EBT_IDEST))
+			return 1;
+	}
+	return 0;
+}
+
+#undef FWINV
+#define FWINV(bool, invflg) ((bool) ^ !!(info->invflags & (invflg)))
+
+/* The matches return 1 when the frame matches, like the kernel's */
+
+static int match_any(const struct frame *f, const void *data)
+{
+	return 1;
+}
+
+static int match_802_3(const struct frame *f, const void *data)
+{
+	const struct ebt_802_3_info *info = data;
+	const unsigned char *llc = header(f, 0, 8);
+	uint16_t type;
+
+	if (!llc)
+		return 0;
+	/* hdr_ui or hdr_ni, depending on the control field */
+	type = llc[2] & IS_UI ? raw16(llc + 6) : (llc = header(f, 0, 9)) ?
+	       raw16(llc + 7) : 0;
+	if (!llc)
+		return 0;
+	if (info->bitmask & EBT_802_3_SAP) {
+		if (FWINV(info->sap != llc[1], EBT_802_3_SAP))
+			return 0;
+		if (FWINV(info->sap != llc[0], EBT_802_3_SAP))
+			return 0;
+	}
+	if (info->bitmask & EBT_802_3_TYPE) {
+		if (!(llc[0] == CHECK_TYPE && llc[1] == CHECK_TYPE))
+			return 0;
+		if (FWINV(info->type != type, EBT_802_3_TYPE))
+			return 0;
+	}
+	return 1;
+}
+
+/* The IPv4 source or destination for among, 0 if there is none and -1 if
+ * the frame is too short */
+static int among_ip(const struct frame *f, int src, uint32_t *addr)
+{
+	const unsigned char *p;
+
+	*addr = 0;
+	if (f->proto == htons(ETH_P_IP)) {
+		if (!(p = header(f, 0, 20)))
+			return -1;
+		*addr = raw32(p + (src ? 12 : 16));
+	} else if (f->proto == htons(ETH_P_ARP)) {
+		if (!(p = header(f, 0, 8)))
+			return -1;
+		if (p[5] != sizeof(uint32_t) || p[4] != ETH_ALEN)
+			return -1;
+		if (!(p = header(f, 8 + (src ? ETH_ALEN : 2 * ETH_ALEN + 4), 4)))
+			return -1;
+		*addr = raw32(p);
+	}
+	return 0;
+}
+
+static int wormhash_contains(const struct ebt_mac_wormhash *wh,
+			     const unsigned char *mac, uint32_t ip)
+{
+	uint32_t cmp[2] = { 0, 0 };
+	int i;
+
+	memcpy((char *)cmp + 2, mac, ETH_ALEN);
+	for (i = wh->table[mac[5]]; i < wh->table[mac[5] + 1]; i++)
+		if (cmp[1] == wh->pool[i].cmp[1] && cmp[0] == wh->pool[i].cmp[0] &&
+		    (!wh->pool[i].ip || (ip && wh->pool[i].ip == ip)))
+			return 1;
+	return 0;
+}
+
+static int match_among(const struct frame *f, const void *data)
+{
+	const struct ebt_among_info *info = data;
+	const struct ebt_mac_wormhash *wh;
+	uint32_t ip;
+
+	if ((wh = ebt_among_wh_dst(info))) {
+		if (among_ip(f, 0, &ip))
+			return 0;
+		if (wormhash_contains(wh, f->dst, ip) ==
+		    !!(info->bitmask & EBT_AMONG_DST_NEG))
+			return 0;
+	}
+	if ((wh = ebt_among_wh_src(info))) {
+		if (among_ip(f, 1, &ip))
+			return 0;
+		if (wormhash_contains(wh, f->src, ip) ==
+		    !!(info->bitmask & EBT_AMONG_SRC_NEG))
+			return 0;
+	}
+	return 1;
+}
+
+static int match_arp(const struct frame *f, const void *data)
+{
+	const struct ebt_arp_info *info = data;
+	const unsigned char *ah = header(f, 0, 8), *p, *mac;
+	unsigned char verdict = 0;
+	int i;
+
+	if (!ah)
+		return 0;
+	if (info->bitmask & EBT_ARP_OPCODE &&
+	    FWINV(info->opcode != raw16(ah + 6), EBT_ARP_OPCODE))
+		return 0;
+	if (info->bitmask & EBT_ARP_HTYPE &&
+	    FWINV(info->htype != raw16(ah), EBT_ARP_HTYPE))
+		return 0;
+	if (info->bitmask & EBT_ARP_PTYPE &&
+	    FWINV(info->ptype != raw16(ah + 2), EBT_ARP_PTYPE))
+		return 0;
+	if (info->bitmask & (EBT_ARP_SRC_IP | EBT_ARP_DST_IP | EBT_ARP_GRAT)) {
+		uint32_t saddr, daddr;
+
+		if (ah[5] != sizeof(uint32_t) || raw16(ah + 2) != htons(ETH_P_IP))
+			return 0;
+		if (!(p = header(f, 8 + ah[4], 4)))
+			return 0;
+		saddr = raw32(p);
+		if (!(p = header(f, 8 + 2 * ah[4] + 4, 4)))
+			return 0;
+		daddr = raw32(p);
+		if (info->bitmask & EBT_ARP_SRC_IP &&
+		    FWINV(info->saddr != (saddr & info->smsk), EBT_ARP_SRC_IP))
+			return 0;
+		if (info->bitmask & EBT_ARP_DST_IP &&
+		    FWINV(info->daddr != (daddr & info->dmsk), EBT_ARP_DST_IP))
+			return 0;
+		if (info->bitmask & EBT_ARP_GRAT &&
+		    FWINV(daddr != saddr, EBT_ARP_GRAT))
+			return 0;
+	}
+	if (info->bitmask & (EBT_ARP_SRC_MAC | EBT_ARP_DST_MAC)) {
+		if (ah[4] != ETH_ALEN || raw16(ah) != htons(1))
+			return 0;
+		if (info->bitmask & EBT_ARP_SRC_MAC) {
+			if (!(mac = header(f, 8, ETH_ALEN)))
+				return 0;
+			for (i = 0; i < ETH_ALEN; i++)
+				verdict |= (mac[i] ^ info->smaddr[i]) & info->smmsk[i];
+			if (FWINV(verdict != 0, EBT_ARP_SRC_MAC))
+				return 0;
+		}
+		if (info->bitmask & EBT_ARP_DST_MAC) {
+			if (!(mac = header(f, 8 + ah[4] + ah[5], ETH_ALEN)))
+				return 0;
+			verdict = 0;
+			for (i = 0; i < ETH_ALEN; i++)
+				verdict |= (mac[i] ^ info->dmaddr[i]) & info->dmmsk[i];
+			if (FWINV(verdict != 0, EBT_ARP_DST_MAC))
+				return 0;
+		}
+	}
+	return 1;
+}
+
+static int match_ip(const struct frame *f, const void *data)
+{
+	const struct ebt_ip_info *info = data;
+	const unsigned char *ih = header(f, 0, 20), *pp;
+
+	if (!ih)
+		return 0;
+	if (info->bitmask & EBT_IP_TOS &&
+	    FWINV(info->tos != ih[1], EBT_IP_TOS))
+		return 0;
+	if (info->bitmask & EBT_IP_SOURCE &&
+	    FWINV((raw32(ih + 12) & info->smsk) != info->saddr, EBT_IP_SOURCE))
+		return 0;
+	if (info->bitmask & EBT_IP_DEST &&
+	    FWINV((raw32(ih + 16) & info->dmsk) != info->daddr, EBT_IP_DEST))
+		return 0;
+	if (!(info->bitmask & EBT_IP_PROTO))
+		return 1;
+	if (FWINV(info->protocol != ih[9], EBT_IP_PROTO))
+		return 0;
+	if (!(info->bitmask & (EBT_IP_DPORT | EBT_IP_SPORT | EBT_IP_ICMP |
+	    EBT_IP_IGMP)))
+		return 1;
+	/* Not the first fragment */
+	if (get16(ih + 6) & 0x1fff)
+		return 0;
+	if (!(pp = header(f, (ih[0] & 0x0f) * 4, 4)))
+		return 0;
+	if (info->bitmask & EBT_IP_DPORT &&
+	    FWINV(get16(pp + 2) < info->dport[0] ||
+		  get16(pp + 2) > info->dport[1], EBT_IP_DPORT))
+		return 0;
+	if (info->bitmask & EBT_IP_SPORT &&
+	    FWINV(get16(pp) < info->sport[0] ||
+		  get16(pp) > info->sport[1], EBT_IP_SPORT))
+		return 0;
+	if (info->bitmask & EBT_IP_ICMP &&
+	    FWINV(pp[0] < info->icmp_type[0] || pp[0] > info->icmp_type[1] ||
+		  pp[1] < info->icmp_code[0] || pp[1] > info->icmp_code[1],
+		  EBT_IP_ICMP))
+		return 0;
+	if (info->bitmask & EBT_IP_IGMP &&
+	    FWINV(pp[0] < info->igmp_type[0] || pp[0] > info->igmp_type[1],
+		  EBT_IP_IGMP))
+		return 0;
+	return 1;
+}
+
+static int ip6_masked_cmp(const unsigned char *addr,
+			  const struct in6_addr *msk, const struct in6_addr *a)
+{
+	int i;
+
+	for (i = 0; i < 16; i++)
+		if ((addr[i] & msk->s6_addr[i]) != a->s6_addr[i])
+			return 1;
+	return 0;
+}
+
+/* ipv6_skip_exthdr(), the offset of the upper layer header or -1 */
+static int ip6_skip_exthdr(const struct frame *f, int start, uint8_t *nexthdr)
+{
+	const unsigned char *hp;
+
+	for (;;) {
+		switch (*nexthdr) {
+		case 0: /* hop-by-hop */
+		case 43: /* routing */
+		case 60: /* destination options */
+		case 51: /* authentication */
+		case 44: /* fragment */
+			break;
+		case 59: /* no next header */
+			return -1;
+		default:
+			return start;
+		}
+		if (!(hp = header(f, start, 8)))
+			return -1;
+		if (*nexthdr == 44) {
+			/* Not the first fragment */
+			if (get16(hp + 2) & ~0x7)
+				return start;
+			start += 8;
+		} else if (*nexthdr == 51)
+			start += (hp[1] + 2) << 2;
+		else
+			start += (hp[1] + 1) << 3;
+		*nexthdr = hp[0];
+	}
+}
+
+static int match_ip6(const struct frame *f, const void *data)
+{
+	const struct ebt_ip6_info *info = data;
+	const unsigned char *ih6 = header(f, 0, 40), *pp;
+	uint8_t nexthdr;
+	int offset;
+
+	if (!ih6)
+		return 0;
+	if (info->bitmask & EBT_IP6_TCLASS &&
+	    FWINV(info->tclass != ((get16(ih6) >> 4) & 0xff), EBT_IP6_TCLASS))
+		return 0;
+	if (info->bitmask & EBT_IP6_SOURCE &&
+	    FWINV(ip6_masked_cmp(ih6 + 8, &info->smsk, &info->saddr),
+		  EBT_IP6_SOURCE))
+		return 0;
+	if (info->bitmask & EBT_IP6_DEST &&
+	    FWINV(ip6_masked_cmp(ih6 + 24, &info->dmsk, &info->daddr),
+		  EBT_IP6_DEST))
+		return 0;
+	if (!(info->bitmask & EBT_IP6_PROTO))
+		return 1;
+	nexthdr = ih6[6];
+	if ((offset = ip6_skip_exthdr(f, 40, &nexthdr)) == -1)
+		return 0;
+	if (FWINV(info->protocol != nexthdr, EBT_IP6_PROTO))
+		return 0;
+	if (!(info->bitmask & (EBT_IP6_DPORT | EBT_IP6_SPORT | EBT_IP6_ICMP6)))
+		return 1;
+	if (!(pp = header(f, offset, 4)))
+		return 0;
+	if (info->bitmask & EBT_IP6_DPORT &&
+	    FWINV(get16(pp + 2) < info->dport[0] ||
+		  get16(pp + 2) > info->dport[1], EBT_IP6_DPORT))
+		return 0;
+	if (info->bitmask & EBT_IP6_SPORT &&
+	    FWINV(get16(pp) < info->sport[0] ||
+		  get16(pp) > info->sport[1], EBT_IP6_SPORT))
+		return 0;
+	if (info->bitmask & EBT_IP6_ICMP6 &&
+	    FWINV(pp[0] < info->icmpv6_type[0] || pp[0] > info->icmpv6_type[1] ||
+		  pp[1] < info->icmpv6_code[0] || pp[1] > info->icmpv6_code[1],
+		  EBT_IP6_ICMP6))
+		return 0;
+	return 1;
+}
+
+static int match_mark(const struct frame *f, const void *data)
+{
+	const struct ebt_mark_m_info *info = data;
+
+	if (info->bitmask & EBT_MARK_OR)
+		return !!(f->mark & info->mask) ^ info->invert;
+	return ((f->mark & info->mask) == info->mark) ^ info->invert;
+}
+
+static int match_pkttype(const struct frame *f, const void *data)
+{
+	const struct ebt_pkttype_info *info = data;
+
+	return (f->pkt_type == info->pkt_type) ^ info->invert;
+}
+
+#define STP_RANGE(flag, v, l, u) \
+	(info->bitmask & (flag) && FWINV((v) < c->l || (v) > c->u, flag))
+
+/* A BPDU: LLC 42 42 03, protocol id 0, version 0, then the type */
+static int match_stp(const struct frame *f, const void *data)
+{
+	static const unsigned char bpdu[6] = {0x42, 0x42, 0x03, 0x00, 0x00, 0x00};
+	const struct ebt_stp_info *info = data;
+	const struct ebt_stp_config_info *c = &info->config;
+	const unsigned char *sp = header(f, 0, 7), *st;
+	unsigned char verdict = 0;
+	int i;
+
+	if (!sp || memcmp(sp, bpdu, sizeof(bpdu)))
+		return 0;
+	if (info->bitmask & EBT_STP_TYPE &&
+	    FWINV(info->type != sp[6], EBT_STP_TYPE))
+		return 0;
+	if (sp[6] != 0 || !(info->bitmask & EBT_STP_CONFIG_MASK))
+		return 1;
+	/* flags, root, root cost, sender, port, message age, max age,
+	 * hello time, forward delay */
+	if (!(st = header(f, 7, 31)))
+		return 0;
+	if (info->bitmask & EBT_STP_FLAGS &&
+	    FWINV(c->flags != st[0], EBT_STP_FLAGS))
+		return 0;
+	if (STP_RANGE(EBT_STP_ROOTPRIO, get16(st + 1), root_priol, root_priou))
+		return 0;
+	if (info->bitmask & EBT_STP_ROOTADDR) {
+		for (i = 0; i < ETH_ALEN; i++)
+			verdict |= (st[3 + i] ^ c->root_addr[i]) & c->root_addrmsk[i];
+		if (FWINV(verdict != 0, EBT_STP_ROOTADDR))
+			return 0;
+	}
+	if (STP_RANGE(EBT_STP_ROOTCOST, get32(st + 9), root_costl, root_costu))
+		return 0;
+	if (STP_RANGE(EBT_STP_SENDERPRIO, get16(st + 13), sender_priol,
+		      sender_priou))
+		return 0;
+	if (info->bitmask & EBT_STP_SENDERADDR) {
+		verdict = 0;
+		for (i = 0; i < ETH_ALEN; i++)
+			verdict |= (st[15 + i] ^ c->sender_addr[i]) &
+				   c->sender_addrmsk[i];
+		if (FWINV(verdict != 0, EBT_STP_SENDERADDR))
+			return 0;
+	}
+	if (STP_RANGE(EBT_STP_PORT, get16(st + 21), portl, portu) ||
+	    STP_RANGE(EBT_STP_MSGAGE, get16(st + 23), msg_agel, msg_ageu) ||
+	    STP_RANGE(EBT_STP_MAXAGE, get16(st + 25), max_agel, max_ageu) ||
+	    STP_RANGE(EBT_STP_HELLOTIME, get16(st + 27), hello_timel,
+		      hello_timeu) ||
+	    STP_RANGE(EBT_STP_FWDD, get16(st + 29), forward_delayl,
+		      forward_delayu))
+		return 0;
+	return 1;
+}
+
+#define VLAN_MISMATCH(flag, v, w) \
+	(info->bitmask & (flag) && !(((v) == (w)) ^ !!(info->invflags & (flag))))
+
+static int match_vlan(const struct frame *f, const void *data)
+{
+	const struct ebt_vlan_info *info = data;
+	const unsigned char *fp = header(f, 0, 4);
+	uint16_t tci;
+
+	if (!fp)
+		return 0;
+	tci = get16(fp);
+	if (VLAN_MISMATCH(EBT_VLAN_ID, info->id, tci & 0x0fff) ||
+	    VLAN_MISMATCH(EBT_VLAN_PRIO, info->prio, (tci >> 13) & 0x7) ||
+	    VLAN_MISMATCH(EBT_VLAN_ENCAP, info->encap, raw16(fp + 2)))
+		return 0;
+	return 1;
+}
+
+#undef FWINV
+
+static const struct
+{
+	const char *name;
+	int (*match)(const struct frame *f, const void *data);
+} sim_matches[] = {
+	{ "802_3",   match_802_3 },
+	{ "among",   match_among },
+	{ "arp",     match_arp },
+	{ "ip",      match_ip },
+	{ "ip6",     match_ip6 },
+	{ "mark_m",  match_mark },
+	{ "pkttype", match_pkttype },
+	{ "stp",     match_stp },
+	{ "vlan",    match_vlan },
+	{ "comment", match_any },
+	{ NULL }
+};
+
+static const struct
+{
+	const char *name;
+	int target;
+} sim_targets[] = {
+	{ EBT_STANDARD_TARGET, T_STANDARD },
+	{ EBT_MARK_TARGET,     T_MARK },
+	{ EBT_SNAT_TARGET,     T_SNAT },
+	{ EBT_DNAT_TARGET,     T_DNAT },
+	{ EBT_REDIRECT_TARGET, T_REDIRECT },
+	{ EBT_ARPREPLY_TARGET, T_ARPREPLY },
+	{ NULL }
+};
+
+/* Names of the unsupported extensions that were already reported */
+static char warned[64][EBT_EXTENSION_MAXNAMELEN];
+static int nwarned;
+
+static void warn_unsupported(const char *kind, const char *name,
+			     const char *what)
+{
+	int i;
+
+	for (i = 0; i < nwarned; i++)
+		if (!strcmp(warned[i], name))
+			return;
+	if (nwarned < 64)
+		strcpy(warned[nwarned++], name);
+	fprintf(stderr, "ebtables-sim: the %s %s is not simulated, it %s\n",
+		kind, name, what);
+}
+
+/* The verdict of a target, applying its changes to the frame */
+static int do_target(const struct sim_rule *r, struct frame *f)
+{
+	switch (r->target) {
+	case T_STANDARD:
+		return r->verdict;
+	case T_MARK: {
+		const struct ebt_mark_t_info *info = r->tdata;
+		int action = info->target & -16;
+
+		if (action == MARK_SET_VALUE)
+			f->mark = info->mark;
+		else if (action == MARK_OR_VALUE)
+			f->mark |= info->mark;
+		else if (action == MARK_AND_VALUE)
+			f->mark &= info->mark;
+		else
+			f->mark ^= info->mark;
+		return info->target | ~EBT_VERDICT_BITS;
+	}
+	case T_SNAT: {
+		const struct ebt_nat_info *info = r->tdata;
+
+		memcpy(f->src, info->mac, ETH_ALEN);
+		return info->target | ~EBT_VERDICT_BITS;
+	}
+	case T_DNAT: {
+		const struct ebt_nat_info *info = r->tdata;
+
+		memcpy(f->dst, info->mac, ETH_ALEN);
+		return info->target;
+	}
+	case T_REDIRECT:
+		if (host_mac_set)
+			memcpy(f->dst, host_mac, ETH_ALEN);
+		return ((const struct ebt_redirect_info *)r->tdata)->target;
+	case T_ARPREPLY: {
+		const struct ebt_arpreply_info *info = r->tdata;
+		const unsigned char *ap = header(f, 0, 8);
+
+		/* Only ARP requests are answered */
+		if (!ap || get16(ap + 6) != 1 || ap[4] != ETH_ALEN ||
+		    raw16(ap + 2) != htons(ETH_P_IP) || ap[5] != 4)
+			return EBT_CONTINUE;
+		return info->target;
+	}
+	}
+	return EBT_CONTINUE;
+}
+
+/* ebt_do_table(). Returns EBT_ACCEPT or EBT_DROP, *evaluated is
+ * incremented for every rule that is looked at */
+static int classify(unsigned int chain_nr, struct frame *f, int count,
+		    unsigned int *evaluated)
+{
+	static unsigned int *stack_chain, *stack_n;
+	const struct sim_chain *chain = &chains[chain_nr];
+	const struct sim_rule *r;
+	unsigned int i = 0, j, n = 0, sp = 0;
+	int verdict;
+
+	if (!stack_chain) {
+		stack_chain = malloc(nchains * sizeof(unsigned int));
+		stack_n = malloc(nchains * sizeof(unsigned int));
+		if (!stack_chain || !stack_n)
+			ebt_print_memory();
+	}
+	for (;;) {
+		while (i < chain->entries->nentries) {
+			r = &chain->rules[i];
+			n++;
+			if (basic_match(r->e, f))
+				goto letscontinue;
+			for (j = 0; j < r->nmatches; j++)
+				if (!r->matches[j].match(f, r->matches[j].data))
+					goto letscontinue;
+			if (count) {
+				((struct sim_rule *)r)->pcnt++;
+				((struct sim_rule *)r)->bcnt += f->len;
+			}
+			verdict = do_target(r, f);
+			if (verdict == EBT_ACCEPT || verdict == EBT_DROP)
+				goto out;
+			if (verdict == EBT_RETURN) {
+letsreturn:
+				/* Act like this is EBT_CONTINUE */
+				if (sp == 0)
+					goto letscontinue;
+				sp--;
+				chain = &chains[stack_chain[sp]];
+				i = stack_n[sp];
+				continue;
+			}
+			if (verdict == EBT_CONTINUE)
+				goto letscontinue;
+			/* Jump to a user defined chain */
+			stack_chain[sp] = chain - chains;
+			stack_n[sp] = i + 1;
+			sp++;
+			chain = &chains[r->jump];
+			i = 0;
+			continue;
+letscontinue:
+			i++;
+		}
+		if (count)
+			((struct sim_chain *)chain)->policy_cnt++;
+		if (chain->entries->policy == EBT_RETURN && sp)
+			goto letsreturn;
+		verdict = chain->entries->policy == EBT_ACCEPT ? EBT_ACCEPT :
+			  EBT_DROP;
+		goto out;
+	}
+out:
+	*evaluated += n;
+	return verdict;
+}
+
+static int chain_at(unsigned int offset)
+{
+	int i;
+
+	for (i = 0; i < nchains; i++)
+		if (chains[i].offset == offset)
+			return i;
+	return -1;
+}
+
+/* Index the table blob: its chains, rules and extensions */
+static void compile_table(const struct ebt_replace *repl)
+{
+	const char *p = repl->entries, *end = repl->entries + repl->entries_size;
+	const struct ebt_entries *entries;
+	const struct ebt_entry *e;
+	const struct ebt_entry_match *m;
+	const struct ebt_entry_target *t;
+	unsigned int nrules = 0, nmatches = 0, off, i, k;
+	struct sim_rule *r;
+	struct sim_match *sm;
+
+	/* Count */
+	while (p < end) {
+		e = (const struct ebt_entry *)p;
+		if (!(e->bitmask & EBT_ENTRY_OR_ENTRIES)) {
+			nchains++;
+			p += sizeof(struct ebt_entries);
+			continue;
+		}
+		if (e->next_offset < sizeof(struct ebt_entry) ||
+		    e->next_offset > end - p || e->watchers_offset > e->next_offset)
+			sim_error("The table is corrupt");
+		nrules++;
+		for (off = sizeof(struct ebt_entry); off < e->watchers_offset;
+		     off += sizeof(struct ebt_entry_match) + m->match_size) {
+			m = (const struct ebt_entry_match *)(p + off);
+			nmatches++;
+		}
+		p += e->next_offset;
+	}
+	if (nrules != repl->nentries)
+		sim_error("The table is corrupt");
+	chains = calloc(nchains, sizeof(struct sim_chain));
+	rules = calloc(nrules ? nrules : 1, sizeof(struct sim_rule));
+	matches = calloc(nmatches ? nmatches : 1, sizeof(struct sim_match));
+	if (!chains || !rules || !matches)
+		ebt_print_memory();
+
+	/* Fill in */
+	i = 0;
+	r = rules;
+	sm = matches;
+	for (p = repl->entries; p < end; ) {
+		entries = (const struct ebt_entries *)p;
+		if (!entries->distinguisher) {
+			chains[i].entries = entries;
+			chains[i].offset = p - repl->entries;
+			chains[i].rules = r;
+			i++;
+			p += sizeof(struct ebt_entries);
+			continue;
+		}
+		e = (const struct ebt_entry *)p;
+		r->e = e;
+		r->matches = sm;
+		for (off = sizeof(struct ebt_entry); off < e->watchers_offset;
+		     off += sizeof(struct ebt_entry_match) + m->match_size) {
+			m = (const struct ebt_entry_match *)(p + off);
+			for (k = 0; sim_matches[k].name; k++)
+				if (!strcmp(sim_matches[k].name, m->u.name))
+					break;
+			if (sim_matches[k].name)
+				sm->match = sim_matches[k].match;
+			else {
+				warn_unsupported("match", m->u.name, "always matches");
+				sm->match = match_any;
+			}
+			sm->data = m->data;
+			sm++;
+			r->nmatches++;
+		}
+		t = (const struct ebt_entry_target *)(p + e->target_offset);
+		r->tdata = t->data;
+		for (k = 0; sim_targets[k].name; k++)
+			if (!strcmp(sim_targets[k].name, t->u.name))
+				break;
+		if (sim_targets[k].name)
+			r->target = sim_targets[k].target;
+		else {
+			warn_unsupported("target", t->u.name, "continues");
+			r->target = T_OTHER;
+		}
+		if (r->target == T_STANDARD)
+			r->verdict = ((const struct ebt_standard_target *)t)->verdict;
+		r++;
+		p += e->next_offset;
+	}
+	/* Resolve the jumps */
+	for (r = rules; r < rules + nrules; r++)
+		if (r->target == T_STANDARD && r->verdict >= 0 &&
+		    (r->jump = chain_at(r->verdict)) == -1)
+			sim_error("The table contains a jump to a non-chain");
+}
+
+/* The table from the kernel or the backend of EBTABLES_BACKEND */
+static void fetch_table(struct ebt_replace *repl, const char *table)
+{
+	struct ebt_backend *backend = ebt_get_backend();
+	socklen_t optlen = sizeof(struct ebt_replace);
+	int fd;
+
+	if ((fd = backend->socket()) < 0)
+		sim_error("Problem getting a socket, you probably don't have "
+			  "the right permissions");
+	memset(repl, 0, sizeof(struct ebt_replace));
+	strcpy(repl->name, table);
+	if (backend->getsockopt(fd, EBT_SO_GET_INFO, repl, &optlen))
+		sim_error("Can't get the %s table, the ebtables kernel module "
+			  "is probably not loaded", table);
+	if (!(repl->entries = malloc(repl->entries_size)))
+		ebt_print_memory();
+	repl->num_counters = 0;
+	repl->counters = NULL;
+	optlen += repl->entries_size;
+	if (backend->getsockopt(fd, EBT_SO_GET_ENTRIES, repl, &optlen))
+		sim_error("Can't get the entries of the %s table", table);
+	close(fd);
+}
+
+/* The atomic file format: the struct ebt_replace, the entries and the
+ * counters */
+static void read_atomic_file(struct ebt_replace *repl, const char *filename)
+{
+	FILE *file;
+	long size;
+
+	if (!(file = fopen(filename, "rb")))
+		sim_error("Could not open file %s", filename);
+	if (fread(repl, 1, sizeof(struct ebt_replace), file) !=
+	    sizeof(struct ebt_replace))
+		sim_error("File %s is corrupt", filename);
+	fseek(file, 0, SEEK_END);
+	size = sizeof(struct ebt_replace) + repl->entries_size +
+	       repl->nentries * sizeof(struct ebt_counter);
+	if (size != ftell(file))
+		sim_error("File %s has wrong size", filename);
+	if (!(repl->entries = malloc(repl->entries_size)))
+		ebt_print_memory();
+	if (fseek(file, sizeof(struct ebt_replace), SEEK_SET) ||
+	    fread(repl->entries, 1, repl->entries_size, file) !=
+	    repl->entries_size)
+		sim_error("File %s is corrupt", filename);
+	fclose(file);
+}
+
+/* The table in the output of ebtables-save, built in the memory backend */
+static void read_restore_file(struct ebt_replace *repl, const char *filename,
+			      const char *table)
+{
+	struct ebt_handle *h;
+	FILE *file = stdin;
+
+	if (strcmp(filename, "-") && !(file = fopen(filename, "r")))
+		sim_error("Could not open file %s", filename);
+	if (!(h = ebt_handle_new(table)))
+		sim_error("Bad table name '%s'", table);
+	if (ebt_handle_restore(h, file, filename))
+		sim_error("%s", ebt_handle_error(h));
+	if (file != stdin)
+		fclose(file);
+	if (ebt_handle_commit(h))
+		sim_error("%s", ebt_handle_error(h));
+	ebt_handle_free(h);
+	fetch_table(repl, table);
+}
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define LINKTYPE_ETHERNET 1
+
+static uint32_t pcap32(const unsigned char *p, int swap)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return swap ? __builtin_bswap32(v) : v;
+}
+
+/* Reads all frames of the pcap file in memory */
+static void read_pcap(const char *filename)
+{
+	unsigned char *buf;
+	size_t size, off, alloc = 0;
+	uint32_t magic, caplen;
+	FILE *file = stdin;
+	int swap;
+
+	if (strcmp(filename, "-") && !(file = fopen(filename, "rb")))
+		sim_error("Could not open file %s", filename);
+	size = 0;
+	buf = NULL;
+	do {
+		if (size == alloc) {
+			alloc = alloc ? 2 * alloc : 1 << 20;
+			if (!(buf = realloc(buf, alloc)))
+				ebt_print_memory();
+		}
+		size += fread(buf + size, 1, alloc - size, file);
+	} while (size == alloc);
+	if (file != stdin)
+		fclose(file);
+
+	if (size < 24)
+		sim_error("%s is not a pcap file", filename);
+	memcpy(&magic, buf, sizeof(magic));
+	if (magic == PCAP_MAGIC || magic == PCAP_MAGIC_NSEC)
+		swap = 0;
+	else if (__builtin_bswap32(magic) == PCAP_MAGIC ||
+		 __builtin_bswap32(magic) == PCAP_MAGIC_NSEC)
+		swap = 1;
+	else
+		sim_error("%s is not a pcap file (pcapng isn't supported)",
+			  filename);
+	if (pcap32(buf + 20, swap) != LINKTYPE_ETHERNET)
+		sim_error("%s doesn't contain ethernet frames", filename);
+
+	alloc = 0;
+	for (off = 24; off + 16 <= size; off += 16 + caplen) {
+		caplen = pcap32(buf + off + 8, swap);
+		if (caplen > size - off - 16)
+			sim_error("%s is truncated", filename);
+		/* Runts can't be bridged */
+		if (caplen < ETH_HLEN)
+			continue;
+		if (npackets == alloc) {
+			alloc = alloc ? 2 * alloc : 1024;
+			packets = realloc(packets, alloc * sizeof(struct packet));
+			if (!packets)
+				ebt_print_memory();
+		}
+		packets[npackets].data = buf + off + 16;
+		packets[npackets].len = caplen;
+		npackets++;
+	}
+	if (off != size)
+		sim_error("%s is truncated", filename);
+}
+
+static void init_frame(struct frame *f, const struct packet *pkt)
+{
+	static const unsigned char bcast[ETH_ALEN] =
+		{0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+
+	memcpy(f->dst, pkt->data, ETH_ALEN);
+	memcpy(f->src, pkt->data + ETH_ALEN, ETH_ALEN);
+	f->proto = raw16(pkt->data + 2 * ETH_ALEN);
+	f->data = pkt->data + ETH_HLEN;
+	f->len = pkt->len - ETH_HLEN;
+	f->mark = start_mark;
+	if (!memcmp(f->dst, bcast, ETH_ALEN))
+		f->pkt_type = PACKET_BROADCAST;
+	else if (f->dst[0] & 1)
+		f->pkt_type = PACKET_MULTICAST;
+	else if (host_mac_set && !memcmp(f->dst, host_mac, ETH_ALEN))
+		f->pkt_type = PACKET_HOST;
+	else
+		f->pkt_type = PACKET_OTHERHOST;
+}
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void print_usage()
+{
+	fprintf(stderr,
+"Usage: ebtables-sim [options] file.pcap\n"
+"  -t, --table table          table to use (default filter)\n"
+"  -c, --chain chain          base chain the frames enter (default FORWARD,\n"
+"                             PREROUTING for nat, BROUTING for broute)\n"
+"  -f, --atomic-file file     take the table from an atomic file\n"
+"  -r, --restore file         take the table from ebtables-save output\n"
+"  -i, --in-if name           input interface of the frames\n"
+"  -o, --out-if name          output interface of the frames\n"
+"      --logical-in name      bridge of the input interface\n"
+"      --logical-out name     bridge of the output interface\n"
+"  -m, --mark value           initial mark of the frames\n"
+"      --host-mac address     MAC address of the bridge, for pkttype and\n"
+"                             redirect\n"
+"  -n, --passes n             classify all frames n more times and report\n"
+"                             the speed\n"
+"Without -f or -r the table is taken from the kernel.\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *table = "filter", *chain = NULL, *atomic = NULL,
+		   *restore = NULL, *pcap;
+	struct ebt_replace repl;
+	struct frame f;
+	struct sim_rule *r;
+	unsigned long long hist[HIST_BUCKETS] = { 0 }, verdicts[2] = { 0 },
+			   total_evaluated = 0;
+	unsigned int evaluated, max_evaluated = 0, k;
+	int c, i, hook, base, passes = 0;
+	double t;
+	char *end, range[24];
+
+	while ((c = getopt_long(argc, argv, "t:c:f:r:i:o:m:n:", options,
+				NULL)) != -1) {
+		switch (c) {
+		case 't':
+			table = optarg;
+			break;
+		case 'c':
+			chain = optarg;
+			break;
+		case 'f':
+			atomic = optarg;
+			break;
+		case 'r':
+			restore = optarg;
+			break;
+		case 'i':
+			in_if = optarg;
+			break;
+		case 'o':
+			out_if = optarg;
+			break;
+		case 'I':
+			logical_in = optarg;
+			break;
+		case 'O':
+			logical_out = optarg;
+			break;
+		case 'm':
+			start_mark = strtoul(optarg, &end, 0);
+			if (*end != '\0')
+				sim_error("Bad mark '%s'", optarg);
+			break;
+		case 'H':
+			if (ebt_get_mac_and_mask(optarg, host_mac,
+			    (unsigned char *)&repl) || memcmp(&repl,
+			    "\xff\xff\xff\xff\xff\xff", ETH_ALEN))
+				sim_error("Bad MAC address '%s'", optarg);
+			host_mac_set = 1;
+			break;
+		case 'n':
+			passes = strtol(optarg, &end, 10);
+			if (*end != '\0' || passes < 0)
+				sim_error("Bad number of passes '%s'", optarg);
+			break;
+		default:
+			print_usage();
+		}
+	}
+	if (optind != argc - 1 || (atomic && restore))
+		print_usage();
+	/* Parsing the rules resets optind */
+	pcap = argv[optind];
+
+	ebt_silent = 0;
+	ebt_early_init_once();
+	if (!ebt_find_table(table))
+		sim_error("Bad table name '%s'", table);
+	if (!chain)
+		chain = !strcmp(table, "nat") ? "PREROUTING" :
+			!strcmp(table, "broute") ? "BROUTING" : "FORWARD";
+	for (hook = 0; hook < NF_BR_NUMHOOKS; hook++)
+		if (!strcmp(chain, ebt_hooknames[hook]))
+			break;
+	if (hook == NF_BR_NUMHOOKS)
+		sim_error("'%s' is not a base chain", chain);
+
+	if (atomic)
+		read_atomic_file(&repl, atomic);
+	else if (restore) {
+		/* Nothing is given to the kernel */
+		if (ebt_set_backend("memory"))
+			sim_error("Can't use the in-memory tables");
+		read_restore_file(&repl, restore, table);
+	} else
+		fetch_table(&repl, table);
+	if (!(repl.valid_hooks & (1 << hook)))
+		sim_error("Table %s has no %s chain", repl.name, chain);
+	/* The base chains come first, in hook order */
+	for (base = 0, i = 0; i < hook; i++)
+		if (repl.valid_hooks & (1 << i))
+			base++;
+	compile_table(&repl);
+	read_pcap(pcap);
+
+	for (k = 0; k < npackets; k++) {
+		init_frame(&f, &packets[k]);
+		evaluated = 0;
+		if (classify(base, &f, 1, &evaluated) == EBT_ACCEPT)
+			verdicts[0]++;
+		else
+			verdicts[1]++;
+		total_evaluated += evaluated;
+		if (evaluated > max_evaluated)
+			max_evaluated = evaluated;
+		for (i = 0; evaluated; i++)
+			evaluated >>= 1;
+		hist[i]++;
+	}
+
+	printf("Table %s, chain %s: %u frames\n", repl.name, chain, npackets);
+	printf("\nVerdicts:\n");
+	for (i = 0; i < 2; i++)
+		printf("  %-21s %12llu %7.2f%%\n", i ? "DROP" : "ACCEPT",
+		       verdicts[i], npackets ? 100.0 * verdicts[i] / npackets : 0);
+	printf("\nRules evaluated per frame: mean %.2f, max %u\n",
+	       npackets ? (double)total_evaluated / npackets : 0, max_evaluated);
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		if (!hist[i])
+			continue;
+		if (i < 2)
+			snprintf(range, sizeof(range), "%d", i);
+		else
+			snprintf(range, sizeof(range), "%u-%u", 1u << (i - 1),
+				 (1u << i) - 1);
+		printf("  %-21s %12llu %7.2f%%\n", range, hist[i],
+		       100.0 * hist[i] / npackets);
+	}
+	printf("\nRule counters (packets, bytes):\n");
+	for (i = 0; i < nchains; i++) {
+		printf("  Bridge chain: %s, entries: %u\n", chains[i].entries->name,
+		       chains[i].entries->nentries);
+		for (k = 0; k < chains[i].entries->nentries; k++) {
+			r = &chains[i].rules[k];
+			printf("  %5u. %12llu %14llu%s\n", k + 1,
+			       (unsigned long long)r->pcnt,
+			       (unsigned long long)r->bcnt,
+			       r->pcnt ? "" : "  never matched");
+		}
+		printf("  policy %-7s %11llu\n",
+		       ebt_standard_targets[-chains[i].entries->policy - 1],
+		       (unsigned long long)chains[i].policy_cnt);
+	}
+
+	if (!passes || !npackets)
+		return 0;
+	total_evaluated = 0;
+	t = now();
+	for (i = 0; i < passes; i++)
+		for (k = 0; k < npackets; k++) {
+			evaluated = 0;
+			init_frame(&f, &packets[k]);
+			classify(base, &f, 0, &evaluated);
+			total_evaluated += evaluated;
+		}
+	t = now() - t;
+	printf("\nReplay: %d passes of %u frames in %.6fs, %.0f frames/s, "
+	       "%.1f ns per frame, %.1f ns per rule evaluated\n", passes,
+	       npackets, t, (double)passes * npackets / t,
+	       t * 1e9 / ((double)passes * npackets),
+	       total_evaluated ? t * 1e9 / total_evaluated : 0);
+	return 0;
+}
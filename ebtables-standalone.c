@@ -1,14 +1,52 @@
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <getopt.h>
+#include <unistd.h>
 #include "include/ebtables_u.h"
 
+/* How many times an --optimistic command is started over */
+#define OPTIMISTIC_RETRIES 10
+/* Size of the stdout buffer when not writing to a terminal, big listings
+ * then need less write() calls */
+#define OUTPUT_BUFSIZE (1 << 16)
+
 static struct ebt_u_replace replace;
 void ebt_early_init_once();
 
 int main(int argc, char *argv[])
 {
+	char **args;
+	int i;
+
+	if (!isatty(STDOUT_FILENO))
+		setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFSIZE);
 	ebt_silent = 0;
 	ebt_early_init_once();
-	strcpy(replace.name, "filter");
-	do_command(argc, argv, EXEC_STYLE_PRG, &replace);
+	if (ebt_has_stats_option(argc, argv))
+		ebt_stats_enable();
+	/* getopt_long() permutes argv, keep the original order around in
+	 * case the command has to be executed again */
+	args = (char **)malloc(argc * sizeof(char *));
+	if (!args)
+		ebt_print_memory();
+	memcpy(args, argv, argc * sizeof(char *));
+	for (i = 0; ; i++) {
+		strcpy(replace.name, "filter");
+		if (do_command(argc, argv, EXEC_STYLE_PRG, &replace) != 1)
+			break;
+		if (i == OPTIMISTIC_RETRIES)
+			ebt_print_error("The kernel table kept changing, giving up after %d attempts", i + 1);
+		/* Start over from the new kernel table */
+		ebt_cleanup_replace(&replace);
+		free(replace.chains);
+		replace.chains = NULL;
+		free(replace.cc);
+		replace.cc = NULL;
+		ebt_reinit_extensions();
+		memcpy(argv, args, argc * sizeof(char *));
+		optind = 0;
+	}
+	free(args);
 	return 0;
 }
@@ -27,6 +27,7 @@
 #include <stdlib.h>
 #include <inttypes.h>
 #include <signal.h>
+#include <pthread.h>
 #include "include/ebtables_u.h"
 #include "include/ethernetdb.h"
 
@@ -93,16 +94,30 @@ static struct option ebt_original_options[] =
 	{ "atomic-save"    , no_argument      , 0, 10  },
 	{ "init-table"     , no_argument      , 0, 11  },
 	{ "concurrent"     , no_argument      , 0, 13  },
+	{ "optimistic"     , no_argument      , 0, 14  },
+	{ "format"         , required_argument, 0, 15  },
+	{ "among-update"   , required_argument, 0, 16  },
+	{ "stats"          , no_argument      , 0, 17  },
+	{ "cost-report"    , no_argument      , 0, 18  },
+	{ "diff"           , required_argument, 0, 19  },
 	{ 0 }
 };
 
+/* Merged with the options of all extensions by ebt_early_init_once(),
+ * read-only afterwards */
 static struct option *ebt_options = ebt_original_options;
+/* The short options of do_command() */
+static const char short_options[] =
+	"-A:D:C:I:N:E:X::L::Z::F::P:Vhi:o:j:c:p:s:d:t:M:";
+
+/* The variables below describe the command being parsed, a thread
+ * only parses one command at a time */
 
 /* Holds all the data */
-static struct ebt_u_replace *replace;
+static __thread struct ebt_u_replace *replace;
 
 /* The chosen table */
-static struct ebt_u_table *table;
+static __thread struct ebt_u_table *table;
 
 /* The pointers in here are special:
  * The struct ebt_target pointer is actually a struct ebt_u_target pointer.
@@ -111,70 +126,60 @@ static struct ebt_u_table *table;
  * they point to won't change. We want to allow that the struct ebt_u_target.t
  * member can change.
  * The same holds for the struct ebt_match and struct ebt_watcher pointers */
-static struct ebt_u_entry *new_entry;
+static __thread struct ebt_u_entry *new_entry;
 
 
-static int global_option_offset;
+/* The options of an extension are merged with val + option_offset, every
+ * extension getting its own range of OPTION_OFFSET values. option_owners[]
+ * tells which kind of extension owns a range, so that do_command() can
+ * hand an option straight to its extension */
 #define OPTION_OFFSET 256
-static struct option *merge_options(struct option *oldopts,
-   const struct option *newopts, unsigned int *options_offset)
+#define OWNER_MATCH 1
+#define OWNER_WATCHER 2
+#define OWNER_TARGET 3
+static unsigned char *option_owners;
+static unsigned int num_option_owners;
+
+static unsigned int count_options(const struct option *opts)
 {
-	unsigned int num_old, num_new, i;
-	struct option *merge;
+	unsigned int n;
 
-	if (!newopts || !oldopts || !options_offset)
+	if (!opts)
 		ebt_print_bug("merge wrong");
-	for (num_old = 0; oldopts[num_old].name; num_old++);
-	for (num_new = 0; newopts[num_new].name; num_new++);
-
-	global_option_offset += OPTION_OFFSET;
-	*options_offset = global_option_offset;
-
-	merge = malloc(sizeof(struct option) * (num_new + num_old + 1));
-	if (!merge)
-		ebt_print_memory();
-	memcpy(merge, oldopts, num_old * sizeof(struct option));
-	for (i = 0; i < num_new; i++) {
-		merge[num_old + i] = newopts[i];
-		merge[num_old + i].val += *options_offset;
-	}
-	memset(merge + num_old + num_new, 0, sizeof(struct option));
-	/* Only free dynamically allocated stuff */
-	if (oldopts != ebt_original_options)
-		free(oldopts);
-
-	return merge;
-}
-
-static void merge_match(struct ebt_u_match *m)
-{
-	ebt_options = merge_options
-	   (ebt_options, m->extra_ops, &(m->option_offset));
+	for (n = 0; opts[n].name; n++);
+	return n;
 }
 
-static void merge_watcher(struct ebt_u_watcher *w)
+/* Copy the options of an extension to merge, returns the next free slot */
+static struct option *merge_options(struct option *merge,
+   const struct option *newopts, unsigned int *options_offset, int owner)
 {
-	ebt_options = merge_options
-	   (ebt_options, w->extra_ops, &(w->option_offset));
+	option_owners[num_option_owners++] = owner;
+	*options_offset = num_option_owners * OPTION_OFFSET;
+	for (; newopts->name; newopts++, merge++) {
+		if (newopts->val < 0 || newopts->val >= OPTION_OFFSET)
+			ebt_print_bug("Option %s has a bad value", newopts->name);
+		*merge = *newopts;
+		merge->val += *options_offset;
+	}
+	return merge;
 }
 
-static void merge_target(struct ebt_u_target *t)
+/* Returns the OWNER_* of option c, 0 if it isn't an extension option */
+static int option_owner(int c)
 {
-	ebt_options = merge_options
-	   (ebt_options, t->extra_ops, &(t->option_offset));
+	if (c < OPTION_OFFSET || c / OPTION_OFFSET > num_option_owners)
+		return 0;
+	return option_owners[c / OPTION_OFFSET - 1];
 }
 
 /* Be backwards compatible, so don't use '+' in kernel */
 #define IF_WILDCARD 1
 static void print_iface(const char *iface)
 {
-	char *c;
-
-	if ((c = strchr(iface, IF_WILDCARD)))
-		*c = '+';
-	printf("%s ", iface);
-	if (c)
-		*c = IF_WILDCARD;
+	for (; *iface; iface++)
+		putchar(*iface == IF_WILDCARD ? '+' : *iface);
+	putchar(' ');
 }
 
 /* We use replace->flags, so we can't use the following values:
@@ -183,18 +188,115 @@ static void print_iface(const char *iface)
 #define LIST_C    0x08
 #define LIST_X    0x10
 #define LIST_MAC2 0x20
+#define LIST_JSON 0x40
+#define LIST_CBOR 0x80
 
-/* Helper function for list_rules() */
-static void list_em(struct ebt_u_entries *entries)
+/* Prints the rule like -L does, without rule number and counters */
+void ebt_print_rule(struct ebt_u_replace *u_repl, struct ebt_u_entry *hlp)
 {
-	int i, j, space = 0, digits;
-	struct ebt_u_entry *hlp;
 	struct ebt_u_match_list *m_l;
 	struct ebt_u_watcher_list *w_l;
 	struct ebt_u_match *m;
 	struct ebt_u_watcher *w;
 	struct ebt_u_target *t;
 
+	/* The standard target's print() uses this to find out
+	 * the name of a udc */
+	hlp->replace = u_repl;
+
+	/* Don't print anything about the protocol if no protocol was
+	 * specified, obviously this means any protocol will do. */
+	if (!(hlp->bitmask & EBT_NOPROTO)) {
+		fputs("-p ", stdout);
+		if (hlp->invflags & EBT_IPROTO)
+			fputs("! ", stdout);
+		if (hlp->bitmask & EBT_802_3)
+			fputs("Length ", stdout);
+		else {
+			struct ethertypeent *ent;
+
+			ent = getethertypebynumber(ntohs(hlp->ethproto));
+			if (!ent)
+				printf("0x%x ", ntohs(hlp->ethproto));
+			else {
+				fputs(ent->e_name, stdout);
+				putchar(' ');
+			}
+		}
+	}
+	if (hlp->bitmask & EBT_SOURCEMAC) {
+		fputs("-s ", stdout);
+		if (hlp->invflags & EBT_ISOURCE)
+			fputs("! ", stdout);
+		ebt_print_mac_and_mask(hlp->sourcemac, hlp->sourcemsk);
+		putchar(' ');
+	}
+	if (hlp->bitmask & EBT_DESTMAC) {
+		fputs("-d ", stdout);
+		if (hlp->invflags & EBT_IDEST)
+			fputs("! ", stdout);
+		ebt_print_mac_and_mask(hlp->destmac, hlp->destmsk);
+		putchar(' ');
+	}
+	if (hlp->in[0] != '\0') {
+		fputs("-i ", stdout);
+		if (hlp->invflags & EBT_IIN)
+			fputs("! ", stdout);
+		print_iface(hlp->in);
+	}
+	if (hlp->logical_in[0] != '\0') {
+		fputs("--logical-in ", stdout);
+		if (hlp->invflags & EBT_ILOGICALIN)
+			fputs("! ", stdout);
+		print_iface(hlp->logical_in);
+	}
+	if (hlp->logical_out[0] != '\0') {
+		fputs("--logical-out ", stdout);
+		if (hlp->invflags & EBT_ILOGICALOUT)
+			fputs("! ", stdout);
+		print_iface(hlp->logical_out);
+	}
+	if (hlp->out[0] != '\0') {
+		fputs("-o ", stdout);
+		if (hlp->invflags & EBT_IOUT)
+			fputs("! ", stdout);
+		print_iface(hlp->out);
+	}
+
+	m_l = hlp->m_list;
+	while (m_l) {
+		m = ebt_find_match(m_l->m->u.name);
+		if (!m)
+			ebt_print_bug("Match not found");
+		m->print(hlp, m_l->m);
+		m_l = m_l->next;
+	}
+	w_l = hlp->w_list;
+	while (w_l) {
+		w = ebt_find_watcher(w_l->w->u.name);
+		if (!w)
+			ebt_print_bug("Watcher not found");
+		w->print(hlp, w_l->w);
+		w_l = w_l->next;
+	}
+
+	fputs("-j ", stdout);
+	if (strcmp(hlp->t->u.name, EBT_STANDARD_TARGET)) {
+		fputs(hlp->t->u.name, stdout);
+		putchar(' ');
+	}
+	t = ebt_find_target(hlp->t->u.name);
+	if (!t)
+		ebt_print_bug("Target '%s' not found", hlp->t->u.name);
+	t->print(hlp, hlp->t);
+}
+
+/* Helper function for list_rules() */
+static void list_em(struct ebt_u_entries *entries)
+{
+	int i, j, space = 0, digits;
+	struct ebt_u_entry *hlp;
+
 	if (replace->flags & LIST_MAC2)
 		ebt_printstyle_mac = 2;
 	else
@@ -227,110 +329,176 @@ static void list_em(struct ebt_u_entries *entries)
 				j /= 10;
 			}
 			for (j = 0; j < space - digits; j++)
-				printf(" ");
-			printf("%d. ", i + 1);
-		}
-		if (replace->flags & LIST_X)
-			printf("ebtables -t %s -A %s ",
-			   replace->name, entries->name);
-
-		/* The standard target's print() uses this to find out
-		 * the name of a udc */
-		hlp->replace = replace;
-
-		/* Don't print anything about the protocol if no protocol was
-		 * specified, obviously this means any protocol will do. */
-		if (!(hlp->bitmask & EBT_NOPROTO)) {
-			printf("-p ");
-			if (hlp->invflags & EBT_IPROTO)
-				printf("! ");
-			if (hlp->bitmask & EBT_802_3)
-				printf("Length ");
-			else {
-				struct ethertypeent *ent;
-
-				ent = getethertypebynumber(ntohs(hlp->ethproto));
-				if (!ent)
-					printf("0x%x ", ntohs(hlp->ethproto));
-				else
-					printf("%s ", ent->e_name);
-			}
-		}
-		if (hlp->bitmask & EBT_SOURCEMAC) {
-			printf("-s ");
-			if (hlp->invflags & EBT_ISOURCE)
-				printf("! ");
-			ebt_print_mac_and_mask(hlp->sourcemac, hlp->sourcemsk);
-			printf(" ");
-		}
-		if (hlp->bitmask & EBT_DESTMAC) {
-			printf("-d ");
-			if (hlp->invflags & EBT_IDEST)
-				printf("! ");
-			ebt_print_mac_and_mask(hlp->destmac, hlp->destmsk);
-			printf(" ");
-		}
-		if (hlp->in[0] != '\0') {
-			printf("-i ");
-			if (hlp->invflags & EBT_IIN)
-				printf("! ");
-			print_iface(hlp->in);
+				putchar(' ');
+			ebt_print_u64(i + 1);
+			fputs(". ", stdout);
 		}
-		if (hlp->logical_in[0] != '\0') {
-			printf("--logical-in ");
-			if (hlp->invflags & EBT_ILOGICALIN)
-				printf("! ");
-			print_iface(hlp->logical_in);
-		}
-		if (hlp->logical_out[0] != '\0') {
-			printf("--logical-out ");
-			if (hlp->invflags & EBT_ILOGICALOUT)
-				printf("! ");
-			print_iface(hlp->logical_out);
-		}
-		if (hlp->out[0] != '\0') {
-			printf("-o ");
-			if (hlp->invflags & EBT_IOUT)
-				printf("! ");
-			print_iface(hlp->out);
+		if (replace->flags & LIST_X) {
+			fputs("ebtables -t ", stdout);
+			fputs(replace->name, stdout);
+			fputs(" -A ", stdout);
+			fputs(entries->name, stdout);
+			putchar(' ');
 		}
 
-		m_l = hlp->m_list;
-		while (m_l) {
-			m = ebt_find_match(m_l->m->u.name);
-			if (!m)
-				ebt_print_bug("Match not found");
-			m->print(hlp, m_l->m);
-			m_l = m_l->next;
-		}
-		w_l = hlp->w_list;
-		while (w_l) {
-			w = ebt_find_watcher(w_l->w->u.name);
-			if (!w)
-				ebt_print_bug("Watcher not found");
-			w->print(hlp, w_l->w);
-			w_l = w_l->next;
+		ebt_print_rule(replace, hlp);
+		if (replace->flags & LIST_C) {
+			fputs(replace->flags & LIST_X ? "-c " : ", pcnt = ", stdout);
+			ebt_print_u64(hlp->cnt.pcnt);
+			fputs(replace->flags & LIST_X ? " " : " -- bcnt = ", stdout);
+			ebt_print_u64(hlp->cnt.bcnt);
 		}
+		putchar('\n');
+		hlp = hlp->next;
+	}
+}
 
-		printf("-j ");
-		if (strcmp(hlp->t->u.name, EBT_STANDARD_TARGET))
-			printf("%s ", hlp->t->u.name);
-		t = ebt_find_target(hlp->t->u.name);
-		if (!t)
-			ebt_print_bug("Target '%s' not found", hlp->t->u.name);
-		t->print(hlp, hlp->t);
-		if (replace->flags & LIST_C) {
-			uint64_t pcnt = hlp->cnt.pcnt;
-			uint64_t bcnt = hlp->cnt.bcnt;
+/* Helper functions for list_structured() */
+static void json_iface(const char *key, const char *iface, int invert)
+{
+	char buf[IFNAMSIZ];
+	int i;
 
-			if (replace->flags & LIST_X)
-				printf("-c %"PRIu64" %"PRIu64, pcnt, bcnt);
-			else
-				printf(", pcnt = %"PRIu64" -- bcnt = %"PRIu64, pcnt, bcnt);
+	for (i = 0; i < IFNAMSIZ - 1 && iface[i]; i++)
+		buf[i] = iface[i] == IF_WILDCARD ? '+' : iface[i];
+	buf[i] = '\0';
+	ebt_json_object(key);
+	ebt_json_str("name", buf);
+	ebt_json_bool("invert", invert);
+	ebt_json_end();
+}
+
+static void json_mac(const char *key, const unsigned char *mac,
+		     const unsigned char *mask, int invert)
+{
+	ebt_json_object(key);
+	ebt_json_mac("mac", mac);
+	ebt_json_mac("mask", mask);
+	ebt_json_bool("invert", invert);
+	ebt_json_end();
+}
+
+static void json_rule(struct ebt_u_entry *e, int num)
+{
+	struct ebt_u_match_list *m_l;
+	struct ebt_u_watcher_list *w_l;
+	struct ebt_u_match *m;
+	struct ebt_u_watcher *w;
+	struct ebt_u_target *t;
+	char id[17];
+
+	/* The standard target's print_json() uses this to find out
+	 * the name of a udc */
+	e->replace = replace;
+
+	ebt_json_object(NULL);
+	ebt_json_uint("num", num);
+	snprintf(id, sizeof(id), "%016" PRIx64, ebt_rule_id(replace, e));
+	ebt_json_str("id", id);
+	ebt_json_uint("pcnt", e->cnt.pcnt);
+	ebt_json_uint("bcnt", e->cnt.bcnt);
+	if (!(e->bitmask & EBT_NOPROTO)) {
+		ebt_json_object("proto");
+		if (e->bitmask & EBT_802_3)
+			ebt_json_bool("length", 1);
+		else {
+			struct ethertypeent *ent;
+
+			ebt_json_uint("value", ntohs(e->ethproto));
+			if ((ent = getethertypebynumber(ntohs(e->ethproto))))
+				ebt_json_str("name", ent->e_name);
 		}
-		printf("\n");
-		hlp = hlp->next;
+		ebt_json_bool("invert", e->invflags & EBT_IPROTO);
+		ebt_json_end();
+	}
+	if (e->bitmask & EBT_SOURCEMAC)
+		json_mac("src", e->sourcemac, e->sourcemsk,
+			 e->invflags & EBT_ISOURCE);
+	if (e->bitmask & EBT_DESTMAC)
+		json_mac("dst", e->destmac, e->destmsk, e->invflags & EBT_IDEST);
+	if (e->in[0] != '\0')
+		json_iface("in", e->in, e->invflags & EBT_IIN);
+	if (e->logical_in[0] != '\0')
+		json_iface("logical-in", e->logical_in,
+			   e->invflags & EBT_ILOGICALIN);
+	if (e->logical_out[0] != '\0')
+		json_iface("logical-out", e->logical_out,
+			   e->invflags & EBT_ILOGICALOUT);
+	if (e->out[0] != '\0')
+		json_iface("out", e->out, e->invflags & EBT_IOUT);
+
+	ebt_json_array("matches");
+	for (m_l = e->m_list; m_l; m_l = m_l->next) {
+		if (!(m = ebt_find_match(m_l->m->u.name)))
+			ebt_print_bug("Match not found");
+		ebt_json_object(NULL);
+		ebt_json_str("name", m->name);
+		if (m->print_json)
+			m->print_json(e, m_l->m);
+		else
+			ebt_json_hex("data", m_l->m->data, m_l->m->match_size);
+		ebt_json_end();
+	}
+	ebt_json_end();
+	ebt_json_array("watchers");
+	for (w_l = e->w_list; w_l; w_l = w_l->next) {
+		if (!(w = ebt_find_watcher(w_l->w->u.name)))
+			ebt_print_bug("Watcher not found");
+		ebt_json_object(NULL);
+		ebt_json_str("name", w->name);
+		if (w->print_json)
+			w->print_json(e, w_l->w);
+		else
+			ebt_json_hex("data", w_l->w->data, w_l->w->watcher_size);
+		ebt_json_end();
 	}
+	ebt_json_end();
+	if (!(t = ebt_find_target(e->t->u.name)))
+		ebt_print_bug("Target '%s' not found", e->t->u.name);
+	ebt_json_object("target");
+	ebt_json_str("name", t->name);
+	if (t->print_json)
+		t->print_json(e, e->t);
+	else
+		ebt_json_hex("data", e->t->data, e->t->target_size);
+	ebt_json_end();
+	ebt_json_end();
+}
+
+static void json_chain(struct ebt_u_entries *entries)
+{
+	struct ebt_u_entry *e;
+	int i;
+
+	ebt_json_object(NULL);
+	ebt_json_str("name", entries->name);
+	ebt_json_str("policy", ebt_standard_targets[-entries->policy - 1]);
+	ebt_json_uint("entries", entries->nentries);
+	ebt_json_array("rules");
+	for (i = 0, e = entries->entries->next; i < entries->nentries;
+	     i++, e = e->next)
+		json_rule(e, i + 1);
+	ebt_json_end();
+	ebt_json_end();
+}
+
+/* Execute command L with --format */
+static void list_structured()
+{
+	int i;
+
+	ebt_json_start(replace->flags & LIST_CBOR);
+	ebt_json_object(NULL);
+	ebt_json_str("table", table->name);
+	ebt_json_array("chains");
+	if (replace->selected_chain != -1)
+		json_chain(ebt_to_chain(replace));
+	else
+		for (i = 0; i < replace->num_chains; i++)
+			if (replace->chains[i])
+				json_chain(replace->chains[i]);
+	ebt_json_end();
+	ebt_json_end();
 }
 
 static void print_help()
@@ -353,7 +521,11 @@ static void print_help()
 "--change-counters -C chain\n"
 "          [rulenum] pcnt bcnt : change counters of existing rule\n"
 "--insert -I chain rulenum     : insert rule at position rulenum in chain\n"
+"--among-update chain rulenum  : change the among lists of an existing rule\n"
 "--list   -L [chain]           : list the rules in a chain or in all chains\n"
+"--cost-report                 : estimate the per-frame cost of every base chain\n"
+"--diff source source          : compare the table of two sources: kernel,\n"
+"                                an atomic file or ebtables-save output\n"
 "--flush  -F [chain]           : delete all rules in chain or in all chains\n"
 "--init-table                  : replace the kernel table with the initial table\n"
 "--zero   -Z [chain]           : put counters on zero in chain or in all chains\n"
@@ -377,9 +549,13 @@ static void print_help()
 "          pcnt bcnt           : set the counters of the to be added rule\n"
 "--modprobe -M program         : try to insert modules using this program\n"
 "--concurrent                  : use a file lock to support concurrent scripts\n"
+"--optimistic                  : retry the command if the table changed meanwhile\n"
+"--format json|cbor            : list the rules in a machine-readable format\n"
+"--stats                       : print the time spent in every phase on exit\n"
 "--version -V                  : print package version\n\n"
-"Environment variable:\n"
-ATOMIC_ENV_VARIABLE "          : if set <FILE> (see above) will equal its value"
+"Environment variables:\n"
+ATOMIC_ENV_VARIABLE "          : if set <FILE> (see above) will equal its value\n"
+STATS_ENV_VARIABLE "                : if set, same as --stats"
 "\n\n");
 	m_l = new_entry->m_list;
 	while (m_l) {
@@ -399,11 +575,49 @@ ATOMIC_ENV_VARIABLE "          : if set <FILE> (see above) will equal its value"
 		table->help(ebt_hooknames);
 }
 
+/* Let the matches of the chain's rules prepare for listing */
+static void prepare_list(struct ebt_u_entries *entries)
+{
+	struct ebt_u_entry *e;
+	struct ebt_u_match_list *m_l;
+	struct ebt_u_match *m;
+
+	for (e = entries->entries->next; e != entries->entries; e = e->next)
+		for (m_l = e->m_list; m_l; m_l = m_l->next) {
+			m = ebt_find_match(m_l->m->u.name);
+			if (m && m->list_prepare)
+				m->list_prepare(m_l->m);
+		}
+}
+
 /* Execute command L */
 static void list_rules()
 {
+	struct ebt_u_match *m;
 	int i;
 
+	/* Matches that look up kernel state do that for all listed rules
+	 * first, so that the listing itself needs no system calls and
+	 * doesn't stop halfway */
+	for (m = ebt_matches; m && !m->list_prepare; m = m->next);
+	if (m) {
+		if (replace->selected_chain != -1)
+			prepare_list(ebt_to_chain(replace));
+		else
+			for (i = 0; i < replace->num_chains; i++)
+				if (replace->chains[i])
+					prepare_list(replace->chains[i]);
+		if (ebt_errormsg[0] != '\0')
+			return;
+	}
+
+	/* Take the stdout lock once instead of for every piece of output */
+	flockfile(stdout);
+	if (replace->flags & (LIST_JSON | LIST_CBOR)) {
+		list_structured();
+		funlockfile(stdout);
+		return;
+	}
 	if (!(replace->flags & LIST_X))
 		printf("Bridge table: %s\n", table->name);
 	if (replace->selected_chain != -1)
@@ -421,6 +635,7 @@ static void list_rules()
 			if (replace->chains[i])
 				list_em(replace->chains[i]);
 	}
+	funlockfile(stdout);
 }
 
 static int parse_rule_range(const char *argv, int *rule_nr, int *rule_nr_end)
@@ -521,24 +736,97 @@ static int parse_iface(char *iface, char *option)
 	return 0;
 }
 
+/* Merge the options of all extensions in one go. The extensions only get
+ * their data (and are initialized) when first used, see ebt_load_match() */
+static void early_init()
+{
+	struct ebt_handle *old = ebt_handle_bind(&ebt_default_handle);
+	struct ebt_u_match *m;
+	struct ebt_u_watcher *w;
+	struct ebt_u_target *t;
+	struct option *merge, *next;
+	unsigned int n, num_ori, owners = 0;
+	char *env;
+
+	n = num_ori = count_options(ebt_original_options);
+	for (m = ebt_matches; m; m = m->next, owners++)
+		n += count_options(m->extra_ops);
+	for (w = ebt_watchers; w; w = w->next, owners++)
+		n += count_options(w->extra_ops);
+	for (t = ebt_targets; t; t = t->next, owners++)
+		n += count_options(t->extra_ops);
+	merge = (struct option *)malloc((n + 1) * sizeof(struct option));
+	option_owners = (unsigned char *)malloc(owners + 1);
+	if (!merge || !option_owners)
+		ebt_print_memory();
+
+	memcpy(merge, ebt_original_options, num_ori * sizeof(struct option));
+	next = merge + num_ori;
+	for (m = ebt_matches; m; m = m->next)
+		next = merge_options(next, m->extra_ops, &m->option_offset,
+				     OWNER_MATCH);
+	for (w = ebt_watchers; w; w = w->next)
+		next = merge_options(next, w->extra_ops, &w->option_offset,
+				     OWNER_WATCHER);
+	for (t = ebt_targets; t; t = t->next)
+		next = merge_options(next, t->extra_ops, &t->option_offset,
+				     OWNER_TARGET);
+	memset(next, 0, sizeof(struct option));
+	ebt_options = merge;
+	if ((env = getenv(STATS_ENV_VARIABLE)) && *env)
+		ebt_stats_enable();
+	ebt_handle_bind(old);
+}
+
+/* Must be called before parsing the first command, calling it again
+ * is harmless */
 void ebt_early_init_once()
 {
-	ebt_iterate_matches(merge_match);
-	ebt_iterate_watchers(merge_watcher);
-	ebt_iterate_targets(merge_target);
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	pthread_once(&once, early_init);
 }
 
-/* We use exec_style instead of #ifdef's because ebtables.so is a shared object. */
-int do_command(int argc, char *argv[], int exec_style,
-               struct ebt_u_replace *replace_)
+/* Returns 1 if the command has the --stats option. The options are parsed
+ * the same way as by do_command(), so an option argument that happens to
+ * be "--stats" doesn't count. ebtables enables the statistics before
+ * executing the command, the table can be retrieved before --stats is
+ * parsed. */
+int ebt_has_stats_option(int argc, char *argv[])
+{
+	char **args;
+	int c, found = 0, old_opterr = opterr;
+
+	ebt_early_init_once();
+	/* getopt_long() could permute the arguments */
+	args = (char **)malloc((argc + 1) * sizeof(char *));
+	if (!args)
+		ebt_print_memory();
+	memcpy(args, argv, argc * sizeof(char *));
+	args[argc] = NULL;
+	opterr = 0;
+	optind = 0;
+	while ((c = getopt_long(argc, args, short_options, ebt_options,
+	   NULL)) != -1)
+		if (c == 17)
+			found = 1;
+	opterr = old_opterr;
+	optind = 0;
+	free(args);
+	return found;
+}
+
+static int execute_command(int argc, char *argv[], int exec_style,
+			   struct ebt_u_replace *replace_)
 {
 	char *buffer;
-	int c, i;
+	int c, i, offset;
 	int zerochain = -1; /* Needed for the -Z option (we can have -Z <this> -L <that>) */
 	int chcounter = 0; /* Needed for -C */
 	int policy = 0;
 	int rule_nr = 0;
 	int rule_nr_end = 0;
+	char *diff_a = NULL, *diff_b = NULL; /* Needed for --diff */
 	struct ebt_u_target *t;
 	struct ebt_u_match *m;
 	struct ebt_u_watcher *w;
@@ -581,8 +869,8 @@ int do_command(int argc, char *argv[], int exec_style,
 	 * before '-A' and the like */
 
 	/* Getopt saves the day */
-	while ((c = getopt_long(argc, argv,
-	   "-A:D:C:I:N:E:X::L::Z::F::P:Vhi:o:j:c:p:s:d:t:M:", ebt_options, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, short_options, ebt_options,
+	   NULL)) != -1) {
 		switch (c) {
 
 		case 'A': /* Add a rule */
@@ -878,6 +1166,7 @@ big_iface_length:
 					/* -j standard not allowed either */
 					if (!t || t == (struct ebt_u_target *)new_entry->t)
 						ebt_print_error2("Illegal target name '%s'", optarg);
+					ebt_load_target(t);
 					new_entry->t = (struct ebt_entry_target *)t;
 					ebt_find_target(EBT_STANDARD_TARGET)->used = 0;
 					t->used = 1;
@@ -974,6 +1263,8 @@ big_iface_length:
 				ebt_print_error2("Use --Lx with -L");
 			if (replace->flags & LIST_N)
 				ebt_print_error2("--Lx is not compatible with --Ln");
+			if (replace->flags & (LIST_JSON | LIST_CBOR))
+				ebt_print_error2("--Lx is not compatible with --format");
 			replace->flags |= LIST_X;
 			break;
 		case 12 : /* Lmac2 */
@@ -986,6 +1277,24 @@ big_iface_length:
 				ebt_print_error2("Use --Lmac2 with -L");
 			replace->flags |= LIST_MAC2;
 			break;
+		case 15 : /* format */
+#ifdef SILENT_DAEMON
+			if (exec_style == EXEC_STYLE_DAEMON)
+				ebt_print_error2("--format is not supported in daemon mode");
+#endif
+			if (replace->flags & (LIST_JSON | LIST_CBOR))
+				ebt_print_error2("Multiple use of same option not allowed");
+			if (replace->command != 'L')
+				ebt_print_error2("Use --format with -L");
+			if (replace->flags & LIST_X)
+				ebt_print_error2("--Lx is not compatible with --format");
+			if (!strcmp(optarg, "json"))
+				replace->flags |= LIST_JSON;
+			else if (!strcmp(optarg, "cbor"))
+				replace->flags |= LIST_CBOR;
+			else
+				ebt_print_error2("Unknown listing format '%s', use json or cbor", optarg);
+			break;
 		case 8 : /* atomic-commit */
 			if (exec_style == EXEC_STYLE_DAEMON)
 				ebt_print_error2("--atomic-commit is not supported in daemon mode");
@@ -1043,6 +1352,58 @@ big_iface_length:
 		case 13 : /* concurrent */
 			use_lockfd = 1;
 			break;
+		case 14 : /* optimistic */
+			if (exec_style == EXEC_STYLE_DAEMON)
+				ebt_print_error2("--optimistic is not supported in daemon mode");
+			ebt_optimistic = 1;
+			break;
+		case 17 : /* stats */
+			if (exec_style == EXEC_STYLE_DAEMON)
+				ebt_print_error2("--stats is not supported in daemon mode, use " STATS_ENV_VARIABLE);
+			ebt_stats_enable();
+			break;
+		case 18 : /* cost-report */
+#ifdef SILENT_DAEMON
+			if (exec_style == EXEC_STYLE_DAEMON)
+				ebt_print_error2("--cost-report is not supported in daemon mode");
+#endif
+			if (OPT_COMMANDS)
+				ebt_print_error2("Multiple commands are not allowed");
+			replace->command = c;
+			replace->flags |= OPT_COMMAND;
+			if (!(replace->flags & OPT_KERNELDATA))
+				ebt_get_kernel_table(replace, 0);
+			break;
+		case 19 : /* diff */
+			if (exec_style == EXEC_STYLE_DAEMON)
+				ebt_print_error2("--diff is not supported in daemon mode");
+			if (OPT_COMMANDS)
+				ebt_print_error2("Multiple commands are not allowed");
+			replace->command = c;
+			replace->flags |= OPT_COMMAND;
+			if (optind >= argc)
+				ebt_print_error2("--diff needs two sources");
+			diff_a = optarg;
+			diff_b = argv[optind++];
+			break;
+		case 16 : /* among-update */
+			if (OPT_COMMANDS)
+				ebt_print_error2("Multiple commands are not allowed");
+			replace->command = c;
+			replace->flags |= OPT_COMMAND;
+			if (!(replace->flags & OPT_KERNELDATA))
+				ebt_get_kernel_table(replace, 0);
+			if (optarg[0] == '-' || !strcmp(optarg, "!"))
+				ebt_print_error2("No chain name specified");
+			if ((replace->selected_chain = ebt_get_chainnr(replace, optarg)) == -1)
+				ebt_print_error2("Chain '%s' doesn't exist", optarg);
+			if (optind >= argc || (argv[optind][0] == '-' && (argv[optind][1] < '0' || argv[optind][1] > '9')))
+				ebt_print_error2("No rule number specified");
+			rule_nr = strtol(argv[optind], &buffer, 10);
+			if (*buffer != '\0' || rule_nr == 0)
+				ebt_print_error2("Problem with the specified rule number '%s'", argv[optind]);
+			optind++;
+			break;
 		case 1 :
 			if (!strcmp(optarg, "!"))
 				ebt_check_inverse2(optarg);
@@ -1052,50 +1413,61 @@ big_iface_length:
 			optind--;
 			continue;
 		default:
-			/* Is it a target option? */
+			/* Give the option to the extension owning it */
 			t = (struct ebt_u_target *)new_entry->t;
-			if ((t->parse(c - t->option_offset, argv, argc, new_entry, &t->flags, &t->t))) {
+			m = NULL;
+			w = NULL;
+			offset = c - c % OPTION_OFFSET;
+			switch (option_owner(c)) {
+			case OWNER_TARGET:
+				/* Only options of the chosen target are allowed */
+				if (t->option_offset != offset ||
+				    !t->parse(c - offset, argv, argc, new_entry, &t->flags, &t->t))
+					break;
 				if (ebt_errormsg[0] != '\0')
 					return -1;
 				goto check_extension;
-			}
-
-			/* Is it a match_option? */
-			for (m = ebt_matches; m; m = m->next)
-				if (m->parse(c - m->option_offset, argv, argc, new_entry, &m->flags, &m->m))
+			case OWNER_MATCH:
+				for (m = ebt_matches; m->option_offset != offset; m = m->next);
+				ebt_load_match(m);
+				if (!m->parse(c - offset, argv, argc, new_entry, &m->flags, &m->m)) {
+					m = NULL;
 					break;
-
-			if (m != NULL) {
+				}
 				if (ebt_errormsg[0] != '\0')
-					return -1;			
+					return -1;
 				if (m->used == 0) {
 					ebt_add_match(new_entry, m);
 					m->used = 1;
 				}
 				goto check_extension;
-			}
-
-			/* Is it a watcher option? */
-			for (w = ebt_watchers; w; w = w->next)
-				if (w->parse(c - w->option_offset, argv, argc, new_entry, &w->flags, &w->w))
+			case OWNER_WATCHER:
+				for (w = ebt_watchers; w->option_offset != offset; w = w->next);
+				ebt_load_watcher(w);
+				if (!w->parse(c - offset, argv, argc, new_entry, &w->flags, &w->w)) {
+					w = NULL;
 					break;
+				}
+				if (ebt_errormsg[0] != '\0')
+					return -1;
+				if (w->used == 0) {
+					ebt_add_watcher(new_entry, w);
+					w->used = 1;
+				}
+				goto check_extension;
+			}
 
-			if (w == NULL && c == '?')
+			if (c == '?')
 				ebt_print_error2("Unknown argument: '%s'", argv[optind - 1], (char)optopt, (char)c);
-			else if (w == NULL) {
-				if (!strcmp(t->name, "standard"))
-					ebt_print_error2("Unknown argument: don't forget the -t option");
-				else
-					ebt_print_error2("Target-specific option does not correspond with specified target");
-			}
-			if (ebt_errormsg[0] != '\0')
-				return -1;
-			if (w->used == 0) {
-				ebt_add_watcher(new_entry, w);
-				w->used = 1;
-			}
+			else if (!strcmp(t->name, "standard"))
+				ebt_print_error2("Unknown argument: don't forget the -t option");
+			else
+				ebt_print_error2("Target-specific option does not correspond with specified target");
 check_extension:
-			if (replace->command != 'A' && replace->command != 'I' &&
+			if (replace->command == 16) {
+				if (!m || !m->update)
+					ebt_print_error2("Only the options of the among match are allowed with --among-update");
+			} else if (replace->command != 'A' && replace->command != 'I' &&
 			    replace->command != 'D' && replace->command != 'C')
 				ebt_print_error2("Extensions only for -A, -I, -D and -C");
 		}
@@ -1158,9 +1530,28 @@ check_extension:
 		if (ebt_errormsg[0] != '\0')
 			return -1;
 	} else if (replace->command == 'L') {
+		ebt_stats_begin(EBT_STATS_LIST);
 		list_rules();
+		ebt_stats_end();
+		if (ebt_errormsg[0] != '\0')
+			return -1;
 		if (!(replace->flags & OPT_ZERO) && exec_style == EXEC_STYLE_PRG)
 			exit(0);
+	} else if (replace->command == 18) {
+		ebt_stats_begin(EBT_STATS_LIST);
+		ebt_cost_report(replace);
+		ebt_stats_end();
+		if (ebt_errormsg[0] != '\0')
+			return -1;
+		if (exec_style == EXEC_STYLE_PRG)
+			exit(0);
+	} else if (replace->command == 19) {
+		/* The sources are parsed with handles of their own, which
+		 * reuses the parsing state of this command */
+		i = ebt_diff_tables(replace->name, diff_a, diff_b);
+		if (ebt_errormsg[0] != '\0')
+			return -1;
+		exit(i);
 	}
 	if (replace->flags & OPT_ZERO) {
 		replace->selected_chain = zerochain;
@@ -1177,16 +1568,19 @@ check_extension:
 		rule_nr_end = rule_nr;
 
 		/* a jump to a udc requires checking for loops */
-		if (!strcmp(new_entry->t->u.name, EBT_STANDARD_TARGET) &&
-		((struct ebt_standard_target *)(new_entry->t))->verdict >= 0) {
-			/* FIXME: this can be done faster */
-			ebt_check_for_loops(replace);
-			if (ebt_errormsg[0] != '\0')
-				goto delete_the_rule;
-		}
+		if (strcmp(new_entry->t->u.name, EBT_STANDARD_TARGET) ||
+		    ((struct ebt_standard_target *)(new_entry->t))->verdict < 0)
+			goto added;
+		/* FIXME: this can be done faster */
+		ebt_check_for_loops(replace);
+		if (ebt_errormsg[0] != '\0')
+			goto delete_the_rule;
 
 		/* Do the final_check(), for all entries.
-		 * This is needed when adding a rule that has a chain target */
+		 * This is needed when adding a rule that has a chain target,
+		 * the rules of that chain can now be reached from other hooks.
+		 * Any other rule was checked above, so adding a rule doesn't
+		 * depend on the size of the table */
 		i = -1;
 		while (++i != replace->num_chains) {
 			struct ebt_u_entry *e;
@@ -1209,6 +1603,7 @@ check_extension:
 				e = e->next;
 			}
 		}
+added:
 		/* Don't reuse the added rule */
 		new_entry = NULL;
 	} else if (replace->command == 'D') {
@@ -1220,6 +1615,10 @@ delete_the_rule:
 		ebt_change_counters(replace, new_entry, rule_nr, rule_nr_end, &(new_entry->cnt_surplus), chcounter);
 		if (ebt_errormsg[0] != '\0')
 			return -1;
+	} else if (replace->command == 16) {
+		ebt_update_rule(replace, new_entry, rule_nr);
+		if (ebt_errormsg[0] != '\0')
+			return -1;
 	}
 	/* Commands -N, -E, -X, --atomic-commit, --atomic-commit, --atomic-save,
 	 * --init-table fall through */
@@ -1230,10 +1629,31 @@ delete_the_rule:
 		table->check(replace);
 
 	if (exec_style == EXEC_STYLE_PRG) {/* Implies ebt_errormsg[0] == '\0' */
-		ebt_deliver_table(replace);
+		/* The kernel table changed since we retrieved it (--optimistic),
+		 * the caller can start over */
+		if (ebt_deliver_table(replace))
+			return 1;
 
 		if (replace->nentries)
 			ebt_deliver_counters(replace);
 	}
 	return 0;
 }
+
+/* We use exec_style instead of #ifdef's because ebtables.so is a shared object.
+ * With --stats, the time of the command that isn't spent in another phase
+ * (option parsing, the checks of the extensions, changing the table) is
+ * counted as parse time. */
+int do_command(int argc, char *argv[], int exec_style,
+               struct ebt_u_replace *replace_)
+{
+	int ret, depth = ebt_cur_stats ? ebt_cur_stats->depth : 0;
+
+	ebt_stats_add(commands, 1);
+	ebt_stats_begin(EBT_STATS_PARSE);
+	ret = execute_command(argc, argv, exec_style, replace_);
+	/* Errors can leave phases open */
+	while (ebt_cur_stats && ebt_cur_stats->depth > depth)
+		ebt_stats_pop();
+	return ret;
+}
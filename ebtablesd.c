@@ -306,7 +306,7 @@ continue_read:
 			ebt_deliver_table(&replace[i]);
 			if (ebt_errormsg[0] == '\0' && open_method[i] == OPEN_METHOD_KERNEL)
 				ebt_deliver_counters(&replace[i]);
-			goto write_msg;
+			goto print_stats;
 		} else if (!strcmp(argv[1], "fcommit")) {
 			if (argc != 4) {
 				ebt_print_error("ebtablesd: command commit "
@@ -338,7 +338,7 @@ continue_read:
 				ebt_deliver_counters(&replace[i]);
 			free(replace[i].filename);
 			replace[i].filename = NULL;
-			goto write_msg;
+			goto print_stats;
 		}else if (!strcmp(argv[1], "quit")) {
 			if (argc != 2) {
 				ebt_print_error("ebtablesd: command quit does "
@@ -355,6 +355,13 @@ continue_read:
 		optind = 0; /* Setting optind = 1 causes serious annoyances */
 		do_command(argc, argv, EXEC_STYLE_DAEMON, &replace[table_nr]);
 		ebt_reinit_extensions();
+		goto write_msg;
+print_stats:
+		/* EBTABLES_STATS: the statistics of every commit */
+		if (ebt_cur_stats) {
+			ebt_stats_print(ebt_cur_stats);
+			ebt_stats_reset(ebt_cur_stats);
+		}
 write_msg:
 #ifndef SILENT_DAEMON
 		if (ebt_errormsg[0] != '\0')
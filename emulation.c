@@ -0,0 +1,650 @@
+/*
+ * emulation.c, in-process emulation of the ebtables kernel tables
+ *
+ * The memory backend answers the EBT_SO_* socket options like the kernel
+ * does, so that tables can be retrieved, delivered, listed and benchmarked
+ * without root or a bridge netfilter kernel. Delivered tables are checked
+ * the way the kernel checks them (the layout of the blob, the chain
+ * headers, the offsets and sizes of the extensions, the standard targets
+ * and loops between chains) and are refused with EINVAL otherwise. Only
+ * the extensions known in userspace are accepted. The tables live as long
+ * as the process and are shared by all handles.
+ *
+ * The set match looks up ipset sets by name and by index, the emulation
+ * answers these requests for the sets created with ebt_emu_add_set().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "include/ebtables_u.h"
+#include <linux/netfilter/ipset/ip_set.h>
+
+/* The number of standard targets the kernel knows (ACCEPT, DROP,
+ * CONTINUE, RETURN) */
+#define NUM_STANDARD_TARGETS 4
+
+struct emu_table
+{
+	char name[EBT_TABLE_MAXNAMELEN];
+	unsigned int valid_hooks;
+	unsigned int nentries;
+	unsigned int entries_size;
+	char *entries;
+	struct ebt_counter *counters;
+};
+
+static struct emu_table emu_tables[] = {
+	{ .name = "filter", .valid_hooks = 1 << NF_BR_LOCAL_IN |
+	  1 << NF_BR_FORWARD | 1 << NF_BR_LOCAL_OUT },
+	{ .name = "nat", .valid_hooks = 1 << NF_BR_PRE_ROUTING |
+	  1 << NF_BR_LOCAL_OUT | 1 << NF_BR_POST_ROUTING },
+	{ .name = "broute", .valid_hooks = 1 << NF_BR_BROUTING },
+};
+#define NUM_TABLES (sizeof(emu_tables) / sizeof(emu_tables[0]))
+
+static pthread_mutex_t emu_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *emu_hooknames[NF_BR_NUMHOOKS] = {
+	"PREROUTING", "INPUT", "FORWARD", "OUTPUT", "POSTROUTING", "BROUTING"
+};
+
+/* The table as it is when the kernel module is loaded: empty base chains
+ * with policy ACCEPT */
+static void initial_table(const struct emu_table *t, struct emu_table *init)
+{
+	struct ebt_entries *chain;
+	unsigned int hooks = t->valid_hooks;
+	int i;
+
+	if (init != t) {
+		memset(init, 0, sizeof(*init));
+		strcpy(init->name, t->name);
+		init->valid_hooks = hooks;
+	}
+	init->nentries = 0;
+	init->entries_size = 0;
+	init->counters = NULL;
+	for (i = 0; i < NF_BR_NUMHOOKS; i++)
+		if (hooks & (1 << i))
+			init->entries_size += sizeof(struct ebt_entries);
+	if (!(init->entries = calloc(1, init->entries_size)))
+		ebt_print_memory();
+	chain = (struct ebt_entries *)init->entries;
+	for (i = 0; i < NF_BR_NUMHOOKS; i++) {
+		if (!(hooks & (1 << i)))
+			continue;
+		strcpy(chain->name, emu_hooknames[i]);
+		chain->policy = EBT_ACCEPT;
+		chain++;
+	}
+}
+
+static struct emu_table *find_table(const char *name, int init,
+				    struct emu_table *tmp)
+{
+	unsigned int i;
+
+	if (strnlen(name, EBT_TABLE_MAXNAMELEN) == EBT_TABLE_MAXNAMELEN)
+		return NULL;
+	for (i = 0; i < NUM_TABLES; i++) {
+		if (strcmp(emu_tables[i].name, name))
+			continue;
+		if (init) {
+			initial_table(&emu_tables[i], tmp);
+			return tmp;
+		}
+		if (!emu_tables[i].entries)
+			initial_table(&emu_tables[i], &emu_tables[i]);
+		return &emu_tables[i];
+	}
+	return NULL;
+}
+
+/*
+ * Checking a delivered table
+ */
+
+struct emu_check
+{
+	const struct ebt_replace *repl;
+	const char *base;
+	/* Offsets of the chain headers, the base chains first */
+	unsigned int *chains;
+	int nchains, max_chains;
+	/* The chain the entry being checked belongs to */
+	int chain_nr;
+	unsigned int chain_entries, total_entries;
+};
+
+/* Returns 1 if the name of an extension isn't terminated */
+static int check_name(const char *name)
+{
+	return !memchr(name, '\0', EBT_EXTENSION_MAXNAMELEN - 1);
+}
+
+/* Checks the matches or watchers in [from, to[ of an entry */
+static int check_extensions(const char *from, const char *to, int watchers)
+{
+	const struct ebt_entry_match *m;
+	struct ebt_u_watcher *w;
+	struct ebt_u_match *u;
+
+	while (from < to) {
+		m = (const struct ebt_entry_match *)from;
+		if ((size_t)(to - from) < sizeof(struct ebt_entry_match) ||
+		    to - from - sizeof(struct ebt_entry_match) < m->match_size ||
+		    check_name(m->u.name))
+			return -1;
+		if (watchers) {
+			if (!(w = ebt_find_watcher(m->u.name)) ||
+			    m->match_size < EBT_ALIGN(w->size))
+				return -1;
+		} else if (!(u = ebt_find_match(m->u.name)) ||
+			   m->match_size < EBT_ALIGN(u->size))
+			return -1;
+		from += sizeof(struct ebt_entry_match) + m->match_size;
+	}
+	return 0;
+}
+
+static int check_entry(const struct ebt_entry *e, struct emu_check *c)
+{
+	const struct ebt_entry_target *t;
+	struct ebt_u_target *u;
+	unsigned int gap;
+	int verdict;
+
+	if (e->bitmask & ~EBT_F_MASK || e->invflags & ~EBT_INV_MASK ||
+	    ((e->bitmask & EBT_NOPROTO) && (e->bitmask & EBT_802_3)))
+		return -1;
+	if (sizeof(struct ebt_entry) > e->watchers_offset ||
+	    e->watchers_offset > e->target_offset ||
+	    e->target_offset >= e->next_offset ||
+	    e->next_offset - e->target_offset < sizeof(struct ebt_entry_target))
+		return -1;
+	if (check_extensions((const char *)e->elems,
+			     (const char *)e + e->watchers_offset, 0) ||
+	    check_extensions((const char *)e + e->watchers_offset,
+			     (const char *)e + e->target_offset, 1))
+		return -1;
+	t = (const struct ebt_entry_target *)((const char *)e + e->target_offset);
+	gap = e->next_offset - e->target_offset - sizeof(struct ebt_entry_target);
+	if (check_name(t->u.name) || gap < t->target_size)
+		return -1;
+	if (!strcmp(t->u.name, EBT_STANDARD_TARGET)) {
+		if (gap < sizeof(int))
+			return -1;
+		verdict = ((const struct ebt_standard_target *)t)->verdict;
+		if (verdict < -NUM_STANDARD_TARGETS)
+			return -1;
+		/* Jumps are checked in check_loops() */
+		if (verdict == EBT_RETURN && c->chain_nr < NF_BR_NUMHOOKS)
+			return -1;
+	} else if (!(u = ebt_find_target(t->u.name)) ||
+		   t->target_size < EBT_ALIGN(u->size))
+		return -1;
+	return 0;
+}
+
+/* Walks the blob: the chain headers and the entries must follow each
+ * other without gaps, the base chains in the order of their hooks */
+static int check_layout(struct emu_check *c)
+{
+	const struct ebt_replace *repl = c->repl;
+	const struct ebt_entries *chain;
+	unsigned int offset = 0, hook = 0;
+	int i;
+
+	c->chain_nr = -1;
+	while (offset < repl->entries_size) {
+		chain = (const struct ebt_entries *)(c->base + offset);
+		if (repl->entries_size - offset < sizeof(unsigned int))
+			return -1;
+		if (chain->distinguisher & EBT_ENTRY_OR_ENTRIES) {
+			const struct ebt_entry *e = (const struct ebt_entry *)chain;
+
+			if (c->chain_nr == -1 ||
+			    repl->entries_size - offset < sizeof(struct ebt_entry) ||
+			    e->next_offset > repl->entries_size - offset ||
+			    c->chain_entries == 0)
+				return -1;
+			if (check_entry(e, c))
+				return -1;
+			c->chain_entries--;
+			c->total_entries++;
+			offset += e->next_offset;
+			continue;
+		}
+		/* A chain header, the previous chain must be complete */
+		if (chain->distinguisher != 0 || c->chain_entries ||
+		    repl->entries_size - offset < sizeof(struct ebt_entries) ||
+		    chain->counter_offset != c->total_entries ||
+		    strnlen(chain->name, EBT_CHAIN_MAXNAMELEN) == EBT_CHAIN_MAXNAMELEN)
+			return -1;
+		/* Find the hook of a base chain */
+		while (hook < NF_BR_NUMHOOKS && !(repl->valid_hooks & (1 << hook)))
+			hook++;
+		if (hook < NF_BR_NUMHOOKS) {
+			c->chain_nr = hook++;
+			if ((char *)repl->hook_entry[c->chain_nr] !=
+			    repl->entries + offset ||
+			    (chain->policy != EBT_ACCEPT && chain->policy != EBT_DROP))
+				return -1;
+		} else {
+			c->chain_nr = NF_BR_NUMHOOKS;
+			if (chain->policy != EBT_ACCEPT && chain->policy != EBT_DROP &&
+			    chain->policy != EBT_RETURN)
+				return -1;
+		}
+		if (c->nchains == c->max_chains) {
+			c->max_chains = c->max_chains ? 2 * c->max_chains : 16;
+			c->chains = realloc(c->chains, c->max_chains * sizeof(unsigned int));
+			if (!c->chains)
+				ebt_print_memory();
+		}
+		c->chains[c->nchains++] = offset;
+		c->chain_entries = chain->nentries;
+		offset += sizeof(struct ebt_entries);
+	}
+	if (offset != repl->entries_size || c->chain_entries ||
+	    c->total_entries != repl->nentries)
+		return -1;
+	/* All base chains must be there */
+	for (i = hook; i < NF_BR_NUMHOOKS; i++)
+		if (repl->valid_hooks & (1 << i))
+			return -1;
+	return 0;
+}
+
+/* Returns the index in c->chains of the user defined chain at offset,
+ * -1 if there is none */
+static int udc_nr(const struct emu_check *c, int nbase, unsigned int offset)
+{
+	int lo = nbase, hi = c->nchains, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (c->chains[mid] < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < c->nchains && c->chains[lo] == offset ? lo : -1;
+}
+
+/* Every jump must go to a user defined chain and no chain may be reached
+ * from itself. Depth first from every chain, state 1 while a chain is on
+ * the path, 2 when all its jumps were followed */
+static int check_loops(struct emu_check *c)
+{
+	const struct ebt_entry *e;
+	const struct ebt_standard_target *t;
+	unsigned int offset, end;
+	int nbase = 0, i, nr, ret = 0;
+	char *state;
+	struct { int nr; unsigned int offset; } *stack;
+	int sp;
+
+	for (i = 0; i < NF_BR_NUMHOOKS; i++)
+		if (c->repl->valid_hooks & (1 << i))
+			nbase++;
+	state = calloc(c->nchains, 1);
+	stack = malloc(c->nchains * sizeof(*stack));
+	if (!state || !stack)
+		ebt_print_memory();
+	for (i = 0; i < c->nchains && !ret; i++) {
+		if (state[i])
+			continue;
+		sp = 0;
+		stack[sp].nr = i;
+		stack[sp].offset = c->chains[i] + sizeof(struct ebt_entries);
+		state[i] = 1;
+		while (sp >= 0) {
+			nr = stack[sp].nr;
+			end = nr + 1 < c->nchains ? c->chains[nr + 1] :
+			      c->repl->entries_size;
+			offset = stack[sp].offset;
+			for (; offset < end; offset += e->next_offset) {
+				e = (const struct ebt_entry *)(c->base + offset);
+				t = (const struct ebt_standard_target *)
+				    ((const char *)e + e->target_offset);
+				if (strcmp(t->target.u.name, EBT_STANDARD_TARGET) ||
+				    t->verdict < 0)
+					continue;
+				if ((nr = udc_nr(c, nbase, t->verdict)) == -1 ||
+				    state[nr] == 1) {
+					ret = -1;
+					goto out;
+				}
+				if (state[nr] == 0)
+					break;
+			}
+			if (offset < end) {
+				stack[sp].offset = offset + e->next_offset;
+				sp++;
+				stack[sp].nr = nr;
+				stack[sp].offset = c->chains[nr] + sizeof(struct ebt_entries);
+				state[nr] = 1;
+				continue;
+			}
+			state[stack[sp].nr] = 2;
+			sp--;
+		}
+	}
+out:
+	free(state);
+	free(stack);
+	return ret;
+}
+
+static int check_table(const struct ebt_replace *repl, const char *entries)
+{
+	struct emu_check c;
+	int ret;
+
+	memset(&c, 0, sizeof(c));
+	c.repl = repl;
+	c.base = entries;
+	ret = check_layout(&c);
+	if (!ret)
+		ret = check_loops(&c);
+	free(c.chains);
+	return ret;
+}
+
+/*
+ * The socket options
+ */
+
+static int emu_get(int optname, void *optval, socklen_t *optlen)
+{
+	struct ebt_replace *repl = (struct ebt_replace *)optval;
+	struct emu_table *t, tmp;
+	int init = optname == EBT_SO_GET_INIT_INFO ||
+		   optname == EBT_SO_GET_INIT_ENTRIES;
+	socklen_t size;
+
+	if (*optlen < sizeof(struct ebt_replace)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!(t = find_table(repl->name, init, &tmp))) {
+		errno = ENOENT;
+		return -1;
+	}
+	switch (optname) {
+	case EBT_SO_GET_INFO:
+	case EBT_SO_GET_INIT_INFO:
+		if (*optlen != sizeof(struct ebt_replace))
+			goto invalid;
+		repl->nentries = t->nentries;
+		repl->entries_size = t->entries_size;
+		repl->valid_hooks = t->valid_hooks;
+		break;
+	case EBT_SO_GET_ENTRIES:
+	case EBT_SO_GET_INIT_ENTRIES:
+		size = sizeof(struct ebt_replace) + t->entries_size;
+		if (repl->num_counters)
+			size += t->nentries * sizeof(struct ebt_counter);
+		if (*optlen != size || repl->nentries != t->nentries ||
+		    repl->entries_size != t->entries_size ||
+		    (repl->num_counters && repl->num_counters != t->nentries))
+			goto invalid;
+		memcpy(repl->entries, t->entries, t->entries_size);
+		if (repl->num_counters && t->nentries) {
+			if (t->counters)
+				memcpy(repl->counters, t->counters,
+				       t->nentries * sizeof(struct ebt_counter));
+			else
+				memset(repl->counters, 0,
+				       t->nentries * sizeof(struct ebt_counter));
+		}
+		break;
+	default:
+		errno = ENOPROTOOPT;
+		return -1;
+	}
+	if (init)
+		free(tmp.entries);
+	return 0;
+invalid:
+	if (init)
+		free(tmp.entries);
+	errno = EINVAL;
+	return -1;
+}
+
+static int emu_set_entries(const struct ebt_replace *repl, socklen_t optlen)
+{
+	struct emu_table *t, tmp;
+	struct ebt_counter *counters = NULL;
+	char *entries;
+
+	if (optlen < sizeof(struct ebt_replace) ||
+	    optlen != sizeof(struct ebt_replace) + repl->entries_size ||
+	    repl->entries_size == 0)
+		goto invalid;
+	if (!(t = find_table(repl->name, 0, &tmp))) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (repl->valid_hooks != t->valid_hooks ||
+	    (repl->num_counters && repl->num_counters != t->nentries))
+		goto invalid;
+	if (!(entries = malloc(repl->entries_size)))
+		ebt_print_memory();
+	memcpy(entries, repl->entries, repl->entries_size);
+	if (check_table(repl, entries)) {
+		free(entries);
+		goto invalid;
+	}
+	if (repl->nentries &&
+	    !(counters = calloc(repl->nentries, sizeof(struct ebt_counter))))
+		ebt_print_memory();
+	/* The counters of the old table go back to userspace */
+	if (repl->num_counters) {
+		if (t->counters)
+			memcpy(repl->counters, t->counters,
+			       t->nentries * sizeof(struct ebt_counter));
+		else
+			memset(repl->counters, 0,
+			       t->nentries * sizeof(struct ebt_counter));
+	}
+	free(t->entries);
+	free(t->counters);
+	t->entries = entries;
+	t->counters = counters;
+	t->entries_size = repl->entries_size;
+	t->nentries = repl->nentries;
+	return 0;
+invalid:
+	errno = EINVAL;
+	return -1;
+}
+
+/* Like the kernel, the given counters are added to the current ones */
+static int emu_set_counters(const struct ebt_replace *repl, socklen_t optlen)
+{
+	struct emu_table *t, tmp;
+	const struct ebt_counter *add;
+	unsigned int i;
+
+	if (optlen < sizeof(struct ebt_replace) ||
+	    optlen != sizeof(struct ebt_replace) +
+		      repl->num_counters * sizeof(struct ebt_counter))
+		goto invalid;
+	if (!(t = find_table(repl->name, 0, &tmp))) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (repl->num_counters != t->nentries)
+		goto invalid;
+	add = repl->counters;
+	for (i = 0; i < t->nentries; i++) {
+		t->counters[i].pcnt += add[i].pcnt;
+		t->counters[i].bcnt += add[i].bcnt;
+	}
+	return 0;
+invalid:
+	errno = EINVAL;
+	return -1;
+}
+
+static int emu_socket()
+{
+	/* Any socket will do, the options never reach it. An unprivileged
+	 * one, so that the extensions talking to other kernel modules (other
+	 * than ipset) over the socket of the handle get an error instead */
+	return socket(AF_UNIX, SOCK_DGRAM, 0);
+}
+
+struct emu_set
+{
+	char name[IPSET_MAXNAMELEN];
+	unsigned int family;
+};
+
+/* Indexed by the set index */
+static struct emu_set *emu_sets;
+static unsigned int emu_nsets;
+
+/* An existing set keeps its family */
+unsigned int ebt_emu_add_set(const char *name, unsigned int family)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&emu_lock);
+	for (i = 0; i < emu_nsets; i++)
+		if (!strncmp(emu_sets[i].name, name, IPSET_MAXNAMELEN - 1))
+			goto out;
+	emu_sets = realloc(emu_sets, (emu_nsets + 1) * sizeof(struct emu_set));
+	if (!emu_sets)
+		ebt_print_memory();
+	strncpy(emu_sets[i].name, name, IPSET_MAXNAMELEN - 1);
+	emu_sets[i].name[IPSET_MAXNAMELEN - 1] = '\0';
+	emu_sets[i].family = family;
+	emu_nsets++;
+out:
+	pthread_mutex_unlock(&emu_lock);
+	return i;
+}
+
+static ip_set_id_t emu_find_set(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < emu_nsets; i++)
+		if (!strncmp(emu_sets[i].name, name, IPSET_MAXNAMELEN))
+			return i;
+	return IPSET_INVALID_ID;
+}
+
+/* Like ip_set_sockfn_get() of the kernel, for the requests of the set
+ * match */
+static int emu_ipset_get(void *req, socklen_t *size)
+{
+	struct ip_set_req_version *req_version = req;
+	struct ip_set_req_get_set *req_get = req;
+	struct ip_set_req_get_set_family *req_family = req;
+	ip_set_id_t idx;
+
+	if (*size < sizeof(struct ip_set_req_version))
+		goto invalid;
+	if (req_version->op != IP_SET_OP_VERSION &&
+	    req_version->version < IPSET_PROTOCOL_MIN) {
+		errno = EPROTO;
+		return -1;
+	}
+	switch (req_version->op) {
+	case IP_SET_OP_VERSION:
+		if (*size != sizeof(struct ip_set_req_version))
+			goto invalid;
+		req_version->version = IPSET_PROTOCOL;
+		return 0;
+	case IP_SET_OP_GET_BYNAME:
+		if (*size != sizeof(struct ip_set_req_get_set))
+			goto invalid;
+		req_get->set.name[IPSET_MAXNAMELEN - 1] = '\0';
+		req_get->set.index = emu_find_set(req_get->set.name);
+		return 0;
+	case IP_SET_OP_GET_FNAME:
+		if (*size != sizeof(struct ip_set_req_get_set_family))
+			goto invalid;
+		req_family->set.name[IPSET_MAXNAMELEN - 1] = '\0';
+		idx = emu_find_set(req_family->set.name);
+		if (idx != IPSET_INVALID_ID)
+			req_family->family = emu_sets[idx].family;
+		req_family->set.index = idx;
+		return 0;
+	case IP_SET_OP_GET_BYINDEX:
+		if (*size != sizeof(struct ip_set_req_get_set))
+			goto invalid;
+		idx = req_get->set.index;
+		if (idx < emu_nsets)
+			strcpy(req_get->set.name, emu_sets[idx].name);
+		else
+			req_get->set.name[0] = '\0';
+		return 0;
+	}
+	errno = EBADMSG;
+	return -1;
+invalid:
+	errno = EINVAL;
+	return -1;
+}
+
+static int emu_getsockopt(int fd, int optname, void *optval,
+			  socklen_t *optlen)
+{
+	int ret;
+
+	pthread_mutex_lock(&emu_lock);
+	ret = emu_get(optname, optval, optlen);
+	pthread_mutex_unlock(&emu_lock);
+	return ret;
+}
+
+static int emu_setsockopt(int fd, int optname, const void *optval,
+			  socklen_t optlen)
+{
+	int ret;
+
+	pthread_mutex_lock(&emu_lock);
+	switch (optname) {
+	case EBT_SO_SET_ENTRIES:
+		ret = emu_set_entries(optval, optlen);
+		break;
+	case EBT_SO_SET_COUNTERS:
+		ret = emu_set_counters(optval, optlen);
+		break;
+	default:
+		errno = ENOPROTOOPT;
+		ret = -1;
+	}
+	pthread_mutex_unlock(&emu_lock);
+	return ret;
+}
+
+static int emu_ipset(int fd, void *req, socklen_t *size)
+{
+	int ret;
+
+	pthread_mutex_lock(&emu_lock);
+	ret = emu_ipset_get(req, size);
+	pthread_mutex_unlock(&emu_lock);
+	return ret;
+}
+
+struct ebt_backend ebt_memory_backend =
+{
+	.name		= "memory",
+	.socket		= emu_socket,
+	.getsockopt	= emu_getsockopt,
+	.setsockopt	= emu_setsockopt,
+	.ipset		= emu_ipset,
+	.modules	= 0,
+};
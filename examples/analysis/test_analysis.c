@@ -0,0 +1,87 @@
+/*
+ * test_analysis.c, regression tests for the rule relations of analysis.c
+ *
+ * Every case adds two rules to an empty FORWARD chain of the in-memory
+ * kernel emulation and checks what ebt_rule_covers() and
+ * ebt_rules_disjoint() say about them. Run through "make check".
+ */
+#include <stdio.h>
+#include "../check.h"
+
+struct test
+{
+	const char *a, *b;
+	/* Expected ebt_rule_covers(a, b) and ebt_rules_disjoint(a, b) */
+	int covers, disjoint;
+};
+
+static const struct test tests[] = {
+	{ "--mark 0x1/0x1 -j ACCEPT", "--mark 0x3/0x3 -j DROP", 1, 0 },
+	{ "--mark 0x3/0x3 -j ACCEPT", "--mark 0x1/0x1 -j DROP", 0, 0 },
+	{ "--mark 0x1/0x3 -j ACCEPT", "--mark 0x2/0x3 -j DROP", 0, 1 },
+	/* 0x3 & 0x1 never equals 0x3, these rules match no frame */
+	{ "--mark 0x3/0x1 -j DROP", "--mark 0x1/0x1 -j ACCEPT", 0, 1 },
+	{ "--mark 0x3/0x1 -j DROP", "--mark 0x3/0x1 -j ACCEPT", 0, 1 },
+	{ "--mark 0x1/0x1 -j ACCEPT", "--mark 0x3/0x1 -j DROP", 1, 1 },
+	/* and when inverted, every frame */
+	{ "--mark ! 0x3/0x1 -j DROP", "--mark 0x1/0x1 -j ACCEPT", 1, 0 },
+	{ "--mark 0x1/0x1 -j DROP", "--mark ! 0x3/0x1 -j ACCEPT", 0, 0 },
+	/* MAC addresses with a mask */
+	{ "-s 0:11:22:0:0:0/ff:ff:ff:0:0:0 -j ACCEPT", "-s 0:11:22:33:44:55 -j DROP", 1, 0 },
+	{ "-s 0:11:22:33:44:55 -j ACCEPT", "-s 0:11:22:0:0:0/ff:ff:ff:0:0:0 -j DROP", 0, 0 },
+	{ "-s 0:11:22:0:0:0/ff:ff:ff:0:0:0 -j ACCEPT", "-s 0:11:23:33:44:55 -j DROP", 0, 1 },
+	{ "-d 0:11:22:0:0:0/ff:ff:ff:0:0:0 -j ACCEPT", "-s 0:11:22:33:44:55 -j DROP", 0, 0 },
+	/* Interfaces with the + wildcard */
+	{ "-i eth+ -j ACCEPT", "-i eth0 -j DROP", 1, 0 },
+	{ "-i eth0 -j ACCEPT", "-i eth+ -j DROP", 0, 0 },
+	{ "-i eth+ -j ACCEPT", "-i wlan0 -j DROP", 0, 1 },
+	{ "-i ! eth+ -j ACCEPT", "-i eth1 -j DROP", 0, 1 },
+	{ "-o eth+ -j ACCEPT", "-i eth0 -j DROP", 0, 0 },
+	/* IPv4 and IPv6 prefixes */
+	{ "-p IPv4 --ip-src 10.0.0.0/8 -j ACCEPT", "-p IPv4 --ip-src 10.1.0.0/16 -j DROP", 1, 0 },
+	{ "-p IPv4 --ip-src 10.1.0.0/16 -j ACCEPT", "-p IPv4 --ip-src 10.0.0.0/8 -j DROP", 0, 0 },
+	{ "-p IPv4 --ip-src 10.0.0.0/8 -j ACCEPT", "-p IPv4 --ip-src 11.0.0.0/8 -j DROP", 0, 1 },
+	{ "-p IPv4 --ip-dst 10.0.0.0/8 -j ACCEPT", "-p IPv4 --ip-src 10.1.0.0/16 -j DROP", 0, 0 },
+	{ "-p IPv4 --ip-src 10.0.0.0/8 -j ACCEPT", "-p ARP -j DROP", 0, 1 },
+	{ "-p IPv6 --ip6-src 2001:db8::/32 -j ACCEPT", "-p IPv6 --ip6-src 2001:db8:1::/48 -j DROP", 1, 0 },
+	{ "-p IPv6 --ip6-src 2001:db8::/32 -j ACCEPT", "-p IPv6 --ip6-src 2001:db9::/32 -j DROP", 0, 1 },
+	/* Port ranges */
+	{ "-p IPv4 --ip-proto tcp --ip-dport 1:1024 -j ACCEPT", "-p IPv4 --ip-proto tcp --ip-dport 80 -j DROP", 1, 0 },
+	{ "-p IPv4 --ip-proto tcp --ip-dport 80 -j ACCEPT", "-p IPv4 --ip-proto tcp --ip-dport 1:1024 -j DROP", 0, 0 },
+	{ "-p IPv4 --ip-proto tcp --ip-dport 1:1024 -j ACCEPT", "-p IPv4 --ip-proto tcp --ip-dport 8080:8090 -j DROP", 0, 1 },
+	{ "-p IPv4 --ip-proto tcp --ip-dport 80 -j ACCEPT", "-p IPv4 --ip-proto udp --ip-dport 80 -j DROP", 0, 1 },
+	{ "-p IPv6 --ip6-proto tcp --ip6-dport 1:1024 -j ACCEPT", "-p IPv6 --ip6-proto tcp --ip6-dport 22 -j DROP", 1, 0 },
+	/* VLAN */
+	{ "-p 802_1Q --vlan-id 10 -j ACCEPT", "-p 802_1Q --vlan-id 10 --vlan-prio 3 -j DROP", 1, 0 },
+	{ "-p 802_1Q --vlan-id 10 --vlan-prio 3 -j ACCEPT", "-p 802_1Q --vlan-id 10 -j DROP", 0, 0 },
+	{ "-p 802_1Q --vlan-id 10 -j ACCEPT", "-p 802_1Q --vlan-id 20 -j DROP", 0, 1 },
+	/* Packet types */
+	{ "--pkttype-type host -j ACCEPT", "--pkttype-type broadcast -j DROP", 0, 1 },
+	{ "--pkttype-type ! host -j ACCEPT", "--pkttype-type broadcast -j DROP", 1, 0 },
+	{ "--pkttype-type host -j ACCEPT", "--pkttype-type host -j DROP", 1, 0 },
+};
+
+static int run_case(struct ebt_handle *h, int i)
+{
+	struct ebt_u_entry *a, *b;
+	int covers, disjoint;
+
+	check_run(h, "-F", NULL, "");
+	check_run(h, "-A", "FORWARD", tests[i].a);
+	check_run(h, "-A", "FORWARD", tests[i].b);
+	a = h->replace.chains[NF_BR_FORWARD]->entries->next;
+	b = a->next;
+	covers = ebt_rule_covers(a, b);
+	disjoint = ebt_rules_disjoint(a, b);
+	if (covers == tests[i].covers && disjoint == tests[i].disjoint)
+		return 0;
+	printf("FAIL: %s / %s: covers %d, disjoint %d\n", tests[i].a,
+	       tests[i].b, covers, disjoint);
+	return 1;
+}
+
+int main()
+{
+	return check_cases("test_analysis", "filter",
+			   sizeof(tests) / sizeof(tests[0]), run_case);
+}
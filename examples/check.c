@@ -0,0 +1,52 @@
+/*
+ * check.c, shared by the regression tests of "make check"
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "check.h"
+
+#define MAX_ARGS 32
+
+static const char *check_name;
+
+void check_run(struct ebt_handle *h, const char *command, const char *chain,
+	       const char *spec)
+{
+	char buf[256], *argv[MAX_ARGS], *p;
+	int argc = 0;
+
+	argv[argc++] = "ebtables";
+	argv[argc++] = (char *)command;
+	if (chain)
+		argv[argc++] = (char *)chain;
+	strncpy(buf, spec, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+	for (p = strtok(buf, " "); p && argc < MAX_ARGS - 1;
+	     p = strtok(NULL, " "))
+		argv[argc++] = p;
+	argv[argc] = NULL;
+	if (ebt_handle_command(h, argc, argv)) {
+		fprintf(stderr, "%s: %s %s %s: %s\n", check_name, command,
+			chain ? chain : "", spec, ebt_handle_error(h));
+		exit(1);
+	}
+}
+
+int check_cases(const char *test, const char *table, int n,
+		int (*run_case)(struct ebt_handle *h, int i))
+{
+	struct ebt_handle *h;
+	int i, failed = 0;
+
+	check_name = test;
+	ebt_set_backend("memory");
+	if (!(h = ebt_handle_new(table)))
+		ebt_print_memory();
+	for (i = 0; i < n; i++)
+		if (run_case(h, i))
+			failed++;
+	ebt_handle_free(h);
+	printf("%s: %d of %d failed\n", test, failed, n);
+	return failed != 0;
+}
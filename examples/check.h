@@ -0,0 +1,21 @@
+/*
+ * check.h, shared by the regression tests of "make check"
+ *
+ * The tests run against the in-memory kernel emulation. A test is a table
+ * of cases, check_cases() runs one after the other on a new handle and
+ * prints the number of failed cases.
+ */
+#ifndef EBT_CHECK_H
+#define EBT_CHECK_H
+#include "../include/ebtables_u.h"
+
+/* Runs "ebtables command chain spec" on the table of the handle, spec is
+ * split at the spaces. Exits when the command fails. */
+void check_run(struct ebt_handle *h, const char *command, const char *chain,
+	       const char *spec);
+
+/* Calls run_case(h, i) for the n cases on the table, it returns 0 if case
+ * i passed. Returns the exit code of the test. */
+int check_cases(const char *test, const char *table, int n,
+		int (*run_case)(struct ebt_handle *h, int i));
+#endif
@@ -0,0 +1,113 @@
+/*
+ * test_inat.c, regression tests for the target data built by isnat
+ *
+ * Every case adds an isnat rule to an empty POSTROUTING chain of the
+ * in-memory kernel emulation, checks the revision of the target data and
+ * looks up addresses in it the way the kernel does. When an address is
+ * given more than once, the one given last has to win. Run through
+ * "make check".
+ */
+#include <stdio.h>
+#include <arpa/inet.h>
+#include "../check.h"
+#include <linux/netfilter_bridge/ebt_inat.h>
+
+struct test
+{
+	const char *spec;
+	/* Looked up address and the last byte of the MAC address it gets,
+	 * -1 if the address isn't in the rule */
+	const char *ip;
+	int mac;
+	/* Of the target, 1 only for a rule with more than one subnet */
+	int revision;
+};
+
+static const struct test tests[] = {
+	{ "--isnat-sub 10.0.0.0/24 --isnat-list 5=0:0:0:0:0:1,5=0:0:0:0:0:2",
+	  "10.0.0.5", 2, 0 },
+	{ "--isnat-sub 10.0.0.0/24 --isnat-list 5=0:0:0:0:0:1,6=0:0:0:0:0:3 "
+	  "--isnat-list 5=0:0:0:0:0:2", "10.0.0.5", 2, 0 },
+	{ "--isnat-sub 10.0.0.0/24 --isnat-list 5=0:0:0:0:0:1,6=0:0:0:0:0:3 "
+	  "--isnat-list 5=0:0:0:0:0:2", "10.0.0.6", 3, 0 },
+	/* An index given before the subnet is added with --isnat-sub */
+	{ "--isnat-list 5=0:0:0:0:0:1,10.0.0.5=0:0:0:0:0:2 "
+	  "--isnat-sub 10.0.0.0/24", "10.0.0.5", 2, 0 },
+	{ "--isnat-list 10.0.0.5=0:0:0:0:0:2,5=0:0:0:0:0:1 "
+	  "--isnat-sub 10.0.0.0/24", "10.0.0.5", 1, 0 },
+	{ "--isnat-sub 10.0.0.0/24 --isnat-list 5=0:0:0:0:0:1 "
+	  "--isnat-sub 10.0.1.0/24 --isnat-list 5=0:0:0:0:0:2",
+	  "10.0.0.5", 1, 1 },
+	{ "--isnat-sub 10.0.0.0/24 --isnat-list 5=0:0:0:0:0:1",
+	  "10.0.0.6", -1, 0 },
+	{ "--isnat-sub 10.0.0.0/24 --isnat-list 5=0:0:0:0:0:1",
+	  "10.0.1.5", -1, 0 },
+	{ "--isnat-list 10.0.0.5=0:0:0:0:0:1,10.0.1.5=0:0:0:0:0:2",
+	  "10.0.1.5", 2, 1 },
+};
+
+/* The last byte of the MAC address for ip, -1 if ip isn't in the rule */
+static int lookup_v0(const struct ebt_inat_info *info, const char *ip)
+{
+	uint32_t addr = ntohl(inet_addr(ip));
+	int b = addr & 0xff;
+
+	if (ntohl(info->ip_subnet) != (addr & 0xffffff00) ||
+	    !info->a[b].enabled)
+		return -1;
+	return info->a[b].mac[ETH_ALEN - 1];
+}
+
+static int lookup(const struct ebt_inat_info_v1 *info, const char *ip)
+{
+	const struct ebt_inat_subnet *sub;
+	uint32_t addr = ntohl(inet_addr(ip)), map;
+	int i, j, b = addr & 0xff, slot;
+
+	for (i = 0; i < info->nsubnets; i++) {
+		sub = &info->subnets[i];
+		if (ntohl(sub->ip_subnet) != (addr & 0xffffff00))
+			continue;
+		if (!(sub->map[b / 32] & 1U << (b % 32)))
+			return -1;
+		slot = sub->first_slot;
+		for (j = 0; j < b / 32; j++)
+			slot += __builtin_popcount(sub->map[j]);
+		map = sub->map[b / 32] & ((1U << (b % 32)) - 1);
+		slot += __builtin_popcount(map);
+		return ebt_inat_slots(info)[slot].mac[ETH_ALEN - 1];
+	}
+	return -1;
+}
+
+static int run_case(struct ebt_handle *h, int i)
+{
+	struct ebt_u_entry *e;
+	char spec[256];
+	int mac;
+
+	check_run(h, "-F", NULL, "");
+	snprintf(spec, sizeof(spec), "-p IPv4 -j isnat %s", tests[i].spec);
+	check_run(h, "-A", "POSTROUTING", spec);
+	e = h->replace.chains[NF_BR_POST_ROUTING]->entries->next;
+	if (e->t->u.revision != tests[i].revision) {
+		printf("FAIL: %s: revision %d instead of %d\n", tests[i].spec,
+		       e->t->u.revision, tests[i].revision);
+		return 1;
+	}
+	if (e->t->u.revision == 0)
+		mac = lookup_v0((struct ebt_inat_info *)e->t->data, tests[i].ip);
+	else
+		mac = lookup((struct ebt_inat_info_v1 *)e->t->data, tests[i].ip);
+	if (mac == tests[i].mac)
+		return 0;
+	printf("FAIL: %s: %s gets %d instead of %d\n", tests[i].spec,
+	       tests[i].ip, mac, tests[i].mac);
+	return 1;
+}
+
+int main()
+{
+	return check_cases("test_inat", "nat", sizeof(tests) / sizeof(tests[0]),
+			   run_case);
+}
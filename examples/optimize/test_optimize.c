@@ -0,0 +1,209 @@
+/*
+ * test_optimize.c, regression tests for ebtables-optimize --apply
+ *
+ * Every case builds the FORWARD chain in an atomic file, classifies frames
+ * from several interfaces with ebtables-sim, lets ebtables-optimize change
+ * the file and classifies the frames again. Every frame has to get the
+ * same verdict and the listing of the changed table, with its counters,
+ * has to show the transform was made. Run through "make check", from the
+ * top directory.
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../check.h"
+
+#define MAX_RULES 12
+#define FRAME_LEN 60
+
+struct test
+{
+	const char *name;
+	const char *optimize;
+	/* Appended to FORWARD with their counters */
+	const char *rules[MAX_RULES];
+	/* Part of the listing (-L --Lc) after ebtables-optimize */
+	const char *expect;
+};
+
+static const struct test tests[] = {
+	{ "reorder", "-r",
+	  { "-p IPv4 -s 0:0:0:0:0:1 -j DROP -c 1 100",
+	    "-p IPv6 -j ACCEPT -c 5 500",
+	    "-p ARP -j DROP -c 100 6400",
+	    "-p IPv4 -j ACCEPT -c 2 200" },
+	  "policy: ACCEPT\n"
+	  "-p ARP -j DROP , pcnt = 100 -- bcnt = 6400\n"
+	  "-p IPv6 -j ACCEPT , pcnt = 5 -- bcnt = 500\n"
+	  "-p IPv4 -s 0:0:0:0:0:1 -j DROP , pcnt = 1 -- bcnt = 100\n"
+	  "-p IPv4 -j ACCEPT , pcnt = 2 -- bcnt = 200\n" },
+	{ "dispatch", "-d in",
+	  { "-i eth0 -p IPv4 -j DROP -c 1 64",
+	    "-i eth1 -p ARP -j DROP -c 2 128",
+	    "-i eth0 -p ARP -j ACCEPT -c 3 192",
+	    "-i eth1 -p IPv4 -j ACCEPT -c 4 256",
+	    "-i eth2 -p IPv6 -j DROP -c 5 320",
+	    "-i eth0 -j DROP -c 6 384",
+	    "-i eth2 -p ARP -j DROP -c 7 448",
+	    "-i eth1 -j DROP -c 8 512",
+	    "-i eth2 -p IPv4 -j ACCEPT -c 9 576" },
+	  "Bridge chain: FORWARD-eth0, entries: 3, policy: RETURN\n"
+	  "-p IPv4 -i eth0 -j DROP , pcnt = 1 -- bcnt = 64\n"
+	  "-p ARP -i eth0 -j ACCEPT , pcnt = 3 -- bcnt = 192\n"
+	  "-i eth0 -j DROP , pcnt = 6 -- bcnt = 384\n" },
+	{ "fold", "",
+	  { "-p IPv6 -s 0:0:0:0:0:1 -j DROP -c 1 100",
+	    "-p IPv6 -s 0:0:0:0:0:2 -j DROP -c 2 200",
+	    "-p IPv6 -s 0:0:0:0:0:3 -j DROP -c 3 300",
+	    "-p IPv6 -s 0:0:0:0:0:4 -j DROP -c 4 400",
+	    "-p IPv6 -s 0:0:0:0:0:5 -j DROP -c 5 500",
+	    "-p IPv6 -j ACCEPT -c 6 600",
+	    "-j DROP" },
+	  "-p IPv6 --among-src 0:0:0:0:0:1,0:0:0:0:0:2,0:0:0:0:0:3,"
+	  "0:0:0:0:0:4,0:0:0:0:0:5, -j DROP , pcnt = 15 -- bcnt = 1500\n" },
+};
+
+static const char *ifaces[] = { "eth0", "eth1", "eth2", "eth3" };
+#define NIFACES (sizeof(ifaces) / sizeof(ifaces[0]))
+
+/* Source MAC address (last byte) and protocol of the frames */
+static const struct {
+	unsigned char src;
+	unsigned short proto;
+} frames[] = {
+	{ 1, 0x0800 }, { 7, 0x0800 }, { 2, 0x0806 },
+	{ 3, 0x86dd }, { 6, 0x86dd }, { 1, 0x88cc },
+};
+#define NFRAMES (sizeof(frames) / sizeof(frames[0]))
+
+static char dir[] = "/tmp/test_optimize.XXXXXX";
+
+static void run(const char *fmt, ...)
+{
+	char cmd[512];
+	va_list l;
+
+	va_start(l, fmt);
+	vsnprintf(cmd, sizeof(cmd), fmt, l);
+	va_end(l);
+	if (system(cmd)) {
+		fprintf(stderr, "test_optimize: %s failed\n", cmd);
+		exit(1);
+	}
+}
+
+/* One frame per pcap file */
+static void write_frames()
+{
+	static const unsigned int header[6] = { 0xa1b2c3d4, 2 | 4 << 16,
+						0, 0, 65535, 1 };
+	unsigned int rec[4] = { 0, 0, FRAME_LEN, FRAME_LEN };
+	unsigned char data[FRAME_LEN];
+	char path[64];
+	FILE *f;
+	int i;
+
+	for (i = 0; i < NFRAMES; i++) {
+		memset(data, 0, sizeof(data));
+		data[0] = 0x02;
+		data[5] = 0xff;
+		data[6 + 5] = frames[i].src;
+		data[12] = frames[i].proto >> 8;
+		data[13] = frames[i].proto & 0xff;
+		snprintf(path, sizeof(path), "%s/%d.pcap", dir, i);
+		if (!(f = fopen(path, "wb")) ||
+		    fwrite(header, sizeof(header), 1, f) != 1 ||
+		    fwrite(rec, sizeof(rec), 1, f) != 1 ||
+		    fwrite(data, sizeof(data), 1, f) != 1 || fclose(f)) {
+			fprintf(stderr, "test_optimize: can't write %s\n", path);
+			exit(1);
+		}
+	}
+}
+
+/* Verdict of ebtables-sim for frame i from iface, 1 for ACCEPT */
+static int verdict(const char *file, const char *iface, int i)
+{
+	char cmd[256], line[256], name[16];
+	unsigned long long n;
+	int accept = -1;
+	FILE *p;
+
+	snprintf(cmd, sizeof(cmd), "./ebtables-sim -f %s -i %s %s/%d.pcap",
+		 file, iface, dir, i);
+	if (!(p = popen(cmd, "r")))
+		return -1;
+	while (fgets(line, sizeof(line), p))
+		if (sscanf(line, " %15s %llu", name, &n) == 2 && n == 1 &&
+		    (!strcmp(name, "ACCEPT") || !strcmp(name, "DROP")))
+			accept = !strcmp(name, "ACCEPT");
+	pclose(p);
+	return accept;
+}
+
+static void listing(const char *file, char *buf, size_t size)
+{
+	char cmd[256];
+	size_t len;
+	FILE *p;
+
+	snprintf(cmd, sizeof(cmd), "./ebtables --atomic-file %s -L --Lc", file);
+	buf[0] = '\0';
+	if (!(p = popen(cmd, "r")))
+		return;
+	len = fread(buf, 1, size - 1, p);
+	buf[len] = '\0';
+	pclose(p);
+}
+
+static int run_case(struct ebt_handle *h, int t)
+{
+	const struct test *test = &tests[t];
+	int before[NIFACES][NFRAMES], v, i, j, ret = 0;
+	char file[64], buf[8192];
+
+	snprintf(file, sizeof(file), "%s/%s", dir, test->name);
+	run("./ebtables --atomic-file %s --atomic-init", file);
+	for (i = 0; i < MAX_RULES && test->rules[i]; i++)
+		run("./ebtables --atomic-file %s -A FORWARD %s", file,
+		    test->rules[i]);
+	for (i = 0; i < NIFACES; i++)
+		for (j = 0; j < NFRAMES; j++)
+			before[i][j] = verdict(file, ifaces[i], j);
+	run("./ebtables-optimize -f %s %s -a >/dev/null", file, test->optimize);
+	listing(file, buf, sizeof(buf));
+	if (!strstr(buf, test->expect)) {
+		printf("FAIL: %s: the table isn't changed as expected:\n%s",
+		       test->name, buf);
+		ret = 1;
+	}
+	for (i = 0; i < NIFACES; i++)
+		for (j = 0; j < NFRAMES; j++) {
+			v = verdict(file, ifaces[i], j);
+			if (v != -1 && v == before[i][j])
+				continue;
+			printf("FAIL: %s: frame %d from %s gets verdict %d "
+			       "instead of %d\n", test->name, j, ifaces[i], v,
+			       before[i][j]);
+			ret = 1;
+		}
+	return ret;
+}
+
+int main()
+{
+	int ret;
+
+	setenv("EBTABLES_BACKEND", "memory", 1);
+	if (!mkdtemp(dir)) {
+		perror("test_optimize");
+		return 1;
+	}
+	write_frames();
+	ret = check_cases("test_optimize", "filter",
+			  sizeof(tests) / sizeof(tests[0]), run_case);
+	run("rm -rf %s", dir);
+	return ret;
+}
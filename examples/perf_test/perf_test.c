@@ -0,0 +1,412 @@
+/*
+ * perf_test.c, libebtc benchmark
+ *
+ * Measures how the table operations of libebtc scale with the size of a
+ * chain, without a kernel: the tables live in the kernel emulation of the
+ * memory backend (emulation.c). For every table size, the FORWARD chain is
+ * filled with a mix of ip, among, vlan, log and set rules (the sets are
+ * created in the emulation) and then the following is timed:
+ *
+ *  add          appending all rules with -A
+ *  translate    converting the table to the kernel format and giving it
+ *               to the emulated kernel, which checks it (the commit)
+ *  fetch        retrieving the committed table
+ *  restore      replaying the table as listed by -L --Lx (what
+ *               ebtables-save writes) on an empty table and committing it
+ *  list         -L, written to /dev/null
+ *  insert       -I FORWARD 1, -k times
+ *  delete-num   -D FORWARD 1, -k times
+ *  delete-spec  -D with the specification of a rule in the middle of the
+ *               chain, -k / 10 times
+ *
+ * The results are written as CSV (count is the number of commands or, for
+ * translate/restore/list, the number of rules handled) and as JSON.
+ * Run through "make bench".
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include "../../include/ebtables_u.h"
+
+#define MAX_SIZES 16
+#define MAX_ARGS 32
+/* The set rules use this many sets */
+#define NUM_SETS 16
+
+struct result
+{
+	const char *op;
+	int rules;
+	int count;
+	double seconds;
+};
+
+static struct result *results;
+static int nresults, max_results;
+
+static void print_usage()
+{
+	fprintf(stderr,
+"Usage: perf_test [options]\n"
+"  -n sizes   comma separated table sizes (default 1000,10000,100000,1000000)\n"
+"  -k count   number of inserts and deletes per size (default 1000)\n"
+"  -c file    write the results as CSV to file ('-' for stdout)\n"
+"  -j file    write the results as JSON to file ('-' for stdout)\n");
+	exit(1);
+}
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void add_result(const char *op, int rules, int count, double seconds)
+{
+	if (nresults == max_results) {
+		max_results = max_results ? 2 * max_results : 64;
+		results = realloc(results, max_results * sizeof(struct result));
+		if (!results)
+			ebt_print_memory();
+	}
+	results[nresults].op = op;
+	results[nresults].rules = rules;
+	results[nresults].count = count;
+	results[nresults].seconds = seconds;
+	nresults++;
+	fprintf(stderr, "%-12s %8d rules %8d in %9.4fs\n", op, rules, count,
+		seconds);
+}
+
+/* The specification of rule i, the rule mix repeats every 8 rules */
+static void rule_spec(char *buf, size_t size, int i)
+{
+	int a = (i >> 16) & 0xff, b = (i >> 8) & 0xff, c = i & 0xff;
+
+	switch (i % 8) {
+	case 0:
+	case 1:
+		snprintf(buf, size, "-p IPv4 --ip-src 10.%d.%d.%d --ip-proto tcp "
+			 "--ip-dport %d -j ACCEPT", a, b, c, 1 + i % 65535);
+		break;
+	case 2:
+		snprintf(buf, size, "-p IPv4 -i eth%d --ip-dst 172.%d.%d.%d/32 -j DROP",
+			 i % 16, 16 + a % 16, b, c);
+		break;
+	case 3:
+		snprintf(buf, size, "-p IPv4 --ip-src 192.%d.%d.%d --log-level info "
+			 "--log-prefix bench --log-ip -j CONTINUE", a, b, c);
+		break;
+	case 4:
+	case 5:
+		snprintf(buf, size, "--among-src 2:0:%x:%x:%x:1,2:0:%x:%x:%x:2,"
+			 "2:0:%x:%x:%x:3=10.%d.%d.%d -j ACCEPT",
+			 a, b, c, a, b, c, a, b, c, a, b, c);
+		break;
+	case 6:
+		snprintf(buf, size, "-p 802_1Q -s 4:0:%x:%x:%x:0 --vlan-id %d "
+			 "--vlan-encap IPv4 -j ACCEPT", a, b, c, 1 + i % 4094);
+		break;
+	case 7:
+		snprintf(buf, size, "-p IPv4 -i eth%d --match-set-src bench%d "
+			 "-j DROP", i % 16, i % NUM_SETS);
+		break;
+	}
+}
+
+/* Splits a line of -L --Lx output in place, double quotes group words */
+static int split_line(char *line, char **argv)
+{
+	int argc = 0;
+	char *p = line;
+
+	while (argc < MAX_ARGS - 1) {
+		while (*p == ' ' || *p == '\n')
+			p++;
+		if (!*p)
+			break;
+		if (*p == '"') {
+			argv[argc++] = ++p;
+			while (*p && *p != '"')
+				p++;
+		} else {
+			argv[argc++] = p;
+			while (*p && *p != ' ' && *p != '\n')
+				p++;
+		}
+		if (*p)
+			*p++ = '\0';
+	}
+	argv[argc] = NULL;
+	return argc;
+}
+
+/* Executes "ebtables <command> [chain] [rule_nr] <spec>", exits on error */
+static void run(struct ebt_handle *h, const char *command, int rule_nr,
+		const char *spec)
+{
+	char buf[256], *argv[MAX_ARGS], nr[16], *p;
+	int argc = 0;
+
+	argv[argc++] = "ebtables";
+	argv[argc++] = (char *)command;
+	if (strcmp(command, "-L"))
+		argv[argc++] = "FORWARD";
+	if (rule_nr) {
+		snprintf(nr, sizeof(nr), "%d", rule_nr);
+		argv[argc++] = nr;
+	}
+	if (spec) {
+		strncpy(buf, spec, sizeof(buf) - 1);
+		buf[sizeof(buf) - 1] = '\0';
+		for (p = strtok(buf, " "); p && argc < MAX_ARGS - 1;
+		     p = strtok(NULL, " "))
+			argv[argc++] = p;
+	}
+	argv[argc] = NULL;
+	if (ebt_handle_command(h, argc, argv)) {
+		fprintf(stderr, "perf_test: %s %s: %s\n", command, spec ? spec : "",
+			ebt_handle_error(h));
+		exit(1);
+	}
+}
+
+static struct ebt_handle *open_table(int init)
+{
+	struct ebt_handle *h;
+
+	if (!(h = ebt_handle_new("filter")))
+		ebt_print_memory();
+	if (ebt_handle_open(h, init)) {
+		fprintf(stderr, "perf_test: %s\n", ebt_handle_error(h));
+		exit(1);
+	}
+	return h;
+}
+
+static void commit(struct ebt_handle *h)
+{
+	if (ebt_handle_commit(h)) {
+		fprintf(stderr, "perf_test: %s\n", ebt_handle_error(h));
+		exit(1);
+	}
+}
+
+/* Runs command with stdout going to f */
+static void run_to(FILE *f, struct ebt_handle *h, const char *command,
+		   const char *spec)
+{
+	int out;
+
+	fflush(stdout);
+	if ((out = dup(STDOUT_FILENO)) == -1) {
+		fprintf(stderr, "perf_test: can't redirect stdout\n");
+		exit(1);
+	}
+	dup2(fileno(f), STDOUT_FILENO);
+	run(h, command, 0, spec);
+	fflush(stdout);
+	dup2(out, STDOUT_FILENO);
+	close(out);
+}
+
+/* Replays the commands in f on an empty table and commits it, the way
+ * ebtables-restore does */
+static void restore(FILE *f)
+{
+	struct ebt_handle *h = open_table(1);
+	char *line = NULL, *argv[MAX_ARGS];
+	size_t len = 0;
+	int argc;
+
+	rewind(f);
+	while (getline(&line, &len, f) != -1) {
+		if ((argc = split_line(line, argv)) < 2)
+			continue;
+		if (ebt_handle_command(h, argc, argv)) {
+			fprintf(stderr, "perf_test: restore: %s\n",
+				ebt_handle_error(h));
+			exit(1);
+		}
+	}
+	free(line);
+	commit(h);
+	ebt_handle_free(h);
+}
+
+static void bench(int n, int k)
+{
+	struct ebt_handle *h, *h2;
+	char spec[256];
+	double t;
+	FILE *saved, *devnull;
+	int i;
+
+	h = open_table(0);
+	run(h, "-F", 0, NULL);
+	if (k > n)
+		k = n;
+
+	t = now();
+	for (i = 0; i < n; i++) {
+		rule_spec(spec, sizeof(spec), i);
+		run(h, "-A", 0, spec);
+	}
+	add_result("add", n, n, now() - t);
+
+	t = now();
+	commit(h);
+	add_result("translate", n, n, now() - t);
+
+	t = now();
+	h2 = open_table(0);
+	add_result("fetch", n, n, now() - t);
+	ebt_handle_free(h2);
+
+	if (!(saved = tmpfile())) {
+		fprintf(stderr, "perf_test: can't create a temporary file\n");
+		exit(1);
+	}
+	run_to(saved, h, "-L", "--Lx");
+	t = now();
+	restore(saved);
+	add_result("restore", n, n, now() - t);
+	fclose(saved);
+
+	if (!(devnull = fopen("/dev/null", "w"))) {
+		fprintf(stderr, "perf_test: can't open /dev/null\n");
+		exit(1);
+	}
+	t = now();
+	run_to(devnull, h, "-L", NULL);
+	add_result("list", n, n, now() - t);
+	fclose(devnull);
+
+	t = now();
+	for (i = 0; i < k; i++) {
+		rule_spec(spec, sizeof(spec), n + i);
+		run(h, "-I", 1, spec);
+	}
+	add_result("insert", n, k, now() - t);
+
+	t = now();
+	for (i = 0; i < k; i++)
+		run(h, "-D", 1, NULL);
+	add_result("delete-num", n, k, now() - t);
+
+	t = now();
+	for (i = 0; i < k / 10; i++) {
+		rule_spec(spec, sizeof(spec), n / 2 + i);
+		run(h, "-D", 0, spec);
+	}
+	add_result("delete-spec", n, k / 10, now() - t);
+
+	ebt_handle_free(h);
+}
+
+static FILE *open_output(const char *name)
+{
+	FILE *f;
+
+	if (!strcmp(name, "-"))
+		return stdout;
+	if (!(f = fopen(name, "w"))) {
+		fprintf(stderr, "perf_test: can't create %s\n", name);
+		exit(1);
+	}
+	return f;
+}
+
+static void close_output(FILE *f)
+{
+	if (f == stdout)
+		fflush(f);
+	else
+		fclose(f);
+}
+
+static double per_second(const struct result *r)
+{
+	return r->seconds > 0 ? r->count / r->seconds : 0;
+}
+
+static void write_csv(const char *name)
+{
+	FILE *f = open_output(name);
+	int i;
+
+	fprintf(f, "op,rules,count,seconds,per_second\n");
+	for (i = 0; i < nresults; i++)
+		fprintf(f, "%s,%d,%d,%.6f,%.1f\n", results[i].op,
+			results[i].rules, results[i].count, results[i].seconds,
+			per_second(&results[i]));
+	close_output(f);
+}
+
+static void write_json(const char *name)
+{
+	FILE *f = open_output(name);
+	int i;
+
+	fprintf(f, "{\"program\":\"%s\",\"version\":\"%s\",\"results\":[",
+		PROGNAME, PROGVERSION);
+	for (i = 0; i < nresults; i++)
+		fprintf(f, "%s\n{\"op\":\"%s\",\"rules\":%d,\"count\":%d,"
+			"\"seconds\":%.6f,\"per_second\":%.1f}", i ? "," : "",
+			results[i].op, results[i].rules, results[i].count,
+			results[i].seconds, per_second(&results[i]));
+	fprintf(f, "\n]}\n");
+	close_output(f);
+}
+
+int main(int argc, char *argv[])
+{
+	int sizes[MAX_SIZES] = {1000, 10000, 100000, 1000000};
+	int nsizes = 4, k = 1000, c, i;
+	const char *csv = NULL, *json = NULL;
+	char *p, name[16];
+
+	while ((c = getopt(argc, argv, "n:k:c:j:")) != -1) {
+		switch (c) {
+		case 'n':
+			for (nsizes = 0, p = strtok(optarg, ",");
+			     p && nsizes < MAX_SIZES; p = strtok(NULL, ","))
+				if ((sizes[nsizes++] = atoi(p)) <= 0)
+					print_usage();
+			break;
+		case 'k':
+			if ((k = atoi(optarg)) < 0)
+				print_usage();
+			break;
+		case 'c':
+			csv = optarg;
+			break;
+		case 'j':
+			json = optarg;
+			break;
+		default:
+			print_usage();
+		}
+	}
+	if (!csv && !json)
+		csv = "-";
+	ebt_set_backend("memory");
+	for (i = 0; i < NUM_SETS; i++) {
+		snprintf(name, sizeof(name), "bench%d", i);
+		ebt_emu_add_set(name, NFPROTO_IPV4);
+	}
+
+	for (i = 0; i < nsizes; i++)
+		bench(sizes[i], k);
+
+	if (csv)
+		write_csv(csv);
+	if (json)
+		write_json(json);
+	return 0;
+}
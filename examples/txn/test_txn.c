@@ -0,0 +1,152 @@
+/*
+ * test_txn.c, regression tests for building tables with ebt_txn_*()
+ *
+ * Every step runs one transaction on the filter table of the in-memory
+ * kernel emulation and then retrieves the table with a new handle, to
+ * check what was given to the kernel. Nothing may reach the kernel before
+ * ebt_txn_commit(), and nothing at all when the transaction was aborted or
+ * one of its operations failed. Run through "make check".
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../include/ebtables_u.h"
+
+static int checks, failed;
+
+static struct ebt_u_entry *rule(int proto, int verdict)
+{
+	struct ebt_u_entry *e = ebt_rule_new();
+
+	ebt_rule_set_proto(e, proto, 0);
+	ebt_rule_set_verdict(e, verdict);
+	return e;
+}
+
+static const char *verdict_name(struct ebt_u_replace *replace, int verdict)
+{
+	if (verdict < 0)
+		return ebt_standard_targets[-verdict - 1];
+	return replace->chains[verdict + NF_BR_NUMHOOKS]->name;
+}
+
+/* The policy of the chain followed by protocol:target of its rules */
+static void describe(struct ebt_u_replace *replace, const char *chain,
+		     char *buf, size_t size)
+{
+	struct ebt_u_entries *entries;
+	struct ebt_u_entry *e;
+	int nr, len;
+
+	if ((nr = ebt_get_chainnr(replace, chain)) == -1) {
+		snprintf(buf, size, "missing");
+		return;
+	}
+	entries = replace->chains[nr];
+	len = snprintf(buf, size, "%s", verdict_name(replace, entries->policy));
+	for (e = entries->entries->next; e != entries->entries; e = e->next)
+		len += snprintf(buf + len, size - len, " %04x:%s",
+				ntohs(e->ethproto), verdict_name(replace,
+				((struct ebt_standard_target *)e->t)->verdict));
+}
+
+/* Compare the chain in the kernel with expect */
+static void check(const char *step, const char *chain, const char *expect)
+{
+	struct ebt_handle *h;
+	char buf[256];
+
+	if (!(h = ebt_handle_new("filter")))
+		ebt_print_memory();
+	if (ebt_handle_open(h, 0))
+		snprintf(buf, sizeof(buf), "%s", ebt_handle_error(h));
+	else
+		describe(&h->replace, chain, buf, sizeof(buf));
+	if (strcmp(buf, expect)) {
+		printf("FAIL: %s: %s is \"%s\" instead of \"%s\"\n", step,
+		       chain, buf, expect);
+		failed++;
+	}
+	checks++;
+	ebt_handle_free(h);
+}
+
+/* Compare the result of an operation with expect */
+static void check_ret(const char *step, struct ebt_handle *h, int ret,
+		      int expect)
+{
+	if (ret != expect) {
+		printf("FAIL: %s returns %d instead of %d: %s\n", step, ret,
+		       expect, ebt_handle_error(h));
+		failed++;
+	}
+	checks++;
+}
+
+int main()
+{
+	struct ebt_handle *h;
+	struct ebt_txn *txn;
+	struct ebt_u_entry *e;
+	int ret;
+
+	ebt_set_backend("memory");
+	if (!(h = ebt_handle_new("filter")))
+		ebt_print_memory();
+
+	/* Build a chain and the rules that use it */
+	if (!(txn = ebt_txn_begin(h)))
+		ebt_print_error2("test_txn: %s", ebt_handle_error(h));
+	ret = ebt_txn_new_chain(txn, "web", EBT_RETURN);
+	ret |= ebt_txn_add(txn, "web", 0, rule(0x0800, EBT_DROP));
+	e = rule(0x0806, EBT_ACCEPT);
+	ret |= ebt_txn_jump(txn, e, "web");
+	ret |= ebt_txn_add(txn, "INPUT", 0, e);
+	ret |= ebt_txn_add(txn, "INPUT", 0, rule(0x86dd, EBT_ACCEPT));
+	ret |= ebt_txn_add(txn, "INPUT", 0, rule(0x0800, EBT_DROP));
+	ret |= ebt_txn_delete(txn, "INPUT", -1);
+	ret |= ebt_txn_move(txn, "INPUT", 2, 1);
+	ret |= ebt_txn_policy(txn, "INPUT", EBT_DROP);
+	check_ret("build", h, ret, 0);
+	check("build, before the commit", "INPUT", "ACCEPT");
+	check("build, before the commit", "web", "missing");
+	check_ret("build, commit", h, ebt_txn_commit(txn), 0);
+	check("build", "INPUT", "DROP 86dd:ACCEPT 0806:web");
+	check("build", "web", "RETURN 0800:DROP");
+
+	/* An aborted transaction */
+	if (!(txn = ebt_txn_begin(h)))
+		ebt_print_error2("test_txn: %s", ebt_handle_error(h));
+	check_ret("abort, flush", h, ebt_txn_flush(txn, NULL), 0);
+	ebt_txn_abort(txn);
+	check("abort", "INPUT", "DROP 86dd:ACCEPT 0806:web");
+
+	/* A failed operation fails the rest of the transaction */
+	if (!(txn = ebt_txn_begin(h)))
+		ebt_print_error2("test_txn: %s", ebt_handle_error(h));
+	check_ret("failed, add", h,
+		  ebt_txn_add(txn, "INPUT", 1, rule(0x0800, EBT_ACCEPT)), 0);
+	check_ret("failed, delete referenced chain", h,
+		  ebt_txn_delete_chain(txn, "web"), -1);
+	e = rule(0x0800, EBT_ACCEPT);
+	check_ret("failed, add after the failure", h,
+		  ebt_txn_add(txn, "INPUT", 1, e), -1);
+	ebt_rule_free(e);
+	check_ret("failed, commit", h, ebt_txn_commit(txn), -1);
+	check("failed", "INPUT", "DROP 86dd:ACCEPT 0806:web");
+	check("failed", "web", "RETURN 0800:DROP");
+
+	/* Removing the chain together with its last reference */
+	if (!(txn = ebt_txn_begin(h)))
+		ebt_print_error2("test_txn: %s", ebt_handle_error(h));
+	ret = ebt_txn_delete(txn, "INPUT", 2);
+	ret |= ebt_txn_delete_chain(txn, "web");
+	check_ret("delete", h, ret, 0);
+	check_ret("delete, commit", h, ebt_txn_commit(txn), 0);
+	check("delete", "INPUT", "DROP 86dd:ACCEPT");
+	check("delete", "web", "missing");
+
+	ebt_handle_free(h);
+	printf("test_txn: %d of %d failed\n", failed, checks);
+	return failed != 0;
+}
@@ -25,12 +25,22 @@
 #define AMONG_SRC '2'
 #define AMONG_DST_F '3'
 #define AMONG_SRC_F '4'
+#define AMONG_ADD_DST '5'
+#define AMONG_ADD_SRC '6'
+#define AMONG_DEL_DST '7'
+#define AMONG_DEL_SRC '8'
+#define AMONG_DELTA_F '9'
 
 static const struct option opts[] = {
 	{"among-dst", required_argument, 0, AMONG_DST},
 	{"among-src", required_argument, 0, AMONG_SRC},
 	{"among-dst-file", required_argument, 0, AMONG_DST_F},
 	{"among-src-file", required_argument, 0, AMONG_SRC_F},
+	{"add-dst", required_argument, 0, AMONG_ADD_DST},
+	{"add-src", required_argument, 0, AMONG_ADD_SRC},
+	{"del-dst", required_argument, 0, AMONG_DEL_DST},
+	{"del-src", required_argument, 0, AMONG_DEL_SRC},
+	{"among-delta-file", required_argument, 0, AMONG_DELTA_F},
 	{0}
 };
 
@@ -66,17 +76,38 @@ static void print_help()
 "If you want to allow two (or more) IP addresses to one MAC address, you\n"
 "can specify two (or more) pairs with the same MAC, e.g.\n"
 " 00:00:00:fa:eb:fe=153.19.120.250,00:00:00:fa:eb:fe=192.168.0.1\n"
+"With --among-update chain rulenum:\n"
+"--add-dst list                 : add the entries to the dst list\n"
+"--add-src list                 : add the entries to the src list\n"
+"--del-dst list                 : remove the entries from the dst list\n"
+"--del-src list                 : remove the entries from the src list\n"
+"--among-delta-file file        : obtain the changes from file, one\n"
+"                                 'add-dst list' etc. per line\n"
 	);
 }
-static int old_size;
+static __thread int old_size;
+
+/* The entries given with --add-dst, --add-src, --del-dst and --del-src,
+ * in that order, see update() */
+#define DELTA_ADD 0
+#define DELTA_DEL 2
+static const char *delta_names[4] = {"add-dst", "add-src", "del-dst", "del-src"};
+static __thread struct ebt_mac_wormhash_tuple *delta[4];
+static __thread int delta_len[4];
 
 static void init(struct ebt_entry_match *match)
 {
 	struct ebt_among_info *amonginfo =
 	    (struct ebt_among_info *) match->data;
+	int i;
 
 	memset(amonginfo, 0, sizeof(struct ebt_among_info));
 	old_size = sizeof(struct ebt_among_info);
+	for (i = 0; i < 4; i++) {
+		free(delta[i]);
+		delta[i] = NULL;
+		delta_len[i] = 0;
+	}
 }
 
 static struct ebt_mac_wormhash *new_wormhash(int n)
@@ -94,162 +125,174 @@ static struct ebt_mac_wormhash *new_wormhash(int n)
 	return result;
 }
 
-static void copy_wormhash(struct ebt_mac_wormhash *d,
-			  const struct ebt_mac_wormhash *s)
+/* Parses one or two hex digits per byte, a ':' between the bytes.
+ * Returns the position after the address or NULL. */
+static const char *parse_list_mac(const char *p, const char *end,
+				  unsigned char *mac)
 {
-	int dpoolsize = d->poolsize;
-	int dsize, ssize, amount;
-
-	dsize = ebt_mac_wormhash_size(d);
-	ssize = ebt_mac_wormhash_size(s);
-	amount = dsize < ssize ? dsize : ssize;
-	memcpy(d, s, amount);
-	d->poolsize = dpoolsize;
-}
+	const unsigned char *u = (const unsigned char *)p;
+	unsigned int d, d2;
+	int i;
 
-/* Returns:
- * -1 when '\0' reached
- * -2 when `n' bytes read and no delimiter found
- *  0 when no less than `n' bytes read and delimiter found
- * if `destbuf' is not NULL, it is filled by read bytes and ended with '\0'
- * *pp is set on the first byte not copied to `destbuf'
- */
-static int read_until(const char **pp, const char *delimiters,
-		      char *destbuf, int n)
-{
-	int count = 0;
-	int ret = 0;
-	char c;
+	/* The usual xx:xx:xx:xx:xx:xx notation, decoded 2 bytes at a time */
+	if (end - p >= 17 && u[2] == ':' && u[5] == ':' && u[8] == ':' &&
+	    u[11] == ':' && u[14] == ':') {
+		for (i = 0; i < ETH_ALEN; i++, u += 3) {
+			d = ebt_hexvalues[u[0]];
+			d2 = ebt_hexvalues[u[1]];
+			if (!d || !d2)
+				break;
+			mac[i] = (d - 1) << 4 | (d2 - 1);
+		}
+		if (i == ETH_ALEN)
+			return p + 17;
+		u = (const unsigned char *)p;
+	}
 
-	while (1) {
-		c = **pp;
-		if (!c) {
-			ret = -1;
-			break;
+	for (i = 0; i < ETH_ALEN; i++) {
+		if (u == (const unsigned char *)end || !(d = ebt_hexvalues[*u++]))
+			return NULL;
+		d--;
+		if (u != (const unsigned char *)end && (d2 = ebt_hexvalues[*u])) {
+			d = d << 4 | (d2 - 1);
+			u++;
 		}
-		if (strchr(delimiters, c)) {
-			ret = 0;
-			break;
+		mac[i] = d;
+		if (i < ETH_ALEN - 1) {
+			if (u == (const unsigned char *)end || *u != ':')
+				return NULL;
+			u++;
 		}
-		if (count == n) {
-			ret = -2;
-			break;
+	}
+	return (const char *)u;
+}
+
+/* Parses a dotted decimal IPv4 address, at most 3 digits per byte.
+ * Returns the position after the address or NULL. */
+static const char *parse_list_ip(const char *p, const char *end,
+				 unsigned char *ip)
+{
+	unsigned int n;
+	int i, digits;
+
+	for (i = 0; i < 4; i++) {
+		n = 0;
+		for (digits = 0; p != end && *p >= '0' && *p <= '9' &&
+		     digits < 3; digits++)
+			n = n * 10 + *p++ - '0';
+		if (!digits || n > 255)
+			return NULL;
+		ip[i] = n;
+		if (i < 3) {
+			if (p == end || *p != '.')
+				return NULL;
+			p++;
 		}
-		if (destbuf)
-			destbuf[count++] = c;
-		(*pp)++;
 	}
-	if (destbuf)
-		destbuf[count] = 0;
-	return ret;
+	return p;
 }
 
-static int fcmp(const void *va, const void *vb) {
+static int tuple_cmp(const void *va, const void *vb)
+{
 	const struct ebt_mac_wormhash_tuple *a = va;
 	const struct ebt_mac_wormhash_tuple *b = vb;
-	int ca = ((const unsigned char*)a->cmp)[7];
-	int cb = ((const unsigned char*)b->cmp)[7];
+	int ret;
 
-	return ca - cb;
+	if ((ret = memcmp(a->cmp, b->cmp, sizeof(a->cmp))))
+		return ret;
+	return memcmp(&a->ip, &b->ip, sizeof(a->ip));
 }
 
-static void index_table(struct ebt_mac_wormhash *wh)
+/* Puts the entries of every bucket in the order of tuple_cmp() and
+ * removes the entries that can't change the outcome of a lookup: copies
+ * and the entries with an IP address for a MAC address that is also
+ * present without one (0.0.0.0 sorts first). The canonical form of a
+ * list doesn't depend on the order of the list, so compare_wh() can use
+ * memcmp(). */
+static void canonicalize_wormhash(struct ebt_mac_wormhash *wh)
 {
-	int ipool, itable;
-	int c;
-
-	for (itable = 0; itable <= 256; itable++) {
-		wh->table[itable] = wh->poolsize;
-	}
-	ipool = 0;
-	itable = 0;
-	while (1) {
-		wh->table[itable] = ipool;
-		c = ((const unsigned char*)wh->pool[ipool].cmp)[7];
-		if (itable <= c) {
-			itable++;
-		} else {
-			ipool++;
+	struct ebt_mac_wormhash_tuple *prev;
+	int i, j, n = 0, start, end;
+
+	for (i = 0; i < 256; i++) {
+		start = wh->table[i];
+		end = wh->table[i + 1];
+		if (end - start > 1)
+			qsort(&wh->pool[start], end - start,
+			      sizeof(struct ebt_mac_wormhash_tuple), tuple_cmp);
+		wh->table[i] = n;
+		prev = NULL;
+		for (j = start; j < end; j++) {
+			if (prev && !memcmp(prev->cmp, wh->pool[j].cmp,
+			    sizeof(prev->cmp)) &&
+			    (!prev->ip || prev->ip == wh->pool[j].ip))
+				continue;
+			wh->pool[n] = wh->pool[j];
+			prev = &wh->pool[n++];
 		}
-		if (ipool > wh->poolsize)
-			break;
 	}
+	wh->table[256] = n;
+	wh->poolsize = n;
+}
+
+static int wormhash_is_canonical(const struct ebt_mac_wormhash *wh)
+{
+	const struct ebt_mac_wormhash_tuple *p = wh->pool;
+	int i, j;
+
+	for (i = 0; i < 256; i++)
+		for (j = wh->table[i] + 1; j < wh->table[i + 1]; j++) {
+			if (tuple_cmp(&p[j - 1], &p[j]) >= 0)
+				return 0;
+			if (!p[j - 1].ip && !memcmp(p[j - 1].cmp, p[j].cmp,
+			    sizeof(p[j].cmp)))
+				return 0;
+		}
+	return 1;
 }
 
-static struct ebt_mac_wormhash *create_wormhash(const char *arg)
+/* Builds the wormhash from the list in [arg, end), which needn't be
+ * terminated by '\0'. The pool is sized from the number of commas and
+ * put in the order of the table[] index with a counting sort. */
+static struct ebt_mac_wormhash *create_wormhash(const char *arg,
+						const char *end)
 {
-	const char *pc = arg;
-	const char *anchor;
-	char *endptr;
-	struct ebt_mac_wormhash *workcopy, *result, *h;
-	unsigned char mac[6];
+	const char *pc = arg, *anchor, *next;
+	struct ebt_mac_wormhash_tuple *list, *t;
+	struct ebt_mac_wormhash *result;
+	unsigned char mac[ETH_ALEN];
 	unsigned char ip[4];
-	int nmacs = 0;
-	int i;
-	char token[4];
+	int count[257];
+	int n = 1, nmacs = 0;
+	int i, key, len;
 
-	if (!(workcopy = new_wormhash(1024))) {
+	for (next = arg; (next = memchr(next, ',', end - next)); next++)
+		n++;
+	if (!(list = calloc(n, sizeof(struct ebt_mac_wormhash_tuple))))
 		ebt_print_memory();
-	}
+
+	memset(count, 0, sizeof(count));
 	while (1) {
 		/* remember current position, we'll need it on error */
 		anchor = pc;
-
-		/* collect MAC; all its bytes are followed by ':' (colon),
-		 * except for the last one which can be followed by 
-		 * ',' (comma), '=' or '\0' */
-		for (i = 0; i < 5; i++) {
-			if (read_until(&pc, ":", token, 2) < 0
-			    || token[0] == 0) {
-				ebt_print_error("MAC parse error: %.20s", anchor);
-				free(workcopy);
-				return NULL;
-			}
-			mac[i] = strtol(token, &endptr, 16);
-			if (*endptr) {
-				ebt_print_error("MAC parse error: %.20s", anchor);
-				free(workcopy);
-				return NULL;
-			}
-			pc++;
-		}
-		if (read_until(&pc, "=,", token, 2) == -2 || token[0] == 0) {
-			ebt_print_error("MAC parse error: %.20s", anchor);
-			return NULL;
+		if (!(pc = parse_list_mac(pc, end, mac)) ||
+		    (pc != end && *pc != ',' && *pc != '=')) {
+			len = end - anchor < 20 ? end - anchor : 20;
+			ebt_print_error("MAC parse error: %.*s", len, anchor);
+			goto error;
 		}
-		mac[i] = strtol(token, &endptr, 16);
-		if (*endptr) {
-			ebt_print_error("MAC parse error: %.20s", anchor);
-			return NULL;
-		}
-		if (*pc == '=') {
-			/* an IP follows the MAC; collect similarly to MAC */
-			pc++;
-			anchor = pc;
-			for (i = 0; i < 3; i++) {
-				if (read_until(&pc, ".", token, 3) < 0 || token[0] == 0) {
-					ebt_print_error("IP parse error: %.20s", anchor);
-					return NULL;
-				}
-				ip[i] = strtol(token, &endptr, 10);
-				if (*endptr) {
-					ebt_print_error("IP parse error: %.20s", anchor);
-					return NULL;
-				}
-				pc++;
-			}
-			if (read_until(&pc, ",", token, 3) == -2 || token[0] == 0) {
-				ebt_print_error("IP parse error: %.20s", anchor);
-				return NULL;
-			}
-			ip[3] = strtol(token, &endptr, 10);
-			if (*endptr) {
-				ebt_print_error("IP parse error: %.20s", anchor);
-				return NULL;
+		if (pc != end && *pc == '=') {
+			/* an IP follows the MAC */
+			anchor = ++pc;
+			if (!(pc = parse_list_ip(pc, end, ip)) ||
+			    (pc != end && *pc != ',')) {
+				len = end - anchor < 20 ? end - anchor : 20;
+				ebt_print_error("IP parse error: %.*s", len, anchor);
+				goto error;
 			}
 			if (ip[0] == 0 && ip[1] == 0 && ip[2] == 0 && ip[3] == 0) {
 				ebt_print_error("Illegal IP 0.0.0.0");
-				return NULL;
+				goto error;
 			}
 		} else {
 			/* no IP, we set it to 0.0.0.0 */
@@ -257,48 +300,188 @@ static struct ebt_mac_wormhash *create_wormhash(const char *arg)
 		}
 
 		/* we have collected MAC and IP, so we add an entry */
-		memcpy(((char *) workcopy->pool[nmacs].cmp) + 2, mac, 6);
-		memcpy(&(workcopy->pool[nmacs].ip), ip, 4);
-		nmacs++;
-
-		/* re-allocate memory if needed */
-		if (*pc && nmacs >= workcopy->poolsize) {
-			if (!(h = new_wormhash(nmacs * 2))) {
-				ebt_print_memory();
-			}
-			copy_wormhash(h, workcopy);
-			free(workcopy);
-			workcopy = h;
-		}
+		t = &list[nmacs++];
+		memcpy(((char *) t->cmp) + 2, mac, ETH_ALEN);
+		memcpy(&t->ip, ip, 4);
+		count[mac[ETH_ALEN - 1]]++;
 
-		/* check if end of string was reached */
-		if (!*pc) {
+		/* we allow an ending comma */
+		if (pc == end || ++pc == end)
 			break;
-		}
+	}
 
-		/* now `pc' points to comma if we are here; */
-		/* increment this to the next char */
-		/* but first assert :-> */
-		if (*pc != ',') {
-			ebt_print_error("Something went wrong; no comma...\n");
-			return NULL;
-		}
-		pc++;
+	if (!(result = new_wormhash(nmacs)))
+		ebt_print_memory();
+	/* The kernel looks up a MAC in the entries from table[c] up to
+	 * table[c + 1], with c the last byte of the MAC */
+	result->table[0] = 0;
+	for (i = 0; i < 256; i++)
+		result->table[i + 1] = result->table[i] + count[i];
+	memcpy(count, result->table, sizeof(count));
+	for (i = 0; i < nmacs; i++) {
+		key = ((const unsigned char *)list[i].cmp)[7];
+		result->pool[count[key]++] = list[i];
+	}
+	free(list);
+	canonicalize_wormhash(result);
+	return result;
+error:
+	free(list);
+	return NULL;
+}
 
-		/* again check if end of string was reached; */
-		/* we allow an ending comma */
-		if (!*pc) {
-			break;
-		}
+/* Maps the file read-only, the files will probably be big and are
+ * parsed in place. Returns NULL on error. */
+static const char *map_file(const char *name, long *len)
+{
+	struct stat stats;
+	const char *p;
+	int fd;
+
+	if ((fd = open(name, O_RDONLY)) == -1) {
+		ebt_print_error("Couldn't open file '%s'", name);
+		return NULL;
+	}
+	if (fstat(fd, &stats) || !(*len = stats.st_size)) {
+		close(fd);
+		ebt_print_error("File should end with a newline");
+		return NULL;
 	}
-	if (!(result = new_wormhash(nmacs))) {
+	p = mmap(0, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		ebt_print_error("Couldn't map file to memory");
+		return NULL;
+	}
+	if (p[*len - 1] != '\n') {
+		munmap((void *)p, *len);
+		ebt_print_error("File should end with a newline");
+		return NULL;
+	}
+	return p;
+}
+
+static int add_delta(int i, const char *arg, const char *end)
+{
+	struct ebt_mac_wormhash *wh;
+	struct ebt_mac_wormhash_tuple *d;
+
+	if (!(wh = create_wormhash(arg, end)))
+		return -1;
+	d = realloc(delta[i], (delta_len[i] + wh->poolsize) *
+		    sizeof(struct ebt_mac_wormhash_tuple));
+	if (!d)
 		ebt_print_memory();
+	memcpy(d + delta_len[i], wh->pool,
+	       wh->poolsize * sizeof(struct ebt_mac_wormhash_tuple));
+	delta[i] = d;
+	delta_len[i] += wh->poolsize;
+	free(wh);
+	return 0;
+}
+
+/* Every non-empty line of a delta file is an option name without the
+ * dashes, followed by a list. Lines starting with '#' are comments. */
+static int parse_delta_file(const char *p, const char *end)
+{
+	const char *eol, *e;
+	int i, len;
+
+	for (; p != end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+		while (p != eol && (*p == ' ' || *p == '\t'))
+			p++;
+		if (p == eol || *p == '#')
+			continue;
+		for (e = eol; e != p && (e[-1] == ' ' || e[-1] == '\t' ||
+		     e[-1] == '\r'); e--);
+		for (i = 0; i < 4; i++) {
+			len = strlen(delta_names[i]);
+			if (e - p > len && !memcmp(p, delta_names[i], len) &&
+			    (p[len] == ' ' || p[len] == '\t'))
+				break;
+		}
+		if (i == 4) {
+			len = e - p < 20 ? e - p : 20;
+			ebt_print_error("Bad line in delta file: %.*s", len, p);
+			return -1;
+		}
+		for (p += len; *p == ' ' || *p == '\t'; p++);
+		if (add_delta(i, p, e))
+			return -1;
 	}
-	copy_wormhash(result, workcopy);
-	free(workcopy);
-	qsort(&result->pool, result->poolsize,
-			sizeof(struct ebt_mac_wormhash_tuple), fcmp);
-	index_table(result);
+	return 0;
+}
+
+static int bucket_cmp(const void *va, const void *vb)
+{
+	const unsigned char *a = va, *b = vb;
+
+	if (a[7] != b[7])
+		return a[7] - b[7];
+	return tuple_cmp(va, vb);
+}
+
+/* A delta without IP address removes all entries of its MAC address */
+static int is_deleted(const struct ebt_mac_wormhash_tuple *t,
+		      const struct ebt_mac_wormhash_tuple *del, int n)
+{
+	for (; n > 0; n--, del++)
+		if (!memcmp(t->cmp, del->cmp, sizeof(t->cmp)) &&
+		    (!del->ip || del->ip == t->ip))
+			return 1;
+	return 0;
+}
+
+/* Returns a copy of the canonical wormhash wh with the entries of add
+ * merged into it and the entries of del removed. Only the buckets with
+ * changes are rebuilt, the other buckets are copied as a whole. */
+static struct ebt_mac_wormhash *patch_wormhash(const struct ebt_mac_wormhash *wh,
+	struct ebt_mac_wormhash_tuple *add, int nadd,
+	struct ebt_mac_wormhash_tuple *del, int ndel)
+{
+	const struct ebt_mac_wormhash_tuple *t, *prev;
+	struct ebt_mac_wormhash *result;
+	int i, j, n = 0, a = 0, a_end = 0, d = 0, d_end = 0;
+
+	qsort(add, nadd, sizeof(struct ebt_mac_wormhash_tuple), bucket_cmp);
+	qsort(del, ndel, sizeof(struct ebt_mac_wormhash_tuple), bucket_cmp);
+	result = new_wormhash(wh->poolsize + nadd);
+	for (i = 0; i < 256; i++) {
+		result->table[i] = n;
+		while (a_end < nadd &&
+		       ((const unsigned char *)add[a_end].cmp)[7] == i)
+			a_end++;
+		while (d_end < ndel &&
+		       ((const unsigned char *)del[d_end].cmp)[7] == i)
+			d_end++;
+		j = wh->table[i];
+		if (a == a_end && d == d_end) {
+			memcpy(&result->pool[n], &wh->pool[j],
+			       (wh->table[i + 1] - j) *
+			       sizeof(struct ebt_mac_wormhash_tuple));
+			n += wh->table[i + 1] - j;
+			continue;
+		}
+		prev = NULL;
+		while (j < wh->table[i + 1] || a < a_end) {
+			if (a == a_end || (j < wh->table[i + 1] &&
+			    tuple_cmp(&wh->pool[j], &add[a]) <= 0))
+				t = &wh->pool[j++];
+			else
+				t = &add[a++];
+			if (is_deleted(t, &del[d], d_end - d))
+				continue;
+			if (prev && !memcmp(prev->cmp, t->cmp,
+			    sizeof(t->cmp)) && (!prev->ip || prev->ip == t->ip))
+				continue;
+			result->pool[n] = *t;
+			prev = &result->pool[n++];
+		}
+		d = d_end;
+	}
+	result->table[256] = n;
+	result->poolsize = n;
 	return result;
 }
 
@@ -310,11 +493,11 @@ static int parse(int c, char **argv, int argc,
 {
 	struct ebt_among_info *info =
 	    (struct ebt_among_info *) (*match)->data;
-	struct ebt_mac_wormhash *wh;
+	struct ebt_mac_wormhash *wh = NULL;
 	struct ebt_entry_match *h;
+	const char *list;
 	int new_size;
 	long flen = 0;
-	int fd = -1;
 
 	switch (c) {
 	case AMONG_DST_F:
@@ -333,33 +516,20 @@ static int parse(int c, char **argv, int argc,
 				info->bitmask |= EBT_AMONG_SRC_NEG;
 		}
 		if (c == AMONG_DST_F || c == AMONG_SRC_F) {
-			struct stat stats;
-
-			if ((fd = open(optarg, O_RDONLY)) == -1)
-				ebt_print_error("Couldn't open file '%s'", optarg);
-			fstat(fd, &stats);
-			flen = stats.st_size;
-			/* use mmap because the file will probably be big */
-			optarg = mmap(0, flen, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
-			if (optarg == MAP_FAILED)
-				ebt_print_error("Couldn't map file to memory");
-			if (optarg[flen-1] != '\n')
-				ebt_print_error("File should end with a newline");
-			if (strchr(optarg, '\n') != optarg+flen-1)
+			if (!(list = map_file(optarg, &flen)))
+				break;
+			if (memchr(list, '\n', flen) != list+flen-1) {
 				ebt_print_error("File should only contain one line");
-			optarg[flen-1] = '\0';
-			if (ebt_errormsg[0] != '\0') {
-				munmap(argv, flen);
-				close(fd);
-				exit(-1);
-			}
-		}
-		wh = create_wormhash(optarg);
+			} else
+				wh = create_wormhash(list, list+flen-1);
+			munmap((void *)list, flen);
+		} else
+			wh = create_wormhash(optarg, optarg+strlen(optarg));
 		if (ebt_errormsg[0] != '\0')
 			break;
 
 		new_size = old_size+ebt_mac_wormhash_size(wh);
-		h = malloc(sizeof(struct ebt_entry_match)+EBT_ALIGN(new_size));
+		h = calloc(1, sizeof(struct ebt_entry_match)+EBT_ALIGN(new_size));
 		if (!h)
 			ebt_print_memory();
 		memcpy(h, *match, old_size+sizeof(struct ebt_entry_match));
@@ -376,10 +546,23 @@ static int parse(int c, char **argv, int argc,
 		free(*match);
 		*match = h;
 		free(wh);
-		if (c == AMONG_DST_F || c == AMONG_SRC_F) {
-			munmap(argv, flen);
-			close(fd);
-		}
+		break;
+	case AMONG_ADD_DST:
+	case AMONG_ADD_SRC:
+	case AMONG_DEL_DST:
+	case AMONG_DEL_SRC:
+		if (ebt_check_inverse2(optarg))
+			ebt_print_error2("Unexpected `!' after --%s",
+					 delta_names[c - AMONG_ADD_DST]);
+		add_delta(c - AMONG_ADD_DST, optarg, optarg+strlen(optarg));
+		break;
+	case AMONG_DELTA_F:
+		if (ebt_check_inverse2(optarg))
+			ebt_print_error2("Unexpected `!' after --among-delta-file");
+		if (!(list = map_file(optarg, &flen)))
+			break;
+		parse_delta_file(list, list+flen);
+		munmap((void *)list, flen);
 		break;
 	default:
 		return 0;
@@ -392,6 +575,91 @@ static void final_check(const struct ebt_u_entry *entry,
 			const char *name, unsigned int hookmask,
 			unsigned int time)
 {
+	int i;
+
+	for (i = 0; i < 4; i++)
+		if (delta_len[i])
+			ebt_print_error("--%s is only allowed with "
+					"--among-update", delta_names[i]);
+}
+
+/* Replaces the lists of the among match of an existing rule by patched
+ * copies, the lists keep their order in the match data */
+static void update(struct ebt_entry_match **match)
+{
+	struct ebt_among_info *info = (struct ebt_among_info *)(*match)->data;
+	struct ebt_mac_wormhash *wh[2], *patched[2] = {NULL, NULL};
+	struct ebt_entry_match *h;
+	struct ebt_among_info *newinfo;
+	int i, j, first, ofs, size = sizeof(struct ebt_among_info);
+	char *copy;
+
+	if (old_size != sizeof(struct ebt_among_info)) {
+		ebt_print_error("Use --add-dst, --add-src, --del-dst and "
+				"--del-src with --among-update");
+		return;
+	}
+	wh[0] = ebt_among_wh_dst(info);
+	wh[1] = ebt_among_wh_src(info);
+	for (i = 0; i < 2; i++) {
+		if (!delta_len[DELTA_ADD + i] && !delta_len[DELTA_DEL + i])
+			continue;
+		if (!wh[i]) {
+			ebt_print_error("The rule has no --among-%s list",
+					i ? "src" : "dst");
+			goto free_patched;
+		}
+		if (wormhash_is_canonical(wh[i]))
+			copy = NULL;
+		else {
+			/* A list that was added by an older version of ebtables */
+			if (!(copy = malloc(ebt_mac_wormhash_size(wh[i]))))
+				ebt_print_memory();
+			memcpy(copy, wh[i], ebt_mac_wormhash_size(wh[i]));
+			canonicalize_wormhash((struct ebt_mac_wormhash *)copy);
+		}
+		patched[i] = patch_wormhash(copy ?
+			(struct ebt_mac_wormhash *)copy : wh[i],
+			delta[DELTA_ADD + i], delta_len[DELTA_ADD + i],
+			delta[DELTA_DEL + i], delta_len[DELTA_DEL + i]);
+		free(copy);
+		wh[i] = patched[i];
+		if (!wh[i]->poolsize) {
+			ebt_print_error("The --among-%s list of the rule would "
+					"become empty", i ? "src" : "dst");
+			goto free_patched;
+		}
+	}
+	if (!patched[0] && !patched[1])
+		return;
+
+	size += ebt_mac_wormhash_size(wh[0]) + ebt_mac_wormhash_size(wh[1]);
+	h = calloc(1, sizeof(struct ebt_entry_match) + EBT_ALIGN(size));
+	if (!h)
+		ebt_print_memory();
+	memcpy(h, *match, sizeof(struct ebt_entry_match) +
+	       sizeof(struct ebt_among_info));
+	h->match_size = EBT_ALIGN(size);
+	newinfo = (struct ebt_among_info *)h->data;
+	ofs = sizeof(struct ebt_among_info);
+	first = info->wh_src_ofs && (!info->wh_dst_ofs ||
+		info->wh_src_ofs < info->wh_dst_ofs);
+	for (i = 0; i < 2; i++) {
+		j = i ^ first;
+		if (!wh[j])
+			continue;
+		memcpy(h->data + ofs, wh[j], ebt_mac_wormhash_size(wh[j]));
+		if (j)
+			newinfo->wh_src_ofs = ofs;
+		else
+			newinfo->wh_dst_ofs = ofs;
+		ofs += ebt_mac_wormhash_size(wh[j]);
+	}
+	free(*match);
+	*match = h;
+free_patched:
+	free(patched[0]);
+	free(patched[1]);
 }
 
 #ifdef DEBUG
@@ -450,18 +718,66 @@ static void print(const struct ebt_u_entry *entry,
 	}
 }
 
+static void wormhash_json(const char *key, const struct ebt_mac_wormhash *wh,
+			  int invert)
+{
+	int i;
+
+	ebt_json_object(key);
+	ebt_json_array("list");
+	for (i = 0; i < wh->poolsize; i++) {
+		const struct ebt_mac_wormhash_tuple *p;
+
+		p = (const struct ebt_mac_wormhash_tuple *)(&wh->pool[i]);
+		ebt_json_object(NULL);
+		ebt_json_mac("mac", ((const unsigned char *) &p->cmp[0]) + 2);
+		if (p->ip)
+			ebt_json_ipv4("ip", p->ip);
+		ebt_json_end();
+	}
+	ebt_json_end();
+	ebt_json_bool("invert", invert);
+	ebt_json_end();
+}
+
+static void print_json(const struct ebt_u_entry *entry,
+		       const struct ebt_entry_match *match)
+{
+	struct ebt_among_info *info = (struct ebt_among_info *)match->data;
+
+	if (info->wh_dst_ofs)
+		wormhash_json("among-dst", ebt_among_wh_dst(info),
+			      info->bitmask & EBT_AMONG_DST_NEG);
+	if (info->wh_src_ofs)
+		wormhash_json("among-src", ebt_among_wh_src(info),
+			      info->bitmask & EBT_AMONG_SRC_NEG);
+}
+
 static int compare_wh(const struct ebt_mac_wormhash *aw,
 		      const struct ebt_mac_wormhash *bw)
 {
-	int as, bs;
+	struct ebt_mac_wormhash *ac, *bc;
+	int as, bs, ret;
 
 	as = ebt_mac_wormhash_size(aw);
 	bs = ebt_mac_wormhash_size(bw);
-	if (as != bs)
+	if (as == bs && (!as || !memcmp(aw, bw, as)))
+		return 1;
+	if (!aw || !bw ||
+	    (wormhash_is_canonical(aw) && wormhash_is_canonical(bw)))
 		return 0;
-	if (as && memcmp(aw, bw, as))
-		return 0;
-	return 1;
+	/* A list that was added by an older version of ebtables */
+	if (!(ac = malloc(as)) || !(bc = malloc(bs)))
+		ebt_print_memory();
+	memcpy(ac, aw, as);
+	memcpy(bc, bw, bs);
+	canonicalize_wormhash(ac);
+	canonicalize_wormhash(bc);
+	as = ebt_mac_wormhash_size(ac);
+	ret = as == ebt_mac_wormhash_size(bc) && !memcmp(ac, bc, as);
+	free(ac);
+	free(bc);
+	return ret;
 }
 
 static int compare(const struct ebt_entry_match *m1,
@@ -489,6 +805,8 @@ static struct ebt_u_match among_match = {
 	.print 		= print,
 	.compare 	= compare,
 	.extra_ops 	= opts,
+	.print_json	= print_json,
+	.update		= update,
 };
 
 static void _INIT(void)
@@ -231,7 +231,6 @@ static void print(const struct ebt_u_entry *entry,
    const struct ebt_entry_match *match)
 {
 	struct ebt_arp_info *arpinfo = (struct ebt_arp_info *)match->data;
-	int i;
 
 	if (arpinfo->bitmask & EBT_ARP_OPCODE) {
 		int opcode = ntohs(arpinfo->opcode);
@@ -265,18 +264,14 @@ static void print(const struct ebt_u_entry *entry,
 		printf("--arp-ip-src ");
 		if (arpinfo->invflags & EBT_ARP_SRC_IP)
 			printf("! ");
-		for (i = 0; i < 4; i++)
-			printf("%d%s", ((unsigned char *)&arpinfo->saddr)[i],
-			   (i == 3) ? "" : ".");
+		ebt_print_ipv4(arpinfo->saddr);
 		printf("%s ", ebt_mask_to_dotted(arpinfo->smsk));
 	}
 	if (arpinfo->bitmask & EBT_ARP_DST_IP) {
 		printf("--arp-ip-dst ");
 		if (arpinfo->invflags & EBT_ARP_DST_IP)
 			printf("! ");
-		for (i = 0; i < 4; i++)
-			printf("%d%s", ((unsigned char *)&arpinfo->daddr)[i],
-			   (i == 3) ? "" : ".");
+		ebt_print_ipv4(arpinfo->daddr);
 		printf("%s ", ebt_mask_to_dotted(arpinfo->dmsk));
 	}
 	if (arpinfo->bitmask & EBT_ARP_SRC_MAC) {
@@ -300,6 +295,78 @@ static void print(const struct ebt_u_entry *entry,
 	}
 }
 
+static void json_value(const char *key, unsigned int value, const char *name,
+		       int invert)
+{
+	ebt_json_object(key);
+	ebt_json_uint("value", value);
+	if (name)
+		ebt_json_str("name", name);
+	ebt_json_bool("invert", invert);
+	ebt_json_end();
+}
+
+static void json_ip(const char *key, uint32_t addr, uint32_t msk, int invert)
+{
+	ebt_json_object(key);
+	ebt_json_ipv4("addr", addr);
+	ebt_json_ipv4("mask", msk);
+	ebt_json_bool("invert", invert);
+	ebt_json_end();
+}
+
+static void json_mac(const char *key, const unsigned char *mac,
+		     const unsigned char *msk, int invert)
+{
+	ebt_json_object(key);
+	ebt_json_mac("mac", mac);
+	ebt_json_mac("mask", msk);
+	ebt_json_bool("invert", invert);
+	ebt_json_end();
+}
+
+static void print_json(const struct ebt_u_entry *entry,
+   const struct ebt_entry_match *match)
+{
+	struct ebt_arp_info *arpinfo = (struct ebt_arp_info *)match->data;
+
+	if (arpinfo->bitmask & EBT_ARP_OPCODE) {
+		int opcode = ntohs(arpinfo->opcode);
+
+		json_value("arp-op", opcode, opcode > 0 && opcode <= NUMOPCODES ?
+			   opcodes[opcode - 1] : NULL,
+			   arpinfo->invflags & EBT_ARP_OPCODE);
+	}
+	if (arpinfo->bitmask & EBT_ARP_HTYPE)
+		json_value("arp-htype", ntohs(arpinfo->htype), NULL,
+			   arpinfo->invflags & EBT_ARP_HTYPE);
+	if (arpinfo->bitmask & EBT_ARP_PTYPE) {
+		struct ethertypeent *ent;
+
+		ent = getethertypebynumber(ntohs(arpinfo->ptype));
+		json_value("arp-ptype", ntohs(arpinfo->ptype),
+			   ent ? ent->e_name : NULL,
+			   arpinfo->invflags & EBT_ARP_PTYPE);
+	}
+	if (arpinfo->bitmask & EBT_ARP_SRC_IP)
+		json_ip("arp-ip-src", arpinfo->saddr, arpinfo->smsk,
+			arpinfo->invflags & EBT_ARP_SRC_IP);
+	if (arpinfo->bitmask & EBT_ARP_DST_IP)
+		json_ip("arp-ip-dst", arpinfo->daddr, arpinfo->dmsk,
+			arpinfo->invflags & EBT_ARP_DST_IP);
+	if (arpinfo->bitmask & EBT_ARP_SRC_MAC)
+		json_mac("arp-mac-src", arpinfo->smaddr, arpinfo->smmsk,
+			 arpinfo->invflags & EBT_ARP_SRC_MAC);
+	if (arpinfo->bitmask & EBT_ARP_DST_MAC)
+		json_mac("arp-mac-dst", arpinfo->dmaddr, arpinfo->dmmsk,
+			 arpinfo->invflags & EBT_ARP_DST_MAC);
+	if (arpinfo->bitmask & EBT_ARP_GRAT) {
+		ebt_json_object("arp-gratuitous");
+		ebt_json_bool("invert", arpinfo->invflags & EBT_ARP_GRAT);
+		ebt_json_end();
+	}
+}
+
 static int compare(const struct ebt_entry_match *m1,
    const struct ebt_entry_match *m2)
 {
@@ -360,6 +427,7 @@ static struct ebt_u_match arp_match =
 	.print		= print,
 	.compare	= compare,
 	.extra_ops	= opts,
+	.print_json	= print_json,
 };
 
 static void _INIT(void)
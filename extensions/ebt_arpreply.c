@@ -15,7 +15,7 @@
 #include <netinet/ether.h>
 #include <linux/netfilter_bridge/ebt_arpreply.h>
 
-static int mac_supplied;
+static __thread int mac_supplied;
 
 #define REPLY_MAC '1'
 #define REPLY_TARGET '2'
@@ -53,14 +53,11 @@ static int parse(int c, char **argv, int argc,
 {
 	struct ebt_arpreply_info *replyinfo =
 	   (struct ebt_arpreply_info *)(*target)->data;
-	struct ether_addr *addr;
-
 	switch (c) {
 	case REPLY_MAC:
 		ebt_check_option2(flags, OPT_REPLY_MAC);
-		if (!(addr = ether_aton(optarg)))
+		if (ebt_get_mac(optarg, replyinfo->mac))
 			ebt_print_error2("Problem with specified --arpreply-mac mac");
-		memcpy(replyinfo->mac, addr, ETH_ALEN);
 		mac_supplied = 1;
 		break;
 	case REPLY_TARGET:
@@ -29,6 +29,14 @@ comment_print(const struct ebt_u_entry *entry,
 	printf("--comment %s ", commentinfo->comment);
 }
 
+static void
+comment_print_json(const struct ebt_u_entry *entry,
+				   const struct ebt_entry_match *match)
+{
+	const struct xt_comment_info *commentinfo = (const void *)match->data;
+	ebt_json_str("comment", (const char *)commentinfo->comment);
+}
+
 static void init(struct ebt_entry_match *match)
 {
 }
@@ -87,6 +95,7 @@ static struct ebt_u_match comment_match =
 		.print = comment_print,
 		.compare = comment_compare,
 		.extra_ops = comment_opts,
+		.print_json = comment_print_json,
 };
 
 static void _INIT(void)
@@ -27,10 +27,10 @@ set_check_v0(const struct ebt_u_entry *entry,
 static void
 print_match(const char *prefix, const struct xt_dset_info *info)
 {
-	int i;
 	char setname[DSET_MAXNAMELEN];
 
-	get_set_byid(setname, info->index);
+	if (get_set_byid(setname, info->index))
+		return;
 	printf("--%s%s %s",
 			prefix,
 		   (info->flags & DSET_INV_MATCH) ? " !" : "",
@@ -175,7 +175,8 @@ set_parse_v4(int c, char **argv, int argc, const struct ebt_u_entry *entry,
 				"setname `%s' too long, max %d characters.",
 				optarg, DSET_MAXNAMELEN - 1);
 
-		get_set_byname(optarg, &info->match_set);
+		if (get_set_byname(optarg, &info->match_set))
+			return -1;
 
 		*flags = 1;
 		break;
@@ -233,6 +234,16 @@ set_print_v4(const struct ebt_u_entry *entry,
 	set_print_v4_matchinfo(info, "match-dset", "");
 }
 
+/* Resolves the set index before the listing starts, see get_set_byid() */
+static void
+set_list_prepare_v4(const struct ebt_entry_match *match)
+{
+	const struct xt_dset_info_match_v0 *info = (const void *)match->data;
+	char setname[DSET_MAXNAMELEN];
+
+	get_set_byid(setname, info->match_set.index);
+}
+
 static void init(struct ebt_entry_match *match)
 {
 }
@@ -276,6 +287,7 @@ static struct ebt_u_match set_match =
 		.final_check = set_check_v0,
 		.print = set_print_v4,
 		.compare = compare,
+		.list_prepare = set_list_prepare_v4,
 		.extra_ops = set_opts_v3,
 };
 
@@ -12,22 +12,27 @@
 #include <netinet/ether.h>
 #include <getopt.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
 #include "../include/ebtables_u.h"
 #include <linux/netfilter_bridge/ebt_inat.h>
 
-static int s_sub_supplied, d_sub_supplied;
-
 #define NAT_S '1'
 #define NAT_D '1'
 #define NAT_S_SUB '2'
 #define NAT_D_SUB '2'
 #define NAT_S_TARGET '3'
 #define NAT_D_TARGET '3'
+#define NAT_S_FILE '4'
+#define NAT_D_FILE '4'
 static const struct option opts_s[] =
 {
 	{ "isnat-list"     , required_argument, 0, NAT_S },
 	{ "isnat-sub"      , required_argument, 0, NAT_S_SUB },
 	{ "isnat-default-target"   , required_argument, 0, NAT_S_TARGET },
+	{ "isnat-file"     , required_argument, 0, NAT_S_FILE },
 	{ 0 }
 };
 
@@ -36,43 +41,46 @@ static const struct option opts_d[] =
 	{ "idnat-list"     , required_argument, 0, NAT_D },
 	{ "idnat-sub"      , required_argument, 0, NAT_D_SUB },
 	{ "idnat-default-target"   , required_argument, 0, NAT_D_TARGET },
+	{ "idnat-file"     , required_argument, 0, NAT_D_FILE },
 	{ 0 }
 };
 
 static void print_help_common(const char *cas)
 {
 	printf(
-"isnat options:\n"
-" --i%1.1snat-list                    : indexed list of MAC addresses\n"
-" --i%1.1snat-sub                     : /24 subnet to which the rule apply\n"
+"i%1.1snat options:\n"
+" --i%1.1snat-sub subnet              : /24 subnet the next list applies to\n"
+" --i%1.1snat-list list               : indexed list of MAC addresses\n"
+" --i%1.1snat-file file               : read a list from file\n"
 " --i%1.1snat-default-target target   : ACCEPT, DROP, RETURN or CONTINUE\n"
 "Indexed list of addresses is as follows:\n"
 "\tlist := chunk\n"
 "\tlist := list chunk\n"
 "\tchunk := pair ','\n"
 "\tpair := index '=' action\n"
+"\tpair := ip_addr '=' action\n"
 "\taction := mac_addr\n"
 "\taction := mac_addr '+'\n"
 "\taction := '_'\n"
 "where\n"
-"\tindex -- an integer [0..255]\n"
+"\tindex -- an integer [0..255], the last byte of an address of the subnet\n"
+"\tip_addr -- an IP address in format a.b.c.d, its /24 is added to the rule\n"
 "\tmac_addr -- a MAC address in format xx:xx:xx:xx:xx:xx\n"
 "If '_' at some index is specified, packets with last %s IP address byte\n"
 "equal to index are DROPped. If there is a MAC address, they are %1.1snatted\n"
 "to this and the target is CONTINUE. If this MAC is followed by '+', the\n"
 "target is ACCEPT.\n"
 "For example,\n"
-"--idnat-list 2=20:21:22:23:24:25,4=_,7=30:31:32:33:34:35,\n"
+"--i%1.1snat-sub 192.168.42.0/24 --i%1.1snat-list 2=20:21:22:23:24:25,4=_,\n"
+"--i%1.1snat-list 10.1.2.7=30:31:32:33:34:35+,\n"
 "is valid.\n"
-"The subnet MUST be specified. Only packets with 3 first bytes of their\n"
-"%s address are considered. --i%1.1snat-sub parameter must begin with\n"
-"3 integers separated by dots. Only they are considered, the rest is ignored.\n"
-"No matter if you write '192.168.42.', '192.168.42.0', '192.168.42.12',\n"
-"'192.168.42.0/24', '192.168.42.0/23' or '192.168.42.i%1.1snat_sucks!!!',\n"
-"The numbers 192, 168 and 42 are taken and it behaves like a /24 IP subnet.\n"
-"--i%1.1snat-default-target affects only the packet not matching the subnet.\n",
-		cas, cas, cas, cas, cas, cas, cas, cas,
-		cas, cas, cas, cas, cas, cas, cas, cas
+"A rule can have many subnets, an index refers to the subnet of the last\n"
+"--i%1.1snat-sub option (or the next one, when none was given yet). Only the\n"
+"first 3 integers of --i%1.1snat-sub are considered, it always is a /24.\n"
+"In a file the pairs can also be separated by white space and '#' starts a\n"
+"comment that runs until the end of the line.\n"
+"--i%1.1snat-default-target affects only the packet not matching the subnets.\n",
+		cas, cas, cas, cas, cas, cas, cas, cas, cas, cas, cas, cas, cas
 	);
 }
 
@@ -86,271 +94,472 @@ static void print_help_d()
 	print_help_common("dest");
 }
 
-static void init_s(struct ebt_entry_target *target)
+/* The addresses and subnets given so far for the rule being parsed, the
+ * target data is rebuilt from them after every option */
+struct inat_addr
 {
-	struct ebt_inat_info *natinfo = (struct ebt_inat_info *)target->data;
+	/* Host byte order, only the index for a pending address */
+	uint32_t ip;
+	unsigned char mac[ETH_ALEN];
+	int target;
+	/* The order in which the addresses were given */
+	unsigned int seq;
+};
 
-	s_sub_supplied = 0;
-	memset(natinfo, 0, sizeof(struct ebt_inat_info));
-	natinfo->target = EBT_CONTINUE;
-	return;
+static __thread struct inat_addr *addrs, *pending;
+static __thread int naddrs, npending, max_addrs, max_pending;
+static __thread unsigned int nseq;
+/* Sorted, host byte order */
+static __thread uint32_t *subnets;
+static __thread int nsubnets, max_subnets;
+/* The subnet of the last --i?nat-sub option, -1 if none */
+static __thread int64_t cur_subnet;
+static __thread int default_target;
+
+/* The default target is at a different place in both revisions */
+static int get_default_target(const struct ebt_entry_target *target)
+{
+	if (target->u.revision == 0)
+		return ((struct ebt_inat_info *)target->data)->target;
+	return ((struct ebt_inat_info_v1 *)target->data)->target;
 }
 
-static void init_d(struct ebt_entry_target *target)
+static void init(struct ebt_entry_target *target)
 {
 	struct ebt_inat_info *natinfo = (struct ebt_inat_info *)target->data;
 
-	d_sub_supplied = 0;
 	memset(natinfo, 0, sizeof(struct ebt_inat_info));
-	natinfo->target = EBT_CONTINUE;
-	return;
+	natinfo->target = default_target = EBT_CONTINUE;
+	naddrs = npending = nsubnets = 0;
+	nseq = 0;
+	cur_subnet = -1;
 }
 
-static void parse_list(const char *arg, struct ebt_inat_info *info)
+static void add_subnet(uint32_t sub)
+{
+	int lo = 0, hi = nsubnets, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (subnets[mid] < sub)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < nsubnets && subnets[lo] == sub)
+		return;
+	if (nsubnets == max_subnets) {
+		max_subnets = max_subnets ? 2 * max_subnets : 16;
+		if (!(subnets = realloc(subnets, max_subnets * sizeof(uint32_t))))
+			ebt_print_memory();
+	}
+	memmove(subnets + lo + 1, subnets + lo,
+		(nsubnets - lo) * sizeof(uint32_t));
+	subnets[lo] = sub;
+	nsubnets++;
+}
+
+static void add_addr(struct inat_addr **list, int *n, int *max,
+		     const struct inat_addr *a)
+{
+	if (*n == *max) {
+		*max = *max ? 2 * *max : 256;
+		if (!(*list = realloc(*list, *max * sizeof(struct inat_addr))))
+			ebt_print_memory();
+	}
+	(*list)[(*n)++] = *a;
+}
+
+static void set_subnet(uint32_t sub)
 {
 	int i;
-	char c;
-	int count = 0;
-	int now_index = 1;
-	int index;
-	char buf[4];
-	unsigned char mac[6];
-	int ibuf = 0;
-	int imac = 0;
-	int target;
-	memset(buf, 0, 4);
-	i = 0;
+
+	add_subnet(sub);
+	cur_subnet = sub;
+	for (i = 0; i < npending; i++) {
+		pending[i].ip |= sub;
+		add_addr(&addrs, &naddrs, &max_addrs, &pending[i]);
+	}
+	npending = 0;
+}
+
+/* Parses up to 4 dotted numbers in [0..255], returns the number of
+ * numbers parsed and the position after them */
+static int parse_dotted(const char **pp, unsigned int *v)
+{
+	const char *p = *pp;
+	int i, digits;
+
+	for (i = 0; i < 4; i++) {
+		v[i] = 0;
+		for (digits = 0; isdigit(*p) && digits < 4; digits++)
+			v[i] = v[i] * 10 + *p++ - '0';
+		if (!digits || v[i] > 255)
+			return -1;
+		if (*p != '.' || i == 3 || !isdigit(p[1]))
+			break;
+		p++;
+	}
+	*pp = p;
+	return i + 1;
+}
+
+#define IS_SEPARATOR(c, file) ((c) == ',' || \
+	((file) && ((c) == '#' || isspace((unsigned char)(c)))))
+
+/* Parses the pairs of a list or of a file. In a file, the pairs can also
+ * be separated by white space and '#' starts a comment. */
+static int parse_list(const char *p, int file)
+{
+	const char *anchor;
+	struct inat_addr a;
+	unsigned int v[4];
+	char buf[18];
+	int i, n, count = 0;
+
 	while (1) {
-		c = arg[i];
-		if (now_index) {
-			if (isdigit(c)) {
-				buf[ibuf++] = c;
-				if (ibuf > 3) {
-					print_error("Index too long at position %d", i);
-				}
-				goto next;
-			}
-			if (c == '=') {
-				if (ibuf == 0) {
-					print_error("Integer index expected before '=' at position %d", i);
-				}
-				buf[ibuf] = 0;
-				ibuf = 0;
-				index = atoi(buf);
-				if (index < 0 || 255 < index) {
-					print_error("Index out of range [0..255], namely %d", index);
-				}
-				now_index = 0;
-				memset(mac, 0, 6);
-				imac = 0;
-				target = EBT_CONTINUE;
-				goto next;
-			}
-			if (c == '\0') {
-				goto next;
-			}
-			print_error("Unexpected '%c' where integer or '=' expected", c);
+		while (IS_SEPARATOR(*p, file)) {
+			if (*p == '#')
+				while (*p && *p != '\n')
+					p++;
+			else
+				p++;
 		}
-		else {
-			if (isxdigit(c)) {
-				buf[ibuf++] = c;
-				if (ibuf > 2) {
-					print_error("MAC address chunk too long at position %d", i);
-				}
-				goto next;
-			}
-			if (c == ':' || c == ',' || c == '\0') {
-				buf[ibuf] = 0;
-				ibuf = 0;
-				mac[imac++] = strtol(buf, 0, 16);
-				if (c == ',' || c == '\0') {
-					info->a[index].enabled = 1;
-					info->a[index].target = target;
-					memcpy(info->a[index].mac, mac, 6);
-					now_index = 1;
-					count++;
-					goto next;
-				}
-				if (c == ':' && imac >= 6) {
-					print_error("Too many MAC address chunks at position %d", i);
-				}
-				goto next;
+		if (!*p)
+			break;
+		anchor = p;
+		n = parse_dotted(&p, v);
+		if ((n != 1 && n != 4) || *p++ != '=') {
+			ebt_print_error("Index or IP address expected before '=' at '%.20s'", anchor);
+			return -1;
+		}
+		a.target = EBT_CONTINUE;
+		memset(a.mac, 0, ETH_ALEN);
+		if (*p == '_') {
+			a.target = EBT_DROP;
+			p++;
+		} else {
+			if (*p == '+') {
+				a.target = EBT_ACCEPT;
+				p++;
 			}
-			if (c == '_') {
-				target = EBT_DROP;
-				goto next;
+			for (i = 0; (isxdigit(*p) || *p == ':') && i < 17; i++)
+				buf[i] = *p++;
+			buf[i] = '\0';
+			if (ebt_get_mac(buf, a.mac)) {
+				ebt_print_error("Problem with the MAC address at '%.20s'", anchor);
+				return -1;
 			}
-			if (c == '+') {
-				target = EBT_ACCEPT;
-				goto next;
+			if (*p == '+') {
+				a.target = EBT_ACCEPT;
+				p++;
 			}
-			print_error("Unexpected '%c' where hex digit, '_', '+', ',' or end of string expected", c);
 		}
-	next:
-		if (!c) break;
-		i++;
+		if (*p && !IS_SEPARATOR(*p, file)) {
+			ebt_print_error("Unexpected '%c' at '%.20s'", *p, anchor);
+			return -1;
+		}
+		count++;
+		a.seq = nseq++;
+		if (n == 4) {
+			a.ip = v[0] << 24 | v[1] << 16 | v[2] << 8 | v[3];
+			add_subnet(a.ip & 0xffffff00);
+			add_addr(&addrs, &naddrs, &max_addrs, &a);
+		} else if (cur_subnet == -1) {
+			a.ip = v[0];
+			add_addr(&pending, &npending, &max_pending, &a);
+		} else {
+			a.ip = cur_subnet | v[0];
+			add_addr(&addrs, &naddrs, &max_addrs, &a);
+		}
 	}
 	if (count == 0) {
-		print_error("List empty");
+		ebt_print_error("List empty");
+		return -1;
+	}
+	return 0;
+}
+
+static int parse_file(const char *name)
+{
+	struct stat stats;
+	char *buf;
+	int fd, ret = -1;
+
+	if ((fd = open(name, O_RDONLY)) == -1) {
+		ebt_print_error("Couldn't open file '%s'", name);
+		return -1;
+	}
+	if (fstat(fd, &stats)) {
+		close(fd);
+		ebt_print_error("Couldn't read file '%s'", name);
+		return -1;
 	}
+	if (!(buf = malloc(stats.st_size + 1)))
+		ebt_print_memory();
+	if (read(fd, buf, stats.st_size) != stats.st_size) {
+		ebt_print_error("Couldn't read file '%s'", name);
+	} else {
+		buf[stats.st_size] = '\0';
+		ret = parse_list(buf, 1);
+	}
+	close(fd);
+	free(buf);
+	return ret;
 }
 
-static uint32_t parse_ip(const char *s)
+static int addr_cmp(const void *va, const void *vb)
 {
-	int a0, a1, a2;
-	char ip[4];
-	sscanf(s, "%d.%d.%d", &a0, &a1, &a2);
-	ip[0] = a0;
-	ip[1] = a1;
-	ip[2] = a2;
-	ip[3] = 0;
-	return *(uint32_t*)ip;
+	const struct inat_addr *a = va, *b = vb;
+
+	if (a->ip != b->ip)
+		return a->ip < b->ip ? -1 : 1;
+	/* Keep the order in which they were given */
+	return a->seq < b->seq ? -1 : a->seq > b->seq;
 }
 
-#define OPT_ISNAT         0x01
-#define OPT_ISNAT_SUB     0x02
-#define OPT_ISNAT_TARGET  0x04
-static int parse_s(int c, char **argv, int argc,
-   const struct ebt_u_entry *entry, unsigned int *flags,
-   struct ebt_entry_target **target)
+/* Revision 0 data, for a rule with at most one subnet */
+static void build_v0(struct ebt_inat_info *info)
+{
+	int i, n;
+
+	if (nsubnets)
+		info->ip_subnet = htonl(subnets[0]);
+	for (i = 0; i < naddrs; i++) {
+		n = addrs[i].ip & 0xff;
+		info->a[n].enabled = 1;
+		memcpy(info->a[n].mac, addrs[i].mac, ETH_ALEN);
+		info->a[n].target = addrs[i].target;
+	}
+	info->target = default_target;
+}
+
+/* Builds the target data from addrs[] and subnets[]. Revision 1 is only
+ * used for a rule with more than one subnet, so the rules that older
+ * kernels know keep working there. */
+static void build_target(struct ebt_entry_target **target)
 {
-	struct ebt_inat_info *natinfo = (struct ebt_inat_info *)(*target)->data;
+	struct ebt_inat_info_v1 *info;
+	struct ebt_entry_target *t;
+	struct ebt_inat_subnet *sub;
+	struct ebt_inat_slot *slot;
+	int i, j, n, size;
+
+	/* The address given last wins */
+	qsort(addrs, naddrs, sizeof(struct inat_addr), addr_cmp);
+	for (i = 0, n = 0; i < naddrs; i++) {
+		if (n && addrs[n - 1].ip == addrs[i].ip)
+			n--;
+		addrs[n++] = addrs[i];
+	}
+	naddrs = n;
+
+	if (nsubnets <= 1)
+		size = sizeof(struct ebt_inat_info);
+	else
+		size = ebt_inat_size(nsubnets, naddrs);
+	if (!(t = calloc(1, sizeof(struct ebt_entry_target) + EBT_ALIGN(size))))
+		ebt_print_memory();
+	memcpy(t, *target, sizeof(struct ebt_entry_target));
+	t->target_size = EBT_ALIGN(size);
+	free(*target);
+	*target = t;
+	if (nsubnets <= 1) {
+		t->u.revision = 0;
+		build_v0((struct ebt_inat_info *)t->data);
+		return;
+	}
+	t->u.revision = 1;
+	info = (struct ebt_inat_info_v1 *)t->data;
+	info->target = default_target;
+	info->nsubnets = nsubnets;
+	info->nslots = naddrs;
+	slot = ebt_inat_slots(info);
+	for (i = 0, j = 0; i < nsubnets; i++) {
+		sub = &info->subnets[i];
+		sub->ip_subnet = htonl(subnets[i]);
+		sub->first_slot = j;
+		for (; j < naddrs && (addrs[j].ip & 0xffffff00) == subnets[i]; j++) {
+			n = addrs[j].ip & 0xff;
+			sub->map[n / 32] |= 1U << (n % 32);
+			memcpy(slot[j].mac, addrs[j].mac, ETH_ALEN);
+			slot[j].target = addrs[j].target;
+		}
+	}
+}
+
+static int parse(int c, unsigned int *flags, struct ebt_entry_target **target,
+		 const char *name)
+{
+	const char *p = optarg;
+	unsigned int v[4];
 
 	switch (c) {
-	case NAT_S:
-		check_option(flags, OPT_ISNAT);
-		parse_list(optarg, natinfo);
+	case NAT_S: /* == NAT_D */
+		if (parse_list(optarg, 0))
+			return -1;
 		break;
-	case NAT_S_TARGET:
-		check_option(flags, OPT_ISNAT_TARGET);
-		if (FILL_TARGET(optarg, natinfo->target))
-			print_error("Illegal --isnat-default-target target");
+	case NAT_S_FILE: /* == NAT_D_FILE */
+		if (parse_file(optarg))
+			return -1;
 		break;
-	case NAT_S_SUB:
-		natinfo->ip_subnet = parse_ip(optarg);
-		s_sub_supplied = 1;
+	case NAT_S_TARGET: /* == NAT_D_TARGET */
+		ebt_check_option2(flags, 0x01);
+		if (FILL_TARGET(optarg, default_target))
+			ebt_print_error2("Illegal --i%snat-default-target target", name);
+		break;
+	case NAT_S_SUB: /* == NAT_D_SUB */
+		if (parse_dotted(&p, v) < 3)
+			ebt_print_error2("Problem with the specified --i%snat-sub subnet '%s'", name, optarg);
+		set_subnet(v[0] << 24 | v[1] << 16 | v[2] << 8);
 		break;
 	default:
 		return 0;
 	}
+	build_target(target);
 	return 1;
 }
 
-#define OPT_IDNAT        0x01
-#define OPT_IDNAT_SUB    0x02
-#define OPT_IDNAT_TARGET 0x04
+static int parse_s(int c, char **argv, int argc,
+   const struct ebt_u_entry *entry, unsigned int *flags,
+   struct ebt_entry_target **target)
+{
+	return parse(c, flags, target, "s");
+}
+
 static int parse_d(int c, char **argv, int argc,
    const struct ebt_u_entry *entry, unsigned int *flags,
    struct ebt_entry_target **target)
 {
-	struct ebt_inat_info *natinfo = (struct ebt_inat_info *)(*target)->data;
+	return parse(c, flags, target, "d");
+}
 
-	switch (c) {
-	case NAT_D:
-		check_option(flags, OPT_IDNAT);
-		parse_list(optarg, natinfo);
-		break;
-	case NAT_D_TARGET:
-		check_option(flags, OPT_IDNAT_TARGET);
-		if (FILL_TARGET(optarg, natinfo->target))
-			print_error("Illegal --idnat-default-target target");
-		break;
-	case NAT_D_SUB:
-		natinfo->ip_subnet = parse_ip(optarg);
-		d_sub_supplied = 1;
-		break;
-	default:
-		return 0;
-	}
-	return 1;
+static void final_check(const struct ebt_entry_target *target,
+			unsigned int time, const char *name)
+{
+	if (time != 0)
+		return;
+	if (npending) {
+		ebt_print_error("No i%snat subnet supplied for the indexes of the list", name);
+	} else if (nsubnets == 0)
+		ebt_print_error("No i%snat subnet supplied", name);
 }
 
 static void final_check_s(const struct ebt_u_entry *entry,
    const struct ebt_entry_target *target, const char *name,
    unsigned int hookmask, unsigned int time)
 {
-	struct ebt_inat_info *natinfo = (struct ebt_inat_info *)target->data;
-
-	if (BASE_CHAIN && natinfo->target == EBT_RETURN)
-		print_error("--isnat-default-target RETURN not allowed on base chain");
+	if (BASE_CHAIN && get_default_target(target) == EBT_RETURN) {
+		ebt_print_error("--isnat-default-target RETURN not allowed on base chain");
+		return;
+	}
 	CLEAR_BASE_CHAIN_BIT;
-	if ((hookmask & ~(1 << NF_BR_POST_ROUTING)) || strcmp(name, "nat"))
-		print_error("Wrong chain for isnat");
-	if (time == 0 && s_sub_supplied == 0)
-		print_error("No isnat subnet supplied");
+	if ((hookmask & ~(1 << NF_BR_POST_ROUTING)) || strcmp(name, "nat")) {
+		ebt_print_error("Wrong chain for isnat");
+		return;
+	}
+	final_check(target, time, "s");
 }
 
 static void final_check_d(const struct ebt_u_entry *entry,
    const struct ebt_entry_target *target, const char *name,
    unsigned int hookmask, unsigned int time)
 {
-	struct ebt_inat_info *natinfo = (struct ebt_inat_info *)target->data;
-
-	if (BASE_CHAIN && natinfo->target == EBT_RETURN)
-		print_error("--idnat-default-target RETURN not allowed on base chain");
+	if (BASE_CHAIN && get_default_target(target) == EBT_RETURN) {
+		ebt_print_error("--idnat-default-target RETURN not allowed on base chain");
+		return;
+	}
 	CLEAR_BASE_CHAIN_BIT;
 	if (((hookmask & ~((1 << NF_BR_PRE_ROUTING) | (1 << NF_BR_LOCAL_OUT)))
 	   || strcmp(name, "nat")) &&
-	   ((hookmask & ~(1 << NF_BR_BROUTING)) || strcmp(name, "broute")))
-		print_error("Wrong chain for idnat");
-	if (time == 0 && d_sub_supplied == 0)
-		print_error("No idnat subnet supplied");
+	   ((hookmask & ~(1 << NF_BR_BROUTING)) || strcmp(name, "broute"))) {
+		ebt_print_error("Wrong chain for idnat");
+		return;
+	}
+	final_check(target, time, "d");
 }
 
-static void print_list(const struct ebt_inat_info *info)
+static void print_slot(int index, const unsigned char *mac, int target)
 {
-	int i;
+	printf("%d=", index);
+	if (target == EBT_DROP)
+		printf("_");
+	else {
+		ebt_print_mac(mac);
+		if (target == EBT_ACCEPT)
+			printf("+");
+	}
+	printf(",");
+}
+
+static void print_v0(const struct ebt_inat_info *info, const char *name)
+{
+	const unsigned char *sub = (const unsigned char *)&info->ip_subnet;
+	int i, list = 0;
+
+	printf("--i%snat-sub %u.%u.%u.0/24 ", name, sub[0], sub[1], sub[2]);
 	for (i = 0; i < 256; i++) {
-		if (info->a[i].enabled) {
-			printf("%d=", i);
-			if (info->a[i].target == EBT_DROP) {
-				printf("_");
-			}
-			else {
-				if (info->a[i].target == EBT_ACCEPT) {
-					printf("+");
-				}
-				print_mac(info->a[i].mac);
-			}
-			printf(",");
+		if (!info->a[i].enabled)
+			continue;
+		if (!list++)
+			printf("--i%snat-list ", name);
+		print_slot(i, info->a[i].mac, info->a[i].target);
+	}
+	if (list)
+		printf(" ");
+	printf("--i%snat-default-target %s", name, TARGET_NAME(info->target));
+}
+
+static void print(const struct ebt_entry_target *target, const char *name)
+{
+	const struct ebt_inat_info_v1 *info =
+		(const struct ebt_inat_info_v1 *)target->data;
+	const struct ebt_inat_slot *slot = ebt_inat_slots(info);
+	const struct ebt_inat_subnet *sub;
+	unsigned char ip[4];
+	unsigned int i, j, k;
+
+	if (target->u.revision == 0) {
+		print_v0((const struct ebt_inat_info *)target->data, name);
+		return;
+	}
+	for (i = 0; i < info->nsubnets; i++) {
+		sub = &info->subnets[i];
+		memcpy(ip, &sub->ip_subnet, 4);
+		printf("--i%snat-sub %u.%u.%u.0/24 ", name, ip[0], ip[1], ip[2]);
+		k = sub->first_slot;
+		for (j = 0; j < 256; j++) {
+			if (!(sub->map[j / 32] & (1U << (j % 32))))
+				continue;
+			if (k == sub->first_slot)
+				printf("--i%snat-list ", name);
+			print_slot(j, slot[k].mac, slot[k].target);
+			k++;
 		}
+		if (k != sub->first_slot)
+			printf(" ");
 	}
+	printf("--i%snat-default-target %s", name, TARGET_NAME(info->target));
 }
 
 static void print_s(const struct ebt_u_entry *entry,
    const struct ebt_entry_target *target)
 {
-	struct ebt_inat_info *info = (struct ebt_inat_info *)target->data;
-
-	unsigned char sub[4];
-	*(uint32_t*)sub = info->ip_subnet;
-	printf("--isnat-sub %u.%u.%u.0/24", sub[0], sub[1], sub[2]);
-	printf(" --isnat-list ");
-	print_list(info);
-	printf(" --isnat-default-target %s", TARGET_NAME(info->target));
+	print(target, "s");
 }
 
 static void print_d(const struct ebt_u_entry *entry,
    const struct ebt_entry_target *target)
 {
-	struct ebt_inat_info *info = (struct ebt_inat_info *)target->data;
-
-	unsigned char sub[4];
-	*(uint32_t*)sub = info->ip_subnet;
-	printf("--idnat-sub %u.%u.%u.0/24", sub[0], sub[1], sub[2]);
-	printf(" --idnat-list ");
-	print_list(info);
-	printf(" --idnat-default-target %s", TARGET_NAME(info->target));
+	print(target, "d");
 }
 
 static int compare(const struct ebt_entry_target *t1,
    const struct ebt_entry_target *t2)
 {
-	struct ebt_inat_info *natinfo1 = (struct ebt_inat_info *)t1->data;
-	struct ebt_inat_info *natinfo2 = (struct ebt_inat_info *)t2->data;
-
-
-	return !memcmp(natinfo1, natinfo2, sizeof(struct ebt_inat_info));
+	return t1->u.revision == t2->u.revision &&
+	       t1->target_size == t2->target_size &&
+	       !memcmp(t1->data, t2->data, t1->target_size);
 }
 
 static struct ebt_u_target isnat_target =
@@ -358,7 +567,7 @@ static struct ebt_u_target isnat_target =
 	.name		= EBT_ISNAT_TARGET,
 	.size		= sizeof(struct ebt_inat_info),
 	.help		= print_help_s,
-	.init		= init_s,
+	.init		= init,
 	.parse		= parse_s,
 	.final_check	= final_check_s,
 	.print		= print_s,
@@ -371,7 +580,7 @@ static struct ebt_u_target idnat_target =
 	.name		= EBT_IDNAT_TARGET,
 	.size		= sizeof(struct ebt_inat_info),
 	.help		= print_help_d,
-	.init		= init_d,
+	.init		= init,
 	.parse		= parse_d,
 	.final_check	= final_check_d,
 	.print		= print_d,
@@ -381,6 +590,6 @@ static struct ebt_u_target idnat_target =
 
 static void _INIT(void)
 {
-	register_target(&isnat_target);
-	register_target(&idnat_target);
+	ebt_register_target(&isnat_target);
+	ebt_register_target(&idnat_target);
 }
@@ -337,24 +337,19 @@ static void print(const struct ebt_u_entry *entry,
    const struct ebt_entry_match *match)
 {
 	struct ebt_ip_info *ipinfo = (struct ebt_ip_info *)match->data;
-	int j;
 
 	if (ipinfo->bitmask & EBT_IP_SOURCE) {
 		printf("--ip-src ");
 		if (ipinfo->invflags & EBT_IP_SOURCE)
 			printf("! ");
-		for (j = 0; j < 4; j++)
-			printf("%d%s",((unsigned char *)&ipinfo->saddr)[j],
-			   (j == 3) ? "" : ".");
+		ebt_print_ipv4(ipinfo->saddr);
 		printf("%s ", ebt_mask_to_dotted(ipinfo->smsk));
 	}
 	if (ipinfo->bitmask & EBT_IP_DEST) {
 		printf("--ip-dst ");
 		if (ipinfo->invflags & EBT_IP_DEST)
 			printf("! ");
-		for (j = 0; j < 4; j++)
-			printf("%d%s", ((unsigned char *)&ipinfo->daddr)[j],
-			   (j == 3) ? "" : ".");
+		ebt_print_ipv4(ipinfo->daddr);
 		printf("%s ", ebt_mask_to_dotted(ipinfo->dmsk));
 	}
 	if (ipinfo->bitmask & EBT_IP_TOS) {
@@ -404,6 +399,73 @@ static void print(const struct ebt_u_entry *entry,
 	}
 }
 
+static void json_addr(const char *key, uint32_t addr, uint32_t msk, int invert)
+{
+	ebt_json_object(key);
+	ebt_json_ipv4("addr", addr);
+	ebt_json_ipv4("mask", msk);
+	ebt_json_bool("invert", invert);
+	ebt_json_end();
+}
+
+static void json_range(const char *key, const char *min, const char *max,
+		       unsigned int from, unsigned int to, int invert)
+{
+	ebt_json_object(key);
+	ebt_json_uint(min, from);
+	ebt_json_uint(max, to);
+	ebt_json_bool("invert", invert);
+	ebt_json_end();
+}
+
+static void print_json(const struct ebt_u_entry *entry,
+   const struct ebt_entry_match *match)
+{
+	struct ebt_ip_info *ipinfo = (struct ebt_ip_info *)match->data;
+
+	if (ipinfo->bitmask & EBT_IP_SOURCE)
+		json_addr("ip-src", ipinfo->saddr, ipinfo->smsk,
+			  ipinfo->invflags & EBT_IP_SOURCE);
+	if (ipinfo->bitmask & EBT_IP_DEST)
+		json_addr("ip-dst", ipinfo->daddr, ipinfo->dmsk,
+			  ipinfo->invflags & EBT_IP_DEST);
+	if (ipinfo->bitmask & EBT_IP_TOS) {
+		ebt_json_object("ip-tos");
+		ebt_json_uint("value", ipinfo->tos);
+		ebt_json_bool("invert", ipinfo->invflags & EBT_IP_TOS);
+		ebt_json_end();
+	}
+	if (ipinfo->bitmask & EBT_IP_PROTO) {
+		struct protoent *pe;
+
+		ebt_json_object("ip-proto");
+		ebt_json_uint("value", ipinfo->protocol);
+		if ((pe = getprotobynumber(ipinfo->protocol)))
+			ebt_json_str("name", pe->p_name);
+		ebt_json_bool("invert", ipinfo->invflags & EBT_IP_PROTO);
+		ebt_json_end();
+	}
+	if (ipinfo->bitmask & EBT_IP_SPORT)
+		json_range("ip-sport", "min", "max", ipinfo->sport[0],
+			   ipinfo->sport[1], ipinfo->invflags & EBT_IP_SPORT);
+	if (ipinfo->bitmask & EBT_IP_DPORT)
+		json_range("ip-dport", "min", "max", ipinfo->dport[0],
+			   ipinfo->dport[1], ipinfo->invflags & EBT_IP_DPORT);
+	if (ipinfo->bitmask & EBT_IP_ICMP) {
+		ebt_json_object("ip-icmp-type");
+		ebt_json_uint("type-min", ipinfo->icmp_type[0]);
+		ebt_json_uint("type-max", ipinfo->icmp_type[1]);
+		ebt_json_uint("code-min", ipinfo->icmp_code[0]);
+		ebt_json_uint("code-max", ipinfo->icmp_code[1]);
+		ebt_json_bool("invert", ipinfo->invflags & EBT_IP_ICMP);
+		ebt_json_end();
+	}
+	if (ipinfo->bitmask & EBT_IP_IGMP)
+		json_range("ip-igmp-type", "type-min", "type-max",
+			   ipinfo->igmp_type[0], ipinfo->igmp_type[1],
+			   ipinfo->invflags & EBT_IP_IGMP);
+}
+
 static int compare(const struct ebt_entry_match *m1,
    const struct ebt_entry_match *m2)
 {
@@ -470,6 +532,7 @@ static struct ebt_u_match ip_match =
 	.print		= print,
 	.compare	= compare,
 	.extra_ops	= opts,
+	.print_json	= print_json,
 };
 
 static void _INIT(void)
@@ -350,6 +350,70 @@ static void print(const struct ebt_u_entry *entry,
 	}
 }
 
+static void json_addr(const char *key, const struct in6_addr *addr,
+		      const struct in6_addr *msk, int invert)
+{
+	ebt_json_object(key);
+	ebt_json_str("addr", ebt_ip6_to_numeric(addr));
+	ebt_json_str("mask", ebt_ip6_to_numeric(msk));
+	ebt_json_bool("invert", invert);
+	ebt_json_end();
+}
+
+static void json_range(const char *key, const char *min, const char *max,
+		       unsigned int from, unsigned int to, int invert)
+{
+	ebt_json_object(key);
+	ebt_json_uint(min, from);
+	ebt_json_uint(max, to);
+	ebt_json_bool("invert", invert);
+	ebt_json_end();
+}
+
+static void print_json(const struct ebt_u_entry *entry,
+   const struct ebt_entry_match *match)
+{
+	struct ebt_ip6_info *ipinfo = (struct ebt_ip6_info *)match->data;
+
+	if (ipinfo->bitmask & EBT_IP6_SOURCE)
+		json_addr("ip6-src", &ipinfo->saddr, &ipinfo->smsk,
+			  ipinfo->invflags & EBT_IP6_SOURCE);
+	if (ipinfo->bitmask & EBT_IP6_DEST)
+		json_addr("ip6-dst", &ipinfo->daddr, &ipinfo->dmsk,
+			  ipinfo->invflags & EBT_IP6_DEST);
+	if (ipinfo->bitmask & EBT_IP6_TCLASS) {
+		ebt_json_object("ip6-tclass");
+		ebt_json_uint("value", ipinfo->tclass);
+		ebt_json_bool("invert", ipinfo->invflags & EBT_IP6_TCLASS);
+		ebt_json_end();
+	}
+	if (ipinfo->bitmask & EBT_IP6_PROTO) {
+		struct protoent *pe;
+
+		ebt_json_object("ip6-proto");
+		ebt_json_uint("value", ipinfo->protocol);
+		if ((pe = getprotobynumber(ipinfo->protocol)))
+			ebt_json_str("name", pe->p_name);
+		ebt_json_bool("invert", ipinfo->invflags & EBT_IP6_PROTO);
+		ebt_json_end();
+	}
+	if (ipinfo->bitmask & EBT_IP6_SPORT)
+		json_range("ip6-sport", "min", "max", ipinfo->sport[0],
+			   ipinfo->sport[1], ipinfo->invflags & EBT_IP6_SPORT);
+	if (ipinfo->bitmask & EBT_IP6_DPORT)
+		json_range("ip6-dport", "min", "max", ipinfo->dport[0],
+			   ipinfo->dport[1], ipinfo->invflags & EBT_IP6_DPORT);
+	if (ipinfo->bitmask & EBT_IP6_ICMP6) {
+		ebt_json_object("ip6-icmp-type");
+		ebt_json_uint("type-min", ipinfo->icmpv6_type[0]);
+		ebt_json_uint("type-max", ipinfo->icmpv6_type[1]);
+		ebt_json_uint("code-min", ipinfo->icmpv6_code[0]);
+		ebt_json_uint("code-max", ipinfo->icmpv6_code[1]);
+		ebt_json_bool("invert", ipinfo->invflags & EBT_IP6_ICMP6);
+		ebt_json_end();
+	}
+}
+
 static int compare(const struct ebt_entry_match *m1,
    const struct ebt_entry_match *m2)
 {
@@ -411,6 +475,7 @@ static struct ebt_u_match ip6_match =
 	.print		= print,
 	.compare	= compare,
 	.extra_ops	= opts,
+	.print_json	= print_json,
 };
 
 static void _INIT(void)
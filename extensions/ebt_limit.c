@@ -184,6 +184,16 @@ static void print(const struct ebt_u_entry *entry,
 	printf("--limit-burst %u ", r->burst);
 }
 
+static void print_json(const struct ebt_u_entry *entry,
+   const struct ebt_entry_match *match)
+{
+	struct ebt_limit_info *r = (struct ebt_limit_info *)match->data;
+
+	/* Average time between packets, in 1/EBT_LIMIT_SCALE seconds */
+	ebt_json_uint("limit-avg", r->avg);
+	ebt_json_uint("limit-burst", r->burst);
+}
+
 static int compare(const struct ebt_entry_match* m1,
    const struct ebt_entry_match *m2)
 {
@@ -210,6 +220,7 @@ static struct ebt_u_match limit_match =
 	.print		= print,
 	.compare	= compare,
 	.extra_ops	= opts,
+	.print_json	= print_json,
 };
 
 static void _INIT(void)
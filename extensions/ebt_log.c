@@ -191,6 +191,18 @@ static void print(const struct ebt_u_entry *entry,
 	printf(" ");
 }
 
+static void print_json(const struct ebt_u_entry *entry,
+   const struct ebt_entry_watcher *watcher)
+{
+	struct ebt_log_info *loginfo = (struct ebt_log_info *)watcher->data;
+
+	ebt_json_str("log-level", eight_priority[loginfo->loglevel].c_name);
+	ebt_json_str("log-prefix", (char *)loginfo->prefix);
+	ebt_json_bool("log-ip", loginfo->bitmask & EBT_LOG_IP);
+	ebt_json_bool("log-arp", loginfo->bitmask & EBT_LOG_ARP);
+	ebt_json_bool("log-ip6", loginfo->bitmask & EBT_LOG_IP6);
+}
+
 static int compare(const struct ebt_entry_watcher *w1,
    const struct ebt_entry_watcher *w2)
 {
@@ -215,6 +227,7 @@ static struct ebt_u_watcher log_watcher =
 	.print		= print,
 	.compare	= compare,
 	.extra_ops	= opts,
+	.print_json	= print_json,
 };
 
 static void _INIT(void)
@@ -13,7 +13,7 @@
 #include "../include/ebtables_u.h"
 #include <linux/netfilter_bridge/ebt_mark_t.h>
 
-static int mark_supplied;
+static __thread int mark_supplied;
 
 #define MARK_TARGET  '1'
 #define MARK_SETMARK '2'
@@ -147,6 +147,27 @@ static void print(const struct ebt_u_entry *entry,
 	printf(" --mark-target %s", TARGET_NAME(tmp));
 }
 
+static void print_json(const struct ebt_u_entry *entry,
+   const struct ebt_entry_target *target)
+{
+	struct ebt_mark_t_info *markinfo =
+	   (struct ebt_mark_t_info *)target->data;
+	int tmp;
+
+	tmp = markinfo->target & ~EBT_VERDICT_BITS;
+	if (tmp == MARK_SET_VALUE)
+		ebt_json_str("action", "set");
+	else if (tmp == MARK_OR_VALUE)
+		ebt_json_str("action", "or");
+	else if (tmp == MARK_XOR_VALUE)
+		ebt_json_str("action", "xor");
+	else if (tmp == MARK_AND_VALUE)
+		ebt_json_str("action", "and");
+	ebt_json_uint("mark", markinfo->mark);
+	tmp = markinfo->target | ~EBT_VERDICT_BITS;
+	ebt_json_str("verdict", TARGET_NAME(tmp));
+}
+
 static int compare(const struct ebt_entry_target *t1,
    const struct ebt_entry_target *t2)
 {
@@ -170,6 +191,7 @@ static struct ebt_u_target mark_target =
 	.print		= print,
 	.compare	= compare,
 	.extra_ops	= opts,
+	.print_json	= print_json,
 };
 
 static void _INIT(void)
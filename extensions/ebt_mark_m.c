@@ -91,6 +91,19 @@ static void print(const struct ebt_u_entry *entry,
 		printf("0x%lx ", markinfo->mark);
 }
 
+static void print_json(const struct ebt_u_entry *entry,
+   const struct ebt_entry_match *match)
+{
+	struct ebt_mark_m_info *markinfo =
+	   (struct ebt_mark_m_info *)match->data;
+
+	if (markinfo->bitmask != EBT_MARK_OR)
+		ebt_json_uint("mark", markinfo->mark);
+	ebt_json_uint("mask", markinfo->mask);
+	ebt_json_bool("or", markinfo->bitmask == EBT_MARK_OR);
+	ebt_json_bool("invert", markinfo->invert);
+}
+
 static int compare(const struct ebt_entry_match *m1,
    const struct ebt_entry_match *m2)
 {
@@ -119,6 +132,7 @@ static struct ebt_u_match mark_match =
 	.print		= print,
 	.compare	= compare,
 	.extra_ops	= opts,
+	.print_json	= print_json,
 };
 
 static void _INIT(void)
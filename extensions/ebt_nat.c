@@ -14,7 +14,7 @@
 #include <netinet/ether.h>
 #include <linux/netfilter_bridge/ebt_nat.h>
 
-static int to_source_supplied, to_dest_supplied;
+static __thread int to_source_supplied, to_dest_supplied;
 
 #define NAT_S '1'
 #define NAT_D '1'
@@ -81,15 +81,12 @@ static int parse_s(int c, char **argv, int argc,
    struct ebt_entry_target **target)
 {
 	struct ebt_nat_info *natinfo = (struct ebt_nat_info *)(*target)->data;
-	struct ether_addr *addr;
-
 	switch (c) {
 	case NAT_S:
 		ebt_check_option2(flags, OPT_SNAT);
 		to_source_supplied = 1;
-		if (!(addr = ether_aton(optarg)))
+		if (ebt_get_mac(optarg, natinfo->mac))
 			ebt_print_error2("Problem with specified --to-source mac");
-		memcpy(natinfo->mac, addr, ETH_ALEN);
 		break;
 	case NAT_S_TARGET:
 		{ int tmp;
@@ -116,15 +113,12 @@ static int parse_d(int c, char **argv, int argc,
    struct ebt_entry_target **target)
 {
 	struct ebt_nat_info *natinfo = (struct ebt_nat_info *)(*target)->data;
-	struct ether_addr *addr;
-
 	switch (c) {
 	case NAT_D:
 		ebt_check_option2(flags, OPT_DNAT);
 		to_dest_supplied = 1;
-		if (!(addr = ether_aton(optarg)))
+		if (ebt_get_mac(optarg, natinfo->mac))
 			ebt_print_error2("Problem with specified --to-destination mac");
-		memcpy(natinfo->mac, addr, ETH_ALEN);
 		break;
 	case NAT_D_TARGET:
 		ebt_check_option2(flags, OPT_DNAT_TARGET);
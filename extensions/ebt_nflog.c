@@ -140,6 +140,17 @@ static void nflog_print(const struct ebt_u_entry *entry,
 		printf(" --nflog-threshold %d ", info->threshold);
 }
 
+static void nflog_print_json(const struct ebt_u_entry *entry,
+			     const struct ebt_entry_watcher *watcher)
+{
+	struct ebt_nflog_info *info = (struct ebt_nflog_info *)watcher->data;
+
+	ebt_json_str("nflog-prefix", info->prefix);
+	ebt_json_uint("nflog-group", info->group);
+	ebt_json_uint("nflog-range", info->len);
+	ebt_json_uint("nflog-threshold", info->threshold);
+}
+
 static int nflog_compare(const struct ebt_entry_watcher *w1,
 			 const struct ebt_entry_watcher *w2)
 {
@@ -164,6 +175,7 @@ static struct ebt_u_watcher nflog_watcher = {
 	.print = nflog_print,
 	.compare = nflog_compare,
 	.extra_ops = nflog_opts,
+	.print_json = nflog_print_json,
 };
 
 static void _INIT(void)
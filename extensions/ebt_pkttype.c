@@ -100,6 +100,19 @@ static void print(const struct ebt_u_entry *entry,
 		printf("%d ", pt->pkt_type);
 }
 
+static void print_json(const struct ebt_u_entry *entry,
+   const struct ebt_entry_match *match)
+{
+	struct ebt_pkttype_info *pt = (struct ebt_pkttype_info *)match->data;
+	int i = 0;
+
+	ebt_json_uint("pkttype-type", pt->pkt_type);
+	while (classes[i++][0]);
+	if (pt->pkt_type < i - 1)
+		ebt_json_str("pkttype-name", classes[pt->pkt_type]);
+	ebt_json_bool("invert", pt->invert);
+}
+
 static int compare(const struct ebt_entry_match *m1,
    const struct ebt_entry_match *m2)
 {
@@ -123,6 +136,7 @@ static struct ebt_u_match pkttype_match =
 	.print		= print,
 	.compare	= compare,
 	.extra_ops	= opts,
+	.print_json	= print_json,
 };
 
 static void _INIT(void)
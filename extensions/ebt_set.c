@@ -31,10 +31,10 @@ set_check_v0(const struct ebt_u_entry *entry,
 static void
 print_match(const char *prefix, const struct xt_set_info *info)
 {
-	int i;
 	char setname[IPSET_MAXNAMELEN];
 
-	get_set_byid(setname, info->index);
+	if (get_set_byid(setname, info->index))
+		return;
 	printf("--%s%s %s",
 		   prefix,
 		   (info->flags & IPSET_INV_MATCH) ? " !" : "",
@@ -191,8 +191,8 @@ set_parse_v4(int c, char **argv, int argc, const struct ebt_u_entry *entry,
 		break;
 	case '2':
 		fprintf(stderr,
-				"--set-%s option deprecated, please use --match-set-%s\n", type2str[type]),
-			type2str[type];
+				"--set-%s option deprecated, please use --match-set-%s\n",
+				type2str[type], type2str[type]);
 		/* fall through */
 	case '1': /* --match-set <set> <flag>[,<flag> */
 		if (info->match_set.dim)
@@ -205,7 +205,8 @@ set_parse_v4(int c, char **argv, int argc, const struct ebt_u_entry *entry,
 				"setname `%s' too long, max %d characters.",
 				optarg, IPSET_MAXNAMELEN - 1);
 
-		get_set_byname(optarg, &info->match_set);
+		if (get_set_byname(optarg, &info->match_set))
+			return -1;
 		if (type == TYPE_SRC)
 		{
 			info->match_set.flags |= IPSET_DIM_ONE_SRC;
@@ -289,6 +290,16 @@ set_print_v4_dst(const struct ebt_u_entry *entry,
 	set_print_v4_matchinfo(info, "match-set-dst", "");
 }
 
+/* Resolves the set index before the listing starts, see get_set_byid() */
+static void
+set_list_prepare_v4(const struct ebt_entry_match *match)
+{
+	const struct xt_set_info_match_v4 *info = (const void *)match->data;
+	char setname[IPSET_MAXNAMELEN];
+
+	get_set_byid(setname, info->match_set.index);
+}
+
 static void init(struct ebt_entry_match *match)
 {
 }
@@ -332,6 +343,7 @@ static struct ebt_u_match set_match_src =
 		.final_check = set_check_v0,
 		.print = set_print_v4_src,
 		.compare = compare,
+		.list_prepare = set_list_prepare_v4,
 		.extra_ops = set_opts_v3_src,
 };
 
@@ -346,6 +358,7 @@ static struct ebt_u_match set_match_dst =
 		.final_check = set_check_v0,
 		.print = set_print_v4_dst,
 		.compare = compare,
+		.list_prepare = set_list_prepare_v4,
 		.extra_ops = set_opts_v3_dst,
 };
 
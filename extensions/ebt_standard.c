@@ -48,21 +48,33 @@ static void print(const struct ebt_u_entry *entry,
 		struct ebt_u_entries *entries;
 
 		entries = entry->replace->chains[verdict + NF_BR_NUMHOOKS];
-		printf("%s", entries->name);
+		fputs(entries->name, stdout);
 		return;
 	}
 	if (verdict == EBT_CONTINUE)
-		printf("CONTINUE ");
+		fputs("CONTINUE ", stdout);
 	else if (verdict == EBT_ACCEPT)
-		printf("ACCEPT ");
+		fputs("ACCEPT ", stdout);
 	else if (verdict == EBT_DROP)
-		printf("DROP ");
+		fputs("DROP ", stdout);
 	else if (verdict == EBT_RETURN)
-		printf("RETURN ");
+		fputs("RETURN ", stdout);
 	else
 		ebt_print_bug("Bad standard target");
 }
 
+static void print_json(const struct ebt_u_entry *entry,
+   const struct ebt_entry_target *target)
+{
+	int verdict = ((struct ebt_standard_target *)target)->verdict;
+
+	if (verdict >= 0)
+		ebt_json_str("jump", entry->replace->chains[verdict +
+			     NF_BR_NUMHOOKS]->name);
+	else
+		ebt_json_str("verdict", ebt_standard_targets[-verdict - 1]);
+}
+
 static int compare(const struct ebt_entry_target *t1,
    const struct ebt_entry_target *t2)
 {
@@ -82,6 +94,7 @@ static struct ebt_u_target standard =
 	.print		= print,
 	.compare	= compare,
 	.extra_ops	= opts,
+	.print_json	= print_json,
 };
 
 static void _INIT(void)
@@ -147,6 +147,34 @@ static void print(const struct ebt_u_entry *entry,
 	}
 }
 
+static void print_json(const struct ebt_u_entry *entry,
+   const struct ebt_entry_match *match)
+{
+	struct ebt_vlan_info *vlaninfo = (struct ebt_vlan_info *) match->data;
+
+	if (vlaninfo->bitmask & EBT_VLAN_ID) {
+		ebt_json_object("vlan-id");
+		ebt_json_uint("value", vlaninfo->id);
+		ebt_json_bool("invert", vlaninfo->invflags & EBT_VLAN_ID);
+		ebt_json_end();
+	}
+	if (vlaninfo->bitmask & EBT_VLAN_PRIO) {
+		ebt_json_object("vlan-prio");
+		ebt_json_uint("value", vlaninfo->prio);
+		ebt_json_bool("invert", vlaninfo->invflags & EBT_VLAN_PRIO);
+		ebt_json_end();
+	}
+	if (vlaninfo->bitmask & EBT_VLAN_ENCAP) {
+		ebt_json_object("vlan-encap");
+		ebt_json_uint("value", ntohs(vlaninfo->encap));
+		ethent = getethertypebynumber(ntohs(vlaninfo->encap));
+		if (ethent != NULL)
+			ebt_json_str("name", ethent->e_name);
+		ebt_json_bool("invert", vlaninfo->invflags & EBT_VLAN_ENCAP);
+		ebt_json_end();
+	}
+}
+
 static int compare(const struct ebt_entry_match *vlan1,
    const struct ebt_entry_match *vlan2)
 {
@@ -179,6 +207,7 @@ static struct ebt_u_match vlan_match = {
 	.print		= print,
 	.compare	= compare,
 	.extra_ops	= opts,
+	.print_json	= print_json,
 };
 
 static void _INIT(void)
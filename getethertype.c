@@ -36,126 +36,353 @@
 #include <features.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 #include <netinet/ether.h>
 #include <net/ethernet.h>
 
 #include "ethernetdb.h"
 
 #define	MAXALIASES	35
+/* Seconds between two checks of the modification time of the file */
+#define ETHERTYPES_RECHECK 1
 
-static FILE *etherf = NULL;
-static char line[BUFSIZ + 1];
-static struct ethertypeent et_ent;
-static char *ethertype_aliases[MAXALIASES];
-static int ethertype_stayopen;
+/*
+ * The ethertypes file is parsed once into an array of entries in file
+ * order, an index sorted on number and a case-insensitive hash table of
+ * the names and aliases. When the first entry with a certain number or
+ * name is found in the file, the same entry is found here.
+ * If the file can't be read, builtin_ethertypes is used instead.
+ */
+struct ethertype_name {
+	const char *name;
+	struct ethertypeent *ent;
+};
 
-void setethertypeent(int f)
+struct ethertype_db {
+	char *buf;
+	char **aliases;
+	struct ethertypeent *ents;
+	struct ethertypeent **by_number;
+	struct ethertype_name *by_name;
+	unsigned int n, name_mask;
+	/* Identifies the file contents, mtime == 0 for the builtin table */
+	time_t mtime;
+	off_t size;
+	ino_t ino;
+	time_t checked;
+	struct ethertype_db *prev;
+};
+
+static const char builtin_ethertypes[] =
+	"IPv4		0800	ip ip4\n"
+	"X25		0805\n"
+	"ARP		0806	ether-arp\n"
+	"FR_ARP		0808\n"
+	"BPQ		08FF\n"
+	"DEC		6000\n"
+	"DNA_DL		6001\n"
+	"DNA_RC		6002\n"
+	"DNA_RT		6003\n"
+	"LAT		6004\n"
+	"DIAG		6005\n"
+	"CUST		6006\n"
+	"SCA		6007\n"
+	"TEB		6558\n"
+	"RAW_FR		6559\n"
+	"RARP		8035\n"
+	"AARP		80F3\n"
+	"ATALK		809B\n"
+	"802_1Q		8100	8021q 1q 802.1q dot1q\n"
+	"IPX		8137\n"
+	"NetBEUI		8191\n"
+	"IPv6		86DD	ip6\n"
+	"PPP		880B\n"
+	"ATMMPOA		884C\n"
+	"PPP_DISC	8863\n"
+	"PPP_SES		8864\n"
+	"ATMFATE		8884\n"
+	"LOOP		9000	loopback\n";
+
+static struct ethertype_db *db;
+static pthread_mutex_t db_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Position of getethertypeent(), every thread walks the entries on its own */
+static __thread unsigned int ent_pos;
+static __thread int ethertype_stayopen;
+
+static unsigned int hash_name(const char *name)
 {
-	if (etherf == NULL)
-		etherf = fopen(_PATH_ETHERTYPES, "r");
-	else
-		rewind(etherf);
-	ethertype_stayopen |= f;
+	unsigned int hash = 2166136261U;
+
+	for (; *name; name++) {
+		hash ^= tolower((unsigned char)*name);
+		hash *= 16777619U;
+	}
+	return hash;
 }
 
-void endethertypeent(void)
+static void add_name(struct ethertype_db *d, const char *name,
+		     struct ethertypeent *e)
 {
-	if (etherf) {
-		fclose(etherf);
-		etherf = NULL;
-	}
-	ethertype_stayopen = 0;
+	unsigned int i = hash_name(name) & d->name_mask;
+
+	for (; d->by_name[i].name; i = (i + 1) & d->name_mask)
+		/* The first entry with the name wins */
+		if (!strcasecmp(d->by_name[i].name, name))
+			return;
+	d->by_name[i].name = name;
+	d->by_name[i].ent = e;
 }
 
-struct ethertypeent *getethertypeent(void)
+static int cmp_number(const void *a, const void *b)
 {
-	char *e;
-	char *endptr;
-	register char *cp, **q;
+	const struct ethertypeent *e1 = *(struct ethertypeent * const *)a;
+	const struct ethertypeent *e2 = *(struct ethertypeent * const *)b;
 
-	if (etherf == NULL
-	    && (etherf = fopen(_PATH_ETHERTYPES, "r")) == NULL) {
-		return (NULL);
-	}
+	if (e1->e_ethertype != e2->e_ethertype)
+		return e1->e_ethertype - e2->e_ethertype;
+	/* Keep the file order */
+	return e1 < e2 ? -1 : e1 > e2;
+}
 
-again:
-	if ((e = fgets(line, BUFSIZ, etherf)) == NULL) {
-		return (NULL);
+/* Parse the contents of an ethertypes file, buf becomes part of the db */
+static struct ethertype_db *parse_ethertypes(char *buf)
+{
+	struct ethertype_db *d;
+	unsigned int max_ents = 1, max_aliases = 1, nalias = 0, *first_alias;
+	unsigned int i, j, names = 0;
+	char *e, *cp, *endptr, *next;
+
+	if (!(d = (struct ethertype_db *)calloc(1, sizeof(struct ethertype_db))))
+		return NULL;
+	d->buf = buf;
+	/* Upper bounds for the number of entries and aliases */
+	for (cp = buf; *cp; cp++) {
+		if (*cp == '\n')
+			max_ents++;
+		else if (*cp == ' ' || *cp == '\t')
+			max_aliases++;
 	}
-	if (*e == '#')
-		goto again;
-	cp = strpbrk(e, "#\n");
-	if (cp == NULL)
-		goto again;
-	*cp = '\0';
-	et_ent.e_name = e;
-	cp = strpbrk(e, " \t");
-	if (cp == NULL)
-		goto again;
-	*cp++ = '\0';
-	while (*cp == ' ' || *cp == '\t')
-		cp++;
-	e = strpbrk(cp, " \t");
-	if (e != NULL)
-		*e++ = '\0';
-// Check point
-	et_ent.e_ethertype = strtol(cp, &endptr, 16);
-	if (*endptr != '\0'
-	    || (et_ent.e_ethertype < ETH_ZLEN
-		|| et_ent.e_ethertype > 0xFFFF))
-		goto again;	// Skip invalid etherproto type entry
-	q = et_ent.e_aliases = ethertype_aliases;
-	if (e != NULL) {
+	d->ents = (struct ethertypeent *)malloc(max_ents * sizeof(struct ethertypeent));
+	d->aliases = (char **)malloc((max_aliases + max_ents) * sizeof(char *));
+	first_alias = (unsigned int *)malloc(max_ents * sizeof(unsigned int));
+	if (!d->ents || !d->aliases || !first_alias)
+		goto error;
+
+	/* Same syntax as always: name number [alias ...] [# comment] */
+	for (e = buf; e && *e; e = next) {
+		struct ethertypeent *ent = &d->ents[d->n];
+		unsigned int q;
+
+		if ((next = strchr(e, '\n')))
+			*next++ = '\0';
+		if (*e == '#')
+			continue;
+		if ((cp = strchr(e, '#')))
+			*cp = '\0';
+		else if (!next) /* Incomplete last line */
+			continue;
+		ent->e_name = e;
+		cp = strpbrk(e, " \t");
+		if (cp == NULL)
+			continue;
+		*cp++ = '\0';
+		while (*cp == ' ' || *cp == '\t')
+			cp++;
+		e = strpbrk(cp, " \t");
+		if (e != NULL)
+			*e++ = '\0';
+		ent->e_ethertype = strtol(cp, &endptr, 16);
+		if (*endptr != '\0' || ent->e_ethertype < ETH_ZLEN ||
+		    ent->e_ethertype > 0xFFFF)
+			continue; /* Skip invalid etherproto type entry */
+		first_alias[d->n] = q = nalias;
 		cp = e;
 		while (cp && *cp) {
 			if (*cp == ' ' || *cp == '\t') {
 				cp++;
 				continue;
 			}
-			if (q < &ethertype_aliases[MAXALIASES - 1])
-				*q++ = cp;
+			if (nalias - q < MAXALIASES - 1)
+				d->aliases[nalias++] = cp;
 			cp = strpbrk(cp, " \t");
 			if (cp != NULL)
 				*cp++ = '\0';
 		}
+		d->aliases[nalias++] = NULL;
+		names += nalias - q;
+		d->n++;
+	}
+	for (i = 0; i < d->n; i++)
+		d->ents[i].e_aliases = d->aliases + first_alias[i];
+	free(first_alias);
+	first_alias = NULL;
+
+	if (!(d->by_number = (struct ethertypeent **)
+	      malloc((d->n + 1) * sizeof(struct ethertypeent *))))
+		goto error;
+	for (i = 0; i < d->n; i++)
+		d->by_number[i] = &d->ents[i];
+	qsort(d->by_number, d->n, sizeof(struct ethertypeent *), cmp_number);
+
+	/* A power of 2, at least twice the number of names */
+	for (i = 16; i < 2 * names; i <<= 1);
+	d->name_mask = i - 1;
+	if (!(d->by_name = (struct ethertype_name *)
+	      calloc(i, sizeof(struct ethertype_name))))
+		goto error;
+	for (i = 0; i < d->n; i++) {
+		add_name(d, d->ents[i].e_name, &d->ents[i]);
+		for (j = 0; d->ents[i].e_aliases[j]; j++)
+			add_name(d, d->ents[i].e_aliases[j], &d->ents[i]);
 	}
-	*q = NULL;
-	return (&et_ent);
+	return d;
+error:
+	free(first_alias);
+	free(d->ents);
+	free(d->aliases);
+	free(d->by_number);
+	free(d);
+	return NULL;
 }
 
+static void free_db(struct ethertype_db *d)
+{
+	if (!d)
+		return;
+	free(d->buf);
+	free(d->aliases);
+	free(d->ents);
+	free(d->by_number);
+	free(d->by_name);
+	free(d);
+}
 
-struct ethertypeent *getethertypebyname(const char *name)
+static struct ethertype_db *read_ethertypes(struct stat *st)
 {
-	register struct ethertypeent *e;
-	register char **cp;
-
-	setethertypeent(ethertype_stayopen);
-	while ((e = getethertypeent()) != NULL) {
-		if (strcasecmp(e->e_name, name) == 0)
-			break;
-		for (cp = e->e_aliases; *cp != 0; cp++)
-			if (strcasecmp(*cp, name) == 0)
-				goto found;
+	struct ethertype_db *d;
+	FILE *file;
+	char *buf;
+
+	if (!(file = fopen(_PATH_ETHERTYPES, "r")))
+		return NULL;
+	if (fstat(fileno(file), st) || !(buf = (char *)malloc(st->st_size + 1))) {
+		fclose(file);
+		return NULL;
 	}
-found:
-	if (!ethertype_stayopen)
-		endethertypeent();
-	return (e);
+	buf[fread(buf, 1, st->st_size, file)] = '\0';
+	fclose(file);
+	if (!(d = parse_ethertypes(buf)))
+		free(buf);
+	return d;
+}
+
+/* Returns the current database, (re)reading the file if it changed. The
+ * previous database is kept around a bit longer, because other threads
+ * can still be using an entry of it */
+static struct ethertype_db *get_db()
+{
+	struct ethertype_db *d;
+	struct stat st;
+	time_t now = time(NULL);
+	char *buf;
+
+	pthread_mutex_lock(&db_lock);
+	if (db && now - db->checked < ETHERTYPES_RECHECK)
+		goto out;
+	if (stat(_PATH_ETHERTYPES, &st))
+		memset(&st, 0, sizeof(st));
+	if (db && db->mtime == st.st_mtime && db->size == st.st_size &&
+	    db->ino == st.st_ino) {
+		db->checked = now;
+		goto out;
+	}
+	if (!st.st_mtime || !(d = read_ethertypes(&st))) {
+		if (db && !db->mtime) {
+			db->checked = now;
+			goto out;
+		}
+		memset(&st, 0, sizeof(st));
+		if (!(buf = strdup(builtin_ethertypes)) ||
+		    !(d = parse_ethertypes(buf))) {
+			free(buf);
+			goto out;
+		}
+	}
+	d->mtime = st.st_mtime;
+	d->size = st.st_size;
+	d->ino = st.st_ino;
+	d->checked = now;
+	if (db) {
+		free_db(db->prev);
+		db->prev = NULL;
+	}
+	d->prev = db;
+	db = d;
+	ent_pos = 0;
+out:
+	d = db;
+	pthread_mutex_unlock(&db_lock);
+	return d;
+}
+
+void setethertypeent(int f)
+{
+	ent_pos = 0;
+	ethertype_stayopen |= f;
+}
+
+void endethertypeent(void)
+{
+	ent_pos = 0;
+	ethertype_stayopen = 0;
+}
+
+struct ethertypeent *getethertypeent(void)
+{
+	struct ethertype_db *d = get_db();
+
+	if (!d || ent_pos >= d->n)
+		return NULL;
+	return &d->ents[ent_pos++];
+}
+
+struct ethertypeent *getethertypebyname(const char *name)
+{
+	struct ethertype_db *d = get_db();
+	unsigned int i;
+
+	if (!d)
+		return NULL;
+	for (i = hash_name(name) & d->name_mask; d->by_name[i].name;
+	     i = (i + 1) & d->name_mask)
+		if (!strcasecmp(d->by_name[i].name, name))
+			return d->by_name[i].ent;
+	return NULL;
 }
 
 struct ethertypeent *getethertypebynumber(int type)
 {
-	register struct ethertypeent *e;
-
-	setethertypeent(ethertype_stayopen);
-	while ((e = getethertypeent()) != NULL)
-		if (e->e_ethertype == type)
-			break;
-	if (!ethertype_stayopen)
-		endethertypeent();
-	return (e);
+	struct ethertype_db *d = get_db();
+	unsigned int lo = 0, hi, mid;
+
+	if (!d)
+		return NULL;
+	/* Find the first entry with this number */
+	hi = d->n;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (d->by_number[mid]->e_ethertype < type)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < d->n && d->by_number[lo]->e_ethertype == type)
+		return d->by_number[lo];
+	return NULL;
 }
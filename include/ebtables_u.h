@@ -23,6 +23,7 @@
 
 #ifndef EBTABLES_U_H
 #define EBTABLES_U_H
+#include <stdio.h>
 #include <netinet/in.h>
 #include <netinet/ether.h>
 #include <linux/netfilter_bridge/ebtables.h>
@@ -65,9 +66,40 @@ struct ebt_cntchanges
 	unsigned short change; /* determines incremental/decremental/change */
 	struct ebt_cntchanges *prev;
 	struct ebt_cntchanges *next;
+	/* CNT_MOVE: the CNT_DEL entry at the old position of the rule */
+	struct ebt_cntchanges *from;
+	/* Set by ebt_deliver_counters() for the rules that have an old counter */
+	unsigned int old_nr;
 };
 
 #define EBT_ORI_MAX_CHAINS 10
+/* Identifies the kernel table a struct ebt_u_replace was built from,
+ * used by --optimistic to detect concurrent updates */
+struct ebt_u_fingerprint
+{
+	/* 0 if the table didn't come from the kernel */
+	int valid;
+	/* 1 if it is the table we delivered ourselves */
+	int delivered;
+	unsigned int valid_hooks;
+	unsigned int nentries;
+	unsigned int entries_size;
+	uint64_t hash;
+};
+
+/* A copy of the table last delivered to the kernel, a later retrieval of
+ * the table takes it instead of the kernel's entries when the information
+ * of the kernel table still matches fp */
+struct ebt_u_delivered
+{
+	struct ebt_u_delivered *next;
+	char name[EBT_TABLE_MAXNAMELEN];
+	struct ebt_u_fingerprint fp;
+	char *entries;
+	/* Set by ebt_deliver_counters(), NULL until then */
+	struct ebt_counter *counters;
+};
+
 struct ebt_u_replace
 {
 	char name[EBT_TABLE_MAXNAMELEN];
@@ -96,6 +128,8 @@ struct ebt_u_replace
 	char *filename;
 	/* tells what happened to the old rules (counter changes) */
 	struct ebt_cntchanges *cc;
+	/* the kernel table as it was when we retrieved it */
+	struct ebt_u_fingerprint fp;
 };
 
 struct ebt_u_table
@@ -168,6 +202,7 @@ struct ebt_u_match
 	 */
 	unsigned int flags;
 	unsigned int option_offset;
+	/* NULL until the extension is used, see ebt_load_match() */
 	struct ebt_entry_match *m;
 	/*
 	 * if used == 1 we no longer have to add it to
@@ -176,6 +211,17 @@ struct ebt_u_match
 	 */
 	unsigned int used;
 	struct ebt_u_match *next;
+	/* optional, emits the match data with the ebt_json_*() functions
+	 * for -L --format, the raw data is emitted if NULL */
+	void (*print_json)(const struct ebt_u_entry *entry,
+	   const struct ebt_entry_match *match);
+	/* optional, applies the options parsed for --among-update to the
+	 * match of an existing rule, see ebt_update_rule() */
+	void (*update)(struct ebt_entry_match **match);
+	/* optional, called for every match of the rules that are about to
+	 * be listed, so that the extension can look up what it will print
+	 * (set names) before the listing starts */
+	void (*list_prepare)(const struct ebt_entry_match *match);
 };
 
 struct ebt_u_watcher
@@ -200,11 +246,14 @@ struct ebt_u_watcher
 	struct ebt_entry_watcher *w;
 	unsigned int used;
 	struct ebt_u_watcher *next;
+	void (*print_json)(const struct ebt_u_entry *entry,
+	   const struct ebt_entry_watcher *watcher);
 };
 
 struct ebt_u_target
 {
 	char name[EBT_FUNCTION_MAXNAMELEN];
+	uint8_t revision;
 	unsigned int size;
 	void (*help)(void);
 	void (*init)(struct ebt_entry_target *t);
@@ -224,6 +273,8 @@ struct ebt_u_target
 	struct ebt_entry_target *t;
 	unsigned int used;
 	struct ebt_u_target *next;
+	void (*print_json)(const struct ebt_u_entry *entry,
+	   const struct ebt_entry_target *target);
 };
 
 
@@ -237,17 +288,189 @@ struct ebt_icmp_names {
 
 /* libebtc.c */
 
+/*
+ * All state of a libebtc user. Each thread works on the handle it bound to
+ * with ebt_handle_bind(), which is ebt_default_handle unless specified
+ * otherwise. The ebtables, ebtables-restore and ebtablesd programs only use
+ * the default handle. Its extension lists are the lists the extensions
+ * register themselves in, other handles get a private copy of every
+ * extension so that they can parse rules independently.
+ */
+struct ebt_handle
+{
+	/* The error messages are put in here when silent == 1,
+	 * errormsg[0] == '\0' implies there was no error */
+	char errormsg[ERRORMSG_MAXLEN];
+	int silent;
+	/* 0: default
+	 * 1: the inverse '!' of the option has already been specified */
+	int invert;
+	/* 0: default, print only 2 digits if necessary
+	 * 2: always print 2 digits, a printed mac address
+	 * then always has the same length */
+	int printstyle_mac;
+	/* The socket used to talk to the kernel, -1 if not yet opened */
+	int sockfd;
+	/* Incremented for every table that is delivered, the extensions
+	 * that cache kernel state (set names) start over when it changes */
+	unsigned int generation;
+	int use_lockfd;
+	int optimistic;
+	char *modprobe;
+	struct ebt_u_match *matches;
+	struct ebt_u_watcher *watchers;
+	struct ebt_u_target *targets;
+	/* One for every table delivered through the handle */
+	struct ebt_u_delivered *delivered;
+	/* The table the handle works on (not used for ebt_default_handle) */
+	struct ebt_u_replace replace;
+	/* 1 if replace equals the kernel table described by replace.fp,
+	 * ebt_handle_open() can then keep it */
+	int in_sync;
+	/* NULL unless --stats or EBTABLES_STATS is used */
+	struct ebt_stats *stats;
+};
+
+extern struct ebt_handle ebt_default_handle;
+extern __thread struct ebt_handle *ebt_cur_handle;
+
+#define ebt_errormsg (ebt_cur_handle->errormsg)
+#define ebt_silent (ebt_cur_handle->silent)
+#define ebt_invert (ebt_cur_handle->invert)
+#define ebt_printstyle_mac (ebt_cur_handle->printstyle_mac)
+#define ebt_modprobe (ebt_cur_handle->modprobe)
+#define use_lockfd (ebt_cur_handle->use_lockfd)
+#define ebt_optimistic (ebt_cur_handle->optimistic)
+#define ebt_generation (ebt_cur_handle->generation)
+#define ebt_delivered (ebt_cur_handle->delivered)
+#define ebt_cur_stats (ebt_cur_handle->stats)
+#define ebt_matches (ebt_cur_handle->matches)
+#define ebt_watchers (ebt_cur_handle->watchers)
+#define ebt_targets (ebt_cur_handle->targets)
+
 extern struct ebt_u_table *ebt_tables;
-extern struct ebt_u_match *ebt_matches;
-extern struct ebt_u_watcher *ebt_watchers;
-extern struct ebt_u_target *ebt_targets;
 
-extern int use_lockfd;
+/* --stats: the phases of a command that are timed */
+enum {
+	EBT_STATS_LOCK,
+	EBT_STATS_FETCH,
+	EBT_STATS_DECODE,
+	EBT_STATS_PARSE,
+	EBT_STATS_LOOPS,
+	EBT_STATS_TRANSLATE,
+	EBT_STATS_DELIVER,
+	EBT_STATS_COUNTERS,
+	EBT_STATS_LIST,
+	EBT_STATS_NPHASES
+};
+
+/* Deeper nested phases are not timed */
+#define EBT_STATS_DEPTH 8
+
+struct ebt_stats
+{
+	double start;
+	/* Time spent in each phase, without the time of nested phases */
+	double seconds[EBT_STATS_NPHASES];
+	unsigned int calls[EBT_STATS_NPHASES];
+	/* The phases in progress */
+	struct {
+		int phase;
+		double start, nested;
+	} stack[EBT_STATS_DEPTH];
+	int depth;
+	unsigned int commands;
+	/* Data exchanged with the kernel */
+	uint64_t bytes_in, bytes_out;
+	unsigned int rules_in, chains_in, rules_out, chains_out;
+};
+
+/* Allocations of the whole process, only counted when malloc_stats.o is
+ * linked in and statistics are enabled */
+struct ebt_heap_stats
+{
+	/* 1 if malloc_stats.o is linked in */
+	int available;
+	int counting;
+	unsigned long allocs, frees;
+	long in_use, peak;
+};
+
+extern struct ebt_heap_stats ebt_heap_stats;
+
+void ebt_stats_enable();
+void ebt_stats_reset(struct ebt_stats *s);
+void ebt_stats_push(int phase);
+void ebt_stats_pop();
+void ebt_stats_print(struct ebt_stats *s);
+#define ebt_stats_begin(phase) \
+	do { if (ebt_cur_stats) ebt_stats_push(phase); } while (0)
+#define ebt_stats_end() \
+	do { if (ebt_cur_stats) ebt_stats_pop(); } while (0)
+#define ebt_stats_add(field, n) \
+	do { if (ebt_cur_stats) ebt_cur_stats->field += (n); } while (0)
+
+struct ebt_handle *ebt_handle_new(const char *table);
+void ebt_handle_free(struct ebt_handle *h);
+struct ebt_handle *ebt_handle_bind(struct ebt_handle *h);
+int ebt_handle_open(struct ebt_handle *h, int init);
+int ebt_handle_command(struct ebt_handle *h, int argc, char *argv[]);
+int ebt_handle_commit(struct ebt_handle *h);
+const char *ebt_handle_error(struct ebt_handle *h);
+int ebt_handle_restore(struct ebt_handle *h, FILE *file, const char *source);
+
+/* Building rules without command line parsing */
+struct ebt_txn;
+
+#define EBT_RULE_PROTO_LENGTH 0x10000
+struct ebt_u_entry *ebt_rule_new();
+void ebt_rule_free(struct ebt_u_entry *e);
+int ebt_rule_set_proto(struct ebt_u_entry *e, int proto, int invert);
+int ebt_rule_set_iface(struct ebt_u_entry *e, unsigned int which,
+		       const char *name, int invert);
+int ebt_rule_set_mac(struct ebt_u_entry *e, unsigned int which,
+		     const unsigned char *mac, const unsigned char *mask,
+		     int invert);
+void ebt_rule_set_counters(struct ebt_u_entry *e, uint64_t pcnt, uint64_t bcnt);
+int ebt_rule_add_match(struct ebt_u_entry *e, const char *name,
+		       const void *data, unsigned int size);
+int ebt_rule_add_watcher(struct ebt_u_entry *e, const char *name,
+			 const void *data, unsigned int size);
+int ebt_rule_set_target(struct ebt_u_entry *e, const char *name,
+			const void *data, unsigned int size);
+int ebt_rule_set_verdict(struct ebt_u_entry *e, int verdict);
+/* info points to the kernel struct of the extension,
+ * e.g. ebt_rule_match(e, "ip", &ip_info) with struct ebt_ip_info ip_info */
+#define ebt_rule_match(e, name, info) \
+	ebt_rule_add_match(e, name, info, sizeof(*(info)))
+#define ebt_rule_watcher(e, name, info) \
+	ebt_rule_add_watcher(e, name, info, sizeof(*(info)))
+#define ebt_rule_target(e, name, info) \
+	ebt_rule_set_target(e, name, info, sizeof(*(info)))
+
+struct ebt_txn *ebt_txn_begin(struct ebt_handle *h);
+int ebt_txn_new_chain(struct ebt_txn *txn, const char *name, int policy);
+int ebt_txn_policy(struct ebt_txn *txn, const char *chain, int policy);
+int ebt_txn_flush(struct ebt_txn *txn, const char *chain);
+int ebt_txn_delete_chain(struct ebt_txn *txn, const char *chain);
+int ebt_txn_jump(struct ebt_txn *txn, struct ebt_u_entry *e, const char *chain);
+int ebt_txn_add(struct ebt_txn *txn, const char *chain, int rule_nr,
+		struct ebt_u_entry *e);
+int ebt_txn_delete(struct ebt_txn *txn, const char *chain, int rule_nr);
+int ebt_txn_move(struct ebt_txn *txn, const char *chain, int rule_nr,
+		 int new_nr);
+int ebt_txn_move_to(struct ebt_txn *txn, const char *chain, int rule_nr,
+		    const char *to_chain, int new_nr);
+int ebt_txn_commit(struct ebt_txn *txn);
+void ebt_txn_abort(struct ebt_txn *txn);
 
 void ebt_register_table(struct ebt_u_table *);
 void ebt_register_match(struct ebt_u_match *);
 void ebt_register_watcher(struct ebt_u_watcher *);
 void ebt_register_target(struct ebt_u_target *t);
+void ebt_load_match(struct ebt_u_match *m);
+void ebt_load_watcher(struct ebt_u_watcher *w);
+void ebt_load_target(struct ebt_u_target *t);
 int ebt_get_kernel_table(struct ebt_u_replace *replace, int init);
 struct ebt_u_target *ebt_find_target(const char *name);
 struct ebt_u_match *ebt_find_match(const char *name);
@@ -274,6 +497,8 @@ void ebt_add_rule(struct ebt_u_replace *replace, struct ebt_u_entry *new_entry,
 		  int rule_nr);
 void ebt_delete_rule(struct ebt_u_replace *replace,
 		     struct ebt_u_entry *new_entry, int begin, int end);
+void ebt_update_rule(struct ebt_u_replace *replace,
+		     struct ebt_u_entry *new_entry, int rule_nr);
 void ebt_zero_counters(struct ebt_u_replace *replace);
 void ebt_change_counters(struct ebt_u_replace *replace,
 		     struct ebt_u_entry *new_entry, int begin, int end,
@@ -298,18 +523,85 @@ void __ebt_print_error(char *format, ...);
 
 /* communication.c */
 
+/*
+ * How the EBT_SO_* socket options reach the kernel. ebt_kernel_backend is
+ * the default, ebt_memory_backend (emulation.c) emulates the kernel tables
+ * inside the process, so that no root or bridge netfilter kernel is needed.
+ * The backend is chosen per process, before the first socket is made, see
+ * ebt_set_backend().
+ */
+struct ebt_backend
+{
+	const char *name;
+	/* Returns the socket for a new handle, -1 on error */
+	int (*socket)();
+	int (*getsockopt)(int fd, int optname, void *optval, socklen_t *optlen);
+	int (*setsockopt)(int fd, int optname, const void *optval,
+	   socklen_t optlen);
+	/* The SO_IP_SET requests of the set match, req starts with the
+	 * operation */
+	int (*ipset)(int fd, void *req, socklen_t *size);
+	/* 1 if missing tables can be loaded with modprobe */
+	int modules;
+};
+
+extern struct ebt_backend ebt_kernel_backend;
+extern struct ebt_backend ebt_memory_backend;
+/* Creates an ipset set in the emulation, returns its index */
+unsigned int ebt_emu_add_set(const char *name, unsigned int family);
+
+int ebt_set_backend(const char *name);
+struct ebt_backend *ebt_get_backend();
 int ebt_get_table(struct ebt_u_replace *repl, int init);
+int ebt_get_sockfd();
 void ebt_deliver_counters(struct ebt_u_replace *repl);
-void ebt_deliver_table(struct ebt_u_replace *repl);
+int ebt_deliver_table(struct ebt_u_replace *repl);
+void ebt_free_delivered();
+int ebt_refresh_kernel_table(struct ebt_u_replace *repl);
+uint64_t ebt_rule_id(const struct ebt_u_replace *replace,
+		     const struct ebt_u_entry *e);
+
+/* analysis.c */
+
+int ebt_rule_covers(const struct ebt_u_entry *a, const struct ebt_u_entry *b);
+int ebt_rules_disjoint(const struct ebt_u_entry *a,
+		       const struct ebt_u_entry *b);
+
+/* cost.c */
+
+void ebt_cost_report(struct ebt_u_replace *replace);
+
+/* diff.c */
+
+int ebt_diff_tables(const char *table, const char *source_a,
+		    const char *source_b);
 
 /* useful_functions.c */
 
-extern int ebt_invert;
 void ebt_check_option(unsigned int *flags, unsigned int mask);
 #define ebt_check_inverse(arg) _ebt_check_inverse(arg, argc, argv)
 int _ebt_check_inverse(const char option[], int argc, char **argv);
 void ebt_print_mac(const unsigned char *mac);
 void ebt_print_mac_and_mask(const unsigned char *mac, const unsigned char *mask);
+void ebt_print_u64(uint64_t n);
+void ebt_print_ipv4(uint32_t addr);
+/*
+ * Structured listing (-L --format json|cbor). Containers are closed with
+ * ebt_json_end(), key is NULL for the elements of an array. The caller of
+ * ebt_json_start() holds the stdout lock (flockfile()).
+ */
+void ebt_json_start(int cbor);
+void ebt_json_object(const char *key);
+void ebt_json_array(const char *key);
+void ebt_json_end();
+void ebt_json_str(const char *key, const char *s);
+void ebt_json_uint(const char *key, uint64_t n);
+void ebt_json_bool(const char *key, int b);
+void ebt_json_hex(const char *key, const void *data, unsigned int len);
+void ebt_json_mac(const char *key, const unsigned char *mac);
+void ebt_json_ipv4(const char *key, uint32_t addr);
+extern const unsigned char ebt_hexvalues[256];
+int ebt_get_mac(const char *from, unsigned char *to);
 int ebt_get_mac_and_mask(const char *from, unsigned char *to, unsigned char *mask);
 void ebt_parse_ip_address(char *address, uint32_t *addr, uint32_t *msk);
 char *ebt_mask_to_dotted(uint32_t mask);
@@ -325,8 +617,42 @@ void ebt_print_icmp_type(const struct ebt_icmp_names *icmp_codes,
 void ebt_print_icmp_types(const struct ebt_icmp_names *icmp_codes,
 			  size_t n_codes);
 
+/* Set names looked up by the set and dset matches */
+struct ebt_set_cache_entry
+{
+	/* NULL if not known */
+	char *name;
+	/* 1 if the family of the set was checked */
+	int checked;
+};
+
+struct ebt_set_cache
+{
+	struct ebt_handle *handle;
+	unsigned int generation;
+	/* The protocol version of the kernel module, 0 if not known yet */
+	unsigned int version;
+	/* Indexed by the set index */
+	struct ebt_set_cache_entry *sets;
+	unsigned int num_sets;
+	/* The known indexes + 1 hashed by name, 0 if free */
+	unsigned int *hash;
+	unsigned int hash_size, hash_used;
+};
+
+void ebt_set_cache_check(struct ebt_set_cache *c);
+struct ebt_set_cache_entry *ebt_set_cache_find(struct ebt_set_cache *c,
+					       const char *name,
+					       unsigned int *idx);
+const char *ebt_set_cache_name(struct ebt_set_cache *c, unsigned int idx);
+void ebt_set_cache_add(struct ebt_set_cache *c, const char *name,
+		       unsigned int idx, int checked);
+
 int do_command(int argc, char *argv[], int exec_style,
                struct ebt_u_replace *replace_);
+void ebt_print_rule(struct ebt_u_replace *u_repl, struct ebt_u_entry *hlp);
+void ebt_early_init_once();
+int ebt_has_stats_option(int argc, char *argv[]);
 
 struct ethertypeent *parseethertypebynumber(int type);
 
@@ -363,13 +689,10 @@ __ret;})
 #define CNT_DEL 	1
 #define CNT_ADD 	2
 #define CNT_CHANGE 	3
+#define CNT_MOVE 	4 /* like CNT_CHANGE, but the old counter is at from */
 
 extern const char *ebt_hooknames[NF_BR_NUMHOOKS];
 extern const char *ebt_standard_targets[NUM_STANDARD_TARGETS];
-extern char ebt_errormsg[ERRORMSG_MAXLEN];
-extern char *ebt_modprobe;
-extern int ebt_silent;
-extern int ebt_printstyle_mac;
 
 /*
  * Transforms a target string into the right integer,
@@ -400,6 +723,7 @@ extern int ebt_printstyle_mac;
 #define PROC_SYS_MODPROBE "/proc/sys/kernel/modprobe"
 #endif
 #define ATOMIC_ENV_VARIABLE "EBTABLES_ATOMIC_FILE"
+#define STATS_ENV_VARIABLE "EBTABLES_STATS"
 
 #ifndef ARRAY_SIZE
 # define ARRAY_SIZE(x)	(sizeof(x) / sizeof((x)[0]))
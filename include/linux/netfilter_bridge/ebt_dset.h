@@ -7,68 +7,87 @@
 #include <sys/socket.h>
 #include <errno.h>
 
+/* The dset protocol version and the sets looked up so far, see
+ * ebt_set_cache_check() */
+static __thread struct ebt_set_cache set_cache;
+
+/* Returns the socket, -1 on error */
 static int
 get_version(unsigned *version)
 {
-	int res, sockfd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+	int res, sockfd;
 	struct domain_set_req_version req_version;
 	socklen_t size = sizeof(req_version);
-	
-	if (sockfd < 0)
-		ebt_print_error2(
-			      "Can't open socket to dset.\n");
-
-	if (fcntl(sockfd, F_SETFD, FD_CLOEXEC) == -1) {
-		ebt_print_error2(
-			      "Could not set close on exec: %s\n",
-			      strerror(errno));
+
+	ebt_set_cache_check(&set_cache);
+	if ((sockfd = ebt_get_sockfd()) < 0)
+		return -1;
+	if (set_cache.version) {
+		*version = set_cache.version;
+		return sockfd;
 	}
 
 	req_version.op = DOMAIN_SET_OP_VERSION;
 	res = getsockopt(sockfd, SOL_IP, SO_DOMAIN_SET, &req_version, &size);
-	if (res != 0)
-		ebt_print_error2(
-			      "Kernel module xt_set is not loaded in.\n");
+	if (res != 0) {
+		ebt_print_error("Kernel module xt_set is not loaded in");
+		return -1;
+	}
+
+	*version = set_cache.version = req_version.version;
 
-	*version = req_version.version;
-	
 	return sockfd;
 }
 
-static void
+/* Returns -1 on error */
+static int
 get_set_byid(char *setname, domain_set_id_t idx)
 {
 	struct domain_set_req_get_set req;
 	socklen_t size = sizeof(struct domain_set_req_get_set);
 	int res, sockfd;
+	const char *name;
 
-	sockfd = get_version(&req.version);
+	if ((sockfd = get_version(&req.version)) < 0)
+		return -1;
+	if ((name = ebt_set_cache_name(&set_cache, idx))) {
+		strcpy(setname, name);
+		return 0;
+	}
 	req.op = DOMAIN_SET_OP_GET_BYINDEX;
 	req.set.index = idx;
 	res = getsockopt(sockfd, SOL_IP, SO_DOMAIN_SET, &req, &size);
-	close(sockfd);
 
-	if (res != 0)
-		ebt_print_error2(
-			"Problem when communicating with dset, errno=%d.\n",
+	if (res != 0) {
+		ebt_print_error(
+			"Problem when communicating with dset, errno=%d",
 			errno);
-	if (size != sizeof(struct domain_set_req_get_set))
-		ebt_print_error2(
-			"Incorrect return size from kernel duriipng dset lookup, "
-			"(want %zu, got %zu)\n",
+		return -1;
+	}
+	if (size != sizeof(struct domain_set_req_get_set)) {
+		ebt_print_error(
+			"Incorrect return size from kernel during dset lookup, "
+			"(want %zu, got %zu)",
 			sizeof(struct domain_set_req_get_set), (size_t)size);
-	if (req.set.name[0] == '\0')
-		ebt_print_error2(
-			"Set with index %i in kernel doesn't exist.\n", idx);
+		return -1;
+	}
+	if (req.set.name[0] == '\0') {
+		ebt_print_error(
+			"Set with index %i in kernel doesn't exist", idx);
+		return -1;
+	}
 
-	strncpy(setname, req.set.name, DSET_MAXNAMELEN);
+	memcpy(setname, req.set.name, DSET_MAXNAMELEN - 1);
+	setname[DSET_MAXNAMELEN - 1] = '\0';
+	ebt_set_cache_add(&set_cache, setname, idx, 0);
+	return 0;
 }
 
-static void
+static int
 get_set_byname_only(const char *setname, struct xt_dset_info *info,
 		    int sockfd, unsigned int version)
 {
-	struct domain_set_req_get_set req = { .version = version };
+	struct domain_set_req_get_set req = {.version = version};
 	socklen_t size = sizeof(struct domain_set_req_get_set);
 	int res;
 
@@ -76,32 +95,47 @@ get_set_byname_only(const char *setname, struct xt_dset_info *info,
 	strncpy(req.set.name, setname, DSET_MAXNAMELEN);
 	req.set.name[DSET_MAXNAMELEN - 1] = '\0';
 	res = getsockopt(sockfd, SOL_IP, SO_DOMAIN_SET, &req, &size);
-	close(sockfd);
 
-	if (res != 0)
-		ebt_print_error2(
-			"Problem when communicating with dset, errno=%d.\n",
+	if (res != 0) {
+		ebt_print_error(
+			"Problem when communicating with dset, errno=%d",
 			errno);
-	if (size != sizeof(struct domain_set_req_get_set))
-		ebt_print_error2(
+		return -1;
+	}
+	if (size != sizeof(struct domain_set_req_get_set)) {
+		ebt_print_error(
 			"Incorrect return size from kernel during dset lookup, "
-			"(want %zu, got %zu)\n",
+			"(want %zu, got %zu)",
 			sizeof(struct domain_set_req_get_set), (size_t)size);
-	if (req.set.index == DSET_INVALID_ID)
-		ebt_print_error2(
-			      "Set %s doesn't exist.\n", setname);
+		return -1;
+	}
+	if (req.set.index == DSET_INVALID_ID) {
+		ebt_print_error("Set %s doesn't exist", setname);
+		return -1;
+	}
 
 	info->index = req.set.index;
+	ebt_set_cache_add(&set_cache, setname, req.set.index, 1);
+	return 0;
 }
 
-static void
+/* Returns -1 on error */
+static int
 get_set_byname(const char *setname, struct xt_dset_info *info)
 {
 	struct domain_set_req_get_set_family req;
 	socklen_t size = sizeof(struct domain_set_req_get_set_family);
 	int res, sockfd, version;
-
-	sockfd = get_version(&req.version);
+	struct ebt_set_cache_entry *e;
+	unsigned int idx;
+
+	if ((sockfd = get_version(&req.version)) < 0)
+		return -1;
+	e = ebt_set_cache_find(&set_cache, setname, &idx);
+	if (e && e->checked) {
+		info->index = idx;
+		return 0;
+	}
 	version = req.version;
 	req.op = DOMAIN_SET_OP_GET_FNAME;
 	strncpy(req.set.name, setname, DSET_MAXNAMELEN);
@@ -112,29 +146,37 @@ get_set_byname(const char *setname, struct xt_dset_info *info)
 		/* Backward compatibility */
 		return get_set_byname_only(setname, info, sockfd, version);
 
-	close(sockfd);
-	if (res != 0)
-		ebt_print_error2(
-			"Problem when communicating with dset, errno=%d.\n",
+	if (res != 0) {
+		ebt_print_error(
+			"Problem when communicating with dset, errno=%d",
 			errno);
-	if (size != sizeof(struct domain_set_req_get_set_family))
-		ebt_print_error2(
+		return -1;
+	}
+	if (size != sizeof(struct domain_set_req_get_set_family)) {
+		ebt_print_error(
 			"Incorrect return size from kernel during dset lookup, "
-			"(want %zu, got %zu)\n",
+			"(want %zu, got %zu)",
 			sizeof(struct domain_set_req_get_set_family),
 			(size_t)size);
-	if (req.set.index == DSET_INVALID_ID)
-		ebt_print_error2(
-			      "Set %s doesn't exist.\n", setname);
+		return -1;
+	}
+	if (req.set.index == DSET_INVALID_ID) {
+		ebt_print_error("Set %s doesn't exist", setname);
+		return -1;
+	}
 	if (!(req.family == NFPROTO_IPV4 || //modify
-	      req.family == NFPROTO_UNSPEC))
-		ebt_print_error2(
-			      "The protocol family of set %s is %s, "
-			      "which is not applicable.\n",
-			      setname,
-			      req.family == NFPROTO_IPV4 ? "IPv4" : "IPv6");
+		  req.family == NFPROTO_UNSPEC)) {
+		ebt_print_error(
+			"The protocol family of set %s is %s, "
+			"which is not applicable",
+			setname,
+			req.family == NFPROTO_IPV4 ? "IPv4" : "IPv6");
+		return -1;
+	}
 
 	info->index = req.set.index;
+	ebt_set_cache_add(&set_cache, setname, req.set.index, 1);
+	return 0;
 }
 
 #endif /*_EBT_DSET_H*/
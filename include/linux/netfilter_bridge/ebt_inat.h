@@ -0,0 +1,70 @@
+#ifndef __LINUX_BRIDGE_EBT_INAT_H
+#define __LINUX_BRIDGE_EBT_INAT_H
+
+#include <linux/types.h>
+
+/* Grzegorz Borowiak <grzes@gnu.univ.gda.pl> 2003
+ *
+ * Indexed MAC NAT: the MAC address a frame is natted to is chosen by the
+ * last byte of its IPv4 source (isnat) or destination (idnat) address,
+ * for the addresses inside the subnets of the rule.
+ */
+
+/* Revision 0: one /24 subnet, a slot for every last byte */
+struct ebt_inat_tuple
+{
+	int enabled;
+	unsigned char mac[ETH_ALEN];
+	/* EBT_ACCEPT, EBT_DROP or EBT_CONTINUE */
+	int target;
+};
+
+struct ebt_inat_info
+{
+	uint32_t ip_subnet;
+	struct ebt_inat_tuple a[256];
+	/* EBT_ACCEPT, EBT_DROP, EBT_CONTINUE or EBT_RETURN */
+	int target;
+};
+
+/* Revision 1: any number of /24 subnets. It needs a kernel module that
+ * knows it, so it is only used for a rule with more than one subnet. The
+ * subnets are sorted, so the
+ * kernel can find the subnet of an address with a binary search. A subnet
+ * only has slots for the last bytes that are set in its bitmap, the slot
+ * of last byte b is slots[first_slot + the number of bits below b]. */
+struct ebt_inat_slot
+{
+	unsigned char mac[ETH_ALEN];
+	/* EBT_ACCEPT, EBT_DROP or EBT_CONTINUE */
+	int target;
+};
+
+struct ebt_inat_subnet
+{
+	/* Network byte order, the last byte is 0 */
+	__be32 ip_subnet;
+	__u32 first_slot;
+	__u32 map[256 / 32];
+};
+
+struct ebt_inat_info_v1
+{
+	/* EBT_ACCEPT, EBT_DROP, EBT_CONTINUE or EBT_RETURN, for the frames
+	 * outside the subnets */
+	int target;
+	__u32 nsubnets;
+	__u32 nslots;
+	/* Followed by nslots struct ebt_inat_slot */
+	struct ebt_inat_subnet subnets[0];
+};
+
+#define ebt_inat_slots(x) ((struct ebt_inat_slot *)&(x)->subnets[(x)->nsubnets])
+#define ebt_inat_size(nsubnets, nslots) (sizeof(struct ebt_inat_info_v1) + \
+	(nsubnets) * sizeof(struct ebt_inat_subnet) + \
+	(nslots) * sizeof(struct ebt_inat_slot))
+
+#define EBT_ISNAT_TARGET "isnat"
+#define EBT_IDNAT_TARGET "idnat"
+
+#endif
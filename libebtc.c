@@ -36,9 +36,15 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
 
 static void decrease_chain_jumps(struct ebt_u_replace *replace);
+static int insert_rule(struct ebt_u_replace *replace,
+		       struct ebt_u_entry *new_entry, int rule_nr);
 static int iterate_entries(struct ebt_u_replace *replace, int type);
+static int txn_check_rule(struct ebt_u_replace *replace, int nr,
+			  struct ebt_u_entry *e);
 
 /* The standard names */
 const char *ebt_hooknames[NF_BR_NUMHOOKS] =
@@ -60,11 +66,14 @@ const char* ebt_standard_targets[NUM_STANDARD_TARGETS] =
 	"RETURN",
 };
 
-/* The lists of supported tables, matches, watchers and targets */
+/* The list of supported tables, the lists of supported matches, watchers
+ * and targets are in ebt_default_handle */
 struct ebt_u_table *ebt_tables;
-struct ebt_u_match *ebt_matches;
-struct ebt_u_watcher *ebt_watchers;
-struct ebt_u_target *ebt_targets;
+
+struct ebt_handle ebt_default_handle = {
+	.sockfd = -1,
+};
+__thread struct ebt_handle *ebt_cur_handle = &ebt_default_handle;
 
 /* Find the right structure belonging to a name */
 struct ebt_u_target *ebt_find_target(const char *name)
@@ -138,22 +147,41 @@ void ebt_list_extensions()
 #define LOCKDIR "/var/lib/ebtables"
 #define LOCKFILE LOCKDIR"/lock"
 #endif
-int use_lockfd;
+/* The lock is taken by the process and kept until it exits, it then covers
+ * all handles. A second flock() from another thread would wait for
+ * ourselves, so taking it is serialized. */
+static pthread_mutex_t lock_file_lock = PTHREAD_MUTEX_INITIALIZER;
+static int locked;
+
 /* Returns 0 on success, -1 when the file is locked by another process
  * or -2 on any other error. */
 static int lock_file()
 {
-	int fd, try = 0;
+	int fd, try = 0, ret = 0;
 
+	pthread_mutex_lock(&lock_file_lock);
+	/* We can be asked again when an --optimistic command is retried */
+	if (locked)
+		goto out;
 retry:
 	fd = open(LOCKFILE, O_CREAT, 00600);
 	if (fd < 0) {
-		if (try == 1 || mkdir(LOCKDIR, 00700))
-			return -2;
+		if (try == 1 || mkdir(LOCKDIR, 00700)) {
+			ret = -2;
+			goto out;
+		}
 		try = 1;
 		goto retry;
 	}
-	return flock(fd, LOCK_EX);
+	if (flock(fd, LOCK_EX)) {
+		close(fd);
+		ret = -1;
+		goto out;
+	}
+	locked = 1;
+out:
+	pthread_mutex_unlock(&lock_file_lock);
+	return ret;
 }
 
 /* Get the table from the kernel or from a binary file
@@ -168,16 +196,21 @@ int ebt_get_kernel_table(struct ebt_u_replace *replace, int init)
 		ebt_print_error("Bad table name '%s'", replace->name);
 		return -1;
 	}
+	if (use_lockfd)
+		ebt_stats_begin(EBT_STATS_LOCK);
 	while (use_lockfd && (ret = lock_file())) {
 		if (ret == -2) {
 			/* if we get an error we can't handle, we exit. This
 			 * doesn't break backwards compatibility since using
 			 * this file locking is disabled by default. */
+			ebt_stats_end();
 			ebt_print_error2("Unable to create lock file "LOCKFILE);
 		}
 		fprintf(stderr, "Trying to obtain lock %s\n", LOCKFILE);
 		sleep(1);
 	}
+	if (use_lockfd)
+		ebt_stats_end();
 	/* Get the kernel's information */
 	if (ebt_get_table(replace, init)) {
 		if (ebt_errormsg[0] != '\0')
@@ -204,11 +237,12 @@ void ebt_initialize_entry(struct ebt_u_entry *e)
 	e->m_list = NULL;
 	e->w_list = NULL;
 	e->t = (struct ebt_entry_target *)ebt_find_target(EBT_STANDARD_TARGET);
-	ebt_find_target(EBT_STANDARD_TARGET)->used = 1;
 	e->cnt.pcnt = e->cnt.bcnt = e->cnt_surplus.pcnt = e->cnt_surplus.bcnt = 0;
 
 	if (!e->t)
 		ebt_print_bug("Couldn't load standard target");
+	ebt_load_target((struct ebt_u_target *)e->t);
+	((struct ebt_u_target *)e->t)->used = 1;
 	((struct ebt_standard_target *)((struct ebt_u_target *)e->t)->t)->verdict = EBT_CONTINUE;
 }
 
@@ -261,49 +295,34 @@ void ebt_reinit_extensions()
 	struct ebt_u_match *m;
 	struct ebt_u_watcher *w;
 	struct ebt_u_target *t;
-	int size;
 
-	/* The init functions should determine by themselves whether they are
-	 * called for the first time or not (when necessary). */
+	/* The data of a used extension belongs to the new rule, the next
+	 * command that uses the extension will give it new data. The init
+	 * functions should determine by themselves whether they are called
+	 * for the first time or not (when necessary). */
 	for (m = ebt_matches; m; m = m->next) {
 		if (m->used) {
-			size = EBT_ALIGN(m->size) + sizeof(struct ebt_entry_match);
-			m->m = (struct ebt_entry_match *)malloc(size);
-			if (!m->m)
-				ebt_print_memory();
-			strcpy(m->m->u.name, m->name);
-			m->m->u.revision = m->revision;
-			m->m->match_size = EBT_ALIGN(m->size);
+			m->m = NULL;
 			m->used = 0;
-		}
+		} else if (m->m)
+			m->init(m->m);
 		m->flags = 0; /* An error can occur before used is set, while flags is changed. */
-		m->init(m->m);
 	}
 	for (w = ebt_watchers; w; w = w->next) {
 		if (w->used) {
-			size = EBT_ALIGN(w->size) + sizeof(struct ebt_entry_watcher);
-			w->w = (struct ebt_entry_watcher *)malloc(size);
-			if (!w->w)
-				ebt_print_memory();
-			strcpy(w->w->u.name, w->name);
-			w->w->watcher_size = EBT_ALIGN(w->size);
+			w->w = NULL;
 			w->used = 0;
-		}
+		} else if (w->w)
+			w->init(w->w);
 		w->flags = 0;
-		w->init(w->w);
 	}
 	for (t = ebt_targets; t; t = t->next) {
 		if (t->used) {
-			size = EBT_ALIGN(t->size) + sizeof(struct ebt_entry_target);
-			t->t = (struct ebt_entry_target *)malloc(size);
-			if (!t->t)
-				ebt_print_memory();
-			strcpy(t->t->u.name, t->name);
-			t->t->target_size = EBT_ALIGN(t->size);
+			t->t = NULL;
 			t->used = 0;
-		}
+		} else if (t->t)
+			t->init(t->t);
 		t->flags = 0;
-		t->init(t->t);
 	}
 }
 
@@ -355,13 +374,14 @@ static char *get_modprobe(void)
 	return NULL;
 }
 
-char *ebt_modprobe;
 /* Try to load the kernel module, analogous to ip_tables.c */
 int ebtables_insmod(const char *modname)
 {
 	char *buf = NULL;
 	char *argv[3];
 
+	if (!ebt_get_backend()->modules)
+		return -1;
 	/* If they don't explicitly set it, read out of /proc */
 	if (!ebt_modprobe) {
 		buf = get_modprobe();
@@ -441,7 +461,7 @@ void ebt_change_policy(struct ebt_u_replace *replace, int policy)
 
 void ebt_delete_cc(struct ebt_cntchanges *cc)
 {
-	if (cc->type == CNT_ADD) {
+	if (cc->type == CNT_ADD || cc->type == CNT_MOVE) {
 		cc->prev->next = cc->next;
 		cc->next->prev = cc->prev;
 		free(cc);
@@ -616,10 +636,30 @@ letscontinue:;
  * don't reuse the new_entry after a successful call to ebt_add_rule() */
 void ebt_add_rule(struct ebt_u_replace *replace, struct ebt_u_entry *new_entry, int rule_nr)
 {
-	int i;
-	struct ebt_u_entry *u_e;
 	struct ebt_u_match_list *m_l;
 	struct ebt_u_watcher_list *w_l;
+
+	if (insert_rule(replace, new_entry, rule_nr))
+		return;
+	/* Put the ebt_{match, watcher, target} pointers in place */
+	m_l = new_entry->m_list;
+	while (m_l) {
+		m_l->m = ((struct ebt_u_match *)m_l->m)->m;
+		m_l = m_l->next;
+	}
+	w_l = new_entry->w_list;
+	while (w_l) {
+		w_l->w = ((struct ebt_u_watcher *)w_l->w)->w;
+		w_l = w_l->next;
+	}
+	new_entry->t = ((struct ebt_u_target *)new_entry->t)->t;
+}
+
+/* Helper for ebt_add_rule(), only adds the rule to the chain */
+static int insert_rule(struct ebt_u_replace *replace, struct ebt_u_entry *new_entry, int rule_nr)
+{
+	int i;
+	struct ebt_u_entry *u_e;
 	struct ebt_u_entries *entries = ebt_to_chain(replace);
 	struct ebt_cntchanges *cc, *new_cc;
 
@@ -629,7 +669,7 @@ void ebt_add_rule(struct ebt_u_replace *replace, struct ebt_u_entry *new_entry,
 		rule_nr--;
 	if (rule_nr > entries->nentries || rule_nr < 0) {
 		ebt_print_error("The specified rule number is incorrect");
-		return;
+		return -1;
 	}
 	/* Go to the right position in the chain */
 	if (rule_nr == entries->nentries)
@@ -670,18 +710,6 @@ void ebt_add_rule(struct ebt_u_replace *replace, struct ebt_u_entry *new_entry,
 	cc->prev = new_cc;
 	new_entry->cc = new_cc;
 
-	/* Put the ebt_{match, watcher, target} pointers in place */
-	m_l = new_entry->m_list;
-	while (m_l) {
-		m_l->m = ((struct ebt_u_match *)m_l->m)->m;
-		m_l = m_l->next;
-	}
-	w_l = new_entry->w_list;
-	while (w_l) {
-		w_l->w = ((struct ebt_u_watcher *)w_l->w)->w;
-		w_l = w_l->next;
-	}
-	new_entry->t = ((struct ebt_u_target *)new_entry->t)->t;
 	/* Update the counter_offset of chains behind this one */
 	for (i = replace->selected_chain+1; i < replace->num_chains; i++) {
 		entries = replace->chains[i];
@@ -689,6 +717,7 @@ void ebt_add_rule(struct ebt_u_replace *replace, struct ebt_u_entry *new_entry,
 			continue;
 		entries->counter_offset++;
 	}
+	return 0;
 }
 
 /* If *begin==*end==0 then find the rule corresponding to new_entry,
@@ -769,6 +798,64 @@ void ebt_delete_rule(struct ebt_u_replace *replace,
 	}
 }
 
+/* Move rule rule_nr of the selected chain, so that it becomes rule new_nr
+ * of chain number to_chain. The first rule has rule nr 1. The rule keeps
+ * its counters: the kernel counter at its old position is given to it by
+ * ebt_deliver_counters() */
+static int move_rule(struct ebt_u_replace *replace, int rule_nr, int to_chain,
+		     int new_nr)
+{
+	struct ebt_u_entries *entries = ebt_to_chain(replace);
+	struct ebt_u_entries *to = replace->chains[to_chain];
+	struct ebt_cntchanges *from = NULL;
+	struct ebt_u_entry *u_e;
+	unsigned short type, change = 0;
+	int i, from_chain = replace->selected_chain;
+
+	if (rule_nr < 1 || rule_nr > entries->nentries || new_nr < 1 ||
+	    new_nr > to->nentries + (to != entries)) {
+		ebt_print_error("The specified rule number is incorrect");
+		return -1;
+	}
+	u_e = entries->entries->next;
+	for (i = 1; i < rule_nr; i++)
+		u_e = u_e->next;
+	if (to_chain != from_chain && txn_check_rule(replace, to_chain, u_e))
+		return -1;
+	type = u_e->cc->type;
+	if (type == CNT_MOVE) {
+		from = u_e->cc->from;
+		change = u_e->cc->change;
+	} else if (type == CNT_CHANGE) {
+		from = u_e->cc;
+		change = u_e->cc->change;
+		type = CNT_MOVE;
+	} else if (type == CNT_NORM) {
+		/* Increment the old counter by nothing */
+		from = u_e->cc;
+		change = 1 + 3 * 1;
+		u_e->cnt_surplus.pcnt = u_e->cnt_surplus.bcnt = 0;
+		type = CNT_MOVE;
+	}
+	ebt_delete_cc(u_e->cc);
+	u_e->prev->next = u_e->next;
+	u_e->next->prev = u_e->prev;
+	replace->nentries--;
+	entries->nentries--;
+	for (i = replace->selected_chain+1; i < replace->num_chains; i++) {
+		if (!(entries = replace->chains[i]))
+			continue;
+		entries->counter_offset--;
+	}
+	replace->selected_chain = to_chain;
+	insert_rule(replace, u_e, new_nr);
+	replace->selected_chain = from_chain;
+	u_e->cc->type = type;
+	u_e->cc->change = change;
+	u_e->cc->from = from;
+	return 0;
+}
+
 /* Change the counters of a rule or rules
  * begin == end == 0: change counters of the rule corresponding to new_entry
  *
@@ -798,7 +885,8 @@ void ebt_change_counters(struct ebt_u_replace *replace,
 			u_e->cnt_surplus.pcnt = 0;
 		} else {
 #ifdef EBT_DEBUG
-			if (u_e->cc->type != CNT_NORM)
+			if (u_e->cc->type != CNT_NORM &&
+			    u_e->cc->type != CNT_MOVE)
 				ebt_print_bug("cc->type != CNT_NORM");
 #endif
 			u_e->cnt_surplus.pcnt = (*cnt).pcnt;
@@ -809,18 +897,62 @@ void ebt_change_counters(struct ebt_u_replace *replace,
 			u_e->cnt_surplus.bcnt = 0;
 		} else {
 #ifdef EBT_DEBUG
-			if (u_e->cc->type != CNT_NORM)
+			if (u_e->cc->type != CNT_NORM &&
+			    u_e->cc->type != CNT_MOVE)
 				ebt_print_bug("cc->type != CNT_NORM");
 #endif
 			u_e->cnt_surplus.bcnt = (*cnt).bcnt;
 		}
-		if (u_e->cc->type != CNT_ADD)
+		if (u_e->cc->type == CNT_NORM)
 			u_e->cc->type = CNT_CHANGE;
 		u_e->cc->change = mask;
 		u_e = u_e->next;
 	}
 }
 
+/* Change the matches of rule rule_nr in place (--among-update)
+ *
+ * The first rule has rule nr 1, the last rule has rule nr -1, etc.
+ * Every match of new_entry is handed to the update() function of its
+ * extension, together with the match of the same name in the rule.
+ * This function expects the ebt_match members of new_entry to contain
+ * pointers to ebt_u_match. The counters of the rule are kept. */
+void ebt_update_rule(struct ebt_u_replace *replace,
+		     struct ebt_u_entry *new_entry, int rule_nr)
+{
+	int i, end = rule_nr;
+	struct ebt_u_entry *u_e;
+	struct ebt_u_match *m;
+	struct ebt_u_match_list *m_l, *m_l2;
+	struct ebt_u_entries *entries = ebt_to_chain(replace);
+
+	if (!rule_nr)
+		ebt_print_bug("rule_nr should be non-zero");
+	if (check_and_change_rule_number(replace, new_entry, &rule_nr, &end))
+		return;
+	if (!new_entry->m_list) {
+		ebt_print_error("Nothing to update");
+		return;
+	}
+	u_e = entries->entries->next;
+	for (i = 0; i < rule_nr; i++)
+		u_e = u_e->next;
+	for (m_l = new_entry->m_list; m_l; m_l = m_l->next) {
+		m = (struct ebt_u_match *)m_l->m;
+		for (m_l2 = u_e->m_list; m_l2; m_l2 = m_l2->next)
+			if (!strcmp(m_l2->m->u.name, m->name))
+				break;
+		if (!m_l2) {
+			ebt_print_error("Rule %d has no %s match", rule_nr + 1,
+					m->name);
+			return;
+		}
+		m->update(&m_l2->m);
+		if (ebt_errormsg[0] != '\0')
+			return;
+	}
+}
+
 /* If selected_chain == -1 then zero all counters,
  * otherwise, zero the counters of selected_chain */
 void ebt_zero_counters(struct ebt_u_replace *replace)
@@ -851,6 +983,7 @@ void ebt_zero_counters(struct ebt_u_replace *replace)
 			if (next->cc->type == CNT_NORM)
 				next->cc->type = CNT_CHANGE;
 			next->cnt.bcnt = next->cnt.pcnt = 0;
+			next->cc->change = 0;
 			next = next->next;
 		}
 	}
@@ -1030,6 +1163,7 @@ void ebt_check_for_loops(struct ebt_u_replace *replace)
 	struct ebt_u_stack *stack = NULL;
 	struct ebt_u_entry *e;
 
+	ebt_stats_begin(EBT_STATS_LOOPS);
 	/* Initialize hook_mask to 0 */
 	for (i = 0; i < replace->num_chains; i++) {
 		if (!(entries = replace->chains[i]))
@@ -1042,7 +1176,7 @@ void ebt_check_for_loops(struct ebt_u_replace *replace)
 			entries->hook_mask = 0;
 	}
 	if (replace->num_chains == NF_BR_NUMHOOKS)
-		return;
+		goto free_stack;
 	stack = (struct ebt_u_stack *)malloc((replace->num_chains - NF_BR_NUMHOOKS) * sizeof(struct ebt_u_stack));
 	if (!stack)
 		ebt_print_memory();
@@ -1100,7 +1234,7 @@ letscontinue:
 	}
 free_stack:
 	free(stack);
-	return;
+	ebt_stats_end();
 }
 
 /* The user will use the match, so put it in new_entry. The ebt_u_match
@@ -1202,57 +1336,84 @@ static void decrease_chain_jumps(struct ebt_u_replace *replace)
 	iterate_entries(replace, 0);
 }
 
-/* Used in initialization code of modules */
+/* Used in initialization code of modules. Nothing is allocated or
+ * initialized here, most extensions aren't used by a command */
 void ebt_register_match(struct ebt_u_match *m)
 {
-	int size = EBT_ALIGN(m->size) + sizeof(struct ebt_entry_match);
 	struct ebt_u_match **i;
 
-	m->m = (struct ebt_entry_match *)malloc(size);
+	m->m = NULL;
+	for (i = &ebt_matches; *i; i = &((*i)->next));
+	m->next = NULL;
+	*i = m;
+}
+
+void ebt_register_watcher(struct ebt_u_watcher *w)
+{
+	struct ebt_u_watcher **i;
+
+	w->w = NULL;
+	for (i = &ebt_watchers; *i; i = &((*i)->next));
+	w->next = NULL;
+	*i = w;
+}
+
+void ebt_register_target(struct ebt_u_target *t)
+{
+	struct ebt_u_target **i;
+
+	t->t = NULL;
+	for (i = &ebt_targets; *i; i = &((*i)->next));
+	t->next = NULL;
+	*i = t;
+}
+
+/* Give the extension its data and initialize it, if not yet done since
+ * the last ebt_reinit_extensions(). Must be done before the extension
+ * parses an option */
+void ebt_load_match(struct ebt_u_match *m)
+{
+	int size = EBT_ALIGN(m->size) + sizeof(struct ebt_entry_match);
+
+	if (m->m)
+		return;
+	/* Not all init functions initialize all data */
+	m->m = (struct ebt_entry_match *)calloc(1, size);
 	if (!m->m)
 		ebt_print_memory();
 	strcpy(m->m->u.name, m->name);
 	m->m->u.revision = m->revision;
 	m->m->match_size = EBT_ALIGN(m->size);
 	m->init(m->m);
-
-	for (i = &ebt_matches; *i; i = &((*i)->next));
-	m->next = NULL;
-	*i = m;
 }
 
-void ebt_register_watcher(struct ebt_u_watcher *w)
+void ebt_load_watcher(struct ebt_u_watcher *w)
 {
 	int size = EBT_ALIGN(w->size) + sizeof(struct ebt_entry_watcher);
-	struct ebt_u_watcher **i;
 
-	w->w = (struct ebt_entry_watcher *)malloc(size);
+	if (w->w)
+		return;
+	w->w = (struct ebt_entry_watcher *)calloc(1, size);
 	if (!w->w)
 		ebt_print_memory();
 	strcpy(w->w->u.name, w->name);
 	w->w->watcher_size = EBT_ALIGN(w->size);
 	w->init(w->w);
-
-	for (i = &ebt_watchers; *i; i = &((*i)->next));
-	w->next = NULL;
-	*i = w;
 }
 
-void ebt_register_target(struct ebt_u_target *t)
+void ebt_load_target(struct ebt_u_target *t)
 {
 	int size = EBT_ALIGN(t->size) + sizeof(struct ebt_entry_target);
-	struct ebt_u_target **i;
 
-	t->t = (struct ebt_entry_target *)malloc(size);
+	if (t->t)
+		return;
+	t->t = (struct ebt_entry_target *)calloc(1, size);
 	if (!t->t)
 		ebt_print_memory();
 	strcpy(t->t->u.name, t->name);
+	t->t->u.revision = t->revision;
 	t->t->target_size = EBT_ALIGN(t->size);
 	t->init(t->t);
-
-	for (i = &ebt_targets; *i; i = &((*i)->next));
-	t->next = NULL;
-	*i = t;
 }
 
 void ebt_register_table(struct ebt_u_table *t)
@@ -1298,12 +1459,9 @@ void __ebt_print_bug(char *file, int line, char *format, ...)
 	exit (-1);
 }
 
-/* The error messages are put in here when ebt_silent == 1
- * ebt_errormsg[0] == '\0' implies there was no error */
-char ebt_errormsg[ERRORMSG_MAXLEN];
 /* When error messages should not be printed on the screen, after which
- * the program exit()s, set ebt_silent to 1. */
-int ebt_silent;
+ * the program exit()s, set ebt_silent to 1. The error message is then put
+ * in ebt_errormsg. */
 /* Don't use this function, use ebt_print_error() */
 void __ebt_print_error(char *format, ...)
 {
@@ -1320,3 +1478,837 @@ void __ebt_print_error(char *format, ...)
 		exit (-1);
 	}
 }
+
+/*
+ * Handles
+ *
+ * Independent tables can be built and committed from different threads,
+ * each thread using its own handle. Note that errors that can't be
+ * handled (e.g. out of memory) still make the program exit.
+ *
+ * This is safe, but not everything runs concurrently: ebt_handle_command()
+ * parses its command line with getopt_long() under one process wide lock,
+ * only retrieving, building and committing tables run in parallel. The
+ * lock file of --concurrent is shared by all handles, see lock_file().
+ */
+
+#define OPT_KERNELDATA	0x800 /* This value is also defined in ebtables.c */
+
+/* do_command() uses getopt_long(), which isn't reentrant */
+static pthread_mutex_t parse_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Make the calling thread use h (the default handle if h == NULL),
+ * returns the previously used handle */
+struct ebt_handle *ebt_handle_bind(struct ebt_handle *h)
+{
+	struct ebt_handle *old = ebt_cur_handle;
+
+	ebt_cur_handle = h ? h : &ebt_default_handle;
+	return old;
+}
+
+/* Give the current handle its own copy of the registered extensions,
+ * the copies get their own data when first used */
+static void clone_extensions()
+{
+	struct ebt_u_match *m, **m_next = &ebt_matches;
+	struct ebt_u_watcher *w, **w_next = &ebt_watchers;
+	struct ebt_u_target *t, **t_next = &ebt_targets;
+
+	for (m = ebt_default_handle.matches; m; m = m->next) {
+		if (!(*m_next = (struct ebt_u_match *)malloc(sizeof(*m))))
+			ebt_print_memory();
+		memcpy(*m_next, m, sizeof(*m));
+		(*m_next)->m = NULL;
+		(*m_next)->used = 0;
+		m_next = &(*m_next)->next;
+	}
+	*m_next = NULL;
+	for (w = ebt_default_handle.watchers; w; w = w->next) {
+		if (!(*w_next = (struct ebt_u_watcher *)malloc(sizeof(*w))))
+			ebt_print_memory();
+		memcpy(*w_next, w, sizeof(*w));
+		(*w_next)->w = NULL;
+		(*w_next)->used = 0;
+		w_next = &(*w_next)->next;
+	}
+	*w_next = NULL;
+	for (t = ebt_default_handle.targets; t; t = t->next) {
+		if (!(*t_next = (struct ebt_u_target *)malloc(sizeof(*t))))
+			ebt_print_memory();
+		memcpy(*t_next, t, sizeof(*t));
+		(*t_next)->t = NULL;
+		(*t_next)->used = 0;
+		t_next = &(*t_next)->next;
+	}
+	*t_next = NULL;
+}
+
+/* Returns NULL if the table doesn't exist */
+struct ebt_handle *ebt_handle_new(const char *table)
+{
+	struct ebt_handle *h, *old;
+
+	ebt_early_init_once();
+	if (!ebt_find_table(table))
+		return NULL;
+	if (!(h = (struct ebt_handle *)calloc(1, sizeof(struct ebt_handle))))
+		ebt_print_memory();
+	h->silent = 1;
+	h->sockfd = -1;
+	strcpy(h->replace.name, table);
+	h->replace.selected_chain = -1;
+	old = ebt_handle_bind(h);
+	clone_extensions();
+	ebt_handle_bind(old);
+	return h;
+}
+
+/* Free the table data, keeping the table name */
+static void release_table(struct ebt_u_replace *replace)
+{
+	char name[EBT_TABLE_MAXNAMELEN];
+
+	if (!(replace->flags & OPT_KERNELDATA))
+		return;
+	strcpy(name, replace->name);
+	ebt_cleanup_replace(replace);
+	free(replace->chains);
+	replace->chains = NULL;
+	free(replace->cc);
+	replace->cc = NULL;
+	strcpy(replace->name, name);
+}
+
+void ebt_handle_free(struct ebt_handle *h)
+{
+	struct ebt_handle *old;
+	struct ebt_u_match *m;
+	struct ebt_u_watcher *w;
+	struct ebt_u_target *t;
+
+	if (!h || h == &ebt_default_handle)
+		return;
+	old = ebt_handle_bind(h);
+	release_table(&h->replace);
+	/* When used, m/w/t belong to a rule and were freed above */
+	while ((m = ebt_matches)) {
+		ebt_matches = m->next;
+		if (!m->used)
+			free(m->m);
+		free(m);
+	}
+	while ((w = ebt_watchers)) {
+		ebt_watchers = w->next;
+		if (!w->used)
+			free(w->w);
+		free(w);
+	}
+	while ((t = ebt_targets)) {
+		ebt_targets = t->next;
+		if (!t->used)
+			free(t->t);
+		free(t);
+	}
+	ebt_free_delivered();
+	if (h->sockfd != -1)
+		close(h->sockfd);
+	ebt_handle_bind(old == h ? NULL : old);
+	free(h->stats);
+	free(h);
+}
+
+/* Get the table from the kernel, dropping all uncommitted changes.
+ * init: see ebt_get_kernel_table()
+ * When the kernel table is still the one we last committed through this
+ * handle, our table is kept without retrieving it, see
+ * ebt_refresh_kernel_table(). When it is the one we last retrieved, only
+ * the counters are updated, which saves translating the entries.
+ * Modifying h->replace other than through ebt_handle_command() or a
+ * transaction requires setting h->in_sync to 0. */
+int ebt_handle_open(struct ebt_handle *h, int init)
+{
+	struct ebt_handle *old = ebt_handle_bind(h);
+	int ret;
+
+	ebt_errormsg[0] = '\0';
+	if (!init && h->in_sync && (h->replace.flags & OPT_KERNELDATA) &&
+	    !ebt_refresh_kernel_table(&h->replace)) {
+		h->replace.flags = OPT_KERNELDATA;
+		h->replace.selected_chain = -1;
+		ret = 0;
+		goto out;
+	}
+	h->in_sync = 0;
+	release_table(&h->replace);
+	ret = ebt_get_kernel_table(&h->replace, init);
+	if (!ret) {
+		h->replace.flags = OPT_KERNELDATA;
+		h->in_sync = !init && h->replace.fp.valid;
+	}
+out:
+	ebt_handle_bind(old);
+	return ret;
+}
+
+/* Execute an ebtables command (argv[0] is ignored) on the table of the
+ * handle, the table is retrieved from the kernel first if necessary.
+ * Nothing is given to the kernel until ebt_handle_commit().
+ * Returns 0 on success, -1 on error (see ebt_handle_error()) */
+int ebt_handle_command(struct ebt_handle *h, int argc, char *argv[])
+{
+	struct ebt_handle *old;
+	int ret;
+
+	if (!(h->replace.flags & OPT_KERNELDATA) && ebt_handle_open(h, 0))
+		return -1;
+	old = ebt_handle_bind(h);
+	ebt_errormsg[0] = '\0';
+	h->in_sync = 0;
+	pthread_mutex_lock(&parse_lock);
+	optind = 0; /* Setting optind = 1 causes serious annoyances */
+	ret = do_command(argc, argv, EXEC_STYLE_DAEMON, &h->replace);
+	pthread_mutex_unlock(&parse_lock);
+	ebt_reinit_extensions();
+	if (ebt_errormsg[0] != '\0')
+		ret = -1;
+	ebt_handle_bind(old);
+	return ret;
+}
+
+/* Give the table of the handle to the kernel. Returns 0 on success, -1 on
+ * error and 1 if the kernel table was changed by someone else in the
+ * meantime (only checked when h->optimistic is set). The fingerprint of the
+ * delivered table lets the next ebt_handle_open() keep the table. */
+int ebt_handle_commit(struct ebt_handle *h)
+{
+	struct ebt_handle *old = ebt_handle_bind(h);
+	int ret;
+
+	ebt_errormsg[0] = '\0';
+	if (!(h->replace.flags & OPT_KERNELDATA)) {
+		ebt_print_error("Table %s has not been opened", h->replace.name);
+		ret = -1;
+		goto out;
+	}
+	h->in_sync = 0;
+	ret = ebt_deliver_table(&h->replace);
+	if (!ret && ebt_errormsg[0] == '\0' && h->replace.nentries)
+		ebt_deliver_counters(&h->replace);
+	if (ebt_errormsg[0] != '\0')
+		ret = -1;
+	if (!ret && h->replace.filename == NULL)
+		h->in_sync = h->replace.fp.valid;
+out:
+	ebt_handle_bind(old);
+	return ret;
+}
+
+/* The error message of the last failed call on the handle */
+const char *ebt_handle_error(struct ebt_handle *h)
+{
+	return h->errormsg;
+}
+
+/* Splits a line of ebtables-save in arguments, like ebtables-restore.
+ * Returns -1 on unbalanced quotes */
+static int split_line(char *line, char **argv, int max)
+{
+	int argc = 1, quotemode = 0, whitespace = 1;
+	char *p;
+
+	for (p = line; *p; p++) {
+		if (*p == '\"') {
+			whitespace = 0;
+			quotemode ^= 1;
+			if (quotemode && argc < max - 1)
+				argv[argc++] = p + 1;
+			*p = '\0';
+		} else if (!quotemode && *p == ' ') {
+			whitespace = 1;
+			*p = '\0';
+		} else if (whitespace) {
+			if (argc < max - 1)
+				argv[argc++] = p;
+			whitespace = 0;
+		}
+	}
+	if (quotemode)
+		return -1;
+	argv[argc] = NULL;
+	return argc;
+}
+
+/* The error of the failed command on line nr of source */
+static int restore_error(struct ebt_handle *h, const char *source, int nr)
+{
+	struct ebt_handle *old = ebt_handle_bind(h);
+	char msg[ERRORMSG_MAXLEN];
+
+	strcpy(msg, ebt_errormsg);
+	ebt_errormsg[0] = '\0';
+	ebt_print_error("%s: line %d: %s", source, nr, msg);
+	ebt_handle_bind(old);
+	return -1;
+}
+
+/* Build the table of the handle from the initial table and the lines of the
+ * table's section in file, the output of ebtables-save. source names file
+ * in the error messages. Nothing is given to the kernel until
+ * ebt_handle_commit(). Returns 0 on success, -1 on error (see
+ * ebt_handle_error()) */
+int ebt_handle_restore(struct ebt_handle *h, FILE *file, const char *source)
+{
+	char line[EBTD_CMDLINE_MAXLN], *argv[EBTD_ARGC_MAX], *p;
+	const char *table = h->replace.name;
+	struct ebt_handle *old;
+	int argc, nr = 0, found = 0, ours = 0, i;
+
+	if (ebt_handle_open(h, 1))
+		return -1;
+	argv[0] = "ebtables";
+	while (fgets(line, sizeof(line), file)) {
+		nr++;
+		if ((p = strchr(line, '\n')))
+			*p = '\0';
+		if (*line == '#' || *line == '\0')
+			continue;
+		if (*line == '*') {
+			ours = !strcmp(line + 1, table);
+			found |= ours;
+			continue;
+		}
+		if (!ours)
+			continue;
+		if (*line == ':') {
+			if (!(p = strchr(line, ' '))) {
+				strcpy(h->errormsg, "no policy specified");
+				return restore_error(h, source, nr);
+			}
+			*p = '\0';
+			argc = 1;
+			for (i = 0; i < NF_BR_NUMHOOKS; i++)
+				if (!strcmp(line + 1, ebt_hooknames[i]))
+					break;
+			if (i == NF_BR_NUMHOOKS) {
+				argv[argc++] = "-N";
+				argv[argc++] = line + 1;
+				argv[argc++] = "-P";
+			} else {
+				argv[argc++] = "-P";
+				argv[argc++] = line + 1;
+			}
+			argv[argc++] = p + 1;
+			argv[argc] = NULL;
+		} else if ((argc = split_line(line, argv, EBTD_ARGC_MAX)) < 0) {
+			strcpy(h->errormsg, "wrong use of '\"'");
+			return restore_error(h, source, nr);
+		}
+		if (ebt_handle_command(h, argc, argv))
+			return restore_error(h, source, nr);
+	}
+	if (!found) {
+		old = ebt_handle_bind(h);
+		ebt_print_error("%s doesn't contain the %s table", source,
+				table);
+		ebt_handle_bind(old);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Building rules and tables without parsing command lines
+ *
+ * The matches, watchers and target of a rule made with ebt_rule_new() are
+ * given as the data the kernel expects (e.g. a struct ebt_ip_info for the
+ * ip match), so the entry is in the form ebt_add_rule() gives it. The
+ * rules are added to a transaction, which is given to the kernel at once
+ * by ebt_txn_commit(). The final_check() of the extensions is executed
+ * for all rules on commit.
+ */
+
+struct ebt_txn
+{
+	struct ebt_handle *handle;
+	/* Set after the first failed operation, ebt_errormsg of the handle
+	 * then holds the reason and the transaction can't be committed */
+	int failed;
+};
+
+/* Returns the data of a match, watcher or target as used inside a rule.
+ * The layout of struct ebt_entry_{match,watcher,target} is the same. */
+static struct ebt_entry_match *new_extension_data(const char *name,
+   uint8_t revision, const void *data, unsigned int size)
+{
+	struct ebt_entry_match *m;
+
+	m = (struct ebt_entry_match *)calloc(1, sizeof(struct ebt_entry_match) + EBT_ALIGN(size));
+	if (!m)
+		ebt_print_memory();
+	strcpy(m->u.name, name);
+	m->u.revision = revision;
+	m->match_size = EBT_ALIGN(size);
+	if (data)
+		memcpy(m->data, data, size);
+	return m;
+}
+
+struct ebt_u_entry *ebt_rule_new()
+{
+	struct ebt_u_entry *e;
+
+	if (!(e = (struct ebt_u_entry *)calloc(1, sizeof(struct ebt_u_entry))))
+		ebt_print_memory();
+	e->bitmask = EBT_NOPROTO;
+	ebt_rule_set_verdict(e, EBT_CONTINUE);
+	return e;
+}
+
+/* Only for rules that weren't added to a transaction */
+void ebt_rule_free(struct ebt_u_entry *e)
+{
+	ebt_free_u_entry(e);
+	free(e);
+}
+
+/* proto: host endian protocol, 0 for any protocol or EBT_RULE_PROTO_LENGTH
+ * for 802.3 frames */
+int ebt_rule_set_proto(struct ebt_u_entry *e, int proto, int invert)
+{
+	if (proto < 0 || proto > EBT_RULE_PROTO_LENGTH)
+		return -1;
+	e->bitmask &= ~(EBT_NOPROTO | EBT_802_3);
+	e->invflags &= ~EBT_IPROTO;
+	e->ethproto = 0;
+	if (proto == 0) {
+		e->bitmask |= EBT_NOPROTO;
+		return 0;
+	}
+	if (proto == EBT_RULE_PROTO_LENGTH)
+		e->bitmask |= EBT_802_3;
+	else
+		e->ethproto = htons(proto);
+	if (invert)
+		e->invflags |= EBT_IPROTO;
+	return 0;
+}
+
+/* which: EBT_IIN, EBT_IOUT, EBT_ILOGICALIN or EBT_ILOGICALOUT,
+ * a name ending in '+' is a wildcard */
+int ebt_rule_set_iface(struct ebt_u_entry *e, unsigned int which,
+		       const char *name, int invert)
+{
+	char *iface, *c;
+
+	switch (which) {
+	case EBT_IIN:
+		iface = e->in;
+		break;
+	case EBT_IOUT:
+		iface = e->out;
+		break;
+	case EBT_ILOGICALIN:
+		iface = e->logical_in;
+		break;
+	case EBT_ILOGICALOUT:
+		iface = e->logical_out;
+		break;
+	default:
+		return -1;
+	}
+	if (strlen(name) >= IFNAMSIZ)
+		return -1;
+	if ((c = strchr(name, '+')) && *(c + 1) != '\0')
+		return -1;
+	strcpy(iface, name);
+	/* Be backwards compatible, the kernel doesn't use '+' */
+	if ((c = strchr(iface, '+')))
+		*c = 1;
+	if (invert)
+		e->invflags |= which;
+	else
+		e->invflags &= ~which;
+	return 0;
+}
+
+/* which: EBT_SOURCEMAC or EBT_DESTMAC, mask == NULL means all ones */
+int ebt_rule_set_mac(struct ebt_u_entry *e, unsigned int which,
+		     const unsigned char *mac, const unsigned char *mask,
+		     int invert)
+{
+	unsigned char *to, *to_mask;
+	unsigned int inv;
+	int i;
+
+	if (which == EBT_SOURCEMAC) {
+		to = e->sourcemac;
+		to_mask = e->sourcemsk;
+		inv = EBT_ISOURCE;
+	} else if (which == EBT_DESTMAC) {
+		to = e->destmac;
+		to_mask = e->destmsk;
+		inv = EBT_IDEST;
+	} else
+		return -1;
+	for (i = 0; i < ETH_ALEN; i++) {
+		to_mask[i] = mask ? mask[i] : 0xff;
+		to[i] = mac[i] & to_mask[i];
+	}
+	e->bitmask |= which;
+	if (invert)
+		e->invflags |= inv;
+	else
+		e->invflags &= ~inv;
+	return 0;
+}
+
+void ebt_rule_set_counters(struct ebt_u_entry *e, uint64_t pcnt, uint64_t bcnt)
+{
+	e->cnt.pcnt = pcnt;
+	e->cnt.bcnt = bcnt;
+}
+
+/* Returns -1 if the match doesn't exist or if size is too small */
+int ebt_rule_add_match(struct ebt_u_entry *e, const char *name,
+		       const void *data, unsigned int size)
+{
+	struct ebt_u_match_list **m_l, *new;
+	struct ebt_u_match *m;
+
+	if (!(m = ebt_find_match(name)) || size < m->size)
+		return -1;
+	for (m_l = &e->m_list; *m_l; m_l = &(*m_l)->next)
+		if (!strcmp((*m_l)->m->u.name, name))
+			return -1;
+	if (!(new = (struct ebt_u_match_list *)malloc(sizeof(*new))))
+		ebt_print_memory();
+	new->next = NULL;
+	new->m = new_extension_data(name, m->revision, data, size);
+	*m_l = new;
+	return 0;
+}
+
+int ebt_rule_add_watcher(struct ebt_u_entry *e, const char *name,
+			 const void *data, unsigned int size)
+{
+	struct ebt_u_watcher_list **w_l, *new;
+	struct ebt_u_watcher *w;
+
+	if (!(w = ebt_find_watcher(name)) || size < w->size)
+		return -1;
+	for (w_l = &e->w_list; *w_l; w_l = &(*w_l)->next)
+		if (!strcmp((*w_l)->w->u.name, name))
+			return -1;
+	if (!(new = (struct ebt_u_watcher_list *)malloc(sizeof(*new))))
+		ebt_print_memory();
+	new->next = NULL;
+	new->w = (struct ebt_entry_watcher *)
+	   new_extension_data(name, 0, data, size);
+	*w_l = new;
+	return 0;
+}
+
+/* For the standard target, use ebt_rule_set_verdict() or ebt_txn_jump() */
+int ebt_rule_set_target(struct ebt_u_entry *e, const char *name,
+			const void *data, unsigned int size)
+{
+	struct ebt_u_target *t;
+
+	if (!(t = ebt_find_target(name)) || size < t->size ||
+	    !strcmp(name, EBT_STANDARD_TARGET))
+		return -1;
+	free(e->t);
+	e->t = (struct ebt_entry_target *)
+	   new_extension_data(name, t->revision, data, size);
+	return 0;
+}
+
+/* verdict: EBT_ACCEPT, EBT_DROP, EBT_CONTINUE or EBT_RETURN */
+int ebt_rule_set_verdict(struct ebt_u_entry *e, int verdict)
+{
+	if (verdict < -NUM_STANDARD_TARGETS || verdict >= 0)
+		return -1;
+	free(e->t);
+	e->t = (struct ebt_entry_target *)
+	   new_extension_data(EBT_STANDARD_TARGET, 0, &verdict, sizeof(int));
+	return 0;
+}
+
+/* Returns NULL if the table can't be retrieved (see ebt_handle_error()) */
+struct ebt_txn *ebt_txn_begin(struct ebt_handle *h)
+{
+	struct ebt_txn *txn;
+
+	if (ebt_handle_open(h, 0))
+		return NULL;
+	if (!(txn = (struct ebt_txn *)malloc(sizeof(struct ebt_txn))))
+		ebt_print_memory();
+	txn->handle = h;
+	txn->failed = 0;
+	return txn;
+}
+
+static struct ebt_handle *txn_enter(struct ebt_txn *txn)
+{
+	txn->handle->in_sync = 0;
+	return ebt_handle_bind(txn->handle);
+}
+
+static int txn_leave(struct ebt_txn *txn, struct ebt_handle *old)
+{
+	if (ebt_errormsg[0] != '\0')
+		txn->failed = 1;
+	ebt_handle_bind(old);
+	return txn->failed ? -1 : 0;
+}
+
+/* Select the chain, returns its number or -1 */
+static int txn_select_chain(struct ebt_u_replace *replace, const char *chain)
+{
+	if ((replace->selected_chain = ebt_get_chainnr(replace, chain)) == -1)
+		ebt_print_error("Chain '%s' doesn't exist", chain);
+	return replace->selected_chain;
+}
+
+int ebt_txn_new_chain(struct ebt_txn *txn, const char *name, int policy)
+{
+	struct ebt_u_replace *replace = &txn->handle->replace;
+	struct ebt_handle *old;
+
+	if (txn->failed)
+		return -1;
+	old = txn_enter(txn);
+	if (strlen(name) >= EBT_CHAIN_MAXNAMELEN) {
+		ebt_print_error("Chain name length can't exceed %d", EBT_CHAIN_MAXNAMELEN - 1);
+	} else if (ebt_get_chainnr(replace, name) != -1) {
+		ebt_print_error("Chain %s already exists", name);
+	} else if (ebt_find_target(name)) {
+		ebt_print_error("Target with name %s exists", name);
+	} else if (strchr(name, ' ') != NULL) {
+		ebt_print_error("Use of ' ' not allowed in chain names");
+	} else if (policy >= 0 || policy < -NUM_STANDARD_TARGETS) {
+		ebt_print_error("Wrong policy");
+	} else
+		ebt_new_chain(replace, name, policy);
+	return txn_leave(txn, old);
+}
+
+int ebt_txn_policy(struct ebt_txn *txn, const char *chain, int policy)
+{
+	struct ebt_u_replace *replace = &txn->handle->replace;
+	struct ebt_handle *old;
+
+	if (txn->failed)
+		return -1;
+	old = txn_enter(txn);
+	if (policy >= 0 || policy < -NUM_STANDARD_TARGETS ||
+	    policy == EBT_CONTINUE) {
+		ebt_print_error("Wrong policy");
+	} else if (txn_select_chain(replace, chain) != -1) {
+		if (replace->selected_chain < NF_BR_NUMHOOKS && policy == EBT_RETURN) {
+			ebt_print_error("Policy RETURN only allowed for user defined chains");
+		} else
+			ebt_change_policy(replace, policy);
+	}
+	return txn_leave(txn, old);
+}
+
+/* chain == NULL: flush all chains */
+int ebt_txn_flush(struct ebt_txn *txn, const char *chain)
+{
+	struct ebt_u_replace *replace = &txn->handle->replace;
+	struct ebt_handle *old;
+
+	if (txn->failed)
+		return -1;
+	old = txn_enter(txn);
+	replace->selected_chain = -1;
+	if (!chain || txn_select_chain(replace, chain) != -1)
+		ebt_flush_chains(replace);
+	return txn_leave(txn, old);
+}
+
+/* Delete a user defined chain, it must not be referenced */
+int ebt_txn_delete_chain(struct ebt_txn *txn, const char *chain)
+{
+	struct ebt_u_replace *replace = &txn->handle->replace;
+	struct ebt_handle *old;
+
+	if (txn->failed)
+		return -1;
+	old = txn_enter(txn);
+	if (txn_select_chain(replace, chain) != -1) {
+		if (replace->selected_chain < NF_BR_NUMHOOKS) {
+			ebt_print_error("You can't remove a standard chain");
+		} else
+			ebt_delete_chain(replace);
+	}
+	return txn_leave(txn, old);
+}
+
+/* Make e jump to the user defined chain */
+int ebt_txn_jump(struct ebt_txn *txn, struct ebt_u_entry *e, const char *chain)
+{
+	struct ebt_u_replace *replace = &txn->handle->replace;
+	struct ebt_handle *old;
+	int nr;
+
+	if (txn->failed)
+		return -1;
+	old = txn_enter(txn);
+	if ((nr = ebt_get_chainnr(replace, chain)) == -1) {
+		ebt_print_error("Chain '%s' doesn't exist", chain);
+	} else if (nr < NF_BR_NUMHOOKS) {
+		ebt_print_error("Don't jump to a standard chain");
+	} else {
+		nr -= NF_BR_NUMHOOKS;
+		free(e->t);
+		e->t = (struct ebt_entry_target *)
+		   new_extension_data(EBT_STANDARD_TARGET, 0, &nr, sizeof(int));
+	}
+	return txn_leave(txn, old);
+}
+
+/* Returns -1 if the rule can't be put in chain number nr */
+static int txn_check_rule(struct ebt_u_replace *replace, int nr,
+			  struct ebt_u_entry *e)
+{
+	int verdict;
+
+	if ((e->in[0] || e->logical_in[0]) && nr > 2 && nr < NF_BR_BROUTING) {
+		ebt_print_error("Use -i and --logical-in only in INPUT, FORWARD, PREROUTING and BROUTING chains");
+		return -1;
+	}
+	if ((e->out[0] || e->logical_out[0]) && (nr < 2 || nr == NF_BR_BROUTING)) {
+		ebt_print_error("Use -o and --logical-out only in OUTPUT, FORWARD and POSTROUTING chains");
+		return -1;
+	}
+	if (!strcmp(e->t->u.name, EBT_STANDARD_TARGET)) {
+		verdict = ((struct ebt_standard_target *)e->t)->verdict;
+		if (verdict == EBT_RETURN && nr < NF_BR_NUMHOOKS) {
+			ebt_print_error("Return target only for user defined chains");
+			return -1;
+		}
+		if (verdict >= 0 && verdict + NF_BR_NUMHOOKS >= replace->num_chains) {
+			ebt_print_error("Jump to a deleted chain");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Add e to the chain, the numbering is the same as for ebt_add_rule().
+ * On success, the transaction owns e */
+int ebt_txn_add(struct ebt_txn *txn, const char *chain, int rule_nr,
+		struct ebt_u_entry *e)
+{
+	struct ebt_u_replace *replace = &txn->handle->replace;
+	struct ebt_handle *old;
+	int nr;
+
+	if (txn->failed)
+		return -1;
+	old = txn_enter(txn);
+	if ((nr = txn_select_chain(replace, chain)) == -1 ||
+	    txn_check_rule(replace, nr, e))
+		goto out;
+	e->replace = replace;
+	e->next = e->prev = NULL;
+	/* Unlike ebt_add_rule(), the data of the extensions is already
+	 * in place */
+	insert_rule(replace, e, rule_nr);
+out:
+	return txn_leave(txn, old);
+}
+
+/* Delete rule number rule_nr (1 is the first, -1 the last rule) */
+int ebt_txn_delete(struct ebt_txn *txn, const char *chain, int rule_nr)
+{
+	struct ebt_u_replace *replace = &txn->handle->replace;
+	struct ebt_handle *old;
+
+	if (txn->failed)
+		return -1;
+	old = txn_enter(txn);
+	if (rule_nr == 0) {
+		ebt_print_error("Sorry, wrong rule numbers");
+	} else if (txn_select_chain(replace, chain) != -1)
+		ebt_delete_rule(replace, NULL, rule_nr, rule_nr);
+	return txn_leave(txn, old);
+}
+
+/* Move rule number rule_nr (1 is the first rule) so that it becomes rule
+ * number new_nr, the rule keeps its counters */
+int ebt_txn_move(struct ebt_txn *txn, const char *chain, int rule_nr,
+		 int new_nr)
+{
+	return ebt_txn_move_to(txn, chain, rule_nr, chain, new_nr);
+}
+
+/* The same, to another chain */
+int ebt_txn_move_to(struct ebt_txn *txn, const char *chain, int rule_nr,
+		    const char *to_chain, int new_nr)
+{
+	struct ebt_u_replace *replace = &txn->handle->replace;
+	struct ebt_handle *old;
+	int to;
+
+	if (txn->failed)
+		return -1;
+	old = txn_enter(txn);
+	if ((to = txn_select_chain(replace, to_chain)) != -1 &&
+	    txn_select_chain(replace, chain) != -1)
+		move_rule(replace, rule_nr, to, new_nr);
+	return txn_leave(txn, old);
+}
+
+/* Check all rules and give the table to the kernel, the transaction is
+ * freed. Returns the same values as ebt_handle_commit(), nothing is
+ * given to the kernel if an earlier operation failed */
+int ebt_txn_commit(struct ebt_txn *txn)
+{
+	struct ebt_handle *h = txn->handle, *old;
+	struct ebt_u_replace *replace = &h->replace;
+	struct ebt_u_entries *entries;
+	struct ebt_u_entry *e;
+	struct ebt_u_table *table;
+	int i, ret = -1;
+
+	if (txn->failed)
+		goto free_txn;
+	old = txn_enter(txn);
+	/* This also puts the hook_mask right for the chains */
+	ebt_check_for_loops(replace);
+	for (i = 0; i < replace->num_chains && ebt_errormsg[0] == '\0'; i++) {
+		if (!(entries = replace->chains[i]))
+			continue;
+		for (e = entries->entries->next; e != entries->entries; e = e->next) {
+			/* Userspace extensions use host endian */
+			e->ethproto = ntohs(e->ethproto);
+			ebt_do_final_checks(replace, e, entries);
+			e->ethproto = htons(e->ethproto);
+			if (ebt_errormsg[0] != '\0')
+				break;
+		}
+	}
+	if (ebt_errormsg[0] == '\0' && (table = ebt_find_table(replace->name)) &&
+	    table->check)
+		table->check(replace);
+	ret = txn_leave(txn, old);
+	if (!ret)
+		ret = ebt_handle_commit(h);
+free_txn:
+	/* Don't keep the changes of a failed transaction around */
+	if (ret)
+		release_table(replace);
+	free(txn);
+	return ret;
+}
+
+/* Drop the transaction and all changes made to the table of the handle */
+void ebt_txn_abort(struct ebt_txn *txn)
+{
+	release_table(&txn->handle->replace);
+	free(txn);
+}
@@ -0,0 +1,122 @@
+/*
+ * malloc_stats.c, allocation counting for --stats
+ *
+ * Linked into the ebtables programs (not into libebtc.so), it replaces
+ * malloc() and friends of the whole process by wrappers around the glibc
+ * allocator that count the allocations and track the bytes in use and
+ * their peak in ebt_heap_stats. The bytes are the usable sizes of the
+ * blocks, as reported by malloc_usable_size(). Nothing is counted until
+ * ebt_stats_enable() sets ebt_heap_stats.counting, without --stats or
+ * EBTABLES_STATS the wrappers only test that flag.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <malloc.h>
+#include "include/ebtables_u.h"
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+static inline int counting()
+{
+	return __atomic_load_n(&ebt_heap_stats.counting, __ATOMIC_RELAXED);
+}
+
+static void count_alloc(void *ptr)
+{
+	long in_use, peak;
+
+	if (!ptr || !counting())
+		return;
+	__atomic_add_fetch(&ebt_heap_stats.allocs, 1, __ATOMIC_RELAXED);
+	in_use = __atomic_add_fetch(&ebt_heap_stats.in_use,
+	   malloc_usable_size(ptr), __ATOMIC_RELAXED);
+	peak = __atomic_load_n(&ebt_heap_stats.peak, __ATOMIC_RELAXED);
+	while (in_use > peak && !__atomic_compare_exchange_n(&ebt_heap_stats.peak,
+	       &peak, in_use, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void count_free(void *ptr)
+{
+	if (!ptr || !counting())
+		return;
+	__atomic_add_fetch(&ebt_heap_stats.frees, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&ebt_heap_stats.in_use, malloc_usable_size(ptr),
+	   __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size)
+{
+	void *ptr = __libc_malloc(size);
+
+	count_alloc(ptr);
+	return ptr;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	void *ptr = __libc_calloc(nmemb, size);
+
+	count_alloc(ptr);
+	return ptr;
+}
+
+/* Counted as a free of the old block and an allocation of the new one */
+void *realloc(void *ptr, size_t size)
+{
+	size_t old;
+	void *new;
+
+	if (!counting())
+		return __libc_realloc(ptr, size);
+	old = ptr ? malloc_usable_size(ptr) : 0;
+	if (!(new = __libc_realloc(ptr, size)))
+		return NULL;
+	if (ptr) {
+		__atomic_sub_fetch(&ebt_heap_stats.in_use, old, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&ebt_heap_stats.frees, 1, __ATOMIC_RELAXED);
+	}
+	count_alloc(new);
+	return new;
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+	void *ptr = __libc_memalign(alignment, size);
+
+	count_alloc(ptr);
+	return ptr;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	return memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	void *ptr;
+
+	if (!alignment || alignment % sizeof(void *) ||
+	    (alignment & (alignment - 1)))
+		return EINVAL;
+	if (!(ptr = memalign(alignment, size)))
+		return ENOMEM;
+	*memptr = ptr;
+	return 0;
+}
+
+void free(void *ptr)
+{
+	count_free(ptr);
+	__libc_free(ptr);
+}
+
+static void __attribute__((constructor)) announce()
+{
+	ebt_heap_stats.available = 1;
+}
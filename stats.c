@@ -0,0 +1,167 @@
+/*
+ * stats.c, per-phase statistics of ebtables commands
+ *
+ * With --stats or EBTABLES_STATS, the time spent in every phase of a
+ * command (waiting for the lock, retrieving and decoding the kernel table,
+ * parsing, checking for loops, translating and delivering the table,
+ * listing) is measured with the monotonic clock, together with the bytes
+ * exchanged with the kernel and the number of rules and chains handled.
+ * Phases can be nested, e.g. the table is retrieved while the command is
+ * parsed: the time of the inner phase is only counted for the inner phase.
+ * The heap figures come from malloc_stats.o, which the ebtables programs
+ * link in to count the allocations of the whole process. Counting starts
+ * when the statistics are enabled, the bytes in use are those allocated
+ * since then minus those freed since then.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "include/ebtables_u.h"
+
+struct ebt_heap_stats ebt_heap_stats;
+
+static const char *phase_names[EBT_STATS_NPHASES] = {
+	[EBT_STATS_LOCK]	= "lock",
+	[EBT_STATS_FETCH]	= "fetch",
+	[EBT_STATS_DECODE]	= "decode",
+	[EBT_STATS_PARSE]	= "parse",
+	[EBT_STATS_LOOPS]	= "loops",
+	[EBT_STATS_TRANSLATE]	= "translate",
+	[EBT_STATS_DELIVER]	= "deliver",
+	[EBT_STATS_COUNTERS]	= "counters",
+	[EBT_STATS_LIST]	= "list",
+};
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void print_default_stats()
+{
+	if (ebt_default_handle.stats)
+		ebt_stats_print(ebt_default_handle.stats);
+}
+
+/* Start collecting statistics for the current handle, the statistics of
+ * the default handle are printed when the process exits */
+void ebt_stats_enable()
+{
+	if (ebt_cur_stats)
+		return;
+	ebt_cur_stats = (struct ebt_stats *)malloc(sizeof(struct ebt_stats));
+	if (!ebt_cur_stats)
+		ebt_print_memory();
+	if (ebt_heap_stats.available)
+		__atomic_store_n(&ebt_heap_stats.counting, 1, __ATOMIC_RELAXED);
+	ebt_stats_reset(ebt_cur_stats);
+	if (ebt_cur_handle == &ebt_default_handle)
+		atexit(print_default_stats);
+}
+
+void ebt_stats_reset(struct ebt_stats *s)
+{
+	memset(s, 0, sizeof(struct ebt_stats));
+	s->start = now();
+	if (ebt_heap_stats.counting) {
+		__atomic_store_n(&ebt_heap_stats.allocs, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&ebt_heap_stats.frees, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&ebt_heap_stats.peak,
+		   __atomic_load_n(&ebt_heap_stats.in_use, __ATOMIC_RELAXED),
+		   __ATOMIC_RELAXED);
+	}
+}
+
+void ebt_stats_push(int phase)
+{
+	struct ebt_stats *s = ebt_cur_stats;
+
+	if (s->depth < EBT_STATS_DEPTH) {
+		s->stack[s->depth].phase = phase;
+		s->stack[s->depth].start = now();
+		s->stack[s->depth].nested = 0;
+	}
+	s->depth++;
+}
+
+void ebt_stats_pop()
+{
+	struct ebt_stats *s = ebt_cur_stats;
+	double elapsed;
+	int phase;
+
+	/* Statistics were enabled inside the phase */
+	if (!s->depth)
+		return;
+	if (--s->depth >= EBT_STATS_DEPTH)
+		return;
+	phase = s->stack[s->depth].phase;
+	elapsed = now() - s->stack[s->depth].start;
+	s->seconds[phase] += elapsed - s->stack[s->depth].nested;
+	s->calls[phase]++;
+	if (s->depth)
+		s->stack[s->depth - 1].nested += elapsed;
+}
+
+/* A human readable summary followed by the same figures as one JSON line,
+ * both on stderr */
+void ebt_stats_print(struct ebt_stats *s)
+{
+	struct ebt_stats *old = ebt_cur_stats;
+	double total, other;
+	int i;
+
+	/* A command that exits with an error leaves its phases open */
+	ebt_cur_stats = s;
+	while (s->depth)
+		ebt_stats_pop();
+	ebt_cur_stats = old;
+
+	total = now() - s->start;
+	other = total;
+	fprintf(stderr, "ebtables stats: %u command%s in %.6fs\n", s->commands,
+		s->commands == 1 ? "" : "s", total);
+	for (i = 0; i < EBT_STATS_NPHASES; i++) {
+		other -= s->seconds[i];
+		if (s->calls[i])
+			fprintf(stderr, "  %-10s %10.6fs %8u call%s\n",
+				phase_names[i], s->seconds[i], s->calls[i],
+				s->calls[i] == 1 ? "" : "s");
+	}
+	fprintf(stderr, "  %-10s %10.6fs\n", "other", other > 0 ? other : 0);
+	fprintf(stderr, "  kernel: %llu bytes in, %llu bytes out\n",
+		(unsigned long long)s->bytes_in,
+		(unsigned long long)s->bytes_out);
+	fprintf(stderr, "  rules: %u in %u chains retrieved, "
+		"%u in %u chains delivered\n", s->rules_in, s->chains_in,
+		s->rules_out, s->chains_out);
+	if (ebt_heap_stats.counting)
+		fprintf(stderr, "  heap: %lu allocations, %lu frees, "
+			"peak %ld bytes, %ld bytes in use\n",
+			ebt_heap_stats.allocs, ebt_heap_stats.frees,
+			ebt_heap_stats.peak, ebt_heap_stats.in_use);
+
+	fprintf(stderr, "{\"commands\":%u,\"seconds\":%.6f,\"phases\":{",
+		s->commands, total);
+	for (i = 0; i < EBT_STATS_NPHASES; i++)
+		fprintf(stderr, "\"%s\":{\"seconds\":%.6f,\"calls\":%u},",
+			phase_names[i], s->seconds[i], s->calls[i]);
+	fprintf(stderr, "\"other\":{\"seconds\":%.6f}},\"bytes_in\":%llu,"
+		"\"bytes_out\":%llu,\"rules_in\":%u,\"chains_in\":%u,"
+		"\"rules_out\":%u,\"chains_out\":%u,\"heap\":",
+		other > 0 ? other : 0, (unsigned long long)s->bytes_in,
+		(unsigned long long)s->bytes_out, s->rules_in, s->chains_in,
+		s->rules_out, s->chains_out);
+	if (ebt_heap_stats.counting)
+		fprintf(stderr, "{\"allocs\":%lu,\"frees\":%lu,\"peak\":%ld,"
+			"\"in_use\":%ld}}\n", ebt_heap_stats.allocs,
+			ebt_heap_stats.frees, ebt_heap_stats.peak,
+			ebt_heap_stats.in_use);
+	else
+		fprintf(stderr, "null}\n");
+}
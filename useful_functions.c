@@ -24,6 +24,7 @@
  */
 #include "include/ebtables_u.h"
 #include "include/ethernetdb.h"
+#include <ctype.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <limits.h>
@@ -47,20 +48,26 @@ const unsigned char msk_type_broadcast[ETH_ALEN] = {255,255,255,255,255,255};
 const unsigned char mac_type_bridge_group[ETH_ALEN] = {0x01,0x80,0xc2,0,0,0};
 const unsigned char msk_type_bridge_group[ETH_ALEN] = {255,255,255,255,255,255};
 
-/* 0: default, print only 2 digits if necessary
- * 2: always print 2 digits, a printed mac address
- * then always has the same length */
-int ebt_printstyle_mac;
+/*
+ * Formatting helpers for listing big tables, printf() is slow. Their output
+ * goes to stdout like everything else that is printed, so it can be mixed
+ * with the printf()s of the extensions.
+ */
+static const char hexdigits[] = "0123456789abcdef";
 
 void ebt_print_mac(const unsigned char *mac)
 {
-	if (ebt_printstyle_mac == 2) {
-		int j;
-		for (j = 0; j < ETH_ALEN; j++)
-			printf("%02x%s", mac[j],
-				(j==ETH_ALEN-1) ? "" : ":");
-	} else
-		printf("%s", ether_ntoa((struct ether_addr *) mac));
+	char buf[3 * ETH_ALEN], *p = buf;
+	int j;
+
+	/* ether_ntoa() doesn't print leading zeros */
+	for (j = 0; j < ETH_ALEN; j++) {
+		if (ebt_printstyle_mac == 2 || mac[j] > 0xf)
+			*p++ = hexdigits[mac[j] >> 4];
+		*p++ = hexdigits[mac[j] & 0xf];
+		*p++ = ':';
+	}
+	fwrite(buf, 1, p - buf - 1, stdout);
 }
 
 void ebt_print_mac_and_mask(const unsigned char *mac, const unsigned char *mask)
@@ -69,25 +76,253 @@ void ebt_print_mac_and_mask(const unsigned char *mac, const unsigned char *mask)
 
 	if (!memcmp(mac, mac_type_unicast, 6) &&
 	    !memcmp(mask, msk_type_unicast, 6))
-		printf("Unicast");
+		fputs("Unicast", stdout);
 	else if (!memcmp(mac, mac_type_multicast, 6) &&
 	         !memcmp(mask, msk_type_multicast, 6))
-		printf("Multicast");
+		fputs("Multicast", stdout);
 	else if (!memcmp(mac, mac_type_broadcast, 6) &&
 	         !memcmp(mask, msk_type_broadcast, 6))
-		printf("Broadcast");
+		fputs("Broadcast", stdout);
 	else if (!memcmp(mac, mac_type_bridge_group, 6) &&
 	         !memcmp(mask, msk_type_bridge_group, 6))
-		printf("BGA");
+		fputs("BGA", stdout);
 	else {
 		ebt_print_mac(mac);
 		if (memcmp(mask, hlpmsk, 6)) {
-			printf("/");
+			putchar('/');
 			ebt_print_mac(mask);
 		}
 	}
 }
 
+/* Writes n in decimal before end, returns where it starts */
+static char *format_u64(char *end, uint64_t n)
+{
+	do {
+		*--end = '0' + n % 10;
+		n /= 10;
+	} while (n);
+	return end;
+}
+
+/* Same as printf("%"PRIu64, n) */
+void ebt_print_u64(uint64_t n)
+{
+	char buf[20], *p = format_u64(buf + sizeof(buf), n);
+
+	fwrite(p, 1, buf + sizeof(buf) - p, stdout);
+}
+
+/* Print an IPv4 address (network order) in dotted decimal notation */
+void ebt_print_ipv4(uint32_t addr)
+{
+	const unsigned char *ip = (const unsigned char *)&addr;
+	char buf[16], *p = buf;
+	int j;
+
+	for (j = 0; j < 4; j++) {
+		if (ip[j] >= 100)
+			*p++ = '0' + ip[j] / 100;
+		if (ip[j] >= 10)
+			*p++ = '0' + ip[j] / 10 % 10;
+		*p++ = '0' + ip[j] % 10;
+		*p++ = '.';
+	}
+	fwrite(buf, 1, p - buf - 1, stdout);
+}
+
+/*
+ * Structured listing: the same calls produce JSON or CBOR (RFC 7049), in
+ * CBOR maps and arrays have indefinite length so nothing has to be counted
+ * in advance. The caller holds the stdout lock (flockfile()) from
+ * ebt_json_start() on, the output is written with the _unlocked stdio calls.
+ */
+#define JSON_MAX_DEPTH 16
+
+static __thread struct {
+	int cbor;
+	int depth;
+	/* '}' or ']' */
+	char close[JSON_MAX_DEPTH];
+	char first[JSON_MAX_DEPTH];
+} json;
+
+static void cbor_head(int major, uint64_t n)
+{
+	unsigned char buf[9];
+	int len, i;
+
+	if (n < 24) {
+		putchar_unlocked(major << 5 | n);
+		return;
+	}
+	if (n <= 0xff)
+		len = 1;
+	else if (n <= 0xffff)
+		len = 2;
+	else if (n <= 0xffffffff)
+		len = 4;
+	else
+		len = 8;
+	buf[0] = major << 5 | (len == 1 ? 24 : len == 2 ? 25 : len == 4 ? 26 : 27);
+	for (i = len; i > 0; i--, n >>= 8)
+		buf[i] = n & 0xff;
+	fwrite_unlocked(buf, 1, len + 1, stdout);
+}
+
+static void json_string(const char *s, unsigned int len)
+{
+	unsigned int i;
+
+	if (json.cbor) {
+		cbor_head(3, len);
+		fwrite_unlocked(s, 1, len, stdout);
+		return;
+	}
+	putchar_unlocked('"');
+	for (i = 0; i < len; i++) {
+		unsigned char c = s[i];
+
+		if (c == '"' || c == '\\') {
+			putchar_unlocked('\\');
+			putchar_unlocked(c);
+		} else if (c < 0x20) {
+			fwrite_unlocked("\\u00", 1, 4, stdout);
+			putchar_unlocked(hexdigits[c >> 4]);
+			putchar_unlocked(hexdigits[c & 0xf]);
+		} else
+			putchar_unlocked(c);
+	}
+	putchar_unlocked('"');
+}
+
+/* Separator and key of the next value */
+static void json_key(const char *key)
+{
+	if (!json.cbor && json.depth) {
+		if (!json.first[json.depth - 1])
+			putchar_unlocked(',');
+		json.first[json.depth - 1] = 0;
+	}
+	if (key) {
+		json_string(key, strlen(key));
+		if (!json.cbor)
+			putchar_unlocked(':');
+	}
+}
+
+static void json_open(const char *key, char close)
+{
+	if (json.depth == JSON_MAX_DEPTH)
+		ebt_print_bug("Structured listing nested too deep");
+	json_key(key);
+	if (json.cbor)
+		putchar_unlocked(close == '}' ? 0xbf : 0x9f);
+	else
+		putchar_unlocked(close == '}' ? '{' : '[');
+	json.close[json.depth] = close;
+	json.first[json.depth++] = 1;
+}
+
+void ebt_json_start(int cbor)
+{
+	json.cbor = cbor;
+	json.depth = 0;
+}
+
+void ebt_json_object(const char *key)
+{
+	json_open(key, '}');
+}
+
+void ebt_json_array(const char *key)
+{
+	json_open(key, ']');
+}
+
+void ebt_json_end()
+{
+	if (!json.depth)
+		ebt_print_bug("ebt_json_end() without container");
+	json.depth--;
+	putchar_unlocked(json.cbor ? 0xff : json.close[json.depth]);
+	if (!json.depth && !json.cbor)
+		putchar_unlocked('\n');
+}
+
+void ebt_json_str(const char *key, const char *s)
+{
+	json_key(key);
+	json_string(s, strlen(s));
+}
+
+void ebt_json_uint(const char *key, uint64_t n)
+{
+	char buf[20], *p;
+
+	json_key(key);
+	if (json.cbor) {
+		cbor_head(0, n);
+		return;
+	}
+	p = format_u64(buf + sizeof(buf), n);
+	fwrite_unlocked(p, 1, buf + sizeof(buf) - p, stdout);
+}
+
+void ebt_json_bool(const char *key, int b)
+{
+	json_key(key);
+	if (json.cbor)
+		putchar_unlocked(b ? 0xf5 : 0xf4);
+	else
+		fwrite_unlocked(b ? "true" : "false", 1, b ? 4 : 5, stdout);
+}
+
+/* A byte string in CBOR, a string of hex digits in JSON */
+void ebt_json_hex(const char *key, const void *data, unsigned int len)
+{
+	const unsigned char *p = data;
+	unsigned int i;
+
+	json_key(key);
+	if (json.cbor) {
+		cbor_head(2, len);
+		fwrite_unlocked(data, 1, len, stdout);
+		return;
+	}
+	putchar_unlocked('"');
+	for (i = 0; i < len; i++) {
+		putchar_unlocked(hexdigits[p[i] >> 4]);
+		putchar_unlocked(hexdigits[p[i] & 0xf]);
+	}
+	putchar_unlocked('"');
+}
+
+/* Always with leading zeros, unlike ebt_print_mac() */
+void ebt_json_mac(const char *key, const unsigned char *mac)
+{
+	char buf[3 * ETH_ALEN], *p = buf;
+	int j;
+
+	for (j = 0; j < ETH_ALEN; j++) {
+		*p++ = hexdigits[mac[j] >> 4];
+		*p++ = hexdigits[mac[j] & 0xf];
+		*p++ = ':';
+	}
+	json_key(key);
+	json_string(buf, p - buf - 1);
+}
+
+/* addr is in network order */
+void ebt_json_ipv4(const char *key, uint32_t addr)
+{
+	struct in_addr in = { addr };
+	char buf[INET_ADDRSTRLEN];
+
+	inet_ntop(AF_INET, &in, buf, sizeof(buf));
+	ebt_json_str(key, buf);
+}
+
 /* Checks the type for validity and calls getethertypebynumber(). */
 struct ethertypeent *parseethertypebynumber(int type)
 {
@@ -98,53 +333,117 @@ struct ethertypeent *parseethertypebynumber(int type)
 	return getethertypebynumber(type);
 }
 
+/* The value of a hex digit plus one, 0 for other characters */
+const unsigned char ebt_hexvalues[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+/* Parses [from, end) like ether_aton() parses a string, including its
+ * quirks: one or two digits per byte, anything after a last byte of two
+ * digits is ignored. Returns 0 on success. */
+static int parse_mac(const char *from, const char *end, unsigned char *mac)
+{
+	const unsigned char *p = (const unsigned char *)from;
+	unsigned int i, d, d2;
+	unsigned char c;
+
+	/* The usual xx:xx:xx:xx:xx:xx notation */
+	if (end - from == 3 * ETH_ALEN - 1) {
+		for (i = 0; i < ETH_ALEN; i++, p += 3) {
+			d = ebt_hexvalues[p[0]];
+			d2 = ebt_hexvalues[p[1]];
+			if (!d || !d2 || (i < ETH_ALEN - 1 && p[2] != ':'))
+				break;
+			mac[i] = (d - 1) << 4 | (d2 - 1);
+		}
+		if (i == ETH_ALEN)
+			return 0;
+		p = (const unsigned char *)from;
+	}
+
+	for (i = 0; i < ETH_ALEN; i++) {
+		if (p == (const unsigned char *)end || !(d = ebt_hexvalues[*p++]))
+			return -1;
+		d--;
+		c = p == (const unsigned char *)end ? '\0' : *p;
+		if ((i < ETH_ALEN - 1 && c != ':') ||
+		    (i == ETH_ALEN - 1 && c != '\0' && !isspace(c))) {
+			p++;
+			if (!(d2 = ebt_hexvalues[c]))
+				return -1;
+			d = d << 4 | (d2 - 1);
+			c = p == (const unsigned char *)end ? '\0' : *p;
+			if (i < ETH_ALEN - 1 && c != ':')
+				return -1;
+		}
+		mac[i] = d;
+		p++;
+	}
+	return 0;
+}
+
+/* Same as ether_aton(), without the static buffer. Returns 0 on success. */
+int ebt_get_mac(const char *from, unsigned char *to)
+{
+	return parse_mac(from, from + strlen(from), to);
+}
+
 /* Put the mac address into 6 (ETH_ALEN) bytes returns 0 on success. */
 int ebt_get_mac_and_mask(const char *from, unsigned char *to,
   unsigned char *mask)
 {
-	char *p;
+	const unsigned char *type_mac = NULL, *type_msk = NULL;
+	const char *end, *slash;
 	int i;
-	struct ether_addr *addr;
 
-	if (strcasecmp(from, "Unicast") == 0) {
-		memcpy(to, mac_type_unicast, ETH_ALEN);
-		memcpy(mask, msk_type_unicast, ETH_ALEN);
-		return 0;
-	}
-	if (strcasecmp(from, "Multicast") == 0) {
-		memcpy(to, mac_type_multicast, ETH_ALEN);
-		memcpy(mask, msk_type_multicast, ETH_ALEN);
-		return 0;
-	}
-	if (strcasecmp(from, "Broadcast") == 0) {
-		memcpy(to, mac_type_broadcast, ETH_ALEN);
-		memcpy(mask, msk_type_broadcast, ETH_ALEN);
-		return 0;
+	switch (from[0] | 0x20) {
+	case 'u':
+		if (!strcasecmp(from, "Unicast")) {
+			type_mac = mac_type_unicast;
+			type_msk = msk_type_unicast;
+		}
+		break;
+	case 'm':
+		if (!strcasecmp(from, "Multicast")) {
+			type_mac = mac_type_multicast;
+			type_msk = msk_type_multicast;
+		}
+		break;
+	case 'b':
+		if (!strcasecmp(from, "Broadcast")) {
+			type_mac = mac_type_broadcast;
+			type_msk = msk_type_broadcast;
+		} else if (!strcasecmp(from, "BGA")) {
+			type_mac = mac_type_bridge_group;
+			type_msk = msk_type_bridge_group;
+		}
+		break;
 	}
-	if (strcasecmp(from, "BGA") == 0) {
-		memcpy(to, mac_type_bridge_group, ETH_ALEN);
-		memcpy(mask, msk_type_bridge_group, ETH_ALEN);
+	if (type_mac) {
+		memcpy(to, type_mac, ETH_ALEN);
+		memcpy(mask, type_msk, ETH_ALEN);
 		return 0;
 	}
-	if ( (p = strrchr(from, '/')) != NULL) {
-		*p = '\0';
-		if (!(addr = ether_aton(p + 1)))
+
+	/* The mask follows the last '/' */
+	end = from + strlen(from);
+	for (slash = end; slash > from && slash[-1] != '/'; slash--);
+	if (slash > from) {
+		if (parse_mac(slash, end, mask))
 			return -1;
-		memcpy(mask, addr, ETH_ALEN);
+		end = slash - 1;
 	} else
 		memset(mask, 0xff, ETH_ALEN);
-	if (!(addr = ether_aton(from)))
+	if (parse_mac(from, end, to))
 		return -1;
-	memcpy(to, addr, ETH_ALEN);
 	for (i = 0; i < ETH_ALEN; i++)
 		to[i] &= mask[i];
 	return 0;
 }
 
-/* 0: default
- * 1: the inverse '!' of the option has already been specified */
-int ebt_invert = 0;
-
 /*
  * Check if the inverse of the option is specified. This is used
  * in the parse functions of the extensions and ebtables.c
@@ -605,3 +904,107 @@ void ebt_print_icmp_types(const struct ebt_icmp_names *icmp_codes,
 	}
 	printf("\n");
 }
+
+/*
+ * The names of the sets looked up by the set and dset matches. The cache
+ * belongs to one handle and is emptied when that handle delivered a table
+ * (ebt_generation), so a restore resolves every set only once. The set
+ * indexes of both modules fit in an unsigned int.
+ */
+void ebt_set_cache_check(struct ebt_set_cache *c)
+{
+	unsigned int i;
+
+	if (c->handle == ebt_cur_handle && c->generation == ebt_generation)
+		return;
+	for (i = 0; i < c->num_sets; i++)
+		free(c->sets[i].name);
+	free(c->sets);
+	free(c->hash);
+	memset(c, 0, sizeof(struct ebt_set_cache));
+	c->handle = ebt_cur_handle;
+	c->generation = ebt_generation;
+}
+
+static unsigned int set_cache_hash(const char *name)
+{
+	unsigned int h = 2166136261u;
+
+	while (*name)
+		h = (h ^ (unsigned char)*name++) * 16777619u;
+	return h;
+}
+
+/* Returns the entry of the set with that name and puts its index in idx,
+ * NULL if the set wasn't looked up yet */
+struct ebt_set_cache_entry *ebt_set_cache_find(struct ebt_set_cache *c,
+					       const char *name,
+					       unsigned int *idx)
+{
+	unsigned int i;
+
+	if (!c->hash_size)
+		return NULL;
+	i = set_cache_hash(name) & (c->hash_size - 1);
+	for (; c->hash[i]; i = (i + 1) & (c->hash_size - 1))
+		if (!strcmp(c->sets[c->hash[i] - 1].name, name)) {
+			*idx = c->hash[i] - 1;
+			return &c->sets[*idx];
+		}
+	return NULL;
+}
+
+/* The name of the set with index idx, NULL if not known */
+const char *ebt_set_cache_name(struct ebt_set_cache *c, unsigned int idx)
+{
+	return idx < c->num_sets ? c->sets[idx].name : NULL;
+}
+
+static void set_cache_insert(struct ebt_set_cache *c, unsigned int idx)
+{
+	unsigned int i;
+
+	i = set_cache_hash(c->sets[idx].name) & (c->hash_size - 1);
+	while (c->hash[i])
+		i = (i + 1) & (c->hash_size - 1);
+	c->hash[i] = idx + 1;
+}
+
+/* checked: 1 if the family of the set was checked */
+void ebt_set_cache_add(struct ebt_set_cache *c, const char *name,
+		       unsigned int idx, int checked)
+{
+	unsigned int i, n, *old;
+
+	if (idx >= c->num_sets) {
+		for (n = c->num_sets ? c->num_sets : 64; n <= idx; n *= 2);
+		c->sets = realloc(c->sets, n * sizeof(struct ebt_set_cache_entry));
+		if (!c->sets)
+			ebt_print_memory();
+		memset(c->sets + c->num_sets, 0,
+		       (n - c->num_sets) * sizeof(struct ebt_set_cache_entry));
+		c->num_sets = n;
+	}
+	if (c->sets[idx].name) {
+		c->sets[idx].checked |= checked;
+		return;
+	}
+	if (!(c->sets[idx].name = strdup(name)))
+		ebt_print_memory();
+	c->sets[idx].checked = checked;
+
+	if (2 * (c->hash_used + 1) > c->hash_size) {
+		old = c->hash;
+		n = c->hash_size;
+		c->hash_size = n ? 2 * n : 64;
+		c->hash = calloc(c->hash_size, sizeof(unsigned int));
+		if (!c->hash)
+			ebt_print_memory();
+		for (i = 0; i < n; i++)
+			if (old[i])
+				set_cache_insert(c, old[i] - 1);
+		free(old);
+	}
+	set_cache_insert(c, idx);
+	c->hash_used++;
+}